@@ -0,0 +1,694 @@
+/*
+ * HVD Hardware Video Decoder benchmark
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *
+ * Decodes raw Annex B (H.264, HEVC) or IVF (VP8, VP9, AV1) file
+ * at maximum speed or fixed frame rate and reports:
+ * - fps, input and output MB/s
+ * - per-frame latency percentiles (hvd_send_packet to hvd_receive_frame)
+ * - library stage timings (hvd_get_stats)
+ * - startup: hvd_init time and time to first frame
+ * - switch: hvd_reconfigure time between repeats (--reconfigure)
+ * - frames dropped by load shedding policies (--drop)
+ * - decoding saved by resync after simulated packet loss (--loss, --resync)
+ * - memory held by decoder, within budget with --memory-budget
+ * - CPU time and peak RSS
+ *
+ * With --trace per-frame pipeline events of the last frames
+ * are written in Chrome trace format (chrome://tracing, Perfetto).
+ *
+ * Results are printed to stdout as single line JSON (one per run),
+ * human readable summary to stderr.
+ *
+ * The file is memory-mapped and indexed before measurement (hvd_file),
+ * packets reference the mapping. With --stream it is loaded whole.
+ *
+ * With --check-kernels (only argument) checks SIMD conversion kernels
+ * against scalar reference instead and fails (exit code 1) on mismatch.
+ */
+
+#include "../hvd.h"
+
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h> //poll
+#include <sys/resource.h> //getrusage
+
+enum {IVF_FILE_HEADER = 32, STREAM_CHUNK = 4096, TRACE_EVENTS = 65536};
+
+struct bench_input
+{
+	uint8_t *file; //whole file, padded (--stream)
+	int file_size;
+	struct hvd_file *source; //memory-mapped packets
+	int64_t packet_count;
+};
+
+struct bench_options
+{
+	struct hvd_config config;
+	const char *file;
+	const char *index; //NULL or sidecar index of the file
+	const char *name;
+	double fps; //0 for maximum speed
+	int repeat;
+	int stream; //feed raw chunks with hvd_send_stream
+	int reconfigure; //switch with hvd_reconfigure before each repeat
+	int loss; //0 or drop every loss-th packet (simulated packet loss)
+	const char *shm; //publish frames to shared memory ring with this name
+	const char *trace; //NULL or Chrome trace file of the last events
+};
+
+struct bench_results
+{
+	uint64_t packets;
+	uint64_t lost; //packets dropped by simulated loss
+	uint64_t frames;
+	uint64_t input_bytes;
+	uint64_t output_bytes;
+	int flushing; //flush sent, waiting for the last frames
+	int flushed;
+	int64_t *latency; //per frame in microseconds
+	uint64_t latency_count;
+	uint64_t latency_capacity;
+	int width;
+	int height;
+	const char *format;
+	struct hvd_shm *shm; //created for the first frame
+};
+
+static int process_user_input(int argc, char **argv, struct bench_options *options);
+static int load_input(const struct bench_options *options, struct bench_input *input);
+static int load_file(const char *path, struct bench_input *input);
+static void free_input(struct bench_input *input);
+static int benchmark(struct hvd *h, const struct bench_options *options, const struct bench_input *input, struct bench_results *results);
+static int send_data(struct hvd *h, const struct bench_options *options, struct hvd_packet *packet, struct bench_results *results);
+static int receive_frames(struct hvd *h, const struct bench_options *options, struct bench_results *results);
+static int publish_frame(const struct bench_options *options, struct bench_results *results, const AVFrame *frame);
+static int add_latency(struct bench_results *results, int64_t latency);
+static void wait_frames(struct hvd *h);
+static void pace(double fps, int64_t start, uint64_t packets);
+static int64_t now_us(void);
+static int compare_int64(const void *a, const void *b);
+static int64_t percentile(const int64_t *sorted, uint64_t count, int percent);
+static void report(const struct bench_options *options, const struct bench_results *results, struct hvd *h, double seconds, double cpu_seconds, long max_rss_kb);
+static double cpu_time(long *max_rss_kb);
+
+int main(int argc, char **argv)
+{
+	struct bench_options options = {0};
+	struct bench_input input = {0};
+	struct bench_results results = {0};
+	struct hvd *h;
+	double start_cpu, cpu_seconds;
+	int64_t start;
+	long max_rss_kb;
+	int ret;
+
+	if(argc == 2 && strcmp(argv[1], "--check-kernels") == 0)
+		return hvd_check_kernels() == HVD_OK ? 0 : 1;
+
+	if(process_user_input(argc, argv, &options) != 0)
+		return 1;
+
+	if(load_input(&options, &input) != 0)
+	{
+		free_input(&input);
+		return 1;
+	}
+
+	if( (h = hvd_init(&options.config)) == NULL )
+	{
+		fprintf(stderr, "failed to initialize decoder for %s\n", options.config.hardware);
+		free_input(&input);
+		return 1;
+	}
+
+	start_cpu = cpu_time(&max_rss_kb);
+	start = now_us();
+
+	ret = benchmark(h, &options, &input, &results);
+
+	cpu_seconds = cpu_time(&max_rss_kb) - start_cpu;
+
+	if(ret == 0)
+		report(&options, &results, h, (now_us() - start) / 1000000.0, cpu_seconds, max_rss_kb);
+
+	if(options.trace && hvd_trace_export(h, options.trace) != HVD_OK)
+		ret = 1;
+
+	hvd_close(h);
+	hvd_shm_close(results.shm);
+	free_input(&input);
+	free(results.latency);
+
+	return ret;
+}
+
+static int benchmark(struct hvd *h, const struct bench_options *options, const struct bench_input *input, struct bench_results *results)
+{
+	const int64_t start = now_us();
+
+	struct hvd_packet packet = {0};
+
+	for(int r=0;r<options->repeat;++r)
+	{	//like channel switch, frames of the previous repeat in flight are dropped
+		if(r && options->reconfigure && hvd_reconfigure(h, &options->config) != HVD_OK)
+		{
+			fprintf(stderr, "failed to reconfigure decoder\n");
+			return 1;
+		}
+
+		if(options->stream)
+		{
+			for(int offset=0;offset<input->file_size;offset+=STREAM_CHUNK)
+			{
+				packet.data = input->file + offset;
+				packet.size = input->file_size - offset < STREAM_CHUNK ? input->file_size - offset : STREAM_CHUNK;
+
+				if(send_data(h, options, &packet, results) != 0)
+					return 1;
+			}
+			continue;
+		}
+
+		for(int64_t i=0;i<input->packet_count;++i)
+		{
+			if(options->loss && (i + 1) % options->loss == 0)
+			{
+				++results->lost;
+				continue;
+			}
+
+			pace(options->fps, start, results->packets);
+
+			//points into the mapping, decoder references instead of copying
+			if(hvd_file_packet(input->source, i, &packet) != HVD_OK || send_data(h, options, &packet, results) != 0)
+				return 1;
+		}
+	}
+
+	//flush and get the last frames
+	if(send_data(h, options, NULL, results) != 0)
+		return 1;
+
+	while(!results->flushed)
+	{
+		wait_frames(h);
+
+		if(receive_frames(h, options, results) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+//sends packet (NULL to flush) and receives all ready frames
+static int send_data(struct hvd *h, const struct bench_options *options, struct hvd_packet *packet, struct bench_results *results)
+{
+	int ret;
+
+	for(;;)
+	{
+		if(options->stream)
+			ret = hvd_send_stream(h, packet ? packet->data : NULL, packet ? packet->size : 0);
+		else
+			ret = hvd_send_packet(h, packet);
+
+		if(ret == HVD_ERROR)
+		{
+			fprintf(stderr, "failed to send data for decoding\n");
+			return 1;
+		}
+
+		if(receive_frames(h, options, results) != 0)
+			return 1;
+
+		if(ret == HVD_OK)
+			break;
+
+		if(options->config.async)
+			wait_frames(h);
+	}
+
+	if(packet == NULL)
+		results->flushing = 1;
+
+	results->packets += packet ? 1 : 0;
+	results->input_bytes += packet ? packet->size : 0;
+
+	return 0;
+}
+
+static int receive_frames(struct hvd *h, const struct bench_options *options, struct bench_results *results)
+{
+	struct hvd_frame_info info;
+	AVFrame *frame;
+	int error;
+
+	while( (frame = hvd_receive_frame(h, &error)) != NULL )
+	{
+		const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+
+		++results->frames;
+		results->width = frame->width;
+		results->height = frame->height;
+		results->format = av_get_pix_fmt_name(frame->format);
+
+		//hardware frames (surfaces) stay in GPU memory
+		if(desc && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+			results->output_bytes += av_image_get_buffer_size(frame->format, frame->width, frame->height, 1);
+
+		if(hvd_get_frame_info(h, frame, &info) == HVD_OK && info.latency >= 0 && add_latency(results, info.latency) != 0)
+			return 1;
+
+		if(options->shm && publish_frame(options, results, frame) != 0)
+			return 1;
+	}
+
+	if(error == HVD_ERROR)
+	{
+		fprintf(stderr, "failed to decode data\n");
+		return 1;
+	}
+
+	//without frame and error the decoder was flushed completely
+	if(results->flushing && error == HVD_OK)
+		results->flushed = 1;
+
+	return 0;
+}
+
+//ring is sized for the first frame, frames are copied to shared memory
+static int publish_frame(const struct bench_options *options, struct bench_results *results, const AVFrame *frame)
+{
+	if(results->shm == NULL)
+	{
+		struct hvd_shm_config shm_config = {options->shm, 0, frame->width, frame->height, av_get_pix_fmt_name(frame->format)};
+
+		if( (results->shm = hvd_shm_create(&shm_config)) == NULL )
+			return 1;
+	}
+
+	return hvd_shm_publish(results->shm, frame) == HVD_OK ? 0 : 1;
+}
+
+static int add_latency(struct bench_results *results, int64_t latency)
+{
+	if(results->latency_count == results->latency_capacity)
+	{
+		const uint64_t capacity = results->latency_capacity ? 2 * results->latency_capacity : 1024;
+		int64_t *latency_array = (int64_t*)realloc(results->latency, capacity * sizeof(int64_t));
+
+		if(latency_array == NULL)
+		{
+			fprintf(stderr, "not enough memory for latency measurements\n");
+			return 1;
+		}
+
+		results->latency = latency_array;
+		results->latency_capacity = capacity;
+	}
+
+	results->latency[results->latency_count++] = latency;
+	return 0;
+}
+
+//async mode, wait until frames are ready (at most 10 ms)
+static void wait_frames(struct hvd *h)
+{
+	struct pollfd pfd = {hvd_get_event_fd(h), POLLIN, 0};
+
+	if(pfd.fd != -1)
+		poll(&pfd, 1, 10);
+}
+
+//sleep until it is time for next packet at fixed frame rate
+static void pace(double fps, int64_t start, uint64_t packets)
+{
+	int64_t wait;
+
+	if(fps <= 0)
+		return;
+
+	wait = start + (int64_t)(packets * 1000000.0 / fps) - now_us();
+
+	if(wait > 0)
+	{
+		struct timespec ts = {wait / 1000000, (wait % 1000000) * 1000};
+		while(nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+	}
+}
+
+static void report(const struct bench_options *options, const struct bench_results *results, struct hvd *h, double seconds, double cpu_seconds, long max_rss_kb)
+{
+	const double fps = results->frames / seconds;
+	const double input_mbs = results->input_bytes / seconds / 1000000.0;
+	const double output_mbs = results->output_bytes / seconds / 1000000.0;
+	const struct hvd_timing *timing[4];
+	const char *timing_name[4] = {"send", "receive", "transfer", "reconfigure"};
+	int64_t p50, p90, p99, max;
+	struct hvd_stats stats;
+	struct hvd_memory memory;
+
+	qsort(results->latency, results->latency_count, sizeof(int64_t), compare_int64);
+	p50 = percentile(results->latency, results->latency_count, 50);
+	p90 = percentile(results->latency, results->latency_count, 90);
+	p99 = percentile(results->latency, results->latency_count, 99);
+	max = results->latency_count ? results->latency[results->latency_count - 1] : 0;
+
+	hvd_get_stats(h, &stats);
+	hvd_get_memory(h, &memory);
+	timing[0] = &stats.send;
+	timing[1] = &stats.receive;
+	timing[2] = &stats.transfer;
+	timing[3] = &stats.reconfigure;
+
+	printf("{\"name\":\"%s\",\"hardware\":\"%s\",\"codec\":\"%s\",\"file\":\"%s\",",
+		options->name, options->config.hardware, options->config.codec, options->file);
+	printf("\"width\":%d,\"height\":%d,\"format\":\"%s\",", results->width, results->height, results->format ? results->format : "");
+	printf("\"async\":%d,\"low_latency\":%d,\"output\":%d,\"stream\":%d,\"target_fps\":%.2f,",
+		options->config.async, options->config.low_latency, options->config.output, options->stream, options->fps);
+	printf("\"frames\":%llu,\"seconds\":%.6f,\"fps\":%.2f,\"input_mbs\":%.3f,\"output_mbs\":%.3f,",
+		(unsigned long long)results->frames, seconds, fps, input_mbs, output_mbs);
+	printf("\"latency_us\":{\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"max\":%lld},",
+		(long long)p50, (long long)p90, (long long)p99, (long long)max);
+
+	for(int i=0;i<4;++i)
+		printf("\"%s_us\":{\"count\":%llu,\"p50\":%lld,\"p99\":%lld,\"max\":%lld},", timing_name[i],
+			(unsigned long long)timing[i]->count, (long long)timing[i]->p50, (long long)timing[i]->p99, (long long)timing[i]->max);
+
+	printf("\"init_us\":%lld,\"first_frame_us\":%lld,\"first_frame_latency_us\":%lld,\"prebuilt_surfaces\":%d,",
+		(long long)stats.init_time, (long long)stats.first_frame_time, (long long)stats.first_frame_latency, stats.prebuilt_surfaces);
+	printf("\"dropped_nonref\":%llu,\"dropped_unread\":%llu,\"dropped_stale\":%llu,",
+		(unsigned long long)stats.dropped_nonref, (unsigned long long)stats.dropped_unread, (unsigned long long)stats.dropped_stale);
+	printf("\"lost\":%llu,\"resyncs\":%llu,\"resync_packets\":%llu,\"resync_bytes\":%llu,\"corrupt_frames\":%llu,",
+		(unsigned long long)results->lost, (unsigned long long)stats.resyncs, (unsigned long long)stats.resync_packets,
+		(unsigned long long)stats.resync_bytes, (unsigned long long)stats.corrupt_frames);
+	printf("\"memory_bytes\":%lld,\"memory_budget\":%lld,\"frames_allocated\":%d,\"surface_bytes\":%lld,\"memory_refused\":%llu,",
+		(long long)memory.used, (long long)memory.budget, memory.frames_allocated, (long long)memory.surface_bytes,
+		(unsigned long long)memory.refused);
+	printf("\"reopens\":%llu,\"invalid_data\":%llu,\"cpu_seconds\":%.6f,\"cpu_percent\":%.1f,\"max_rss_kb\":%ld}\n",
+		(unsigned long long)stats.reopens, (unsigned long long)stats.invalid_data, cpu_seconds, 100.0 * cpu_seconds / seconds, max_rss_kb);
+
+	fprintf(stderr, "%s: %llu frames %dx%d in %.3f s, %.1f fps, %.2f MB/s in, %.2f MB/s out\n",
+		options->name, (unsigned long long)results->frames, results->width, results->height, seconds, fps, input_mbs, output_mbs);
+	fprintf(stderr, "%s: latency p50 %lld us, p90 %lld us, p99 %lld us, max %lld us\n",
+		options->name, (long long)p50, (long long)p90, (long long)p99, (long long)max);
+	fprintf(stderr, "%s: init %lld us, first frame %lld us (%lld us after first packet), %d prebuilt surfaces\n",
+		options->name, (long long)stats.init_time, (long long)stats.first_frame_time, (long long)stats.first_frame_latency, stats.prebuilt_surfaces);
+	if(options->config.drop_policy)
+		fprintf(stderr, "%s: dropped %llu non-reference, %llu not downloaded, %llu stale\n", options->name,
+			(unsigned long long)stats.dropped_nonref, (unsigned long long)stats.dropped_unread, (unsigned long long)stats.dropped_stale);
+	if(options->config.resync)
+		fprintf(stderr, "%s: %llu lost packets, %llu resyncs, %llu packets (%llu bytes) not decoded, %llu corrupt frames not downloaded\n",
+			options->name, (unsigned long long)results->lost, (unsigned long long)stats.resyncs, (unsigned long long)stats.resync_packets,
+			(unsigned long long)stats.resync_bytes, (unsigned long long)stats.corrupt_frames);
+	if(options->config.memory_budget)
+		fprintf(stderr, "%s: memory %lld of %lld bytes, %d frames allocated, %llu packets refused\n", options->name,
+			(long long)memory.used, (long long)memory.budget, memory.frames_allocated, (unsigned long long)memory.refused);
+	if(stats.reconfigure.count)
+		fprintf(stderr, "%s: %llu switches p50 %lld us, max %lld us, %llu reopened decoder\n", options->name,
+			(unsigned long long)stats.reconfigure.count, (long long)stats.reconfigure.p50, (long long)stats.reconfigure.max,
+			(unsigned long long)stats.reopens);
+	fprintf(stderr, "%s: cpu %.3f s (%.1f%%), peak rss %ld kB\n",
+		options->name, cpu_seconds, 100.0 * cpu_seconds / seconds, max_rss_kb);
+}
+
+static int64_t percentile(const int64_t *sorted, uint64_t count, int percent)
+{
+	uint64_t rank;
+
+	if(count == 0)
+		return 0;
+
+	rank = (count * percent + 99) / 100;
+
+	return sorted[rank ? rank - 1 : 0];
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+	const int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+	return (x > y) - (x < y);
+}
+
+//user + system time of the process in seconds and peak resident set size
+static double cpu_time(long *max_rss_kb)
+{
+	struct rusage usage;
+
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0.0;
+
+	*max_rss_kb = usage.ru_maxrss; //kB on Linux
+
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0 +
+		usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0;
+}
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int load_input(const struct bench_options *options, struct bench_input *input)
+{
+	struct hvd_file_config file_config = {0};
+	struct hvd_file_info info;
+
+	if(options->stream)
+	{
+		if(load_file(options->file, input) != 0)
+			return 1;
+
+		//IVF signature, otherwise assume Annex B
+		if(input->file_size >= IVF_FILE_HEADER && memcmp(input->file, "DKIF", 4) == 0)
+		{
+			fprintf(stderr, "stream input needs Annex B file, not IVF\n");
+			return 1;
+		}
+		return 0;
+	}
+
+	file_config.path = options->file;
+	file_config.codec = options->config.codec;
+	file_config.index_path = options->index;
+
+	if( (input->source = hvd_file_open(&file_config)) == NULL )
+	{
+		fprintf(stderr, "unable to open %s\n", options->file);
+		return 1;
+	}
+
+	hvd_file_get_info(input->source, &info);
+	input->packet_count = info.frames;
+
+	return 0;
+}
+
+//whole file with zeroed padding after the data
+static int load_file(const char *path, struct bench_input *input)
+{
+	FILE *file = fopen(path, "rb");
+	long size;
+
+	if(file == NULL)
+	{
+		fprintf(stderr, "unable to open %s\n", path);
+		return 1;
+	}
+
+	if(fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0)
+	{
+		fprintf(stderr, "unable to get size of %s\n", path);
+		fclose(file);
+		return 1;
+	}
+
+	if( (input->file = (uint8_t*)calloc(size + AV_INPUT_BUFFER_PADDING_SIZE, 1)) == NULL )
+	{
+		fprintf(stderr, "not enough memory for %s\n", path);
+		fclose(file);
+		return 1;
+	}
+
+	input->file_size = (int)size;
+
+	if(fread(input->file, 1, size, file) != (size_t)size)
+	{
+		fprintf(stderr, "unable to read %s\n", path);
+		fclose(file);
+		return 1;
+	}
+
+	fclose(file);
+	return 0;
+}
+
+static void free_input(struct bench_input *input)
+{
+	hvd_file_close(input->source);
+	free(input->file);
+}
+
+static int process_user_input(int argc, char **argv, struct bench_options *options)
+{
+	struct hvd_config *config = &options->config;
+
+	if(argc < 4)
+	{
+		fprintf(stderr, "Usage: %s <hardware> <codec> <file> [options]\n", argv[0]);
+		fprintf(stderr, "       %s --check-kernels\n\n", argv[0]);
+		fprintf(stderr, "file: raw Annex B (H.264, HEVC) or IVF (VP8, VP9, AV1)\n\n");
+		fprintf(stderr, "options:\n");
+		fprintf(stderr, "  --name <name>          name of the run in results\n");
+		fprintf(stderr, "  --device <device>      e.g. /dev/dri/renderD128\n");
+		fprintf(stderr, "  --pixel-format <fmt>   e.g. nv12, yuv420p\n");
+		fprintf(stderr, "  --fps <fps>            fixed frame rate (default maximum speed)\n");
+		fprintf(stderr, "  --repeat <n>           decode the file n times\n");
+		fprintf(stderr, "  --output <mode>        transfer (default), hardware, map\n");
+		fprintf(stderr, "  --threads <n>          software decoding threads (default automatic)\n");
+		fprintf(stderr, "  --frames-in-flight <n> frame pool size\n");
+		fprintf(stderr, "  --width <w>            stream width (with height prepares surfaces in hvd_init)\n");
+		fprintf(stderr, "  --height <h>           stream height\n");
+		fprintf(stderr, "  --surfaces <n>         extra hardware surfaces\n");
+		fprintf(stderr, "  --warmup               prepare surfaces and output buffers in hvd_init\n");
+		fprintf(stderr, "  --async                decode on internal threads\n");
+		fprintf(stderr, "  --low-latency          minimize decoder buffering\n");
+		fprintf(stderr, "  --fallback             fall back to software decoding\n");
+		fprintf(stderr, "  --stream               send raw chunks with hvd_send_stream (Annex B)\n");
+		fprintf(stderr, "  --reconfigure          switch with hvd_reconfigure before each repeat\n");
+		fprintf(stderr, "  --drop <policies>      comma separated nonref, unread, latest, auto\n");
+		fprintf(stderr, "  --loss <n>             drop every n-th packet (simulated packet loss)\n");
+		fprintf(stderr, "  --resync               after errors drop packets until the next keyframe\n");
+		fprintf(stderr, "  --index <path>         sidecar frame index of the file, built if missing or stale\n");
+		fprintf(stderr, "  --trace <path>         write Chrome trace of the last frames (chrome://tracing, Perfetto)\n");
+		fprintf(stderr, "  --memory-budget <n>    host bytes of frames and packets held by decoder\n");
+		fprintf(stderr, "  --shm <name>           publish frames to shared memory ring, e.g. /hvd-bench\n\n");
+		fprintf(stderr, "examples: \n");
+		fprintf(stderr, "%s software h264 sample.h264\n", argv[0]);
+		fprintf(stderr, "%s software h264 sample.h264 --fps 30 --low-latency\n", argv[0]);
+		fprintf(stderr, "%s vaapi h264 sample.h264 --device /dev/dri/renderD128 --pixel-format nv12\n", argv[0]);
+		fprintf(stderr, "%s cuda hevc sample.h265 --async --repeat 10\n", argv[0]);
+		fprintf(stderr, "%s software vp9 sample.ivf --threads 1\n", argv[0]);
+		fprintf(stderr, "%s vaapi h264 sample.h264 --width 1920 --height 1080 --warmup\n", argv[0]);
+		fprintf(stderr, "%s vaapi h264 sample.h264 --async --drop nonref,latest\n", argv[0]);
+		fprintf(stderr, "%s vaapi h264 sample.h264 --loss 50 --resync\n", argv[0]);
+		fprintf(stderr, "%s software h264 recording.h264 --index recording.h264.hvdi --repeat 10\n", argv[0]);
+		fprintf(stderr, "%s vaapi h264 sample.h264 --async --trace hvd.json\n", argv[0]);
+		fprintf(stderr, "%s vaapi h264 sample.h264 --async --memory-budget 16000000\n", argv[0]);
+		return 1;
+	}
+
+	config->hardware = argv[1];
+	config->codec = argv[2];
+	options->file = argv[3];
+	options->name = "bench";
+	options->repeat = 1;
+
+	for(int i=4;i<argc;++i)
+	{
+		const char *arg = argv[i];
+		const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if(strcmp(arg, "--async") == 0)
+			config->async = 1;
+		else if(strcmp(arg, "--low-latency") == 0)
+			config->low_latency = 1;
+		else if(strcmp(arg, "--fallback") == 0)
+			config->software_fallback = 1;
+		else if(strcmp(arg, "--stream") == 0)
+			options->stream = 1;
+		else if(strcmp(arg, "--warmup") == 0)
+			config->warmup = 1;
+		else if(strcmp(arg, "--reconfigure") == 0)
+			options->reconfigure = 1;
+		else if(strcmp(arg, "--resync") == 0)
+			config->resync = 1;
+		else if(value == NULL)
+		{
+			fprintf(stderr, "unknown option or missing value: %s\n", arg);
+			return 1;
+		}
+		else
+		{
+			if(strcmp(arg, "--name") == 0)
+				options->name = value;
+			else if(strcmp(arg, "--device") == 0)
+				config->device = value;
+			else if(strcmp(arg, "--pixel-format") == 0)
+				config->pixel_format = value;
+			else if(strcmp(arg, "--fps") == 0)
+				options->fps = atof(value);
+			else if(strcmp(arg, "--repeat") == 0)
+				options->repeat = atoi(value);
+			else if(strcmp(arg, "--threads") == 0)
+				config->thread_count = atoi(value);
+			else if(strcmp(arg, "--frames-in-flight") == 0)
+				config->frames_in_flight = atoi(value);
+			else if(strcmp(arg, "--width") == 0)
+				config->width = atoi(value);
+			else if(strcmp(arg, "--height") == 0)
+				config->height = atoi(value);
+			else if(strcmp(arg, "--surfaces") == 0)
+				config->surfaces = atoi(value);
+			else if(strcmp(arg, "--shm") == 0)
+				options->shm = value;
+			else if(strcmp(arg, "--index") == 0)
+				options->index = value;
+			else if(strcmp(arg, "--trace") == 0)
+			{
+				options->trace = value;
+				config->trace = TRACE_EVENTS;
+			}
+			else if(strcmp(arg, "--memory-budget") == 0)
+				config->memory_budget = atoll(value);
+			else if(strcmp(arg, "--loss") == 0)
+				options->loss = atoi(value);
+			else if(strcmp(arg, "--drop") == 0)
+				config->drop_policy = (strstr(value, "nonref") ? HVD_DROP_NONREF : 0) | (strstr(value, "unread") ? HVD_DROP_UNREAD : 0) |
+					(strstr(value, "latest") ? HVD_DROP_LATEST : 0) | (strstr(value, "auto") ? HVD_DROP_AUTO : 0);
+			else if(strcmp(arg, "--output") == 0)
+				config->output = strcmp(value, "hardware") == 0 ? HVD_OUTPUT_HARDWARE :
+					strcmp(value, "map") == 0 ? HVD_OUTPUT_MAP : HVD_OUTPUT_TRANSFER;
+			else
+			{
+				fprintf(stderr, "unknown option: %s\n", arg);
+				return 1;
+			}
+			++i;
+		}
+	}
+
+	if(options->stream && options->fps > 0)
+	{
+		fprintf(stderr, "fixed frame rate needs packets, not supported with --stream\n");
+		return 1;
+	}
+
+	if(options->stream && options->loss > 0)
+	{
+		fprintf(stderr, "packet loss needs packets, not supported with --stream\n");
+		return 1;
+	}
+
+	return 0;
+}
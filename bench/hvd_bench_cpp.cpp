@@ -0,0 +1,398 @@
+/*
+ * HVD Hardware Video Decoder C++ wrapper benchmark
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *
+ * Decodes the same file with the C interface and with hvd.hpp
+ * (both hold frames with hvd_acquire_frame) and reports for each:
+ * - fps
+ * - allocations with operator new during decoding
+ * - frame pool allocations and bytes copied out of decoder memory
+ *
+ * Fails (exit code 1) if the wrapper allocates or copies more than the C interface.
+ *
+ * Results are printed to stdout as single line JSON (one per interface),
+ * human readable summary to stderr.
+ *
+ * Annex B files are sent in chunks with hvd_send_stream, IVF files by frames.
+ */
+
+#include "../hvd.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include <poll.h> //poll
+
+enum {IVF_FILE_HEADER = 32, IVF_FRAME_HEADER = 12, STREAM_CHUNK = 4096};
+
+//everything allocated in C++ (hvd.hpp included) goes through here
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(std::size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+
+	if(void *p = std::malloc(size ? size : 1))
+		return p;
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+struct bench_options
+{
+	struct hvd_config config;
+	const char *file;
+	int repeat;
+};
+
+struct bench_input
+{
+	std::vector<uint8_t> file; //whole file, padded
+	std::vector<hvd_cpp::bytes> units; //IVF frames or Annex B chunks
+	bool stream; //Annex B, units sent with hvd_send_stream
+};
+
+struct bench_results
+{
+	const char *api;
+	uint64_t frames;
+	uint64_t allocations;
+	double seconds;
+	struct hvd_stats stats;
+	struct hvd_pool_stats pool;
+};
+
+static int process_user_input(int argc, char **argv, bench_options &options);
+static int load_input(const bench_options &options, bench_input &input);
+static int decode_c(const bench_options &options, const bench_input &input, bench_results &results);
+static int send_c(struct hvd *h, bool stream, hvd_cpp::bytes data, uint64_t &frames);
+static int receive_c(struct hvd *h, uint64_t &frames);
+static int decode_cpp(const bench_options &options, const bench_input &input, bench_results &results);
+static int send_cpp(hvd_cpp::decoder &decoder, bool stream, hvd_cpp::bytes data, uint64_t &frames);
+static int receive_cpp(hvd_cpp::decoder &decoder, uint64_t &frames);
+static void wait_frames(int event_fd);
+static double now_seconds();
+static void report(const bench_results &results);
+
+int main(int argc, char **argv)
+{
+	bench_options options = {};
+	bench_input input;
+	bench_results c = {}, cpp = {};
+
+	c.api = "c";
+	cpp.api = "cpp";
+
+	if(process_user_input(argc, argv, options) != 0)
+		return 1;
+
+	if(load_input(options, input) != 0)
+		return 1;
+
+	if(decode_c(options, input, c) != 0 || decode_cpp(options, input, cpp) != 0)
+	{
+		fprintf(stderr, "decoding failed\n");
+		return 1;
+	}
+
+	report(c);
+	report(cpp);
+
+	fprintf(stderr, "wrapper: %+lld allocations, %+lld pool allocations, %+lld bytes copied, %.3f time ratio\n",
+		(long long)(cpp.allocations - c.allocations), (long long)(cpp.pool.allocations - c.pool.allocations),
+		(long long)(cpp.stats.transfer_bytes - c.stats.transfer_bytes), cpp.seconds / c.seconds);
+
+	//pool allocations depend on timing of download thread in async mode
+	if(cpp.allocations > c.allocations || cpp.stats.transfer_bytes > c.stats.transfer_bytes ||
+		(!options.config.async && cpp.pool.allocations > c.pool.allocations))
+	{
+		fprintf(stderr, "wrapper added allocations or copies\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int decode_c(const bench_options &options, const bench_input &input, bench_results &results)
+{
+	struct hvd *h = hvd_init(&options.config);
+	int ret = 0;
+
+	if(h == NULL)
+		return 1;
+
+	const uint64_t allocated = allocations.load();
+	const double start = now_seconds();
+
+	for(int r=0;r<options.repeat && ret == 0;++r)
+		for(size_t i=0;i<input.units.size() && ret == 0;++i)
+			ret = send_c(h, input.stream, input.units[i], results.frames);
+
+	//flush and get the last frames
+	if(ret == 0)
+		ret = send_c(h, input.stream, hvd_cpp::bytes(), results.frames);
+
+	while(ret == 0 && (ret = receive_c(h, results.frames)) == HVD_AGAIN)
+	{
+		wait_frames(hvd_get_event_fd(h));
+		ret = 0;
+	}
+
+	results.seconds = now_seconds() - start;
+	results.allocations = allocations.load() - allocated;
+	hvd_get_stats(h, &results.stats);
+	hvd_get_pool_stats(h, &results.pool);
+
+	hvd_close(h);
+
+	return ret == HVD_OK ? 0 : 1;
+}
+
+//sends data (empty to flush) and receives all ready frames
+static int send_c(struct hvd *h, bool stream, hvd_cpp::bytes data, uint64_t &frames)
+{
+	struct hvd_packet packet = {};
+	int ret;
+
+	packet.data = data.data();
+	packet.size = (int)data.size();
+
+	for(;;)
+	{
+		if(stream)
+			ret = hvd_send_stream(h, data.data(), (int)data.size());
+		else
+			ret = hvd_send_packet(h, data.data() ? &packet : NULL);
+
+		if(ret == HVD_ERROR || receive_c(h, frames) == HVD_ERROR)
+			return 1;
+
+		if(ret == HVD_OK)
+			return 0;
+
+		wait_frames(hvd_get_event_fd(h));
+	}
+}
+
+static int receive_c(struct hvd *h, uint64_t &frames)
+{
+	AVFrame *frame;
+	int error;
+
+	while( (frame = hvd_acquire_frame(h, &error)) )
+	{
+		++frames;
+		hvd_release_frame(h, frame);
+	}
+
+	return error;
+}
+
+static int decode_cpp(const bench_options &options, const bench_input &input, bench_results &results)
+{
+	hvd_cpp::decoder decoder(options.config);
+	int ret = 0;
+
+	if(!decoder)
+		return 1;
+
+	const uint64_t allocated = allocations.load();
+	const double start = now_seconds();
+
+	for(int r=0;r<options.repeat && ret == 0;++r)
+		for(hvd_cpp::bytes unit : input.units)
+			if( (ret = send_cpp(decoder, input.stream, unit, results.frames)) != 0 )
+				break;
+
+	//flush and get the last frames
+	if(ret == 0)
+		ret = send_cpp(decoder, input.stream, hvd_cpp::bytes(), results.frames);
+
+	while(ret == 0 && (ret = receive_cpp(decoder, results.frames)) == HVD_AGAIN)
+	{
+		wait_frames(decoder.event_fd());
+		ret = 0;
+	}
+
+	results.seconds = now_seconds() - start;
+	results.allocations = allocations.load() - allocated;
+	results.stats = decoder.stats();
+	results.pool = decoder.pool_stats();
+
+	return ret == HVD_OK ? 0 : 1;
+}
+
+static int send_cpp(hvd_cpp::decoder &decoder, bool stream, hvd_cpp::bytes data, uint64_t &frames)
+{
+	for(;;)
+	{
+		const int ret = stream ? decoder.send_stream(data) : data.data() ? decoder.send(data) : decoder.flush();
+
+		if(ret == HVD_ERROR || receive_cpp(decoder, frames) == HVD_ERROR)
+			return 1;
+
+		if(ret == HVD_OK)
+			return 0;
+
+		wait_frames(decoder.event_fd());
+	}
+}
+
+static int receive_cpp(hvd_cpp::decoder &decoder, uint64_t &frames)
+{
+	auto ready = decoder.frames();
+
+	for(hvd_cpp::frame &frame : ready)
+		frames += frame ? 1 : 0;
+
+	return ready.error();
+}
+
+static void wait_frames(int event_fd)
+{
+	struct pollfd pfd = {event_fd, POLLIN, 0};
+
+	if(pfd.fd != -1)
+		poll(&pfd, 1, 10);
+}
+
+static int load_input(const bench_options &options, bench_input &input)
+{
+	FILE *file = fopen(options.file, "rb");
+	long size;
+
+	if(file == NULL)
+	{
+		fprintf(stderr, "unable to open %s\n", options.file);
+		return 1;
+	}
+
+	if(fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0)
+	{
+		fprintf(stderr, "unable to get size of %s\n", options.file);
+		fclose(file);
+		return 1;
+	}
+
+	input.file.resize(size + AV_INPUT_BUFFER_PADDING_SIZE);
+
+	if(fread(input.file.data(), size, 1, file) != 1)
+	{
+		fprintf(stderr, "unable to read %s\n", options.file);
+		fclose(file);
+		return 1;
+	}
+
+	fclose(file);
+
+	uint8_t *data = input.file.data();
+
+	//IVF signature, otherwise Annex B in chunks
+	input.stream = !(size >= IVF_FILE_HEADER && memcmp(data, "DKIF", 4) == 0);
+
+	if(input.stream)
+	{
+		for(long offset=0;offset<size;offset+=STREAM_CHUNK)
+			input.units.push_back(hvd_cpp::bytes(data + offset, size - offset < STREAM_CHUNK ? size - offset : (long)STREAM_CHUNK));
+		return 0;
+	}
+
+	for(long offset = data[6] | (data[7] << 8);offset + IVF_FRAME_HEADER <= size;)
+	{
+		const uint8_t *h = data + offset;
+		const long frame_size = h[0] | (h[1] << 8) | (h[2] << 16) | ((unsigned long)h[3] << 24);
+
+		offset += IVF_FRAME_HEADER;
+
+		if(frame_size <= 0 || offset + frame_size > size)
+			break;
+
+		input.units.push_back(hvd_cpp::bytes(data + offset, frame_size));
+		offset += frame_size;
+	}
+
+	return 0;
+}
+
+static double now_seconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const bench_results &results)
+{
+	const double fps = results.seconds > 0 ? results.frames / results.seconds : 0;
+
+	printf("{\"api\":\"%s\",\"frames\":%llu,\"seconds\":%.6f,\"fps\":%.2f,\"allocations\":%llu,\"pool_allocations\":%llu,\"transfer_bytes\":%llu}\n",
+		results.api, (unsigned long long)results.frames, results.seconds, fps, (unsigned long long)results.allocations,
+		(unsigned long long)results.pool.allocations, (unsigned long long)results.stats.transfer_bytes);
+
+	fprintf(stderr, "%s: %llu frames in %.3f s, %.1f fps, %llu allocations, %llu pool allocations, %llu bytes copied\n",
+		results.api, (unsigned long long)results.frames, results.seconds, fps, (unsigned long long)results.allocations,
+		(unsigned long long)results.pool.allocations, (unsigned long long)results.stats.transfer_bytes);
+}
+
+static int process_user_input(int argc, char **argv, bench_options &options)
+{
+	if(argc < 4)
+	{
+		fprintf(stderr, "Usage: %s <hardware> <codec> <file> [options]\n\n", argv[0]);
+		fprintf(stderr, "options:\n");
+		fprintf(stderr, "  --device <device>      e.g. /dev/dri/renderD128\n");
+		fprintf(stderr, "  --pixel-format <fmt>   e.g. nv12, yuv420p\n");
+		fprintf(stderr, "  --repeat <n>           decode the file n times\n");
+		fprintf(stderr, "  --async                decode on internal threads\n\n");
+		fprintf(stderr, "examples: \n");
+		fprintf(stderr, "%s software h264 sample.h264\n", argv[0]);
+		fprintf(stderr, "%s vaapi h264 sample.h264 --device /dev/dri/renderD128 --async --repeat 10\n", argv[0]);
+		return 1;
+	}
+
+	options.config.hardware = argv[1];
+	options.config.codec = argv[2];
+	options.file = argv[3];
+	options.repeat = 1;
+
+	for(int i=4;i<argc;++i)
+	{
+		const char *arg = argv[i];
+		const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if(strcmp(arg, "--async") == 0)
+			options.config.async = 1;
+		else if(value && strcmp(arg, "--device") == 0)
+			options.config.device = argv[++i];
+		else if(value && strcmp(arg, "--pixel-format") == 0)
+			options.config.pixel_format = argv[++i];
+		else if(value && strcmp(arg, "--repeat") == 0)
+			options.repeat = atoi(argv[++i]);
+		else
+		{
+			fprintf(stderr, "unknown option or missing value: %s\n", arg);
+			return 1;
+		}
+	}
+
+	return 0;
+}
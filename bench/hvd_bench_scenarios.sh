@@ -0,0 +1,87 @@
+#!/bin/sh
+#
+# HVD Hardware Video Decoder benchmark scenarios
+#
+# Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+#
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at http://mozilla.org/MPL/2.0/.
+#
+#
+# Runs the same set of scenarios for comparable results between commits and machines.
+# Prints one JSON line per scenario to stdout (e.g. redirect to results.jsonl).
+#
+# Usage: hvd_bench_scenarios.sh <hvd-bench> [hardware] [device] [pixel_format]
+#
+# examples:
+# ./hvd_bench_scenarios.sh ./hvd-bench > software.jsonl
+# ./hvd_bench_scenarios.sh ./hvd-bench vaapi /dev/dri/renderD128 nv12 > vaapi.jsonl
+#
+# Sample clips are generated with ffmpeg (testsrc2 pattern) in HVD_BENCH_DIR (default bench-data)
+# unless already present.
+
+set -e
+
+BENCH=${1:?usage: $0 <hvd-bench> [hardware] [device] [pixel_format]}
+HARDWARE=${2:-software}
+DEVICE=${3:-}
+PIXEL_FORMAT=${4:-}
+DIR=${HVD_BENCH_DIR:-bench-data}
+SECONDS_OF_VIDEO=10
+
+mkdir -p "$DIR"
+
+# name size rate encoder extension
+clip() {
+	if [ ! -f "$DIR/$1.$5" ]; then
+		ffmpeg -loglevel error -f lavfi -i testsrc2=size=$2:rate=$3 -t $SECONDS_OF_VIDEO \
+			-pix_fmt yuv420p -c:v $4 -g $3 "$DIR/$1.$5" >&2
+	fi
+}
+
+clip h264_720p 1280x720 30 libx264 h264
+clip h264_1080p 1920x1080 30 libx264 h264
+clip hevc_1080p 1920x1080 30 libx265 h265
+clip vp9_720p 1280x720 30 libvpx-vp9 ivf
+
+# name codec file [options]
+run() {
+	NAME=$1; CODEC=$2; FILE=$3; shift 3
+	"$BENCH" "$HARDWARE" "$CODEC" "$DIR/$FILE" --name "$NAME" \
+		${DEVICE:+--device "$DEVICE"} ${PIXEL_FORMAT:+--pixel-format "$PIXEL_FORMAT"} "$@"
+}
+
+# throughput at maximum speed
+run h264_720p_max h264 h264_720p.h264 --repeat 3
+run h264_1080p_max h264 h264_1080p.h264 --repeat 3
+run hevc_1080p_max hevc hevc_1080p.h265 --repeat 3
+run vp9_720p_max vp9 vp9_720p.ivf --repeat 3
+run h264_1080p_async_max h264 h264_1080p.h264 --repeat 3 --async
+run h264_1080p_stream_max h264 h264_1080p.h264 --repeat 3 --stream
+
+# latency at real-time rate
+run h264_1080p_30fps h264 h264_1080p.h264 --fps 30
+run h264_1080p_30fps_low_latency h264 h264_1080p.h264 --fps 30 --low-latency
+run h264_1080p_30fps_async_low_latency h264 h264_1080p.h264 --fps 30 --low-latency --async
+
+# startup (time to first frame), lazy and warm
+run h264_1080p_startup h264 h264_1080p.h264 --fps 30 --low-latency
+run h264_1080p_startup_warm h264 h264_1080p.h264 --fps 30 --low-latency --width 1920 --height 1080 --warmup
+
+# switching streams in place (compare reconfigure_us with init_us)
+run h264_1080p_switch h264 h264_1080p.h264 --repeat 10 --reconfigure --low-latency --width 1920 --height 1080
+
+# load shedding at maximum speed (frames dropped instead of falling behind)
+run h264_1080p_async_drop_latest h264 h264_1080p.h264 --repeat 3 --async --drop latest
+run h264_1080p_async_drop_auto h264 h264_1080p.h264 --repeat 3 --async --drop auto
+
+# packet loss, garbage decoded and downloaded vs resync at keyframe (compare frames, resync_packets)
+run h264_1080p_loss h264 h264_1080p.h264 --loss 50
+run h264_1080p_loss_resync h264 h264_1080p.h264 --loss 50 --resync
+
+# single threaded software reference
+if [ "$HARDWARE" = "software" ]; then
+	run h264_1080p_max_1_thread h264 h264_1080p.h264 --threads 1
+	run h264_1080p_30fps_1_thread_low_latency h264 h264_1080p.h264 --fps 30 --threads 1 --low-latency
+fi
@@ -114,6 +114,7 @@ int process_user_input(int argc, char **argv, struct hvd_config *config)
 		fprintf(stderr, "%s cuda h264_cuvid \n", argv[0]);
 		fprintf(stderr, "%s cuda hevc_cuvid \n", argv[0]);
 		fprintf(stderr, "%s vaapi hevc /dev/dri/renderD128 848 480 1 \n", argv[0]);
+		fprintf(stderr, "%s software h264\n", argv[0]);
 		return 1;
 	}
 
@@ -0,0 +1,118 @@
+/*
+ * HVD Hardware Video Decoder capability probe example
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *
+ * Lists what the device decodes and picks pixel format without trial hvd_init.
+ * Run twice with cache file to see the second probe coming from cache.
+ */
+
+#include "../hvd.h"
+
+#include <libavutil/pixdesc.h>
+
+#include <stdio.h>
+
+void print_probe(const struct hvd_probe *probe);
+int process_user_input(int argc, char **argv, struct hvd_probe_config *config);
+
+int main(int argc, char **argv)
+{
+	struct hvd_probe_config probe_config = {0};
+	struct hvd_probe probe;
+	struct hvd_config config = {0};
+	const char *pixel_formats[] = {"nv12", "yuv420p", "rgb0"};
+
+	if(process_user_input(argc, argv, &probe_config) != 0)
+		return 1;
+
+	if(hvd_probe(&probe_config, &probe) != HVD_OK)
+	{
+		fprintf(stderr, "failed to probe %s\n", probe_config.hardware);
+		return 1;
+	}
+
+	print_probe(&probe);
+
+	//the first pixel format that works for h264 1080p
+	config.hardware = probe_config.hardware;
+	config.device = probe_config.device;
+	config.codec = "h264";
+	config.width = 1920;
+	config.height = 1080;
+
+	for(int i=0;i<(int)(sizeof(pixel_formats)/sizeof(pixel_formats[0]));++i)
+	{
+		config.pixel_format = pixel_formats[i];
+
+		if(hvd_probe_check(&probe, &config) == HVD_OK)
+		{
+			printf("h264 1920x1080 %s: ok, use it with hvd_init\n", config.pixel_format);
+			return 0;
+		}
+	}
+
+	printf("h264 1920x1080: not supported, pick other hardware\n");
+
+	return 0;
+}
+
+void print_probe(const struct hvd_probe *probe)
+{
+	printf("%s %s (%s in %lld us)\n", probe->hardware, probe->device[0] ? probe->device : "default device",
+		probe->cached ? "from cache" : "probed", (long long)probe->probe_time);
+
+	printf("surfaces %dx%d - %dx%d (0 if not reported)\n", probe->min_width, probe->min_height, probe->max_width, probe->max_height);
+
+	for(int i=0;i<probe->codec_count;++i)
+	{
+		const struct hvd_probe_codec *codec = &probe->codecs[i];
+
+		printf("codec %s, profiles:", codec->name);
+
+		for(int j=0;j<codec->profile_count;++j)
+		{
+			const char *name = avcodec_profile_name((enum AVCodecID)codec->codec_id, codec->profiles[j]);
+			printf(" %s%s", name ? name : "?", j + 1 < codec->profile_count ? "," : "");
+		}
+
+		printf("\n");
+	}
+
+	for(int i=0;i<probe->format_count;++i)
+	{
+		const struct hvd_probe_format *format = &probe->formats[i];
+
+		printf("surface %s, transfer as:", av_get_pix_fmt_name((enum AVPixelFormat)format->sw_format));
+
+		for(int j=0;j<format->transfer_count;++j)
+			printf(" %s", av_get_pix_fmt_name((enum AVPixelFormat)format->transfer_formats[j]));
+
+		printf("\n");
+	}
+}
+
+int process_user_input(int argc, char **argv, struct hvd_probe_config *config)
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <hardware> [device] [cache]\n\n", argv[0]);
+		fprintf(stderr, "examples: \n");
+		fprintf(stderr, "%s vaapi\n", argv[0]);
+		fprintf(stderr, "%s vaapi /dev/dri/renderD128 hvd.probe\n", argv[0]);
+		fprintf(stderr, "%s cuda 0 hvd.probe\n", argv[0]);
+		fprintf(stderr, "%s software \"\" hvd.probe\n", argv[0]);
+		return 1;
+	}
+
+	config->hardware = argv[1];
+	config->device = argc >= 3 ? argv[2] : NULL;
+	config->cache_path = argc >= 4 ? argv[3] : NULL;
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * HVD Hardware Video Decoder shared memory reader example
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *
+ * Reads frames published by other process (e.g. hvd-bench --shm /hvd-bench).
+ * Start any number of readers, they don't disturb the publisher or each other.
+ */
+
+#include "../hvd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void reading_loop(struct hvd_shm *ring, int frames, int every_frame);
+int process_user_input(int argc, char **argv, const char **name, int *frames, int *every_frame);
+
+int main(int argc, char **argv)
+{
+	struct hvd_shm *ring;
+	const char *name;
+	int frames, every_frame;
+
+	if(process_user_input(argc, argv, &name, &frames, &every_frame) != 0)
+		return 1;
+
+	if( (ring = hvd_shm_attach(name, -1) ) == NULL )
+	{
+		fprintf(stderr, "failed to attach to %s, is the publisher running?\n", name);
+		return 1;
+	}
+
+	printf("attached to %s...\n", name);
+
+	reading_loop(ring, frames, every_frame);
+
+	hvd_shm_close(ring);
+
+	printf("bye...\n");
+
+	return 0;
+}
+
+void reading_loop(struct hvd_shm *ring, int frames, int every_frame)
+{
+	struct hvd_shm_frame frame;
+	uint64_t number = hvd_shm_latest(ring);
+	int read = 0, overruns = 0;
+
+	while(read < frames)
+	{
+		if(hvd_shm_wait(ring, number, 1000) != HVD_OK)
+		{
+			printf("no new frames for 1 second...\n");
+			continue;
+		}
+
+		//either every frame (may overrun when too slow) or just the latest one
+		number = every_frame ? number + 1 : hvd_shm_latest(ring);
+
+		if(hvd_shm_read(ring, number, &frame) != HVD_OK)
+		{
+			++overruns;
+			continue;
+		}
+
+		//...
+		//consume frame data (frame.data, frame.linesize) directly from shared memory
+		//or copy what you need
+		//...
+
+		if(hvd_shm_check(ring, &frame) != HVD_OK)
+		{
+			++overruns; //overwritten while we were reading, discard results
+			continue;
+		}
+
+		printf("frame %llu %dx%d pts %lld\n", (unsigned long long)frame.number,
+			frame.width, frame.height, (long long)frame.pts);
+
+		++read;
+	}
+
+	printf("read %d frames, %d overruns\n", read, overruns);
+}
+
+int process_user_input(int argc, char **argv, const char **name, int *frames, int *every_frame)
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <name> [frames] [every]\n\n", argv[0]);
+		fprintf(stderr, "examples: \n");
+		fprintf(stderr, "%s /hvd-bench\n", argv[0]);
+		fprintf(stderr, "%s /hvd-bench 100\n", argv[0]);
+		fprintf(stderr, "%s /hvd-bench 100 every\n", argv[0]);
+		return 1;
+	}
+
+	*name = argv[1];
+	*frames = argc >= 3 ? atoi(argv[2]) : 300;
+	*every_frame = argc >= 4;
+
+	return 0;
+}
@@ -14,83 +14,809 @@
 // FFmpeg
 #include <libavcodec/avcodec.h>
 #include <libavutil/hwcontext.h>
+#include <libavutil/cpu.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
+#include <libavutil/avstring.h>
+#include <libavutil/lfg.h>
 
-#include <stdio.h> //fprintf
-#include <stdlib.h> //malloc
+#include <pthread.h> //pthread_once, pthread_create, ...
+#include <stdatomic.h> //atomic_int, ...
+#include <stdarg.h> //va_list
+#include <limits.h> //INT_MAX
+#include <stdio.h> //fprintf, vsnprintf
+#include <stdlib.h> //malloc, calloc
+#include <string.h> //strcmp, memcpy
+
+#ifdef __linux__
+#include <sys/eventfd.h> //eventfd
+#include <unistd.h> //read, write, close
+#include <linux/futex.h> //FUTEX_WAIT, FUTEX_WAKE
+#include <sys/syscall.h> //SYS_futex, SYS_memfd_create
+#include <sys/utsname.h> //uname
+#endif
+
+//surfaces prepared before decoding have to be checked against what decoder needs (FFmpeg 4.0)
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100)
+#define HVD_HW_FRAMES_PARAMETERS
+#endif
+
+//decoder hardware configurations (FFmpeg 4.0)
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100)
+#define HVD_HW_CONFIG
+#endif
+
+//AV1 codec id (FFmpeg 4.0)
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100)
+#define HVD_AV1
+#endif
+
+//shared memory frame ring, atomics in shared memory have to be lock-free
+#if (defined(__unix__) || defined(__APPLE__)) && ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2
+#define HVD_SHM
+#include <fcntl.h> //O_RDONLY, O_RDWR, ...
+#include <sys/mman.h> //mmap, shm_open, shm_unlink
+#include <sys/stat.h> //fstat
+#include <unistd.h> //ftruncate, close
+#endif
+
+//memory-mapped file source
+#if defined(__unix__) || defined(__APPLE__)
+#define HVD_MMAP
+#include <fcntl.h> //open, O_RDONLY
+#include <sys/mman.h> //mmap, munmap, posix_madvise
+#include <sys/stat.h> //fstat
+#include <unistd.h> //close
+#endif
+
+//SIMD conversion kernels, selected at runtime by CPU flags
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HVD_SSE2
+#include <emmintrin.h> //SSE2
+#if defined(__GNUC__) || defined(__clang__)
+#define HVD_AVX2
+#define HVD_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h> //AVX2
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HVD_NEON
+#include <arm_neon.h>
+#endif
+
+enum {HVD_DEFAULT_FRAMES_IN_FLIGHT = 4, HVD_DEFAULT_ASYNC_DEPTH = 16, HVD_ASYNC_DECODED = 2, HVD_ASYNC_MARKERS = 4,
+	HVD_PACKET_INFO = 256, HVD_HISTOGRAM_BUCKETS = 32, HVD_DEFAULT_LOG_RATE = 10, HVD_LOG_MESSAGE = 512,
+	HVD_CONVERT_BLOCK = 256, HVD_SHM_DEFAULT_SLOTS = 8, HVD_SHM_PAGE = 4096, HVD_SHM_ALIGN = 32,
+	HVD_SHM_MAGIC = 0x52445648, HVD_SHM_VERSION = 1, //shared memory magic "HVDR" in little endian
+	HVD_SCHEDULER_QUEUE_DEPTH = 16, HVD_SCHEDULER_BUDGET = 4, HVD_SCHEDULER_SAMPLE_US = 1000000, HVD_SCHEDULER_PARK_US = 1000,
+	HVD_DEFAULT_DROP_DEPTH = 4,
+	HVD_FILE_MAGIC = 0x49445648, HVD_FILE_VERSION = 2, //sidecar index magic "HVDI" in little endian
+	HVD_IVF_HEADER = 32, HVD_IVF_FRAME_HEADER = 12,
+	HVD_PROBE_MAGIC = 0x50445648, HVD_PROBE_VERSION = 1, //probe cache magic "HVDP" in little endian
+	HVD_PROBE_CACHE_RECORDS = 64, HVD_PROBE_SURFACE = 64};
+
+//how frames are downloaded from hardware frames context
+enum hvd_transfer_mode {HVD_TRANSFER_DIRECT, HVD_TRANSFER_CONVERT, HVD_TRANSFER_UNSUPPORTED};
+
+//kinds of messages rate limited independently
+enum hvd_log_class {HVD_LOG_GENERAL, HVD_LOG_SEND, HVD_LOG_DECODE, HVD_LOG_OUTPUT, HVD_LOG_CLASSES};
+
+//relaxed atomic counter, cheap enough for hot path
+typedef atomic_uint_fast64_t hvd_counter;
+
+//log2 histogram of durations in microseconds, bucket i holds durations < 2^i
+struct hvd_histogram
+{
+	hvd_counter bucket[HVD_HISTOGRAM_BUCKETS];
+	atomic_int_fast64_t max;
+};
+
+//fixed window (1 second) rate limiting of one message class
+struct hvd_log_limit
+{
+	atomic_int_fast64_t window; //start of the window in microseconds
+	atomic_int count; //messages in the window
+	hvd_counter suppressed; //since the last message that got through
+};
+
+//messages may come from the user thread and async threads
+struct hvd_log
+{
+	void (*callback)(void *opaque, int level, const char *message);
+	void *opaque;
+	int level;
+	int rate;
+	struct hvd_log_limit limit[HVD_LOG_CLASSES];
+	hvd_counter suppressed;
+};
+
+//hot path counters, written by decoding threads, read by the user at any time
+struct hvd_counters
+{
+	hvd_counter packets;
+	hvd_counter bytes;
+	hvd_counter invalid_data;
+	hvd_counter io_errors;
+	hvd_counter again;
+	hvd_counter flushes;
+	struct hvd_histogram send;
+	struct hvd_histogram receive;
+	struct hvd_histogram transfer;
+	hvd_counter transfer_bytes;
+	hvd_counter first_packet; //time in microseconds, 0 until then
+	hvd_counter first_frame; //time in microseconds, 0 until then
+	hvd_counter prebuilt_surfaces; //set by get_format on decoding thread
+	struct hvd_histogram reconfigure;
+	hvd_counter reopens;
+	hvd_counter nonref_packets; //sent with non-reference frames skipped
+	hvd_counter nonref_frames; //decoded from such packets
+	hvd_counter dropped_unread;
+	hvd_counter dropped_stale;
+	hvd_counter resyncs;
+	hvd_counter resync_packets; //dropped waiting for keyframe
+	hvd_counter resync_bytes;
+	hvd_counter corrupt_frames;
+};
+
+//packet data carried to decoded frame, pts of packet carries sequence number
+//decoders reorder pts together with frames, so it survives reordering
+struct hvd_packet_info
+{
+	int64_t seq; //packet sequence number, -1 if unused
+	int64_t sent; //hvd_send_packet time in microseconds
+	int64_t pts; //of the user
+	uint64_t tag; //of the user
+	int skip; //sent with non-reference frames skipped
+	int size; //held by decoder (accounted in memory) until frames of this or later packet come out, 0 otherwise
+};
+
+//user data with free callback, owned by the library unless the packet is rejected
+struct hvd_packet_owner
+{
+	void (*free)(void *opaque, uint8_t *data);
+	void *opaque;
+	int rejected; //set only when the library holds the only reference
+};
+
+//frame returned to the user, reused between calls together with its data buffers
+struct hvd_frame_slot
+{
+	AVFrame *frame;
+	atomic_int in_use;
+	struct hvd_packet_info packet; //seq -1 if unknown
+	struct hvd_frame_info info;
+	int64_t bytes; //library data buffers accounted in memory
+};
+
+//trace event, seqlock like shared memory slots, written by any thread, read by the user at any time
+//sequence is 2 * number + 1 while written and 2 * number + 2 when published
+struct hvd_trace_slot
+{
+	atomic_uint_fast64_t sequence;
+	atomic_int_fast64_t time;
+	atomic_int_fast64_t seq;
+	atomic_int_fast64_t pts;
+	atomic_uint_fast64_t tag;
+	atomic_int type;
+	atomic_int thread;
+};
+
+//multiple producer ring of the latest events, producers claim numbers, old events are overwritten
+struct hvd_trace
+{
+	struct hvd_trace_slot *slots; //NULL without tracing
+	uint64_t mask; //power of 2 capacity - 1
+	atomic_uint_fast64_t next; //number of the next event
+};
+
+//memory held by decoder, updated by threads owning the memory, read by the user at any time
+struct hvd_memory_counters
+{
+	int64_t budget; //0 for unlimited
+	atomic_int_fast64_t frames; //host bytes of library frame data buffers
+	atomic_int_fast64_t packets; //host bytes of queued packets and packets held by decoder
+	atomic_int_fast64_t frame_size; //the largest frame, the cost of growing the pool
+	atomic_int allocated; //frames of the pool with data buffers
+	atomic_int surfaces;
+	atomic_int_fast64_t surface_bytes;
+	hvd_counter refused;
+	int64_t scratch; //conversion frames, owned by output
+	int64_t decoded; //the newest packet with frame out of decoder, owned by decoding thread
+	const void *surfaces_ctx; //hardware frames context of the estimate, owned by decoding thread
+};
+
+//single producer, single consumer lock-free ring (indexes, entries are stored by the user)
+struct hvd_ring
+{
+	atomic_uint head;
+	atomic_uint tail;
+	unsigned capacity;
+};
+
+//sleeping worker and its wakeup
+struct hvd_waiter
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	atomic_int sleeping;
+	int initialized;
+};
+
+struct hvd_async_packet
+{
+	AVPacket packet; //data in reusable refcounted buffer or referenced user data
+	struct hvd_packet_info info;
+	int64_t bytes; //accounted in memory
+	int referenced; //user data, released after decoding
+	int flush;
+};
+
+//decoded frame or output frame, without frame it is marker (HVD_ERROR, AVERROR_EOF)
+struct hvd_async_entry
+{
+	AVFrame *frame; //decoded (hardware) frame
+	struct hvd_packet_info packet; //of decoded frame
+	struct hvd_frame_slot *slot; //output frame from the pool
+	int status;
+};
+
+struct hvd_async
+{
+	int created;
+	struct hvd_ring packets; //user -> decode thread
+	struct hvd_ring decoded; //decode thread -> download thread
+	struct hvd_ring frames; //download thread -> user
+	struct hvd_async_packet *packet;
+	struct hvd_async_entry *decode;
+	struct hvd_async_entry *frame;
+	int packet_count;
+	int decoded_count;
+	int frame_count;
+	struct hvd_waiter decode_waiter;
+	struct hvd_waiter download_waiter;
+	pthread_t decode_thread;
+	pthread_t download_thread;
+	int decode_thread_running;
+	int download_thread_running;
+	atomic_int stop;
+	atomic_int error;
+	int event_fd;
+};
+
+//raw byte stream input, parsed into packets
+struct hvd_parser
+{
+	AVCodecParserContext *parser; //NULL until first data (and after flush)
+	AVCodecContext *parser_ctx; //separate from decoder, async decoding uses decoder_ctx concurrently
+	AVBufferPool *pool; //padded buffers for data chunks
+	int pool_size;
+	AVPacket packet;
+	AVPacket *pending; //parsed packets not accepted yet by decoder (full), NULL data for flush
+	int pending_count;
+	int pending_capacity;
+};
+
+//YUV to RGB in fixed point with 6 fractional bits
+struct hvd_yuv_rgb
+{
+	int16_t y_offset;
+	int16_t y;
+	int16_t rv;
+	int16_t gu;
+	int16_t gv;
+	int16_t bu;
+	int bgr; //bgr0/bgra instead of rgb0/rgba
+};
+
+//row kernels of CPU conversion (scalar reference or SIMD)
+struct hvd_convert_kernels
+{
+	void (*interleave_uv8)(uint8_t *dst, const uint8_t *u, const uint8_t *v, int width);
+	void (*deinterleave_uv8)(uint8_t *u, uint8_t *v, const uint8_t *src, int width);
+	void (*deinterleave_uv16)(uint16_t *u, uint16_t *v, const uint16_t *src, int width);
+	void (*shift_right16)(uint16_t *dst, const uint16_t *src, int count);
+	void (*narrow16)(uint8_t *dst, const uint16_t *src, int count);
+	void (*nv12_to_rgbx)(uint8_t *dst, const uint8_t *y, const uint8_t *uv, int width, const struct hvd_yuv_rgb *c);
+};
+
+//hardware device shared between decoders
+struct hvd_device
+{
+	AVBufferRef *hw_device_ctx; //NULL for software
+	enum AVPixelFormat hw_pix_fmt;
+};
+
+//shared memory frame ring layout: header, slot headers, page aligned slot data
+
+//seqlock, sequence is 2 * number - 1 while written and 2 * number when published
+struct hvd_shm_slot
+{
+	atomic_uint_fast64_t sequence;
+	int32_t format;
+	int32_t width;
+	int32_t height;
+	int32_t linesize[4];
+	uint32_t offset[4]; //of planes from slot data
+	int64_t pts;
+};
+
+struct hvd_shm_header
+{
+	uint32_t magic; //written last by publisher
+	uint32_t version;
+	uint32_t slots;
+	uint32_t reserved;
+	uint64_t slot_size; //bytes of slot data
+	uint64_t data_offset; //of the first slot data from the header
+	uint64_t size; //of shared memory
+	atomic_uint_fast64_t latest; //number of the latest published frame
+	atomic_uint futex; //low bits of latest, readers sleep on it
+};
+
+//process local view of the shared memory frame ring
+struct hvd_shm
+{
+	int fd;
+	int fd_owned;
+	int publisher;
+	char *name; //unlinked by publisher on close
+	uint8_t *memory;
+	size_t size;
+	struct hvd_shm_header *header;
+	struct hvd_shm_slot *slots;
+	uint8_t *data;
+	atomic_uint_fast64_t claimed; //publisher, get_buffer may be called from download thread
+};
+
+//packet of the file, key as returned by hvd_keyframe
+struct hvd_file_entry
+{
+	int64_t offset;
+	int32_t size;
+	int32_t key;
+};
+
+//sidecar index file, header followed by entries
+struct hvd_file_index_header
+{
+	uint32_t magic;
+	uint32_t version;
+	int64_t file_size; //the index is valid for file of this size
+	int64_t file_mtime; //and modification time (nanoseconds)
+	int32_t codec; //AVCodecID
+	int32_t entry_size;
+	int64_t count;
+};
+
+struct hvd_file
+{
+	AVBufferRef *map; //whole file mapping, unmapped when the last reference is gone
+	AVBufferRef *tail; //zero padded copy of the last packets
+	int64_t tail_offset; //packets from here are in tail
+	int64_t size;
+	int64_t mtime; //nanoseconds, files rewritten within a second still differ
+	enum AVCodecID codec;
+	struct hvd_file_entry *entries;
+	int64_t count;
+	int64_t capacity;
+	int64_t *keyframes; //entry numbers where decoding can start, ascending
+	int64_t keyframe_count;
+	int64_t next; //hvd_file_read position
+	int index_loaded;
+};
+
+//probe cache file, header followed by records
+struct hvd_probe_cache_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t count;
+};
 
 //internal library data passed around by the user
 struct hvd
 {
 	AVBufferRef* hw_device_ctx;
+	AVBufferRef *hw_frames_ctx; //surfaces prepared in hvd_init, NULL if not prepared or not fitting the stream
+	int surfaces; //extra surfaces requested by the user
+	int held_surfaces; //surfaces held outside of decoder (output frames, async queue)
 	enum AVPixelFormat hw_pix_fmt;
 	enum AVPixelFormat sw_pix_fmt;
+	int software; //software decoder standing in for hardware
+	int software_fallback;
+	int device_failed; //get_format found no usable surface format, owned by decoding thread
+	int output; //hvd_output_mode
+	int width;
+	int height;
+	int profile;
+	int thread_count;
+	int thread_type;
+	int low_latency;
+	int (*get_buffer)(void *opaque, AVFrame *frame); //user frame data buffers, NULL for library buffers
+	void *get_buffer_opaque;
+	const AVCodec *decoder;
 	AVCodecContext* decoder_ctx;
-	AVFrame *sw_frame;
 	AVFrame *hw_frame;
+	AVFrame *transfer_frame; //native format of hardware, converted on CPU
+	AVFrame *map_frame; //hardware frame mapped for region copy
+	AVFrame *region_frame; //region in source format, converted on CPU
+	AVFrame *drop_frame; //newer decoded frame replacing hw_frame (HVD_DROP_UNREAD)
+	const void *transfer_frames; //hardware frames context the mode was checked for
+	enum AVPixelFormat transfer_sw_format;
+	int transfer_mode; //hvd_transfer_mode
+	struct hvd_region region; //changed by the user, read by output (user or download thread)
+	pthread_mutex_t region_mutex;
+	int region_mutex_initialized;
+	int region_map_unsupported; //hardware can't map frames, region copied from full transfer
+	struct hvd_frame_slot *pool;
+	int pool_size;
+	struct hvd_frame_slot *borrowed; //returned by hvd_receive_frame, released on next call
+	atomic_int drop_policy; //set by the user
+	atomic_int drop_active; //in effect, read by decoding threads
+	int drop_depth;
+	int resync; //drop packets after errors until the next keyframe
+	int resync_wait; //waiting for keyframe, owned by decoding thread
+	hvd_counter pool_frames;
+	hvd_counter pool_allocations;
+	struct hvd_counters stats;
+	int64_t init_start; //time in microseconds, start of the last hvd_reconfigure after switch
+	int64_t init_time;
+	struct hvd_log log;
 	AVPacket av_packet;
+	int64_t packet_seq; //number of packets sent by the user
+	struct hvd_packet_info packet_info[HVD_PACKET_INFO]; //by seq, in flight in decoder
+	struct hvd_trace trace;
+	struct hvd_memory_counters memory;
+	int async;
+	struct hvd_async async_data;
+	struct hvd_parser stream;
+};
+
+//scheduler, streams with pending packets take turns on worker threads
+
+struct hvd_scheduler_device
+{
+	struct hvd_device *device;
+	int streams;
+	double load; //sum of measured loads of the streams
+};
+
+struct hvd_stream_entry
+{
+	AVPacket packet; //data in reusable refcounted buffer or referenced user data
+	int64_t pts; //of the user
+	uint64_t tag;
+	int64_t bytes; //accounted in memory of the decoder
+	int referenced; //user data, released after decoding
+	int flush;
+};
+
+struct hvd_stream
+{
+	struct hvd_scheduler *scheduler;
+	struct hvd *h; //used by one worker at a time
+	hvd_stream_callback callback;
+	void *opaque;
+	int device;
+	pthread_mutex_t mutex; //queue, scheduled, removing
+	int mutex_initialized;
+	struct hvd_stream_entry *queue;
+	int queue_depth;
+	int head; //the oldest entry, stays in queue while decoded
+	int queued;
+	int scheduled; //in worker queue or taking turn
+	int parked; //decoder had no room and gave no frames, not in worker queue until retried
+	int removing;
+	int worker; //which took the last turn, the stream is queued there again
+	struct hvd_stream *prev; //in worker queue
+	struct hvd_stream *next;
+	hvd_counter packets;
+	hvd_counter frames;
+	hvd_counter again;
+	hvd_counter errors;
+	hvd_counter busy; //microseconds taking turns
+	//load measurement, guarded by scheduler mutex
+	int64_t sample_time;
+	uint64_t sample_busy;
+	double load; //-1 until measured
+};
+
+struct hvd_scheduler_worker
+{
+	struct hvd_scheduler *scheduler;
+	int index;
+	pthread_t thread;
+	int running;
+	pthread_mutex_t mutex; //queue
+	int mutex_initialized;
+	struct hvd_stream *head; //taken by the worker
+	struct hvd_stream *tail; //stolen by other workers
+};
+
+struct hvd_scheduler
+{
+	char *hardware;
+	struct hvd_scheduler_device *devices;
+	int device_count;
+	struct hvd_scheduler_worker *workers;
+	int worker_count;
+	int queue_depth;
+	int budget;
+	pthread_mutex_t mutex; //streams, devices, sleeping workers
+	pthread_cond_t cond; //workers wait for streams
+	pthread_cond_t idle; //removers wait for the end of stream turn
+	int sync_initialized;
+	atomic_int queued; //streams in worker queues
+	atomic_int sleeping; //workers waiting for streams
+	atomic_int parked; //streams waiting for retry
+	int64_t unpark_time; //retry of parked streams, guarded by mutex
+	atomic_int stop;
+	struct hvd_stream **streams;
+	int stream_count;
+	int stream_capacity;
+	int next_worker;
+	hvd_counter turns;
+	hvd_counter steals;
+	hvd_counter parks;
 };
 
 static struct hvd *hvd_close_and_return_null(struct hvd *h, const char *msg, const char *msg_details);
+static void hvd_global_init(void);
+static struct hvd_device *hvd_device_close_and_return_null(struct hvd_device *d, const char *msg, const char *msg_details);
+static int hvd_hw_device_open(struct hvd *h, AVBufferRef **hw_device_ctx, enum AVPixelFormat *hw_pix_fmt, const char *hardware, const char *device);
+static int hvd_hardware_init(struct hvd *h, const struct hvd_config *config);
+static int hvd_decoder_init(struct hvd *h, const AVCodec *decoder);
+static int hvd_software_fallback(struct hvd *h);
+static int hvd_device_error(const struct hvd *h, int err);
 static enum AVPixelFormat hvd_find_pixel_fmt_by_hw_type(const enum AVHWDeviceType type);
 static enum AVPixelFormat hvd_get_hw_pix_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts);
-static AVFrame *NULL_MSG(const char *msg, const char *msg_details);
-static void hvd_dump_sw_pix_formats(struct hvd *h);
+static void hvd_hw_frames_init(struct hvd *h);
+static int hvd_hw_frames_fit(struct hvd *h);
+static int hvd_hw_frames_count(struct hvd *h);
+static int hvd_hw_frames_held(const struct hvd *h, int frames_in_flight, int async);
+static enum AVPixelFormat hvd_hw_frames_sw_format(struct hvd *h);
+static void hvd_hw_frames_attach(struct hvd *h, AVCodecContext *ctx);
+static void hvd_warmup(struct hvd *h);
+static void hvd_mark_first(hvd_counter *time);
+static void hvd_drop_update(struct hvd *h);
+static int hvd_queue_depth(const struct hvd *h);
+static int hvd_pool_init(struct hvd *h, int size);
+static void hvd_pool_close(struct hvd *h);
+static struct hvd_frame_slot *hvd_pool_get(struct hvd *h);
+static struct hvd_frame_slot *hvd_pool_find(const struct hvd *h, const AVFrame *frame);
+static void hvd_pool_put(struct hvd *h, struct hvd_frame_slot *slot);
+static int hvd_pool_available(struct hvd *h);
+static int hvd_pool_free(struct hvd *h);
+static int hvd_packet_reference(struct hvd *h, AVPacket *av_packet, const struct hvd_packet *packet);
+static void hvd_packet_owner_free(void *opaque, uint8_t *data);
+static int hvd_submit_packet(struct hvd *h, AVPacket *packet, int64_t pts, uint64_t tag);
+static int hvd_decode_packet(struct hvd *h, AVPacket *packet);
+static int hvd_stream_parse(struct hvd *h, AVBufferRef *chunk, const uint8_t *data, int size);
+static int hvd_stream_send(struct hvd *h, AVPacket *packet);
+static int hvd_stream_drain(struct hvd *h);
+static int hvd_stream_pending_push(struct hvd *h, const AVPacket *packet);
+static int hvd_stream_full(struct hvd *h, int size);
+static void hvd_stream_close(struct hvd *h);
+static void hvd_stream_reset(struct hvd *h);
+static void hvd_packet_stamp(struct hvd *h, AVPacket *packet, const struct hvd_packet_info *info);
+static int hvd_trace_init(struct hvd *h, int events);
+static void hvd_trace(struct hvd *h, int type, int thread, const struct hvd_packet_info *info);
+static void hvd_trace_record(struct hvd *h, int type, int thread, const struct hvd_packet_info *info);
+static const char *hvd_trace_name(int type);
+static void hvd_memory_add(atomic_int_fast64_t *bytes, int64_t delta);
+static int hvd_memory_over(const struct hvd *h, int64_t bytes);
+static int hvd_memory_frame_fits(const struct hvd *h);
+static void hvd_memory_frame(struct hvd *h, struct hvd_frame_slot *slot);
+static void hvd_memory_scratch(struct hvd *h);
+static void hvd_memory_packet(struct hvd *h, const AVPacket *packet, int copy, int64_t *bytes);
+static void hvd_memory_accept(struct hvd *h, const AVPacket *packet);
+static void hvd_memory_decoded(struct hvd *h, int64_t seq);
+static void hvd_memory_release(struct hvd *h, struct hvd_packet_info *info);
+static void hvd_memory_release_all(struct hvd *h);
+static void hvd_memory_surfaces(struct hvd *h, const AVBufferRef *hw_frames_ctx);
+static int64_t hvd_frame_bytes(const AVFrame *frame);
+static struct hvd_frame_slot *hvd_receive(struct hvd *h, int *error);
+static struct hvd_frame_slot *hvd_receive_slot(struct hvd *h, int *error);
+static void hvd_drop_unread(struct hvd *h, struct hvd_frame_slot *slot);
+static int hvd_decode_frame(struct hvd *h, AVFrame *frame, struct hvd_packet_info *info);
+static void hvd_frame_info_read(struct hvd *h, AVFrame *frame, struct hvd_packet_info *info);
+static int hvd_frame_corrupt(const AVFrame *frame);
+static void hvd_resync_start(struct hvd *h, const char *reason);
+static int hvd_resync_keyframe(struct hvd *h, const AVPacket *packet);
+static int hvd_keyframe(enum AVCodecID codec, const uint8_t *data, int size);
+static int hvd_keyframe_nal(const uint8_t *data, int size, int hevc);
+static int hvd_keyframe_vp9(const uint8_t *data, int size);
+#ifdef HVD_AV1
+static int hvd_keyframe_av1(const uint8_t *data, int size);
+#endif
+static int hvd_async_init(struct hvd *h, int depth);
+static void hvd_async_close(struct hvd *h);
+static int hvd_async_start(struct hvd *h);
+static void hvd_async_stop(struct hvd *h);
+static void hvd_async_reset(struct hvd *h);
+static int hvd_async_send_packet(struct hvd *h, AVPacket *packet, int64_t pts, uint64_t tag);
+static int hvd_packet_copy(struct hvd *h, AVPacket *packet, const uint8_t *data, int size);
+static struct hvd_frame_slot *hvd_async_receive_slot(struct hvd *h, int *error);
+static int hvd_async_unread(struct hvd *h, int index);
+static int hvd_async_superseded(struct hvd_ring *ring, const struct hvd_async_entry *entries);
+static void *hvd_async_decode_thread(void *arg);
+static int hvd_async_decode_frames(struct hvd *h);
+static void hvd_async_push_marker(struct hvd *h, int status);
+static void *hvd_async_download_thread(void *arg);
+static int hvd_async_wait_download(struct hvd *h);
+static int hvd_async_download_ready(struct hvd *h);
+static int hvd_async_wait_readable(struct hvd *h, struct hvd_ring *ring, struct hvd_waiter *w);
+static int hvd_async_wait_writable(struct hvd *h, struct hvd_ring *ring, struct hvd_waiter *w);
+static void hvd_async_notify(struct hvd_async *a);
+static void hvd_async_clear_event(struct hvd_async *a);
+static void hvd_ring_init(struct hvd_ring *r, unsigned capacity);
+static int hvd_ring_writable(struct hvd_ring *r);
+static void hvd_ring_push(struct hvd_ring *r);
+static int hvd_ring_readable(struct hvd_ring *r);
+static int hvd_ring_peek(struct hvd_ring *r, unsigned n);
+static unsigned hvd_ring_count(const struct hvd_ring *r);
+static void hvd_ring_pop(struct hvd_ring *r);
+static int hvd_waiter_init(struct hvd_waiter *w);
+static void hvd_waiter_close(struct hvd_waiter *w);
+static void hvd_waiter_lock(struct hvd_waiter *w);
+static void hvd_waiter_wait(struct hvd_waiter *w);
+static void hvd_waiter_unlock(struct hvd_waiter *w);
+static void hvd_waiter_wake(struct hvd_waiter *w);
+static void hvd_waiter_wake_always(struct hvd_waiter *w);
+static void hvd_count(hvd_counter *counter, uint64_t value);
+static void hvd_histogram_add(struct hvd_histogram *histogram, int64_t duration);
+static void hvd_histogram_read(const struct hvd_histogram *histogram, struct hvd_timing *timing);
+static int64_t hvd_histogram_percentile(const uint64_t *bucket, uint64_t count, int percent, int64_t max);
+static int hvd_output_frame(struct hvd *h, struct hvd_frame_slot *slot, AVFrame *hw_frame);
+static int hvd_output_data(struct hvd *h, AVFrame *frame, AVFrame *hw_frame);
+static int hvd_frame_reusable(AVFrame *frame, int format, int width, int height);
+static int hvd_frame_get_data(struct hvd *h, AVFrame *frame, enum AVPixelFormat format, int width, int height, int user);
+static int hvd_region_valid(const struct hvd_region *region);
+static int hvd_region_get(struct hvd *h, struct hvd_region *region);
+static int hvd_region_supported(enum AVPixelFormat format);
+static void hvd_region_rect(const struct hvd_region *region, const AVFrame *frame, struct hvd_region *rect);
+static int hvd_region_crop(struct hvd *h, AVFrame *frame, const struct hvd_region *region);
+static int hvd_region_copy(struct hvd *h, AVFrame *dst, const AVFrame *src, const struct hvd_region *region, hvd_counter *bytes);
+static int64_t hvd_region_copy_planes(AVFrame *dst, const AVFrame *src, const struct hvd_region *rect);
+static void hvd_scale_row(uint8_t *dst, const uint8_t *src, int dst_width, int src_width, int step);
+static int hvd_transfer_region(struct hvd *h, AVFrame *sw_frame, const AVFrame *hw_frame, const struct hvd_region *region);
+static int hvd_frame_user_buffer(struct hvd *h, AVFrame *frame);
+static int hvd_transfer_data(struct hvd *h, AVFrame *sw_frame, const AVFrame *hw_frame);
+static int hvd_copy_data(struct hvd *h, AVFrame *dst, const AVFrame *src);
+static enum AVPixelFormat hvd_software_output_format(struct hvd *h, enum AVPixelFormat decoded);
+static int hvd_transfer_mode(struct hvd *h, const AVFrame *hw_frame);
+static int hvd_transfer_convert(struct hvd *h, AVFrame *sw_frame, const AVFrame *hw_frame);
+static int hvd_convert_supported(enum AVPixelFormat src, enum AVPixelFormat dst);
+static int hvd_convert_data(AVFrame *dst, const AVFrame *src);
+static void hvd_convert_rgb(AVFrame *dst, const AVFrame *src);
+static void hvd_yuv_rgb_init(struct hvd_yuv_rgb *c, const AVFrame *src, enum AVPixelFormat dst);
+static void hvd_convert_init(int cpu_flags);
+static void hvd_convert_select(struct hvd_convert_kernels *k, int cpu_flags);
+static int hvd_check_kernel_set(const struct hvd_convert_kernels *reference, const struct hvd_convert_kernels *k, const char *name);
+static const char *hvd_check_kernel(const struct hvd_convert_kernels *k, int kernel, uint8_t *out[2], uint8_t *src[2], int width, const struct hvd_yuv_rgb *c);
+static void hvd_interleave_uv8(uint8_t *dst, const uint8_t *u, const uint8_t *v, int width);
+static void hvd_deinterleave_uv8(uint8_t *u, uint8_t *v, const uint8_t *src, int width);
+static void hvd_deinterleave_uv16(uint16_t *u, uint16_t *v, const uint16_t *src, int width);
+static void hvd_shift_right16(uint16_t *dst, const uint16_t *src, int count);
+static void hvd_narrow16(uint8_t *dst, const uint16_t *src, int count);
+static void hvd_nv12_to_rgbx(uint8_t *dst, const uint8_t *y, const uint8_t *uv, int width, const struct hvd_yuv_rgb *c);
+static void hvd_interleave_uv16(uint16_t *dst, const uint16_t *u, const uint16_t *v, int width, int shift);
+static void hvd_shift_plane16(uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int width, int height, int shift);
+static struct hvd_shm *hvd_shm_close_and_return_null(struct hvd_shm *ring, const char *msg, const char *msg_details);
+static int hvd_shm_map(struct hvd_shm *ring, int writable);
+static uint64_t hvd_shm_claim(struct hvd_shm *ring, uint8_t **data);
+static void hvd_shm_buffer_free(void *opaque, uint8_t *data);
+static struct hvd_file *hvd_file_close_and_return_null(struct hvd_file *f, const char *msg, const char *msg_details);
+static int hvd_file_map(struct hvd_file *f, const char *path);
+static void hvd_file_unmap(void *opaque, uint8_t *data);
+static enum AVCodecID hvd_file_codec(const struct hvd_file *f, const char *codec);
+static int hvd_file_index_ivf(struct hvd_file *f);
+static int hvd_file_index_annexb(struct hvd_file *f);
+static int hvd_file_index_parse(struct hvd_file *f, AVCodecParserContext *parser, AVCodecContext *parser_ctx,
+	const uint8_t *data, int size, int64_t data_offset, int64_t *offset);
+static int hvd_file_index_add(struct hvd_file *f, int64_t offset, int size);
+static int hvd_file_index_finish(struct hvd_file *f);
+static int hvd_file_index_load(struct hvd_file *f, const char *path);
+static int hvd_file_index_save(const struct hvd_file *f, const char *path);
+static int hvd_cache_save(const char *path, const void *header, size_t header_size, const void *entries, size_t entry_size, int64_t count);
+static int hvd_probe_hardware(struct hvd_probe *probe, const char *hardware, const char *device);
+static void hvd_probe_software(struct hvd_probe *probe);
+static void hvd_probe_codecs(struct hvd_probe *probe, enum AVHWDeviceType type, enum AVPixelFormat hw_pix_fmt);
+static int hvd_probe_codec_hardware(const AVCodec *decoder, enum AVHWDeviceType type, enum AVPixelFormat hw_pix_fmt);
+static void hvd_probe_format(struct hvd_probe *probe, AVBufferRef *hw_device_ctx, enum AVPixelFormat hw_pix_fmt, enum AVPixelFormat sw_format);
+static void hvd_probe_key(struct hvd_probe *probe, const struct hvd_probe_config *config);
+static void hvd_probe_driver(const char *device, char *driver, int size);
+static int hvd_probe_read_line(const char *path, char *line, int size);
+static int hvd_probe_cache_load(const char *path, struct hvd_probe *probe);
+static int hvd_probe_cache_save(const char *path, const struct hvd_probe *probe);
+static struct hvd_probe *hvd_probe_cache_read(const char *path, int *count);
+static int hvd_probe_record_valid(struct hvd_probe *record);
+static struct hvd_scheduler *hvd_scheduler_close_and_return_null(struct hvd_scheduler *s, const char *msg, const char *msg_details);
+static struct hvd_stream *hvd_stream_free_and_return_null(struct hvd_stream *stream, const char *msg);
+static void hvd_stream_free(struct hvd_stream *stream);
+static void *hvd_scheduler_worker_thread(void *arg);
+static void hvd_scheduler_push(struct hvd_scheduler *s, struct hvd_stream *stream);
+static void hvd_scheduler_unpark(struct hvd_scheduler *s);
+static int hvd_stream_unpark(struct hvd_stream *stream);
+static struct hvd_stream *hvd_scheduler_take(struct hvd_scheduler_worker *w);
+static struct hvd_stream *hvd_scheduler_steal(struct hvd_scheduler_worker *w);
+static void hvd_scheduler_update_load(struct hvd_scheduler *s);
+static int hvd_scheduler_pick_device(const struct hvd_scheduler *s);
+static void hvd_stream_turn(struct hvd_scheduler_worker *w, struct hvd_stream *stream);
+static int hvd_stream_decode(struct hvd_stream *stream, struct hvd_stream_entry *entry);
+static int hvd_stream_receive(struct hvd_stream *stream);
+static void hvd_log(const struct hvd *h, int level, int message_class, const char *format, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 4, 5)))
+#endif
+	;
+static int hvd_log_allow(struct hvd_log *log, struct hvd_log_limit *limit, uint64_t *suppressed);
+static int HVD_ERROR_MSG(const struct hvd *h, const char *msg, const char *msg_details);
+static void hvd_dump_sw_pix_formats(struct hvd *h, const AVFrame *hw_frame);
+
+//selected once per process in hvd_global_init, scalar until then
+static struct hvd_convert_kernels hvd_kernels = {hvd_interleave_uv8, hvd_deinterleave_uv8, hvd_deinterleave_uv16,
+	hvd_shift_right16, hvd_narrow16, hvd_nv12_to_rgbx};
 
 //NULL on error
 struct hvd *hvd_init(const struct hvd_config *config)
 {
 	struct hvd *h, zero_hvd = {0};
-	enum AVHWDeviceType hardware_type;
-	AVCodec *decoder = NULL;
-	int err;
 
 	if( ( h = (struct hvd*)malloc(sizeof(struct hvd))) == NULL )
 		return hvd_close_and_return_null(NULL, "not enough memory for hvd", NULL);
 
 	*h = zero_hvd; //set all members of dynamically allocated struct to 0 in a portable way
+	h->init_start = av_gettime_relative();
 
-	avcodec_register_all();
-	av_log_set_level(AV_LOG_VERBOSE);
-
-	if( (hardware_type = av_hwdevice_find_type_by_name(config->hardware) ) == AV_HWDEVICE_TYPE_NONE )
-		return hvd_close_and_return_null(h, "cannot find hardware decoder", config->hardware);
+	if(pthread_mutex_init(&h->region_mutex, NULL) != 0)
+		return hvd_close_and_return_null(h, "unable to initialize mutex", NULL);
 
-	//This is MUCH easier in FFmpeg 4.0 with avcodec_get_hw_config but we want
-	//to support FFmpeg 3.4 (system FFmpeg on Ubuntu 18.04 until 2028).
-	if( ( h->hw_pix_fmt = hvd_find_pixel_fmt_by_hw_type(hardware_type) ) == AV_PIX_FMT_NONE)
-		return hvd_close_and_return_null(h, "unable to find pixel format for", config->hardware);
+	h->region_mutex_initialized = 1;
 
-	if( ( decoder = avcodec_find_decoder_by_name(config->codec) ) == NULL)
-		return hvd_close_and_return_null(h, "cannot find decoder", config->codec);
+	h->log.callback = config->log_callback;
+	h->log.opaque = config->log_opaque;
+	h->log.level = config->log_level ? config->log_level : HVD_LOG_INFO;
+	h->log.rate = config->log_rate ? config->log_rate : HVD_DEFAULT_LOG_RATE;
 
-	if (!(h->decoder_ctx = avcodec_alloc_context3(decoder)))
-		return hvd_close_and_return_null(h, "failed to alloc decoder context, no memory?", NULL);
+	hvd_global_init();
 
-	h->decoder_ctx->width = config->width;
-	h->decoder_ctx->height = config->height;
+	if(config->output < HVD_OUTPUT_TRANSFER || config->output > HVD_OUTPUT_MAP)
+		return hvd_close_and_return_null(h, "invalid output mode", NULL);
 
-	if(config->profile)
-		h->decoder_ctx->profile = config->profile;
+	h->output = config->output;
+	h->software_fallback = config->software_fallback;
+	h->width = config->width;
+	h->height = config->height;
+	h->profile = config->profile;
+	h->thread_count = config->thread_count;
+	h->thread_type = config->thread_type;
+	h->low_latency = config->low_latency;
+	h->get_buffer = config->get_buffer;
+	h->get_buffer_opaque = config->get_buffer_opaque;
+	h->surfaces = config->surfaces;
+	h->held_surfaces = hvd_hw_frames_held(h, config->frames_in_flight > 0 ? config->frames_in_flight : HVD_DEFAULT_FRAMES_IN_FLIGHT, config->async);
+	h->drop_depth = config->drop_depth > 0 ? config->drop_depth : HVD_DEFAULT_DROP_DEPTH;
+	h->resync = config->resync;
+	h->memory.budget = config->memory_budget > 0 ? config->memory_budget : 0;
+	h->memory.decoded = -1;
 
-	//Set user data carried by AVContext, we need this to determine pixel format
-	//from within FFmpeg using our supplied function for decoder_ctx->get_format.
-	//This is MUCH easier in FFmpeg 4.0 with avcodec_get_hw_config but we want
-	//to support FFmpeg 3.4 (system FFmpeg on Ubuntu 18.04 until 2028).
-	h->decoder_ctx->opaque = h;
-	h->decoder_ctx->get_format = hvd_get_hw_pix_format;
+	if(hvd_set_drop_policy(h, config->drop_policy) != HVD_OK)
+		return hvd_close_and_return_null(h, NULL, NULL);
 
-	//specified device or NULL / empty string for default
-	const char *device = (config->device != NULL && config->device[0] != '\0') ? config->device : NULL;
+	if(!hvd_region_valid(&config->region))
+		return hvd_close_and_return_null(h, "invalid region", NULL);
 
-	if ( (err = av_hwdevice_ctx_create(&h->hw_device_ctx, hardware_type, device, NULL, 0) ) < 0)
-		return hvd_close_and_return_null(h, "failed to open device and create context for", config->hardware);
+	h->region = config->region;
 
-	if( (h->decoder_ctx->hw_device_ctx = av_buffer_ref(h->hw_device_ctx) ) == NULL)
-		return hvd_close_and_return_null(h, "unable to reference hw_device_ctx", NULL);
+	for(int i=0;i<HVD_PACKET_INFO;++i)
+		h->packet_info[i].seq = -1;
 
-	if (( err = avcodec_open2(h->decoder_ctx, decoder, NULL)) < 0)
-		return hvd_close_and_return_null(h, "failed to initialize decoder context for", decoder->name);
+	if(config->trace > 0 && hvd_trace_init(h, config->trace) != HVD_OK)
+		return hvd_close_and_return_null(h, "unable to allocate trace events, no memory?", NULL);
 
 	//try to find software pixel format that user wants
 	if(config->pixel_format == NULL || config->pixel_format[0] == '\0')
@@ -98,194 +824,6313 @@ struct hvd *hvd_init(const struct hvd_config *config)
 	else if( ( h->sw_pix_fmt = av_get_pix_fmt(config->pixel_format) ) == AV_PIX_FMT_NONE )
 		return hvd_close_and_return_null(h, "failed to find pixel format", config->pixel_format);
 
+	if( ( h->decoder = avcodec_find_decoder_by_name(config->codec) ) == NULL)
+		return hvd_close_and_return_null(h, "cannot find decoder", config->codec);
+
+	//software decoder standing in for hardware (e.g. testing without GPU)
+	if(config->shared_device)
+		h->software = (config->shared_device->hw_device_ctx == NULL);
+	else
+		h->software = (strcmp(config->hardware, "software") == 0);
+
+	const int software_requested = h->software;
+
+	if(!h->software && hvd_hardware_init(h, config) != HVD_OK)
+	{
+		if(!h->software_fallback)
+			return hvd_close_and_return_null(h, NULL, NULL);
+
+		hvd_log(h, HVD_LOG_WARNING, HVD_LOG_GENERAL, "falling back to software decoding");
+		avcodec_free_context(&h->decoder_ctx);
+		av_buffer_unref(&h->hw_frames_ctx);
+		av_buffer_unref(&h->hw_device_ctx);
+		h->software = 1;
+	}
+
+	//user explicitly requested software decoder or fallback from hardware
+	if(h->software)
+	{
+		const AVCodec *decoder = software_requested ? h->decoder : avcodec_find_decoder(h->decoder->id);
+
+		if(hvd_decoder_init(h, decoder) != HVD_OK)
+			return hvd_close_and_return_null(h, NULL, NULL);
+	}
+
+	if( !(h->hw_frame = av_frame_alloc() ) || !(h->transfer_frame = av_frame_alloc() ) ||
+		!(h->map_frame = av_frame_alloc() ) || !(h->region_frame = av_frame_alloc() ) ||
+		!(h->drop_frame = av_frame_alloc() ) )
+		return hvd_close_and_return_null(h, "unable to av_frame_alloc frame", NULL);
+
+	if( hvd_pool_init(h, config->frames_in_flight > 0 ? config->frames_in_flight : HVD_DEFAULT_FRAMES_IN_FLIGHT) != HVD_OK )
+		return hvd_close_and_return_null(h, "unable to allocate frame pool, no memory?", NULL);
+
+	if(config->warmup)
+		hvd_warmup(h);
+
+	if(h->hw_frames_ctx)
+		hvd_memory_surfaces(h, h->hw_frames_ctx);
+
+	if( config->async && hvd_async_init(h, config->async_depth > 0 ? config->async_depth : HVD_DEFAULT_ASYNC_DEPTH) != HVD_OK )
+		return hvd_close_and_return_null(h, NULL, NULL);
+
 	av_init_packet(&h->av_packet);
 	h->av_packet.data = NULL;
 	h->av_packet.size = 0;
 
-	return h;
-}
-
-// To be replaced in FFmpeg 4.0 with avcodec_get_hw_config. This is necessary for FFmpeg 3.4.
-// This is clumsy - we need to hardcode device type to its internal pixel format.
-// If device type is not on this list it will not be supported by the library.
-// (extend this list as much as possible, this is the only thing which is holding support for some hardware)
-static enum AVPixelFormat hvd_find_pixel_fmt_by_hw_type(const enum AVHWDeviceType type)
-{
-	enum AVPixelFormat fmt;
+	av_init_packet(&h->stream.packet);
+	h->stream.packet.data = NULL;
+	h->stream.packet.size = 0;
 
-	switch (type) {
-	case AV_HWDEVICE_TYPE_VAAPI:
-		fmt = AV_PIX_FMT_VAAPI;
-		break;
-	case AV_HWDEVICE_TYPE_DXVA2:
-		fmt = AV_PIX_FMT_DXVA2_VLD;
-		break;
-	case AV_HWDEVICE_TYPE_D3D11VA:
-		fmt = AV_PIX_FMT_D3D11;
-		break;
-	case AV_HWDEVICE_TYPE_VDPAU:
-		fmt = AV_PIX_FMT_VDPAU;
-		break;
-	case AV_HWDEVICE_TYPE_VIDEOTOOLBOX:
-		fmt = AV_PIX_FMT_VIDEOTOOLBOX;
-		break;
-	case AV_HWDEVICE_TYPE_CUDA:
-		fmt = AV_PIX_FMT_CUDA;
-		break;
-	default:
-		fmt = AV_PIX_FMT_NONE;
-		break;
-	}
+	h->init_time = av_gettime_relative() - h->init_start;
 
-	return fmt;
+	return h;
 }
 
-static enum AVPixelFormat hvd_get_hw_pix_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts)
+//what the first frame would do otherwise, failures are not fatal (done again on first frame)
+static void hvd_warmup(struct hvd *h)
 {
-	const enum AVPixelFormat *p;
-	struct hvd *h = (struct hvd*)ctx->opaque;
+	enum AVPixelFormat format = h->sw_pix_fmt;
+	struct hvd_region region;
 
-	for (p = pix_fmts; *p != -1; p++)
+	if(h->hw_frames_ctx)
 	{
-		if (*p == h->hw_pix_fmt)
-			return *p;
-	}
+		const AVHWFramesContext *frames = (const AVHWFramesContext*)h->hw_frames_ctx->data;
+		const int count = frames->initial_pool_size;
+		AVFrame **surfaces = (AVFrame**)calloc(count, sizeof(AVFrame*));
+		int touched = 0;
 
-	fprintf(stderr, "hvd: failed to get HW surface format\n");
-	return AV_PIX_FMT_NONE;
-}
+		//some drivers allocate surface memory on first use
+		for(int i = 0; surfaces && i < count; ++i)
+			if( (surfaces[i] = av_frame_alloc()) && av_hwframe_get_buffer(h->hw_frames_ctx, surfaces[i], 0) == 0 )
+				++touched;
 
+		if(touched)
+		{	//decides between hardware transfer and CPU conversion
+			hvd_transfer_mode(h, surfaces[0]);
 
-void hvd_close(struct hvd* h)
-{
-	if(h == NULL)
-		return;
+			if(h->transfer_mode == HVD_TRANSFER_CONVERT)
+			{
+				hvd_frame_get_data(h, h->transfer_frame, frames->sw_format, h->width, h->height, 0);
+				hvd_memory_scratch(h);
+			}
+		}
 
-	av_frame_free(&h->sw_frame);
-	av_frame_free(&h->hw_frame);
+		for(int i = 0; surfaces && i < count; ++i)
+			av_frame_free(&surfaces[i]);
 
-	avcodec_free_context(&h->decoder_ctx);
-	av_buffer_unref(&h->hw_device_ctx);
+		free(surfaces);
 
-	free(h);
-}
+		hvd_log(h, HVD_LOG_DEBUG, HVD_LOG_GENERAL, "warm-up touched %d of %d surfaces", touched, count);
 
-static struct hvd *hvd_close_and_return_null(struct hvd *h, const char *msg, const char *msg_details)
-{
-	if(msg)
-		fprintf(stderr, "hvd: %s %s\n", msg, (msg_details) ? msg_details : "");
+		if(format == AV_PIX_FMT_NONE)
+			format = frames->sw_format;
+	}
 
-	hvd_close(h);
+	//output buffers of known format and size, user buffers are requested per frame
+	if(h->output != HVD_OUTPUT_TRANSFER || h->get_buffer || hvd_region_get(h, &region) ||
+		!h->width || !h->height || format == AV_PIX_FMT_NONE || h->transfer_mode == HVD_TRANSFER_UNSUPPORTED)
+		return;
 
-	return NULL;
+	//frames held by the user (after hvd_reconfigure) are skipped, the pool grows only within memory budget
+	for(int i = 0; i < h->pool_size; ++i)
+	{
+		if(atomic_load_explicit(&h->pool[i].in_use, memory_order_acquire))
+			continue;
+
+		if( (!h->pool[i].bytes && !hvd_memory_frame_fits(h)) ||
+			hvd_frame_get_data(h, h->pool[i].frame, format, h->width, h->height, 0) != HVD_OK)
+			break;
+
+		hvd_memory_frame(h, &h->pool[i]);
+	}
 }
 
-int hvd_send_packet(struct hvd *h,struct hvd_packet *packet)
+//all the AVFrames are allocated upfront, data buffers are allocated on first use
+//and kept in the frames for reuse, after warm-up there are no allocations per frame
+static int hvd_pool_init(struct hvd *h, int size)
 {
-	int err;
+	if( ( h->pool = (struct hvd_frame_slot*)calloc(size, sizeof(struct hvd_frame_slot)) ) == NULL )
+		return HVD_ERROR;
 
-	//NULL packet is legal and means user requested flushing
-	h->av_packet.data = (packet) ? packet->data : NULL;
-	h->av_packet.size = (packet) ? packet->size : 0;
+	h->pool_size = size;
 
-	//WARNING The input buffer, av_packet->data must be AV_INPUT_BUFFER_PADDING_SIZE
-	//larger than the actual read bytes because some optimized bitstream readers
-	// read 32 or 64 bits at once and could read over the end.
-	if ( (err = avcodec_send_packet(h->decoder_ctx, &h->av_packet) ) < 0 )
+	for(int i=0;i<size;++i)
 	{
-		fprintf(stderr, "hvd: send_packet error %s\n", av_err2str(err));
-
-		//e.g. non-existing PPS referenced, could not find ref with POC, keep pushing packets
-		if(err == AVERROR_INVALIDDATA || err == AVERROR(EIO))
-			return HVD_OK;
-
-		//EAGAIN means that we need to read data with avcodec_receive_frame before we can push more data to decoder
-		return ( err == AVERROR(EAGAIN) ) ? HVD_AGAIN : HVD_ERROR;
+		if( !(h->pool[i].frame = av_frame_alloc()) )
+			return HVD_ERROR;
+		hvd_count(&h->pool_allocations, 1);
 	}
 
 	return HVD_OK;
 }
 
-//returns:
-//- non NULL on success
-//- NULL and error == HVD_OK if more data is needed or flushed completely
-//- NULL and error == HVD_ERROR if error occured
-//the ownership of returned AVFrame* remains with the library
-AVFrame *hvd_receive_frame(struct hvd *h, int *error)
+static void hvd_pool_close(struct hvd *h)
 {
-	AVCodecContext *avctx=h->decoder_ctx;
-	int ret = 0;
+	if(h->pool == NULL)
+		return;
 
-	*error = HVD_ERROR;
-	//free the leftovers from the last call (if any)
-	//this will happen here or in hvd_close, whichever is first
-	av_frame_free(&h->hw_frame);
-	av_frame_free(&h->sw_frame);
+	for(int i=0;i<h->pool_size;++i)
+		av_frame_free(&h->pool[i].frame);
 
-	if ( !( h->hw_frame = av_frame_alloc() ) || !( h->sw_frame = av_frame_alloc() ) )
-		return NULL_MSG("unable to av_frame_alloc frame", NULL);
+	free(h->pool);
+	h->pool = NULL;
+}
 
-	if ( (ret = avcodec_receive_frame(avctx, h->hw_frame) ) < 0 )
-	{	//EAGAIN - we need to push more data with avcodec_send_packet
-		//EOF  - the decoder was flushed, no more data
-		*error = (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? HVD_OK : HVD_ERROR;
+//called only by one thread (user in synchronous, download thread in asynchronous mode)
+static struct hvd_frame_slot *hvd_pool_get(struct hvd *h)
+{
+	const int index = hvd_pool_free(h);
 
-		//be nice to the user and prepare the decoder for new stream for him
-		//if he wants to continue the decoding (startover)
-		if(ret == AVERROR_EOF)
-			avcodec_flush_buffers(avctx);
+	if(index < 0)
+		return NULL;
 
-		if(*error)
-			fprintf(stderr, "hvd: error while decoding - \"%s\"\n", av_err2str(ret));
+	atomic_store_explicit(&h->pool[index].in_use, 1, memory_order_relaxed);
+	return &h->pool[index];
+}
 
-		return NULL;
-	}
+static int hvd_pool_available(struct hvd *h)
+{
+	return hvd_pool_free(h) >= 0;
+}
 
-	//this would be the place to add fallback to software but we want to treat it as error
-	if (h->hw_frame->format != h->hw_pix_fmt)
-		return NULL_MSG("frame decoded in software (not in hardware)", NULL);
+//index of free frame or -1, with memory budget frames with data buffers are taken first
+//and frame without them only if the next allocation fits
+static int hvd_pool_free(struct hvd *h)
+{
+	int empty = -1;
 
-	// at this point we have a valid frame decoded in hardware
-	// try to supply user software frame in the desired format
-	h->sw_frame->format=h->sw_pix_fmt;
+	for(int i=0;i<h->pool_size;++i)
+		if(!atomic_load_explicit(&h->pool[i].in_use, memory_order_acquire))
+		{
+			if(!h->memory.budget || h->pool[i].bytes)
+				return i;
 
-	if ( (ret = av_hwframe_transfer_data(h->sw_frame, h->hw_frame, 0) ) < 0)
-	{
-		fprintf(stderr, "hvd: unable to transfer data to system memory - \"%s\"\n", av_err2str(ret));
-		hvd_dump_sw_pix_formats(h);
-		return NULL;
-	}
+			if(empty < 0)
+				empty = i;
+		}
 
-	*error = HVD_OK;
-	return h->sw_frame;
+	return (empty >= 0 && hvd_memory_frame_fits(h)) ? empty : -1;
 }
 
-static AVFrame *NULL_MSG(const char *msg, const char *msg_details)
+static struct hvd_frame_slot *hvd_pool_find(const struct hvd *h, const AVFrame *frame)
 {
-	if(msg)
-		fprintf(stderr, "hvd: %s %s\n", msg, msg_details ? msg_details : "");
+	for(int i=0;i<h->pool_size;++i)
+		if(h->pool[i].frame == frame)
+			return &h->pool[i];
 
 	return NULL;
 }
 
-static void hvd_dump_sw_pix_formats(struct hvd *h)
+static void hvd_pool_put(struct hvd *h, struct hvd_frame_slot *slot)
 {
-	enum AVPixelFormat *formats, *iterator;
-
-	if(av_hwframe_transfer_get_formats(h->hw_frame->hw_frames_ctx, AV_HWFRAME_TRANSFER_DIRECTION_FROM, &formats, 0) < 0)
+	//transferred data buffers are not unreferenced, the next transfer writes to them
+	//hardware surfaces, mappings and user buffers are released immidiately
+	if(h->output != HVD_OUTPUT_TRANSFER || h->get_buffer)
 	{
-		fprintf(stderr, "hvd: failed to get transfer formats\n");
-		return;
+		av_frame_unref(slot->frame);
+		hvd_memory_frame(h, slot);
 	}
-	iterator=formats;
 
-	fprintf(stderr, "hvd: make sure you are using supported software pixel format:\n");
+	atomic_store_explicit(&slot->in_use, 0, memory_order_release);
 
-	while(*iterator != AV_PIX_FMT_NONE)
-	{
-		fprintf(stderr, "%d : %s\n", *iterator, av_get_pix_fmt_name (*iterator));
-		++iterator;
-	}
+	//download thread may be waiting for free frame
+	if(h->async)
+		hvd_waiter_wake(&h->async_data.download_waiter);
+}
 
-	av_free(formats);
+//process-wide FFmpeg setup, exactly once, safe to call concurrently
+static void hvd_global_init_once(void)
+{
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+	avcodec_register_all();
+#endif
+	hvd_convert_init(av_get_cpu_flags());
+}
+
+static void hvd_global_init(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, hvd_global_init_once);
+}
+
+//NULL on error
+struct hvd_device *hvd_device_init(const char *hardware, const char *device)
+{
+	struct hvd_device *d, zero_device = {0};
+
+	if( ( d = (struct hvd_device*)malloc(sizeof(struct hvd_device))) == NULL )
+		return hvd_device_close_and_return_null(NULL, "not enough memory for hvd_device", NULL);
+
+	*d = zero_device;
+
+	hvd_global_init();
+
+	//software device has no hardware context (e.g. simulating multiple devices without GPU)
+	if(strcmp(hardware, "software") == 0)
+	{
+		d->hw_pix_fmt = AV_PIX_FMT_NONE;
+		return d;
+	}
+
+	if(hvd_hw_device_open(NULL, &d->hw_device_ctx, &d->hw_pix_fmt, hardware, device) != HVD_OK)
+		return hvd_device_close_and_return_null(d, NULL, NULL);
+
+	return d;
+}
+
+//decoders hold their own references to hardware context
+void hvd_device_close(struct hvd_device *d)
+{
+	if(d == NULL)
+		return;
+
+	av_buffer_unref(&d->hw_device_ctx);
+	free(d);
+}
+
+static struct hvd_device *hvd_device_close_and_return_null(struct hvd_device *d, const char *msg, const char *msg_details)
+{
+	if(msg)
+		hvd_log(NULL, HVD_LOG_ERROR, HVD_LOG_GENERAL, "%s %s", msg, (msg_details) ? msg_details : "");
+
+	hvd_device_close(d);
+
+	return NULL;
+}
+
+//errors logged to decoder log or stderr (NULL decoder)
+static int hvd_hw_device_open(struct hvd *h, AVBufferRef **hw_device_ctx, enum AVPixelFormat *hw_pix_fmt, const char *hardware, const char *device)
+{
+	enum AVHWDeviceType hardware_type;
+	int err;
+
+	if( (hardware_type = av_hwdevice_find_type_by_name(hardware) ) == AV_HWDEVICE_TYPE_NONE )
+		return HVD_ERROR_MSG(h, "cannot find hardware decoder", hardware);
+
+	//This is MUCH easier in FFmpeg 4.0 with avcodec_get_hw_config but we want
+	//to support FFmpeg 3.4 (system FFmpeg on Ubuntu 18.04 until 2028).
+	if( ( *hw_pix_fmt = hvd_find_pixel_fmt_by_hw_type(hardware_type) ) == AV_PIX_FMT_NONE)
+		return HVD_ERROR_MSG(h, "unable to find pixel format for", hardware);
+
+	//specified device or NULL / empty string for default
+	device = (device != NULL && device[0] != '\0') ? device : NULL;
+
+	if ( (err = av_hwdevice_ctx_create(hw_device_ctx, hardware_type, device, NULL, 0) ) < 0)
+		return HVD_ERROR_MSG(h, "failed to open device and create context for", hardware);
+
+	return HVD_OK;
+}
+
+//errors logged
+static int hvd_hardware_init(struct hvd *h, const struct hvd_config *config)
+{
+	const struct hvd_device *shared = config->shared_device;
+
+	if(shared)
+	{	//reuse already opened device
+		h->hw_pix_fmt = shared->hw_pix_fmt;
+
+		if( (h->hw_device_ctx = av_buffer_ref(shared->hw_device_ctx) ) == NULL)
+			return HVD_ERROR_MSG(h, "unable to reference shared hw_device_ctx", NULL);
+	}
+	else if(hvd_hw_device_open(h, &h->hw_device_ctx, &h->hw_pix_fmt, config->hardware, config->device) != HVD_OK)
+		return HVD_ERROR;
+
+	if(hvd_decoder_init(h, h->decoder) != HVD_OK)
+		return HVD_ERROR;
+
+	//otherwise stream parameters are unknown until the first frame
+	if(h->width && h->height)
+		hvd_hw_frames_init(h);
+
+	return HVD_OK;
+}
+
+//hardware decoder if hw_device_ctx is set, software decoder otherwise
+static int hvd_decoder_init(struct hvd *h, const AVCodec *decoder)
+{
+	int err;
+
+	if(decoder == NULL)
+		return HVD_ERROR_MSG(h, "cannot find software decoder for", h->decoder->name);
+
+	if (!(h->decoder_ctx = avcodec_alloc_context3(decoder)))
+		return HVD_ERROR_MSG(h, "failed to alloc decoder context, no memory?", NULL);
+
+	h->decoder_ctx->width = h->width;
+	h->decoder_ctx->height = h->height;
+
+	if(h->profile)
+		h->decoder_ctx->profile = h->profile;
+
+	//output frames as soon as decoded, without waiting for reordering
+	//(where stream allows it, e.g. no B-frames)
+	if(h->low_latency)
+		h->decoder_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+	//Set user data carried by AVContext, we need this to determine pixel format
+	//from within FFmpeg using our supplied function for decoder_ctx->get_format.
+	//This is MUCH easier in FFmpeg 4.0 with avcodec_get_hw_config but we want
+	//to support FFmpeg 3.4 (system FFmpeg on Ubuntu 18.04 until 2028).
+	h->decoder_ctx->opaque = h;
+
+	if(h->hw_device_ctx)
+	{
+		h->decoder_ctx->get_format = hvd_get_hw_pix_format;
+
+		if( (h->decoder_ctx->hw_device_ctx = av_buffer_ref(h->hw_device_ctx) ) == NULL)
+			return HVD_ERROR_MSG(h, "unable to reference hw_device_ctx", NULL);
+
+#ifdef HVD_HW_FRAMES_PARAMETERS
+		//used when decoder allocates surfaces itself, counted like prepared surfaces
+		h->decoder_ctx->extra_hw_frames = h->surfaces + h->held_surfaces;
+#endif
+	}
+	else
+	{	//0 means automatic number of threads for libavcodec
+		h->decoder_ctx->thread_count = h->thread_count;
+
+		//frame threading adds frame of latency per thread, slice threading doesn't
+		if(h->thread_type)
+			h->decoder_ctx->thread_type = h->thread_type;
+		else if(h->low_latency)
+			h->decoder_ctx->thread_type = FF_THREAD_SLICE;
+	}
+
+	if (( err = avcodec_open2(h->decoder_ctx, decoder, NULL)) < 0)
+		return HVD_ERROR_MSG(h, "failed to initialize decoder context for", decoder->name);
+
+	return HVD_OK;
+}
+
+//the data pending in hardware decoder is lost, callers drop packets until the next keyframe
+static int hvd_software_fallback(struct hvd *h)
+{
+	hvd_log(h, HVD_LOG_WARNING, HVD_LOG_DECODE, "hardware decoding failed, falling back to software decoding");
+
+	avcodec_free_context(&h->decoder_ctx);
+	av_buffer_unref(&h->hw_frames_ctx);
+	av_buffer_unref(&h->hw_device_ctx);
+	h->software = 1;
+
+	//packets in the old decoder are gone
+	hvd_memory_release_all(h);
+
+	return hvd_decoder_init(h, avcodec_find_decoder(h->decoder->id));
+}
+
+//failure of the device (e.g. surfaces exhausted, no surface format) rather than of the stream data
+static int hvd_device_error(const struct hvd *h, int err)
+{
+	return h->device_failed || err == AVERROR(ENOMEM) || err == AVERROR(ENOSYS) ||
+		err == AVERROR(ENODEV) || err == AVERROR_EXTERNAL;
+}
+
+// To be replaced in FFmpeg 4.0 with avcodec_get_hw_config. This is necessary for FFmpeg 3.4.
+// This is clumsy - we need to hardcode device type to its internal pixel format.
+// If device type is not on this list it will not be supported by the library.
+// (extend this list as much as possible, this is the only thing which is holding support for some hardware)
+static enum AVPixelFormat hvd_find_pixel_fmt_by_hw_type(const enum AVHWDeviceType type)
+{
+	enum AVPixelFormat fmt;
+
+	switch (type) {
+	case AV_HWDEVICE_TYPE_VAAPI:
+		fmt = AV_PIX_FMT_VAAPI;
+		break;
+	case AV_HWDEVICE_TYPE_DXVA2:
+		fmt = AV_PIX_FMT_DXVA2_VLD;
+		break;
+	case AV_HWDEVICE_TYPE_D3D11VA:
+		fmt = AV_PIX_FMT_D3D11;
+		break;
+	case AV_HWDEVICE_TYPE_VDPAU:
+		fmt = AV_PIX_FMT_VDPAU;
+		break;
+	case AV_HWDEVICE_TYPE_VIDEOTOOLBOX:
+		fmt = AV_PIX_FMT_VIDEOTOOLBOX;
+		break;
+	case AV_HWDEVICE_TYPE_CUDA:
+		fmt = AV_PIX_FMT_CUDA;
+		break;
+	default:
+		fmt = AV_PIX_FMT_NONE;
+		break;
+	}
+
+	return fmt;
+}
+
+static enum AVPixelFormat hvd_get_hw_pix_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts)
+{
+	const enum AVPixelFormat *p;
+	struct hvd *h = (struct hvd*)ctx->opaque;
+
+	for (p = pix_fmts; *p != -1; p++)
+	{
+		if (*p == h->hw_pix_fmt)
+		{
+			hvd_hw_frames_attach(h, ctx);
+			return *p;
+		}
+	}
+
+	if(h->software_fallback)
+	{	//e.g. profile unsupported by hardware, hardware formats are listed first
+		for (p = pix_fmts; *p != -1; p++)
+			if( !(av_pix_fmt_desc_get(*p)->flags & AV_PIX_FMT_FLAG_HWACCEL) )
+			{
+				hvd_log(h, HVD_LOG_WARNING, HVD_LOG_DECODE, "stream not supported by hardware, falling back to software decoding");
+				return *p;
+			}
+	}
+
+	hvd_log(h, HVD_LOG_ERROR, HVD_LOG_DECODE, "failed to get HW surface format");
+	h->device_failed = 1;
+	return AV_PIX_FMT_NONE;
+}
+
+//surfaces for the stream (codec, size, profile), failure is not fatal (decoder allocates them on the first frame)
+static void hvd_hw_frames_init(struct hvd *h)
+{
+#ifdef HVD_HW_FRAMES_PARAMETERS
+	AVHWFramesContext *frames;
+	const int surfaces = hvd_hw_frames_count(h);
+	int err;
+
+	if( (h->hw_frames_ctx = av_hwframe_ctx_alloc(h->hw_device_ctx)) == NULL )
+	{
+		hvd_log(h, HVD_LOG_WARNING, HVD_LOG_GENERAL, "unable to allocate hardware frames context, surfaces allocated on first frame");
+		return;
+	}
+
+	frames = (AVHWFramesContext*)h->hw_frames_ctx->data;
+	frames->format = h->hw_pix_fmt;
+	frames->width = FFALIGN(h->width, 16); //covers codec alignment of coded size
+	frames->height = FFALIGN(h->height, 16);
+	frames->initial_pool_size = surfaces;
+	frames->sw_format = hvd_hw_frames_sw_format(h);
+
+	if( (err = av_hwframe_ctx_init(h->hw_frames_ctx)) < 0 )
+	{
+		hvd_log(h, HVD_LOG_WARNING, HVD_LOG_GENERAL, "unable to prepare %d surfaces, allocated on first frame - \"%s\"",
+			surfaces, av_err2str(err));
+		av_buffer_unref(&h->hw_frames_ctx);
+	}
+#else
+	hvd_log(h, HVD_LOG_DEBUG, HVD_LOG_GENERAL, "preparing surfaces needs FFmpeg 4.0, allocated on first frame");
+#endif
+}
+
+//prepared surfaces are large enough for the stream (e.g. after hvd_reconfigure)
+static int hvd_hw_frames_fit(struct hvd *h)
+{
+	const AVHWFramesContext *frames = (const AVHWFramesContext*)h->hw_frames_ctx->data;
+
+	return frames->sw_format == hvd_hw_frames_sw_format(h) &&
+		frames->width >= FFALIGN(h->width, 16) && frames->height >= FFALIGN(h->height, 16) &&
+		frames->initial_pool_size >= hvd_hw_frames_count(h);
+}
+
+static int hvd_hw_frames_count(struct hvd *h)
+{
+	int surfaces;
+
+	//reference frames like libavcodec counts them, the current frame and libavcodec work surfaces
+	switch(h->decoder->id)
+	{
+	case AV_CODEC_ID_H264:
+	case AV_CODEC_ID_HEVC:
+	case AV_CODEC_ID_AV1:
+		surfaces = 16;
+		break;
+	case AV_CODEC_ID_VP9:
+		surfaces = 8;
+		break;
+	case AV_CODEC_ID_VP8:
+		surfaces = 3;
+		break;
+	default:
+		surfaces = 2;
+	}
+
+	return surfaces + 1 + 3 + h->surfaces + h->held_surfaces;
+}
+
+//surfaces held outside of decoder, output frames reference them until released
+static int hvd_hw_frames_held(const struct hvd *h, int frames_in_flight, int async)
+{
+	int surfaces = 0;
+
+	if(h->output != HVD_OUTPUT_TRANSFER)
+		surfaces += frames_in_flight;
+	if(async)
+		surfaces += HVD_ASYNC_DECODED;
+
+	return surfaces;
+}
+
+//10 bit profiles decode to p010, everything else to nv12
+static enum AVPixelFormat hvd_hw_frames_sw_format(struct hvd *h)
+{
+	if( (h->decoder->id == AV_CODEC_ID_HEVC && h->profile == FF_PROFILE_HEVC_MAIN_10) ||
+		(h->decoder->id == AV_CODEC_ID_VP9 && h->profile == FF_PROFILE_VP9_2) )
+		return AV_PIX_FMT_P010;
+
+	return AV_PIX_FMT_NV12;
+}
+
+//called from get_format, the prepared surfaces are used if they fit what the decoder needs
+static void hvd_hw_frames_attach(struct hvd *h, AVCodecContext *ctx)
+{
+#ifdef HVD_HW_FRAMES_PARAMETERS
+	AVBufferRef *needed_ref = NULL;
+	const AVHWFramesContext *needed, *prepared;
+
+	if(h->hw_frames_ctx == NULL)
+		return;
+
+	if(avcodec_get_hw_frames_parameters(ctx, ctx->hw_device_ctx, h->hw_pix_fmt, &needed_ref) < 0)
+	{
+		av_buffer_unref(&h->hw_frames_ctx);
+		return;
+	}
+
+	needed = (const AVHWFramesContext*)needed_ref->data;
+	prepared = (const AVHWFramesContext*)h->hw_frames_ctx->data;
+
+	if(needed->sw_format == prepared->sw_format && needed->width <= prepared->width && needed->height <= prepared->height &&
+		needed->initial_pool_size <= prepared->initial_pool_size)
+	{
+		av_buffer_unref(&ctx->hw_frames_ctx);
+
+		if( (ctx->hw_frames_ctx = av_buffer_ref(h->hw_frames_ctx)) != NULL )
+		{
+			atomic_store_explicit(&h->stats.prebuilt_surfaces, prepared->initial_pool_size, memory_order_relaxed);
+			av_buffer_unref(&needed_ref);
+			return;
+		}
+	}
+	else
+		hvd_log(h, HVD_LOG_INFO, HVD_LOG_DECODE, "prepared surfaces don't fit the stream (%s %dx%d x%d), allocating new",
+			av_get_pix_fmt_name(needed->sw_format), needed->width, needed->height, needed->initial_pool_size);
+
+	//stream changed or didn't match config, free the memory
+	av_buffer_unref(&needed_ref);
+	av_buffer_unref(&h->hw_frames_ctx);
+	atomic_store_explicit(&h->stats.prebuilt_surfaces, 0, memory_order_relaxed);
+#else
+	(void)h;
+	(void)ctx;
+#endif
+}
+
+
+void hvd_close(struct hvd* h)
+{
+	if(h == NULL)
+		return;
+
+	//workers use everything below
+	hvd_async_close(h);
+
+	hvd_stream_close(h);
+	hvd_pool_close(h);
+	av_frame_free(&h->hw_frame);
+	av_frame_free(&h->transfer_frame);
+	av_frame_free(&h->map_frame);
+	av_frame_free(&h->region_frame);
+	av_frame_free(&h->drop_frame);
+
+	avcodec_free_context(&h->decoder_ctx);
+	av_buffer_unref(&h->hw_frames_ctx);
+	av_buffer_unref(&h->hw_device_ctx);
+
+	if(h->region_mutex_initialized)
+		pthread_mutex_destroy(&h->region_mutex);
+
+	free(h->trace.slots);
+	free(h);
+}
+
+static struct hvd *hvd_close_and_return_null(struct hvd *h, const char *msg, const char *msg_details)
+{
+	if(msg)
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_GENERAL, "%s %s", msg, (msg_details) ? msg_details : "");
+
+	hvd_close(h);
+
+	return NULL;
+}
+
+int hvd_reconfigure(struct hvd *h, const struct hvd_config *config)
+{
+	const int64_t start = av_gettime_relative();
+	enum AVPixelFormat sw_pix_fmt = AV_PIX_FMT_NONE;
+	const AVCodec *decoder, *software;
+	int reopen;
+
+	//invalid config is rejected before anything is changed
+	if(config->output < HVD_OUTPUT_TRANSFER || config->output > HVD_OUTPUT_MAP)
+		return HVD_ERROR_MSG(h, "invalid output mode", NULL);
+
+	if(!hvd_region_valid(&config->region))
+		return HVD_ERROR_MSG(h, "invalid region", NULL);
+
+	if(config->drop_policy < 0 || config->drop_policy > (HVD_DROP_NONREF | HVD_DROP_UNREAD | HVD_DROP_LATEST | HVD_DROP_AUTO))
+		return HVD_ERROR_MSG(h, "invalid drop policy", NULL);
+
+	if(config->pixel_format && config->pixel_format[0] != '\0' &&
+		(sw_pix_fmt = av_get_pix_fmt(config->pixel_format)) == AV_PIX_FMT_NONE)
+		return HVD_ERROR_MSG(h, "failed to find pixel format", config->pixel_format);
+
+	if( (decoder = avcodec_find_decoder_by_name(config->codec)) == NULL )
+		return HVD_ERROR_MSG(h, "cannot find decoder", config->codec);
+
+	//the data of the old stream in flight is discarded
+	if(h->async)
+	{
+		hvd_async_stop(h);
+		hvd_async_reset(h);
+	}
+
+	hvd_stream_reset(h);
+
+	if(h->borrowed)
+	{
+		hvd_pool_put(h, h->borrowed);
+		h->borrowed = NULL;
+	}
+
+	hvd_memory_release_all(h);
+
+	for(int i=0;i<HVD_PACKET_INFO;++i)
+		h->packet_info[i].seq = -1;
+
+	//these are applied only when opening decoder
+	reopen = decoder != h->decoder || config->profile != h->profile || !config->low_latency != !h->low_latency ||
+		(h->software && (config->thread_count != h->thread_count || config->thread_type != h->thread_type));
+
+	//software decoder requested by name or found by codec id after fallback
+	software = (h->decoder_ctx && h->decoder_ctx->codec == h->decoder) ? decoder : avcodec_find_decoder(decoder->id);
+
+	//data buffers kept in free frames are reused only by transfer to library buffers
+	if(config->output != h->output || config->get_buffer != h->get_buffer)
+		for(int i=0;i<h->pool_size;++i)
+			if(!atomic_load_explicit(&h->pool[i].in_use, memory_order_acquire))
+			{
+				av_frame_unref(h->pool[i].frame);
+				hvd_memory_frame(h, &h->pool[i]);
+			}
+
+	h->decoder = decoder;
+	h->output = config->output;
+	h->software_fallback = config->software_fallback;
+	h->width = config->width;
+	h->height = config->height;
+	h->profile = config->profile;
+	h->thread_count = config->thread_count;
+	h->thread_type = config->thread_type;
+	h->low_latency = config->low_latency;
+	h->get_buffer = config->get_buffer;
+	h->get_buffer_opaque = config->get_buffer_opaque;
+	h->surfaces = config->surfaces;
+	h->held_surfaces = hvd_hw_frames_held(h, h->pool_size, h->async);
+	h->sw_pix_fmt = sw_pix_fmt;
+	h->drop_depth = config->drop_depth > 0 ? config->drop_depth : HVD_DEFAULT_DROP_DEPTH;
+	hvd_set_drop_policy(h, config->drop_policy);
+	h->resync = config->resync;
+	h->resync_wait = 0;
+	h->device_failed = 0;
+	h->memory.budget = config->memory_budget > 0 ? config->memory_budget : 0;
+
+	pthread_mutex_lock(&h->region_mutex);
+	h->region = config->region;
+	pthread_mutex_unlock(&h->region_mutex);
+
+	//checked again on the next frame
+	h->transfer_frames = NULL;
+
+	//prepared surfaces are kept if they fit, unknown size is checked by get_format
+	if(h->hw_frames_ctx && h->width && h->height && !hvd_hw_frames_fit(h))
+	{
+		av_buffer_unref(&h->hw_frames_ctx);
+		atomic_store_explicit(&h->stats.prebuilt_surfaces, 0, memory_order_relaxed);
+	}
+
+	if(h->hw_device_ctx && !h->hw_frames_ctx && h->width && h->height)
+		hvd_hw_frames_init(h);
+
+	if(reopen)
+	{
+		avcodec_free_context(&h->decoder_ctx);
+		hvd_count(&h->stats.reopens, 1);
+
+		if(hvd_decoder_init(h, h->software ? software : decoder) != HVD_OK &&
+			(h->software || !h->software_fallback || hvd_software_fallback(h) != HVD_OK))
+			return HVD_ERROR;
+	}
+	else
+		avcodec_flush_buffers(h->decoder_ctx);
+
+	if(config->warmup)
+		hvd_warmup(h);
+
+	if(h->hw_frames_ctx)
+		hvd_memory_surfaces(h, h->hw_frames_ctx);
+
+	if(h->async && hvd_async_start(h) != HVD_OK)
+		return HVD_ERROR;
+
+	//time to first frame is measured from the switch
+	atomic_store_explicit(&h->stats.first_packet, 0, memory_order_relaxed);
+	atomic_store_explicit(&h->stats.first_frame, 0, memory_order_relaxed);
+	h->init_start = start;
+
+	hvd_histogram_add(&h->stats.reconfigure, av_gettime_relative() - start);
+
+	hvd_log(h, HVD_LOG_DEBUG, HVD_LOG_GENERAL, "reconfigured for %s %dx%d in %lld us, decoder %s",
+		decoder->name, h->width, h->height, (long long)(av_gettime_relative() - start), reopen ? "reopened" : "kept");
+
+	return HVD_OK;
+}
+
+int hvd_send_packet(struct hvd *h,struct hvd_packet *packet)
+{
+	int ret;
+
+	//NULL packet is legal and means user requested flushing
+	h->av_packet.data = (packet) ? packet->data : NULL;
+	h->av_packet.size = (packet) ? packet->size : 0;
+
+	if(packet && packet->data && hvd_packet_reference(h, &h->av_packet, packet) != HVD_OK)
+		return HVD_ERROR;
+
+	ret = hvd_submit_packet(h, &h->av_packet, packet ? packet->pts : AV_NOPTS_VALUE, packet ? packet->tag : 0);
+
+	//rejected data stays with the user (who will send it again)
+	if(ret == HVD_AGAIN && h->av_packet.buf && packet->free && av_buffer_get_ref_count(h->av_packet.buf) == 1)
+		((struct hvd_packet_owner*)av_buffer_get_opaque(h->av_packet.buf))->rejected = 1;
+
+	av_buffer_unref(&h->av_packet.buf);
+
+	return ret;
+}
+
+//refcounted data is referenced, data with free callback is wrapped, the decoder doesn't copy either
+//other data (without buf) is copied by decoder
+static int hvd_packet_reference(struct hvd *h, AVPacket *av_packet, const struct hvd_packet *packet)
+{
+	struct hvd_packet_owner *owner = NULL;
+
+	if(packet->buf)
+	{
+		if( (av_packet->buf = av_buffer_ref(packet->buf)) == NULL )
+			return HVD_ERROR_MSG(h, "unable to reference packet data", NULL);
+
+		return HVD_OK;
+	}
+
+	if(packet->free == NULL)
+		return HVD_OK;
+
+	if( (owner = (struct hvd_packet_owner*)malloc(sizeof(struct hvd_packet_owner))) == NULL ||
+		(av_packet->buf = av_buffer_create(packet->data, packet->size, hvd_packet_owner_free, owner, 0)) == NULL )
+	{	//the data is owned by the library, also on failure
+		free(owner);
+		packet->free(packet->opaque, packet->data);
+		return HVD_ERROR_MSG(h, "not enough memory for packet", NULL);
+	}
+
+	owner->free = packet->free;
+	owner->opaque = packet->opaque;
+	owner->rejected = 0;
+
+	return HVD_OK;
+}
+
+//called when decoder releases the data, possibly from decoder threads
+static void hvd_packet_owner_free(void *opaque, uint8_t *data)
+{
+	struct hvd_packet_owner *owner = (struct hvd_packet_owner*)opaque;
+
+	if(!owner->rejected)
+		owner->free(owner->opaque, data);
+
+	free(owner);
+}
+
+//packet with NULL data flushes, refcounted packets are referenced instead of copied
+//pts and tag of the user go with the packet to its frame
+static int hvd_submit_packet(struct hvd *h, AVPacket *packet, int64_t pts, uint64_t tag)
+{
+	const int flush = (packet->data == NULL);
+	int ret;
+
+	if(!flush)
+		hvd_mark_first(&h->stats.first_packet);
+
+	if(h->async)
+		return hvd_async_send_packet(h, packet, pts, tag);
+
+	packet->pts = AV_NOPTS_VALUE;
+
+	if(!flush)
+	{
+		struct hvd_packet_info info = {h->packet_seq, av_gettime_relative(), pts, tag, 0, 0};
+		hvd_packet_stamp(h, packet, &info);
+		hvd_trace(h, HVD_TRACE_SUBMIT, HVD_TRACE_USER, &info);
+	}
+
+	if( (ret = hvd_decode_packet(h, packet)) == HVD_OK && !flush)
+		++h->packet_seq;
+
+	return ret;
+}
+
+/* Raw byte stream input
+ *
+ * The data chunk is copied once to padded refcounted buffer (from pool) and parsed.
+ * Packets entirely inside the chunk reference the chunk (no copy).
+ * Packets spanning chunks come from parser buffer and are copied by decoder.
+ * Packets not accepted by full decoder wait in pending queue.
+ */
+
+int hvd_send_stream(struct hvd *h, const uint8_t *data, int size)
+{
+	struct hvd_parser *s = &h->stream;
+	AVBufferRef *chunk = NULL;
+	int ret;
+
+	if(s->parser == NULL && data != NULL)
+	{
+		if( (s->parser = av_parser_init(h->decoder->id)) == NULL )
+			return HVD_ERROR_MSG(h, "no parser for codec", h->decoder->name);
+
+		if(s->parser_ctx == NULL && (s->parser_ctx = avcodec_alloc_context3(NULL)) == NULL)
+			return HVD_ERROR_MSG(h, "failed to alloc parser context, no memory?", NULL);
+
+		s->parser_ctx->codec_id = h->decoder->id;
+	}
+
+	//data queued earlier goes first
+	if( (ret = hvd_stream_drain(h)) == HVD_ERROR )
+		return HVD_ERROR;
+
+	if(data == NULL || size == 0)
+	{	//flush parser (last packet), then decoder, queued flush is accepted too
+		if(s->parser && hvd_stream_parse(h, NULL, NULL, 0) == HVD_ERROR)
+			return HVD_ERROR;
+
+		av_parser_close(s->parser);
+		s->parser = NULL;
+
+		return hvd_stream_send(h, &s->packet) == HVD_ERROR ? HVD_ERROR : HVD_OK;
+	}
+
+	//the user doesn't receive frames fast enough, the data is not accepted
+	if(hvd_stream_full(h, size))
+	{
+		hvd_count(&h->stats.again, 1);
+		return HVD_AGAIN;
+	}
+
+	if(s->pool == NULL || s->pool_size < size + AV_INPUT_BUFFER_PADDING_SIZE)
+	{	//the buffers still in use are freed when released
+		av_buffer_pool_uninit(&s->pool);
+		s->pool_size = FFALIGN(size + AV_INPUT_BUFFER_PADDING_SIZE, 4096);
+
+		if( (s->pool = av_buffer_pool_init(s->pool_size, NULL)) == NULL)
+			return HVD_ERROR_MSG(h, "not enough memory for stream buffers", NULL);
+	}
+
+	if( (chunk = av_buffer_pool_get(s->pool)) == NULL)
+		return HVD_ERROR_MSG(h, "not enough memory for stream data", NULL);
+
+	memcpy(chunk->data, data, size);
+	memset(chunk->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+	ret = hvd_stream_parse(h, chunk, chunk->data, size);
+
+	av_buffer_unref(&chunk);
+
+	//packets waiting for decoder are accepted
+	return ret == HVD_ERROR ? HVD_ERROR : HVD_OK;
+}
+
+//parse data in chunk (NULL and 0 size to flush parser) and send parsed packets
+static int hvd_stream_parse(struct hvd *h, AVBufferRef *chunk, const uint8_t *data, int size)
+{
+	struct hvd_parser *s = &h->stream;
+	AVPacket *packet = &s->packet;
+	int used, ret = HVD_OK, send_ret;
+
+	do
+	{
+		used = av_parser_parse2(s->parser, s->parser_ctx, &packet->data, &packet->size,
+			data, size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+
+		if(used < 0)
+			return HVD_ERROR_MSG(h, "error while parsing stream", NULL);
+
+		data += used;
+		size -= used;
+
+		if(packet->size == 0)
+			continue;
+
+		//reference chunk if packet is inside, otherwise it is in parser buffer
+		if(chunk && packet->data >= chunk->data && packet->data + packet->size <= data)
+			if( (packet->buf = av_buffer_ref(chunk)) == NULL )
+				return HVD_ERROR_MSG(h, "unable to reference stream data", NULL);
+
+		send_ret = hvd_stream_send(h, packet);
+
+		av_buffer_unref(&packet->buf);
+
+		if(send_ret == HVD_ERROR)
+			return HVD_ERROR;
+		if(send_ret == HVD_AGAIN)
+			ret = HVD_AGAIN;
+	}
+	while(size > 0);
+
+	packet->data = NULL;
+	packet->size = 0;
+
+	return ret;
+}
+
+//send packet or queue it if decoder is full or other packets are waiting
+static int hvd_stream_send(struct hvd *h, AVPacket *packet)
+{
+	int ret = HVD_AGAIN;
+
+	if(h->stream.pending_count == 0 && (ret = hvd_submit_packet(h, packet, AV_NOPTS_VALUE, 0)) != HVD_AGAIN)
+		return ret;
+
+	return hvd_stream_pending_push(h, packet) == HVD_OK ? HVD_AGAIN : HVD_ERROR;
+}
+
+//returns number of pending packets sent or HVD_ERROR
+static int hvd_stream_drain(struct hvd *h)
+{
+	struct hvd_parser *s = &h->stream;
+	int sent = 0, ret = HVD_OK;
+
+	while(sent < s->pending_count && (ret = hvd_submit_packet(h, &s->pending[sent], AV_NOPTS_VALUE, 0)) == HVD_OK)
+	{
+		hvd_memory_add(&h->memory.packets, -s->pending[sent].size);
+		av_packet_unref(&s->pending[sent++]);
+	}
+
+	if(ret == HVD_ERROR)
+		return HVD_ERROR;
+
+	if(sent)
+	{
+		s->pending_count -= sent;
+		memmove(s->pending, s->pending + sent, s->pending_count * sizeof(AVPacket));
+	}
+
+	return sent;
+}
+
+static int hvd_stream_pending_push(struct hvd *h, const AVPacket *packet)
+{
+	struct hvd_parser *s = &h->stream;
+	AVPacket *pending;
+
+	if(s->pending_count == s->pending_capacity)
+	{
+		const int capacity = s->pending_capacity ? 2 * s->pending_capacity : 8;
+
+		if( (pending = (AVPacket*)realloc(s->pending, capacity * sizeof(AVPacket))) == NULL )
+			return HVD_ERROR_MSG(h, "not enough memory for stream queue", NULL);
+
+		s->pending = pending;
+		s->pending_capacity = capacity;
+	}
+
+	pending = &s->pending[s->pending_count];
+	av_init_packet(pending);
+
+	//flush marker, otherwise reference (chunk) or copy (parser buffer)
+	if(packet->data == NULL)
+	{
+		pending->data = NULL;
+		pending->size = 0;
+	}
+	else if(av_packet_ref(pending, packet) < 0)
+		return HVD_ERROR_MSG(h, "unable to queue stream packet", NULL);
+
+	//pending packets share chunk buffers, count only their data
+	hvd_memory_add(&h->memory.packets, pending->size);
+	++s->pending_count;
+
+	return HVD_OK;
+}
+
+static void hvd_stream_close(struct hvd *h)
+{
+	struct hvd_parser *s = &h->stream;
+
+	for(int i=0;i<s->pending_count;++i)
+		av_packet_unref(&s->pending[i]);
+
+	free(s->pending);
+	av_parser_close(s->parser);
+	avcodec_free_context(&s->parser_ctx);
+	av_buffer_pool_uninit(&s->pool);
+}
+
+//pending queue is bounded like async queue and by memory budget, at least one chunk is accepted
+static int hvd_stream_full(struct hvd *h, int size)
+{
+	const int depth = h->async ? h->async_data.packet_count : HVD_DEFAULT_ASYNC_DEPTH;
+	const int pending = h->stream.pending_count;
+
+	if(pending >= depth)
+		return 1;
+
+	if(pending && hvd_memory_over(h, size))
+	{
+		hvd_count(&h->memory.refused, 1);
+		return 1;
+	}
+
+	return 0;
+}
+
+//drops parser state and packets waiting for decoder, buffers are kept
+static void hvd_stream_reset(struct hvd *h)
+{
+	struct hvd_parser *s = &h->stream;
+
+	for(int i=0;i<s->pending_count;++i)
+	{
+		hvd_memory_add(&h->memory.packets, -s->pending[i].size);
+		av_packet_unref(&s->pending[i]);
+	}
+
+	s->pending_count = 0;
+
+	av_parser_close(s->parser);
+	s->parser = NULL;
+	//new context for possibly different codec
+	avcodec_free_context(&s->parser_ctx);
+}
+
+//remember packet info until its frame is decoded, pts carries the sequence number
+static void hvd_packet_stamp(struct hvd *h, AVPacket *packet, const struct hvd_packet_info *info)
+{
+	struct hvd_packet_info *entry = &h->packet_info[info->seq % HVD_PACKET_INFO];
+
+	//too old to be still held by decoder
+	hvd_memory_release(h, entry);
+
+	*entry = *info;
+	entry->size = 0;
+	packet->pts = info->seq;
+}
+
+//returns HVD_OK, HVD_AGAIN or HVD_ERROR
+static int hvd_decode_packet(struct hvd *h, AVPacket *packet)
+{
+	const int64_t start = av_gettime_relative();
+	const int skip = atomic_load_explicit(&h->drop_active, memory_order_relaxed) & HVD_DROP_NONREF;
+	int err;
+
+	//after errors nothing is decoded until the next keyframe, references are missing
+	if(h->resync_wait && packet->data && !hvd_resync_keyframe(h, packet))
+	{
+		hvd_count(&h->stats.resync_packets, 1);
+		hvd_count(&h->stats.resync_bytes, packet->size);
+		return HVD_OK;
+	}
+
+	//decoder context belongs to the decoding thread, policy is applied here
+	h->decoder_ctx->skip_frame = skip ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+
+	//WARNING The input buffer, av_packet->data must be AV_INPUT_BUFFER_PADDING_SIZE
+	//larger than the actual read bytes because some optimized bitstream readers
+	// read 32 or 64 bits at once and could read over the end.
+	err = avcodec_send_packet(h->decoder_ctx, packet);
+
+	//e.g. hardware surfaces exhausted, continue in software from the next keyframe
+	if(err < 0 && !h->software && h->software_fallback && hvd_device_error(h, err))
+	{
+		if(hvd_software_fallback(h) != HVD_OK)
+			return HVD_ERROR;
+
+		//software decoder has no references, mid-GOP packets would decode garbage
+		hvd_resync_start(h, "software fallback");
+
+		if(!hvd_resync_keyframe(h, packet))
+		{
+			hvd_count(&h->stats.resync_packets, 1);
+			hvd_count(&h->stats.resync_bytes, packet->size);
+			return HVD_OK;
+		}
+
+		err = avcodec_send_packet(h->decoder_ctx, packet);
+	}
+
+	if(err >= 0 && packet->data)
+		hvd_memory_accept(h, packet);
+
+	//pts of stamped packet carries the sequence number
+	if(h->trace.slots && packet->data && packet->pts >= 0 && (err >= 0 || err == AVERROR(EAGAIN)))
+		hvd_trace_record(h, err >= 0 ? HVD_TRACE_ACCEPT : HVD_TRACE_AGAIN, h->async ? HVD_TRACE_DECODER : HVD_TRACE_USER,
+			&h->packet_info[packet->pts % HVD_PACKET_INFO]);
+
+	//EAGAIN returns immidiately, it would only hide the actual decoding time
+	if(err != AVERROR(EAGAIN))
+		hvd_histogram_add(&h->stats.send, av_gettime_relative() - start);
+
+	if ( err < 0 )
+	{
+		//e.g. non-existing PPS referenced, could not find ref with POC, keep pushing packets
+		if(err == AVERROR_INVALIDDATA || err == AVERROR(EIO))
+		{
+			hvd_count(err == AVERROR_INVALIDDATA ? &h->stats.invalid_data : &h->stats.io_errors, 1);
+			hvd_log(h, HVD_LOG_WARNING, HVD_LOG_SEND, "send_packet error %s", av_err2str(err));
+
+			if(h->resync)
+				hvd_resync_start(h, "send_packet error");
+
+			return HVD_OK;
+		}
+
+		//EAGAIN means that we need to read data with avcodec_receive_frame before we can push more data to decoder
+		if(err == AVERROR(EAGAIN))
+		{
+			hvd_count(&h->stats.again, 1);
+			hvd_log(h, HVD_LOG_DEBUG, HVD_LOG_SEND, "send_packet error %s", av_err2str(err));
+			return HVD_AGAIN;
+		}
+
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_SEND, "send_packet error %s", av_err2str(err));
+		return HVD_ERROR;
+	}
+
+	if(packet->data)
+	{
+		hvd_count(&h->stats.packets, 1);
+		hvd_count(&h->stats.bytes, packet->size);
+	}
+	else
+		hvd_count(&h->stats.flushes, 1);
+
+	//frames not coming out of such packets were skipped
+	if(skip && packet->data && packet->pts != AV_NOPTS_VALUE && packet->pts >= 0)
+	{
+		h->packet_info[packet->pts % HVD_PACKET_INFO].skip = 1;
+		hvd_count(&h->stats.nonref_packets, 1);
+	}
+
+	return HVD_OK;
+}
+
+//returns:
+//- non NULL on success
+//- NULL and error == HVD_OK if more data is needed or flushed completely
+//- NULL and error == HVD_ERROR if error occured
+//the ownership of returned AVFrame* remains with the library
+AVFrame *hvd_receive_frame(struct hvd *h, int *error)
+{
+	struct hvd_frame_slot *slot;
+
+	//return the frame from the last call (if any) to the pool
+	//this will happen here or in hvd_close, whichever is first
+	if(h->borrowed)
+		hvd_pool_put(h, h->borrowed);
+
+	h->borrowed = slot = hvd_receive(h, error);
+
+	return slot ? slot->frame : NULL;
+}
+
+//returns like hvd_receive_frame, additionally:
+//- NULL and error == HVD_AGAIN if all the frames are in use
+//the ownership of returned AVFrame* is shared until hvd_release_frame
+AVFrame *hvd_acquire_frame(struct hvd *h, int *error)
+{
+	struct hvd_frame_slot *slot = hvd_receive(h, error);
+
+	return slot ? slot->frame : NULL;
+}
+
+void hvd_release_frame(struct hvd *h, AVFrame *frame)
+{
+	struct hvd_frame_slot *slot;
+
+	if(frame == NULL)
+		return;
+
+	if( (slot = hvd_pool_find(h, frame)) == NULL )
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_GENERAL, "released frame doesn't belong to the decoder");
+		return;
+	}
+
+	if(slot == h->borrowed)
+		h->borrowed = NULL;
+
+	hvd_pool_put(h, slot);
+}
+
+//receive in current mode, latency is measured from hvd_send_packet of frame data
+static struct hvd_frame_slot *hvd_receive(struct hvd *h, int *error)
+{
+	struct hvd_frame_slot *slot;
+
+	hvd_drop_update(h);
+
+	//stream data waiting for space in decoder (or async queue)
+	if(h->stream.pending_count && hvd_stream_drain(h) == HVD_ERROR)
+	{
+		*error = HVD_ERROR;
+		return NULL;
+	}
+
+	slot = h->async ? hvd_async_receive_slot(h, error) : hvd_receive_slot(h, error);
+
+	if(slot == NULL)
+		return NULL;
+
+	hvd_mark_first(&h->stats.first_frame);
+
+	if(slot->packet.seq >= 0)
+	{
+		slot->info.latency = av_gettime_relative() - slot->packet.sent;
+		slot->info.delay = (int)(h->packet_seq - slot->packet.seq - 1);
+	}
+	else
+		slot->info.latency = slot->info.delay = -1;
+
+	slot->info.pts = slot->packet.pts;
+	slot->info.tag = slot->packet.tag;
+
+	hvd_trace(h, HVD_TRACE_OUTPUT, HVD_TRACE_USER, &slot->packet);
+
+	return slot;
+}
+
+int hvd_get_frame_info(const struct hvd *h, const AVFrame *frame, struct hvd_frame_info *info)
+{
+	const struct hvd_frame_slot *slot = hvd_pool_find(h, frame);
+
+	if(slot == NULL)
+		return HVD_ERROR_MSG(h, "frame doesn't belong to the decoder", NULL);
+
+	*info = slot->info;
+	return HVD_OK;
+}
+
+int hvd_set_region(struct hvd *h, const struct hvd_region *region)
+{
+	const struct hvd_region full_frame = {0};
+
+	if(region == NULL)
+		region = &full_frame;
+
+	if(!hvd_region_valid(region))
+		return HVD_ERROR_MSG(h, "invalid region", NULL);
+
+	pthread_mutex_lock(&h->region_mutex);
+	h->region = *region;
+	pthread_mutex_unlock(&h->region_mutex);
+
+	return HVD_OK;
+}
+
+int hvd_set_drop_policy(struct hvd *h, int policy)
+{
+	if(policy < 0 || policy > (HVD_DROP_NONREF | HVD_DROP_UNREAD | HVD_DROP_LATEST | HVD_DROP_AUTO))
+		return HVD_ERROR_MSG(h, "invalid drop policy", NULL);
+
+	atomic_store_explicit(&h->drop_policy, policy, memory_order_relaxed);
+	hvd_drop_update(h);
+
+	return HVD_OK;
+}
+
+//policies in effect, with HVD_DROP_AUTO escalating with queue depth (user thread)
+static void hvd_drop_update(struct hvd *h)
+{
+	int policy = atomic_load_explicit(&h->drop_policy, memory_order_relaxed);
+
+	if(policy & HVD_DROP_AUTO)
+	{
+		const int depth = hvd_queue_depth(h);
+
+		if(depth >= h->drop_depth)
+			policy |= HVD_DROP_UNREAD | HVD_DROP_LATEST;
+		if(depth >= 2 * h->drop_depth)
+			policy |= HVD_DROP_NONREF;
+	}
+
+	atomic_store_explicit(&h->drop_active, policy, memory_order_relaxed);
+}
+
+//packets and frames waiting inside the library
+static int hvd_queue_depth(const struct hvd *h)
+{
+	const struct hvd_async *a = &h->async_data;
+	int depth = h->stream.pending_count;
+
+	if(h->async)
+		depth += hvd_ring_count(&a->packets) + hvd_ring_count(&a->decoded) + hvd_ring_count(&a->frames);
+
+	return depth;
+}
+
+void hvd_get_stats(const struct hvd *h, struct hvd_stats *stats)
+{
+	const struct hvd_counters *c = &h->stats;
+	uint64_t first_packet, first_frame, nonref_packets, nonref_frames;
+
+	stats->packets = atomic_load_explicit(&c->packets, memory_order_relaxed);
+	stats->bytes = atomic_load_explicit(&c->bytes, memory_order_relaxed);
+	stats->frames = atomic_load_explicit(&h->pool_frames, memory_order_relaxed);
+	stats->invalid_data = atomic_load_explicit(&c->invalid_data, memory_order_relaxed);
+	stats->io_errors = atomic_load_explicit(&c->io_errors, memory_order_relaxed);
+	stats->again = atomic_load_explicit(&c->again, memory_order_relaxed);
+	stats->flushes = atomic_load_explicit(&c->flushes, memory_order_relaxed);
+	stats->log_suppressed = atomic_load_explicit(&h->log.suppressed, memory_order_relaxed);
+	stats->transfer_bytes = atomic_load_explicit(&c->transfer_bytes, memory_order_relaxed);
+	stats->prebuilt_surfaces = (int)atomic_load_explicit(&c->prebuilt_surfaces, memory_order_relaxed);
+
+	first_packet = atomic_load_explicit(&c->first_packet, memory_order_relaxed);
+	first_frame = atomic_load_explicit(&c->first_frame, memory_order_relaxed);
+
+	stats->init_time = h->init_time;
+	stats->first_frame_time = first_frame ? (int64_t)first_frame - h->init_start : 0;
+	stats->first_frame_latency = first_frame && first_packet ? (int64_t)(first_frame - first_packet) : 0;
+
+	hvd_histogram_read(&c->send, &stats->send);
+	hvd_histogram_read(&c->receive, &stats->receive);
+	hvd_histogram_read(&c->transfer, &stats->transfer);
+	hvd_histogram_read(&c->reconfigure, &stats->reconfigure);
+	stats->reopens = atomic_load_explicit(&c->reopens, memory_order_relaxed);
+
+	nonref_packets = atomic_load_explicit(&c->nonref_packets, memory_order_relaxed);
+	nonref_frames = atomic_load_explicit(&c->nonref_frames, memory_order_relaxed);
+
+	//frames of packets still in decoder are counted until they come out
+	stats->dropped_nonref = nonref_packets > nonref_frames ? nonref_packets - nonref_frames : 0;
+	stats->dropped_unread = atomic_load_explicit(&c->dropped_unread, memory_order_relaxed);
+	stats->dropped_stale = atomic_load_explicit(&c->dropped_stale, memory_order_relaxed);
+	stats->queue_depth = hvd_queue_depth(h);
+	stats->drop_policy = atomic_load_explicit(&h->drop_active, memory_order_relaxed);
+	stats->resyncs = atomic_load_explicit(&c->resyncs, memory_order_relaxed);
+	stats->resync_packets = atomic_load_explicit(&c->resync_packets, memory_order_relaxed);
+	stats->resync_bytes = atomic_load_explicit(&c->resync_bytes, memory_order_relaxed);
+	stats->corrupt_frames = atomic_load_explicit(&c->corrupt_frames, memory_order_relaxed);
+}
+
+void hvd_get_pool_stats(const struct hvd *h, struct hvd_pool_stats *stats)
+{
+	stats->size = h->pool_size;
+	stats->in_use = 0;
+
+	for(int i=0;i<h->pool_size;++i)
+		stats->in_use += atomic_load_explicit(&h->pool[i].in_use, memory_order_relaxed);
+
+	stats->frames = atomic_load_explicit(&h->pool_frames, memory_order_relaxed);
+	stats->allocations = atomic_load_explicit(&h->pool_allocations, memory_order_relaxed);
+}
+
+/* Tracing
+ *
+ * Any thread records events in the ring, claiming event numbers with atomic increment.
+ * Slots are seqlocks, reader skips events overwritten or being written while copied.
+ * Without tracing hvd_trace is only the check of slots pointer.
+ */
+
+static int hvd_trace_init(struct hvd *h, int events)
+{
+	uint64_t capacity = 1;
+
+	while(capacity < (uint64_t)events)
+		capacity <<= 1;
+
+	if( (h->trace.slots = calloc(capacity, sizeof(struct hvd_trace_slot))) == NULL )
+		return HVD_ERROR;
+
+	h->trace.mask = capacity - 1;
+	atomic_init(&h->trace.next, 0);
+
+	return HVD_OK;
+}
+
+static void hvd_trace(struct hvd *h, int type, int thread, const struct hvd_packet_info *info)
+{
+	if(h->trace.slots)
+		hvd_trace_record(h, type, thread, info);
+}
+
+static void hvd_trace_record(struct hvd *h, int type, int thread, const struct hvd_packet_info *info)
+{
+	const uint64_t number = atomic_fetch_add_explicit(&h->trace.next, 1, memory_order_relaxed);
+	struct hvd_trace_slot *slot = &h->trace.slots[number & h->trace.mask];
+
+	atomic_store_explicit(&slot->sequence, 2 * number + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&slot->time, av_gettime_relative(), memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, info->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot->pts, info->pts, memory_order_relaxed);
+	atomic_store_explicit(&slot->tag, info->tag, memory_order_relaxed);
+	atomic_store_explicit(&slot->type, type, memory_order_relaxed);
+	atomic_store_explicit(&slot->thread, thread, memory_order_relaxed);
+
+	atomic_store_explicit(&slot->sequence, 2 * number + 2, memory_order_release);
+}
+
+int hvd_trace_read(const struct hvd *h, struct hvd_trace_event *events, int count)
+{
+	struct hvd_trace_slot *slots = h->trace.slots;
+	uint64_t first, last, sequence;
+	int read = 0;
+
+	if(slots == NULL || count <= 0)
+		return 0;
+
+	//the latest events the ring and array can hold
+	last = atomic_load_explicit(&h->trace.next, memory_order_acquire);
+	first = last > h->trace.mask + 1 ? last - (h->trace.mask + 1) : 0;
+
+	if(last - first > (uint64_t)count)
+		first = last - count;
+
+	for(uint64_t number = first; number < last; ++number)
+	{
+		struct hvd_trace_slot *slot = &slots[number & h->trace.mask];
+		struct hvd_trace_event *event = &events[read];
+
+		if( (sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire)) != 2 * number + 2)
+			continue;
+
+		event->time = atomic_load_explicit(&slot->time, memory_order_relaxed);
+		event->seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+		event->pts = atomic_load_explicit(&slot->pts, memory_order_relaxed);
+		event->tag = atomic_load_explicit(&slot->tag, memory_order_relaxed);
+		event->type = atomic_load_explicit(&slot->type, memory_order_relaxed);
+		event->thread = atomic_load_explicit(&slot->thread, memory_order_relaxed);
+
+		atomic_thread_fence(memory_order_acquire);
+
+		if(atomic_load_explicit(&slot->sequence, memory_order_relaxed) == sequence)
+			++read;
+	}
+
+	return read;
+}
+
+//Chrome trace event format, instant events on threads, transfers as durations
+//and async spans of frames from packet accepted to frame handed to the user
+int hvd_trace_export(const struct hvd *h, const char *path)
+{
+	const char *threads[] = {"user", "decoder", "downloader"};
+	struct hvd_trace_event *events;
+	FILE *file;
+	int count, ret = HVD_OK;
+
+	if(h->trace.slots == NULL)
+		return HVD_ERROR_MSG(h, "tracing is not enabled", NULL);
+
+	if( (events = malloc((h->trace.mask + 1) * sizeof(struct hvd_trace_event))) == NULL )
+		return HVD_ERROR_MSG(h, "not enough memory for trace events", NULL);
+
+	count = hvd_trace_read(h, events, (int)(h->trace.mask + 1));
+
+	if( (file = fopen(path, "w")) == NULL )
+	{
+		free(events);
+		return HVD_ERROR_MSG(h, "unable to open trace file", path);
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for(int i=0;i<HVD_TRACE_DOWNLOADER + 1;++i)
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			i ? ",\n" : "", i, threads[i]);
+
+	for(int i=0;i<count;++i)
+	{
+		const struct hvd_trace_event *e = &events[i];
+		const char *phase = e->type == HVD_TRACE_TRANSFER_START ? "B" : e->type == HVD_TRACE_TRANSFER_END ? "E" : "i";
+		char args[128];
+
+		if(e->pts == AV_NOPTS_VALUE)
+			snprintf(args, sizeof(args), "{\"seq\":%lld,\"tag\":%llu}", (long long)e->seq, (unsigned long long)e->tag);
+		else
+			snprintf(args, sizeof(args), "{\"seq\":%lld,\"pts\":%lld,\"tag\":%llu}",
+				(long long)e->seq, (long long)e->pts, (unsigned long long)e->tag);
+
+		fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"hvd\",\"ph\":\"%s\",%s\"ts\":%lld,\"pid\":1,\"tid\":%d,\"args\":%s}",
+			hvd_trace_name(e->type), phase, phase[0] == 'i' ? "\"s\":\"t\"," : "", (long long)e->time, e->thread, args);
+
+		if(e->seq >= 0 && (e->type == HVD_TRACE_ACCEPT || e->type == HVD_TRACE_OUTPUT))
+			fprintf(file, ",\n{\"name\":\"frame\",\"cat\":\"frame\",\"ph\":\"%s\",\"id\":%lld,\"ts\":%lld,\"pid\":1,\"tid\":%d,\"args\":%s}",
+				e->type == HVD_TRACE_ACCEPT ? "b" : "e", (long long)e->seq, (long long)e->time, e->thread, args);
+	}
+
+	fprintf(file, "\n]}\n");
+
+	if(ferror(file))
+		ret = HVD_ERROR;
+
+	if(fclose(file) != 0)
+		ret = HVD_ERROR;
+
+	free(events);
+
+	return ret == HVD_OK ? HVD_OK : HVD_ERROR_MSG(h, "unable to write trace file", path);
+}
+
+static const char *hvd_trace_name(int type)
+{
+	const char *names[] = {"submit", "accept", "again", "decoded", "transfer", "transfer", "output"};
+
+	return (type >= 0 && type <= HVD_TRACE_OUTPUT) ? names[type] : "unknown";
+}
+
+/* Memory accounting
+ *
+ * Frames are counted on allocation and release of pool data buffers,
+ * packets while queued and then until decoder outputs their frames.
+ * Counters are relaxed atomics updated by the thread owning the memory.
+ * Budget check is approximate with threads, the budget is a soft limit.
+ */
+
+static void hvd_memory_add(atomic_int_fast64_t *bytes, int64_t delta)
+{
+	if(delta)
+		atomic_fetch_add_explicit(bytes, delta, memory_order_relaxed);
+}
+
+static int hvd_memory_over(const struct hvd *h, int64_t bytes)
+{
+	const struct hvd_memory_counters *m = &h->memory;
+
+	if(!m->budget)
+		return 0;
+
+	return atomic_load_explicit(&m->frames, memory_order_relaxed) +
+		atomic_load_explicit(&m->packets, memory_order_relaxed) + bytes > m->budget;
+}
+
+//one frame is always allowed, otherwise decoder couldn't output anything
+static int hvd_memory_frame_fits(const struct hvd *h)
+{
+	const struct hvd_memory_counters *m = &h->memory;
+
+	if(!m->budget || atomic_load_explicit(&m->allocated, memory_order_relaxed) == 0)
+		return 1;
+
+	return !hvd_memory_over(h, atomic_load_explicit(&m->frame_size, memory_order_relaxed));
+}
+
+//after slot frame data changed, only library buffers are counted
+static void hvd_memory_frame(struct hvd *h, struct hvd_frame_slot *slot)
+{
+	struct hvd_memory_counters *m = &h->memory;
+	const int64_t bytes = (h->output == HVD_OUTPUT_TRANSFER && !h->get_buffer) ? hvd_frame_bytes(slot->frame) : 0;
+	int64_t size = atomic_load_explicit(&m->frame_size, memory_order_relaxed);
+
+	if(bytes == slot->bytes)
+		return;
+
+	if(!slot->bytes)
+		atomic_fetch_add_explicit(&m->allocated, 1, memory_order_relaxed);
+	else if(!bytes)
+		atomic_fetch_sub_explicit(&m->allocated, 1, memory_order_relaxed);
+
+	hvd_memory_add(&m->frames, bytes - slot->bytes);
+	slot->bytes = bytes;
+
+	while(bytes > size && !atomic_compare_exchange_weak_explicit(&m->frame_size, &size, bytes,
+		memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+//conversion frames of output thread
+static void hvd_memory_scratch(struct hvd *h)
+{
+	struct hvd_memory_counters *m = &h->memory;
+	const int64_t bytes = hvd_frame_bytes(h->transfer_frame) + hvd_frame_bytes(h->region_frame);
+
+	hvd_memory_add(&m->frames, bytes - m->scratch);
+	m->scratch = bytes;
+}
+
+//after queued packet changed, bytes is what was counted for it
+//library copy buffer is counted whole, referenced user buffer (e.g. file mapping) only for packet data
+static void hvd_memory_packet(struct hvd *h, const AVPacket *packet, int copy, int64_t *bytes)
+{
+	const int64_t size = !packet->buf ? 0 : copy ? packet->buf->size : packet->size;
+
+	hvd_memory_add(&h->memory.packets, size - *bytes);
+	*bytes = size;
+}
+
+//decoder holds its own reference or copy until the frame comes out
+static void hvd_memory_accept(struct hvd *h, const AVPacket *packet)
+{
+	struct hvd_packet_info *entry;
+
+	if(packet->pts < 0)
+		return;
+
+	entry = &h->packet_info[packet->pts % HVD_PACKET_INFO];
+
+	if(entry->seq != packet->pts || entry->size)
+		return;
+
+	entry->size = packet->size;
+	hvd_memory_add(&h->memory.packets, entry->size);
+}
+
+//frames come out in presentation order, packets up to seq are no longer needed
+static void hvd_memory_decoded(struct hvd *h, int64_t seq)
+{
+	struct hvd_memory_counters *m = &h->memory;
+	int64_t first = seq - HVD_PACKET_INFO + 1;
+
+	if(seq <= m->decoded)
+	{
+		hvd_memory_release(h, &h->packet_info[seq % HVD_PACKET_INFO]);
+		return;
+	}
+
+	if(first <= m->decoded)
+		first = m->decoded + 1;
+	if(first < 0)
+		first = 0;
+
+	for(int64_t i=first;i<=seq;++i)
+	{
+		struct hvd_packet_info *entry = &h->packet_info[i % HVD_PACKET_INFO];
+
+		if(entry->seq == i)
+			hvd_memory_release(h, entry);
+	}
+
+	m->decoded = seq;
+}
+
+static void hvd_memory_release(struct hvd *h, struct hvd_packet_info *info)
+{
+	if(!info->size)
+		return;
+
+	hvd_memory_add(&h->memory.packets, -info->size);
+	info->size = 0;
+}
+
+//decoder flushed, closed or reopened
+static void hvd_memory_release_all(struct hvd *h)
+{
+	for(int i=0;i<HVD_PACKET_INFO;++i)
+		hvd_memory_release(h, &h->packet_info[i]);
+
+	h->memory.decoded = -1;
+}
+
+//estimate from hardware frames context, 0 for pools growing on demand
+static void hvd_memory_surfaces(struct hvd *h, const AVBufferRef *hw_frames_ctx)
+{
+	struct hvd_memory_counters *m = &h->memory;
+	int surfaces = 0;
+	int64_t bytes = 0;
+
+	m->surfaces_ctx = hw_frames_ctx ? hw_frames_ctx->data : NULL;
+
+	if(hw_frames_ctx)
+	{
+		const AVHWFramesContext *ctx = (const AVHWFramesContext*)hw_frames_ctx->data;
+		const int size = av_image_get_buffer_size(ctx->sw_format, ctx->width, ctx->height, 1);
+
+		surfaces = ctx->initial_pool_size;
+		bytes = size > 0 ? (int64_t)surfaces * size : 0;
+	}
+
+	atomic_store_explicit(&m->surfaces, surfaces, memory_order_relaxed);
+	atomic_store_explicit(&m->surface_bytes, bytes, memory_order_relaxed);
+}
+
+static int64_t hvd_frame_bytes(const AVFrame *frame)
+{
+	int64_t bytes = 0;
+
+	if(!frame)
+		return 0;
+
+	for(int i=0;i<AV_NUM_DATA_POINTERS;++i)
+		if(frame->buf[i])
+			bytes += frame->buf[i]->size;
+
+	return bytes;
+}
+
+void hvd_get_memory(const struct hvd *h, struct hvd_memory *memory)
+{
+	const struct hvd_memory_counters *m = &h->memory;
+
+	memory->budget = m->budget;
+	memory->frames = atomic_load_explicit(&m->frames, memory_order_relaxed);
+	memory->packets = atomic_load_explicit(&m->packets, memory_order_relaxed);
+	memory->used = memory->frames + memory->packets;
+	memory->frames_allocated = atomic_load_explicit(&m->allocated, memory_order_relaxed);
+	memory->surfaces = atomic_load_explicit(&m->surfaces, memory_order_relaxed);
+	memory->surface_bytes = atomic_load_explicit(&m->surface_bytes, memory_order_relaxed);
+	memory->refused = atomic_load_explicit(&m->refused, memory_order_relaxed);
+}
+
+static struct hvd_frame_slot *hvd_receive_slot(struct hvd *h, int *error)
+{
+	struct hvd_frame_slot *slot;
+	int ret = 0, sent;
+
+	//all the frames are held by the user, don't pull frame from decoder
+	if( (slot = hvd_pool_get(h)) == NULL )
+	{
+		*error = HVD_AGAIN;
+		return NULL;
+	}
+
+	ret = hvd_decode_frame(h, h->hw_frame, &slot->packet);
+
+	//decoder needs more data, it may be waiting from hvd_send_stream
+	while(ret == HVD_AGAIN && h->stream.pending_count && (sent = hvd_stream_drain(h)) != 0)
+		ret = (sent == HVD_ERROR) ? HVD_ERROR : hvd_decode_frame(h, h->hw_frame, &slot->packet);
+
+	if( ret != HVD_OK )
+	{
+		*error = (ret == HVD_AGAIN || ret == AVERROR_EOF) ? HVD_OK : HVD_ERROR;
+		hvd_pool_put(h, slot);
+		return NULL;
+	}
+
+	//only the newest frame decoder has ready is downloaded
+	if(atomic_load_explicit(&h->drop_active, memory_order_relaxed) & (HVD_DROP_UNREAD | HVD_DROP_LATEST))
+		hvd_drop_unread(h, slot);
+
+	// at this point we have a valid frame decoded in hardware
+	// try to supply user frame in the desired output mode
+	ret = hvd_output_frame(h, slot, h->hw_frame);
+
+	//return the surface to the hardware pool as soon as possible
+	//(unless passed or mapped to the user)
+	av_frame_unref(h->hw_frame);
+
+	if(ret != HVD_OK)
+	{
+		*error = HVD_ERROR;
+		hvd_pool_put(h, slot);
+		return NULL;
+	}
+
+	hvd_count(&h->pool_frames, 1);
+	*error = HVD_OK;
+	return slot;
+}
+
+//replaces hw_frame with newer frames already decoded, errors are left for the next call
+static void hvd_drop_unread(struct hvd *h, struct hvd_frame_slot *slot)
+{
+	struct hvd_packet_info info;
+
+	while(hvd_decode_frame(h, h->drop_frame, &info) == HVD_OK)
+	{
+		av_frame_unref(h->hw_frame);
+		av_frame_move_ref(h->hw_frame, h->drop_frame);
+		slot->packet = info;
+		hvd_count(&h->stats.dropped_unread, 1);
+	}
+}
+
+//returns:
+//- HVD_OK with decoded frame
+//- HVD_AGAIN if more data is needed
+//- AVERROR_EOF if decoder was flushed completely
+//- HVD_ERROR on error
+//info of the packet the frame was decoded from is stored in info
+static int hvd_decode_frame(struct hvd *h, AVFrame *frame, struct hvd_packet_info *info)
+{
+	const int64_t start = av_gettime_relative();
+	int ret;
+
+	ret = avcodec_receive_frame(h->decoder_ctx, frame);
+
+	//damaged by missing references or invalid data, not worth the transfer
+	while(ret >= 0 && h->resync && hvd_frame_corrupt(frame))
+	{
+		hvd_count(&h->stats.corrupt_frames, 1);
+		hvd_resync_start(h, "corrupt frame");
+		av_frame_unref(frame);
+
+		ret = avcodec_receive_frame(h->decoder_ctx, frame);
+	}
+
+	//only the calls returning frames, EAGAIN would hide the actual decoding time
+	if(ret >= 0)
+		hvd_histogram_add(&h->stats.receive, av_gettime_relative() - start);
+
+	if ( ret < 0 )
+	{	//EAGAIN - we need to push more data with avcodec_send_packet
+		if(ret == AVERROR(EAGAIN))
+			return HVD_AGAIN;
+
+		//EOF  - the decoder was flushed, no more data
+		//be nice to the user and prepare the decoder for new stream for him
+		//if he wants to continue the decoding (startover)
+		if(ret == AVERROR_EOF)
+		{
+			avcodec_flush_buffers(h->decoder_ctx);
+			hvd_memory_release_all(h);
+			return AVERROR_EOF;
+		}
+
+		//e.g. hardware surfaces exhausted, continue in software from the next keyframe
+		if(!h->software && h->software_fallback && hvd_device_error(h, ret))
+		{
+			if(hvd_software_fallback(h) != HVD_OK)
+				return HVD_ERROR;
+
+			hvd_resync_start(h, "software fallback");
+			return HVD_AGAIN;
+		}
+
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_DECODE, "error while decoding - \"%s\"", av_err2str(ret));
+		return HVD_ERROR;
+	}
+
+	//unless software fallback is enabled we treat software decoding as error
+	if (!h->software && !h->software_fallback && frame->format != h->hw_pix_fmt)
+	{
+		av_frame_unref(frame);
+		return HVD_ERROR_MSG(h, "frame decoded in software (not in hardware)", NULL);
+	}
+
+	hvd_frame_info_read(h, frame, info);
+
+	//decoder may replace surfaces (e.g. stream parameters changed)
+	if(frame->hw_frames_ctx ? (const void*)frame->hw_frames_ctx->data != h->memory.surfaces_ctx : h->memory.surfaces_ctx != NULL)
+		hvd_memory_surfaces(h, frame->hw_frames_ctx);
+
+	return HVD_OK;
+}
+
+//pts carries packet sequence number, unknown if not propagated by decoder or too old
+static void hvd_frame_info_read(struct hvd *h, AVFrame *frame, struct hvd_packet_info *info)
+{
+	const struct hvd_packet_info *packet = NULL;
+
+	if(frame->pts != AV_NOPTS_VALUE && frame->pts >= 0)
+		packet = &h->packet_info[frame->pts % HVD_PACKET_INFO];
+
+	if(packet && packet->seq == frame->pts)
+		*info = *packet;
+	else
+	{
+		info->seq = -1;
+		info->pts = AV_NOPTS_VALUE;
+		info->tag = 0;
+	}
+
+	if(info->seq >= 0 && info->skip)
+		hvd_count(&h->stats.nonref_frames, 1);
+
+	if(info->seq >= 0)
+		hvd_memory_decoded(h, info->seq);
+
+	hvd_trace(h, HVD_TRACE_DECODED, h->async ? HVD_TRACE_DECODER : HVD_TRACE_USER, info);
+
+	//don't leak the sequence number to the user
+	frame->pts = AV_NOPTS_VALUE;
+}
+
+static int hvd_frame_corrupt(const AVFrame *frame)
+{
+	return (frame->flags & AV_FRAME_FLAG_CORRUPT) || frame->decode_error_flags;
+}
+
+//called by decoding thread
+static void hvd_resync_start(struct hvd *h, const char *reason)
+{
+	if(h->resync_wait)
+		return;
+
+	h->resync_wait = 1;
+	hvd_count(&h->stats.resyncs, 1);
+	hvd_log(h, HVD_LOG_DEBUG, HVD_LOG_DECODE, "%s, waiting for keyframe", reason);
+}
+
+//non zero if packet should be decoded, the decoder starts clean from keyframe
+static int hvd_resync_keyframe(struct hvd *h, const AVPacket *packet)
+{
+	const int key = hvd_keyframe(h->decoder_ctx->codec_id, packet->data, packet->size);
+
+	//e.g. parameter sets sent separately, decoder needs them for keyframe
+	if(key < 0)
+		return 1;
+
+	if(key == 0)
+		return 0;
+
+	avcodec_flush_buffers(h->decoder_ctx);
+	h->resync_wait = 0;
+	hvd_log(h, HVD_LOG_DEBUG, HVD_LOG_DECODE, "resynchronized at keyframe");
+
+	return 1;
+}
+
+/* Keyframe inspection
+ *
+ * Only the headers are read (NAL unit headers, VP8/VP9 frame header, AV1 OBU headers),
+ * nothing is decoded. Returns 1 for keyframe, 0 for other picture and -1 if packet
+ * has no picture (e.g. parameter sets only) or can't be told (e.g. H.264 in avcC).
+ * Codecs without inspection have every packet treated as keyframe.
+ */
+
+static int hvd_keyframe(enum AVCodecID codec, const uint8_t *data, int size)
+{
+	switch(codec)
+	{
+		case AV_CODEC_ID_H264:
+			return hvd_keyframe_nal(data, size, 0);
+		case AV_CODEC_ID_HEVC:
+			return hvd_keyframe_nal(data, size, 1);
+		case AV_CODEC_ID_VP8:
+			//frame tag, inverted key frame flag in the lowest bit
+			return size < 3 ? -1 : !(data[0] & 1);
+		case AV_CODEC_ID_VP9:
+			return hvd_keyframe_vp9(data, size);
+#ifdef HVD_AV1
+		case AV_CODEC_ID_AV1:
+			return hvd_keyframe_av1(data, size);
+#endif
+		default:
+			return 1;
+	}
+}
+
+//Annex B byte stream, IDR or recovery point SEI (H.264) and IRAP - IDR, CRA, BLA (HEVC)
+static int hvd_keyframe_nal(const uint8_t *data, int size, int hevc)
+{
+	int key = -1;
+
+	for(int i=0; i + 4 < size; ++i)
+	{
+		if(data[i] != 0 || data[i+1] != 0 || data[i+2] != 1)
+			continue;
+
+		i += 3;
+
+		if(hevc)
+		{
+			const int type = (data[i] >> 1) & 0x3F;
+
+			if(type >= 16 && type <= 23)
+				return 1;
+			if(type < 32) //VCL
+				key = 0;
+
+			continue;
+		}
+
+		const int type = data[i] & 0x1F;
+
+		//the first payload type of SEI, 6 is recovery point (e.g. intra refresh)
+		if(type == 5 || (type == 6 && data[i+1] == 6))
+			return 1;
+		if(type >= 1 && type <= 4)
+			key = 0;
+	}
+
+	return key;
+}
+
+//uncompressed header, the first frame of superframe is at the start
+static int hvd_keyframe_vp9(const uint8_t *data, int size)
+{
+	int bit = 2;
+
+	if(size < 1 || (data[0] >> 6) != 2) //frame marker
+		return -1;
+
+	const int profile = ((data[0] >> 5) & 1) | (((data[0] >> 4) & 1) << 1);
+
+	bit += 2 + (profile == 3); //profile and reserved zero bit
+
+	//show existing frame, nothing is decoded
+	if((data[0] >> (7 - bit)) & 1)
+		return 0;
+
+	//frame type, 0 for key frame
+	return !((data[0] >> (6 - bit)) & 1);
+}
+
+#ifdef HVD_AV1
+//temporal unit of OBUs, key frame in frame header or frame OBU
+static int hvd_keyframe_av1(const uint8_t *data, int size)
+{
+	int i = 0;
+
+	while(i < size)
+	{
+		const int type = (data[i] >> 3) & 0x0F;
+		const int extension = (data[i] >> 2) & 1;
+		const int has_size = (data[i] >> 1) & 1;
+		int64_t obu_size = 0;
+
+		i += 1 + extension;
+
+		//leb128 size, without it the OBU spans the rest of data
+		if(has_size)
+			for(int byte=0, shift=0; byte < 8 && i < size; ++byte, shift += 7)
+			{
+				obu_size |= (int64_t)(data[i] & 0x7F) << shift;
+
+				if( !(data[i++] & 0x80) )
+					break;
+			}
+		else
+			obu_size = size - i;
+
+		if(i >= size)
+			break;
+
+		//frame header or frame, show existing frame and frame type bits (not reduced still picture)
+		if(type == 3 || type == 6)
+			return (data[i] & 0x80) ? 0 : ((data[i] >> 5) & 3) == 0;
+
+		if(obu_size >= size - i)
+			break;
+
+		i += (int)obu_size;
+	}
+
+	return -1;
+}
+#endif
+
+/* Asynchronous pipeline
+ *
+ * user thread -> packets -> decode thread -> decoded -> download thread -> frames -> user thread
+ *
+ * Each queue is single producer, single consumer lock-free ring.
+ * Workers sleep on condition variables only when they have nothing to do.
+ * The user is never blocked, instead gets HVD_AGAIN and may poll event_fd.
+ */
+
+static int hvd_async_init(struct hvd *h, int depth)
+{
+	struct hvd_async *a = &h->async_data;
+
+	a->created = 1;
+	a->packet_count = depth;
+	//in low latency mode single surface waits for download at most
+	a->decoded_count = h->low_latency ? 1 : HVD_ASYNC_DECODED;
+	a->frame_count = h->pool_size + HVD_ASYNC_MARKERS;
+	a->event_fd = -1;
+
+	hvd_ring_init(&a->packets, a->packet_count);
+	hvd_ring_init(&a->decoded, a->decoded_count);
+	hvd_ring_init(&a->frames, a->frame_count);
+
+	if( (a->packet = (struct hvd_async_packet*)calloc(a->packet_count, sizeof(struct hvd_async_packet)) ) == NULL ||
+		(a->decode = (struct hvd_async_entry*)calloc(a->decoded_count, sizeof(struct hvd_async_entry)) ) == NULL ||
+		(a->frame = (struct hvd_async_entry*)calloc(a->frame_count, sizeof(struct hvd_async_entry)) ) == NULL )
+		return HVD_ERROR_MSG(h, "not enough memory for async queues", NULL);
+
+	for(int i=0;i<a->packet_count;++i)
+		av_init_packet(&a->packet[i].packet);
+
+	for(int i=0;i<a->decoded_count;++i)
+		if( !(a->decode[i].frame = av_frame_alloc()) )
+			return HVD_ERROR_MSG(h, "unable to av_frame_alloc frame", NULL);
+
+#ifdef __linux__
+	if( (a->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 )
+		return HVD_ERROR_MSG(h, "unable to create eventfd", NULL);
+#endif
+
+	if(hvd_waiter_init(&a->decode_waiter) != HVD_OK || hvd_waiter_init(&a->download_waiter) != HVD_OK)
+		return HVD_ERROR_MSG(h, "unable to initialize async synchronization", NULL);
+
+	if(hvd_async_start(h) != HVD_OK)
+		return HVD_ERROR;
+
+	h->async = 1;
+
+	return HVD_OK;
+}
+
+static int hvd_async_start(struct hvd *h)
+{
+	struct hvd_async *a = &h->async_data;
+
+	atomic_store(&a->stop, 0);
+
+	if(pthread_create(&a->decode_thread, NULL, hvd_async_decode_thread, h) != 0)
+		return HVD_ERROR_MSG(h, "unable to create decode thread", NULL);
+
+	a->decode_thread_running = 1;
+
+	if(pthread_create(&a->download_thread, NULL, hvd_async_download_thread, h) != 0)
+		return HVD_ERROR_MSG(h, "unable to create download thread", NULL);
+
+	a->download_thread_running = 1;
+
+	return HVD_OK;
+}
+
+static void hvd_async_stop(struct hvd *h)
+{
+	struct hvd_async *a = &h->async_data;
+
+	atomic_store(&a->stop, 1);
+
+	if(a->decode_thread_running)
+	{
+		hvd_waiter_wake_always(&a->decode_waiter);
+		pthread_join(a->decode_thread, NULL);
+		a->decode_thread_running = 0;
+	}
+
+	if(a->download_thread_running)
+	{
+		hvd_waiter_wake_always(&a->download_waiter);
+		pthread_join(a->download_thread, NULL);
+		a->download_thread_running = 0;
+	}
+}
+
+//with threads stopped, drops everything in the queues, frames not returned yet go back to the pool
+static void hvd_async_reset(struct hvd *h)
+{
+	struct hvd_async *a = &h->async_data;
+	int index;
+
+	while( (index = hvd_ring_readable(&a->packets)) >= 0 )
+	{	//user data may be referenced, release it now
+		av_packet_unref(&a->packet[index].packet);
+		hvd_memory_packet(h, &a->packet[index].packet, 0, &a->packet[index].bytes);
+		hvd_ring_pop(&a->packets);
+	}
+
+	while( (index = hvd_ring_readable(&a->decoded)) >= 0 )
+	{
+		av_frame_unref(a->decode[index].frame);
+		hvd_ring_pop(&a->decoded);
+	}
+
+	while( (index = hvd_ring_readable(&a->frames)) >= 0 )
+	{
+		if(a->frame[index].slot)
+			hvd_pool_put(h, a->frame[index].slot);
+		hvd_ring_pop(&a->frames);
+	}
+
+	atomic_store(&a->error, 0);
+	hvd_async_clear_event(a);
+}
+
+static void hvd_async_close(struct hvd *h)
+{
+	struct hvd_async *a = &h->async_data;
+
+	if(!a->created)
+		return;
+
+	hvd_async_stop(h);
+
+	if(a->packet)
+		for(int i=0;i<a->packet_count;++i)
+			av_packet_unref(&a->packet[i].packet);
+
+	if(a->decode)
+		for(int i=0;i<a->decoded_count;++i)
+			av_frame_free(&a->decode[i].frame);
+
+	free(a->packet);
+	free(a->decode);
+	free(a->frame);
+	a->packet = NULL;
+	a->decode = a->frame = NULL;
+
+	hvd_waiter_close(&a->decode_waiter);
+	hvd_waiter_close(&a->download_waiter);
+
+#ifdef __linux__
+	if(a->event_fd != -1)
+		close(a->event_fd);
+#endif
+	a->event_fd = -1;
+}
+
+int hvd_get_event_fd(const struct hvd *h)
+{
+	return h->async ? h->async_data.event_fd : -1;
+}
+
+//the data is copied, user may reuse the buffer after the call
+static int hvd_async_send_packet(struct hvd *h, AVPacket *packet, int64_t pts, uint64_t tag)
+{
+	struct hvd_async *a = &h->async_data;
+	struct hvd_async_packet *entry;
+	int index;
+
+	if(atomic_load_explicit(&a->error, memory_order_relaxed))
+		return HVD_ERROR;
+
+	//over memory budget the queue shrinks to what decoding thread drains, at least one packet
+	if( (index = hvd_ring_writable(&a->packets)) >= 0 && packet->data &&
+		hvd_ring_count(&a->packets) && hvd_memory_over(h, packet->size) )
+	{
+		hvd_count(&h->memory.refused, 1);
+		index = -1;
+	}
+
+	if(index < 0)
+	{
+		struct hvd_packet_info info = {h->packet_seq, av_gettime_relative(), pts, tag, 0, 0};
+
+		hvd_count(&h->stats.again, 1);
+		hvd_trace(h, HVD_TRACE_AGAIN, HVD_TRACE_USER, &info);
+		return HVD_AGAIN;
+	}
+
+	entry = &a->packet[index];
+
+	entry->flush = (packet->data == NULL);
+	entry->referenced = !entry->flush && packet->buf;
+
+	if(entry->referenced)
+	{	//refcounted data is referenced (no copy)
+		av_packet_unref(&entry->packet);
+		hvd_memory_packet(h, &entry->packet, 0, &entry->bytes);
+
+		if(av_packet_ref(&entry->packet, packet) < 0)
+			return HVD_ERROR_MSG(h, "unable to reference packet", NULL);
+	}
+	else if(!entry->flush && hvd_packet_copy(h, &entry->packet, packet->data, packet->size) != HVD_OK)
+		return HVD_ERROR;
+
+	//flush keeps the buffer of the entry as it was
+	if(!entry->flush)
+		hvd_memory_packet(h, &entry->packet, !entry->referenced, &entry->bytes);
+
+	if(!entry->flush)
+	{
+		entry->info.seq = h->packet_seq++;
+		entry->info.sent = av_gettime_relative();
+		entry->info.pts = pts;
+		entry->info.tag = tag;
+		entry->info.skip = 0;
+
+		hvd_trace(h, HVD_TRACE_SUBMIT, HVD_TRACE_USER, &entry->info);
+	}
+
+	hvd_ring_push(&a->packets);
+	hvd_waiter_wake(&a->decode_waiter);
+
+	return HVD_OK;
+}
+
+//copy to reusable refcounted buffer so that libavcodec references instead of copying again
+static int hvd_packet_copy(struct hvd *h, AVPacket *packet, const uint8_t *data, int size)
+{
+	if(packet->buf == NULL || packet->buf->size < size + AV_INPUT_BUFFER_PADDING_SIZE || !av_buffer_is_writable(packet->buf))
+	{
+		av_buffer_unref(&packet->buf);
+
+		if( (packet->buf = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE)) == NULL)
+			return HVD_ERROR_MSG(h, "not enough memory for packet", NULL);
+	}
+
+	memcpy(packet->buf->data, data, size);
+	memset(packet->buf->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+	packet->data = packet->buf->data;
+	packet->size = size;
+
+	return HVD_OK;
+}
+
+//non-blocking, NULL and error HVD_AGAIN if no frame is ready yet
+static struct hvd_frame_slot *hvd_async_receive_slot(struct hvd *h, int *error)
+{
+	struct hvd_async *a = &h->async_data;
+	struct hvd_frame_slot *slot;
+	int index;
+
+	if( (index = hvd_ring_readable(&a->frames)) < 0 )
+	{	//clear notification before checking again, otherwise we could miss one
+		hvd_async_clear_event(a);
+
+		if( (index = hvd_ring_readable(&a->frames)) < 0 )
+		{
+			*error = HVD_AGAIN;
+			return NULL;
+		}
+	}
+
+	//stale frames go back to the pool, markers (flushed, error) are never skipped
+	while(a->frame[index].slot && hvd_async_superseded(&a->frames, a->frame) &&
+		(atomic_load_explicit(&h->drop_active, memory_order_relaxed) & HVD_DROP_LATEST))
+	{
+		hvd_pool_put(h, a->frame[index].slot);
+		hvd_count(&h->stats.dropped_stale, 1);
+		hvd_ring_pop(&a->frames);
+		index = hvd_ring_readable(&a->frames);
+	}
+
+	slot = a->frame[index].slot;
+	//frame, flushed completely or error
+	*error = slot ? HVD_OK : (a->frame[index].status == AVERROR_EOF ? HVD_OK : HVD_ERROR);
+
+	hvd_ring_pop(&a->frames);
+	hvd_waiter_wake(&a->download_waiter);
+
+	return slot;
+}
+
+//decoded frame at index (the oldest) won't be downloaded (HVD_DROP_UNREAD, HVD_DROP_LATEST)
+static int hvd_async_unread(struct hvd *h, int index)
+{
+	struct hvd_async *a = &h->async_data;
+
+	return a->decode[index].status == HVD_OK && hvd_async_superseded(&a->decoded, a->decode) &&
+		(atomic_load_explicit(&h->drop_active, memory_order_relaxed) & (HVD_DROP_UNREAD | HVD_DROP_LATEST));
+}
+
+//the oldest entry of ring is followed by newer frame (consumer side)
+static int hvd_async_superseded(struct hvd_ring *ring, const struct hvd_async_entry *entries)
+{
+	const int next = hvd_ring_peek(ring, 1);
+
+	return next >= 0 && entries[next].status == HVD_OK;
+}
+
+static void *hvd_async_decode_thread(void *arg)
+{
+	struct hvd *h = (struct hvd*)arg;
+	struct hvd_async *a = &h->async_data;
+	struct hvd_async_packet *entry;
+	int index, ret;
+
+	while( (index = hvd_async_wait_readable(h, &a->packets, &a->decode_waiter)) >= 0 )
+	{
+		entry = &a->packet[index];
+
+		if(entry->flush)
+		{
+			entry->packet.data = NULL;
+			entry->packet.size = 0;
+		}
+		else
+			hvd_packet_stamp(h, &entry->packet, &entry->info);
+
+		//EAGAIN - pull decoded frames before decoder accepts more data
+		while( (ret = hvd_decode_packet(h, &entry->packet)) == HVD_AGAIN )
+			if(hvd_async_decode_frames(h) == HVD_ERROR)
+				break;
+
+		if(ret == HVD_AGAIN)
+			;//receive error (marker already passed) or stopped, the packet is dropped, decoding continues as in sync mode
+		else if(ret == HVD_ERROR)
+		{	//fatal, the user gets HVD_ERROR from hvd_send_packet and the marker in frames
+			atomic_store(&a->error, 1);
+			hvd_async_push_marker(h, HVD_ERROR);
+		}
+		else
+			hvd_async_decode_frames(h);
+
+		//user data is released as soon as possible, over memory budget copy buffers too
+		if(entry->referenced || (entry->bytes && hvd_memory_over(h, 0)))
+		{
+			av_packet_unref(&entry->packet);
+			hvd_memory_packet(h, &entry->packet, 0, &entry->bytes);
+		}
+
+		hvd_ring_pop(&a->packets);
+	}
+
+	return NULL;
+}
+
+//pull all frames available from decoder, returns:
+//- HVD_OK if more data is needed
+//- AVERROR_EOF if flushed (marker passed to the user)
+//- HVD_ERROR on error (marker passed to the user) or if stopped
+static int hvd_async_decode_frames(struct hvd *h)
+{
+	struct hvd_async *a = &h->async_data;
+	int index, ret;
+
+	for(;;)
+	{
+		if( (index = hvd_async_wait_writable(h, &a->decoded, &a->decode_waiter)) < 0)
+			return HVD_ERROR;
+
+		ret = hvd_decode_frame(h, a->decode[index].frame, &a->decode[index].packet);
+
+		if(ret == HVD_AGAIN)
+			return HVD_OK;
+
+		a->decode[index].status = ret;
+		hvd_ring_push(&a->decoded);
+		hvd_waiter_wake(&a->download_waiter);
+
+		if(ret != HVD_OK)
+			return ret;
+	}
+}
+
+//marker without frame, blocks until there is space or stopped
+static void hvd_async_push_marker(struct hvd *h, int status)
+{
+	struct hvd_async *a = &h->async_data;
+	int index;
+
+	if( (index = hvd_async_wait_writable(h, &a->decoded, &a->decode_waiter)) < 0)
+		return;
+
+	a->decode[index].status = status;
+	hvd_ring_push(&a->decoded);
+	hvd_waiter_wake(&a->download_waiter);
+}
+
+static void *hvd_async_download_thread(void *arg)
+{
+	struct hvd *h = (struct hvd*)arg;
+	struct hvd_async *a = &h->async_data;
+	struct hvd_async_entry *decoded, *out;
+	int index;
+
+	while( (index = hvd_async_wait_download(h)) >= 0 )
+	{
+		decoded = &a->decode[index];
+
+		if(hvd_async_unread(h, index))
+		{	//newer frame is already decoded, this one would never be read
+			av_frame_unref(decoded->frame);
+			hvd_count(&h->stats.dropped_unread, 1);
+			hvd_ring_pop(&a->decoded);
+			hvd_waiter_wake(&a->decode_waiter);
+			continue;
+		}
+
+		out = &a->frame[hvd_ring_writable(&a->frames)];
+
+		out->slot = NULL;
+		out->status = decoded->status;
+
+		if(decoded->status == HVD_OK)
+		{
+			out->slot = hvd_pool_get(h);
+			out->slot->packet = decoded->packet;
+
+			if(hvd_output_frame(h, out->slot, decoded->frame) == HVD_OK)
+				hvd_count(&h->pool_frames, 1);
+			else
+			{
+				hvd_pool_put(h, out->slot);
+				out->slot = NULL;
+				out->status = HVD_ERROR;
+			}
+
+			av_frame_unref(decoded->frame);
+		}
+
+		hvd_ring_pop(&a->decoded);
+		hvd_waiter_wake(&a->decode_waiter);
+
+		hvd_ring_push(&a->frames);
+		hvd_async_notify(a);
+	}
+
+	return NULL;
+}
+
+//returns index of readable decoded entry when it can be processed, -1 if stopped
+static int hvd_async_wait_download(struct hvd *h)
+{
+	struct hvd_async *a = &h->async_data;
+	int index;
+
+	hvd_waiter_lock(&a->download_waiter);
+
+	while( (index = hvd_async_download_ready(h)) < 0 && !atomic_load(&a->stop) )
+		hvd_waiter_wait(&a->download_waiter);
+
+	hvd_waiter_unlock(&a->download_waiter);
+
+	return atomic_load(&a->stop) ? -1 : index;
+}
+
+//decoded entry is available, output ring has space and for frame there is free frame in the pool
+static int hvd_async_download_ready(struct hvd *h)
+{
+	struct hvd_async *a = &h->async_data;
+	int index;
+
+	if( (index = hvd_ring_readable(&a->decoded)) < 0 )
+		return -1;
+
+	//dropped without output, doesn't wait for space
+	if(hvd_async_unread(h, index))
+		return index;
+
+	if(hvd_ring_writable(&a->frames) < 0)
+		return -1;
+
+	if(a->decode[index].status == HVD_OK && !hvd_pool_available(h))
+		return -1;
+
+	return index;
+}
+
+//blocks until readable, returns index or -1 if stopped
+static int hvd_async_wait_readable(struct hvd *h, struct hvd_ring *ring, struct hvd_waiter *w)
+{
+	struct hvd_async *a = &h->async_data;
+	int index;
+
+	if( (index = hvd_ring_readable(ring)) >= 0 )
+		return index;
+
+	hvd_waiter_lock(w);
+
+	while( (index = hvd_ring_readable(ring)) < 0 && !atomic_load(&a->stop) )
+		hvd_waiter_wait(w);
+
+	hvd_waiter_unlock(w);
+
+	return atomic_load(&a->stop) ? -1 : index;
+}
+
+//blocks until writable, returns index or -1 if stopped
+static int hvd_async_wait_writable(struct hvd *h, struct hvd_ring *ring, struct hvd_waiter *w)
+{
+	struct hvd_async *a = &h->async_data;
+	int index;
+
+	if( (index = hvd_ring_writable(ring)) >= 0 )
+		return index;
+
+	hvd_waiter_lock(w);
+
+	while( (index = hvd_ring_writable(ring)) < 0 && !atomic_load(&a->stop) )
+		hvd_waiter_wait(w);
+
+	hvd_waiter_unlock(w);
+
+	return atomic_load(&a->stop) ? -1 : index;
+}
+
+static void hvd_async_notify(struct hvd_async *a)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+
+	//counter overflow is impossible in practice, nothing to do on failure
+	if(write(a->event_fd, &one, sizeof(one)) < 0)
+		return;
+#else
+	(void)a;
+#endif
+}
+
+static void hvd_async_clear_event(struct hvd_async *a)
+{
+#ifdef __linux__
+	uint64_t value;
+
+	//EAGAIN - already cleared
+	if(read(a->event_fd, &value, sizeof(value)) < 0)
+		return;
+#else
+	(void)a;
+#endif
+}
+
+/* Single producer, single consumer lock-free ring of indexes.
+ * The producer writes to entry from hvd_ring_writable and publishes it with hvd_ring_push.
+ * The consumer reads entry from hvd_ring_readable and returns it with hvd_ring_pop.
+ */
+
+static void hvd_ring_init(struct hvd_ring *r, unsigned capacity)
+{
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	r->capacity = capacity;
+}
+
+static int hvd_ring_writable(struct hvd_ring *r)
+{
+	unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	return (tail - head < r->capacity) ? (int)(tail % r->capacity) : -1;
+}
+
+static void hvd_ring_push(struct hvd_ring *r)
+{
+	atomic_fetch_add_explicit(&r->tail, 1, memory_order_release);
+}
+
+static int hvd_ring_readable(struct hvd_ring *r)
+{
+	unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	return (head != tail) ? (int)(head % r->capacity) : -1;
+}
+
+static void hvd_ring_pop(struct hvd_ring *r)
+{
+	atomic_fetch_add_explicit(&r->head, 1, memory_order_release);
+}
+
+//consumer looking n entries past the oldest, -1 if not there
+static int hvd_ring_peek(struct hvd_ring *r, unsigned n)
+{
+	unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	return (tail - head > n) ? (int)((head + n) % r->capacity) : -1;
+}
+
+//approximate unless called by producer or consumer
+static unsigned hvd_ring_count(const struct hvd_ring *r)
+{
+	unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	return tail - head;
+}
+
+/* Sleeping worker wakeup
+ * The waker takes the mutex only when the worker is sleeping (or about to sleep).
+ * Fences guarantee that either waker sees sleeping flag or sleeper sees published data.
+ */
+
+static int hvd_waiter_init(struct hvd_waiter *w)
+{
+	atomic_init(&w->sleeping, 0);
+
+	if(pthread_mutex_init(&w->mutex, NULL) != 0)
+		return HVD_ERROR;
+
+	if(pthread_cond_init(&w->cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&w->mutex);
+		return HVD_ERROR;
+	}
+
+	w->initialized = 1;
+	return HVD_OK;
+}
+
+static void hvd_waiter_close(struct hvd_waiter *w)
+{
+	if(!w->initialized)
+		return;
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->mutex);
+	w->initialized = 0;
+}
+
+static void hvd_waiter_lock(struct hvd_waiter *w)
+{
+	pthread_mutex_lock(&w->mutex);
+	atomic_store(&w->sleeping, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void hvd_waiter_wait(struct hvd_waiter *w)
+{
+	pthread_cond_wait(&w->cond, &w->mutex);
+}
+
+static void hvd_waiter_unlock(struct hvd_waiter *w)
+{
+	atomic_store(&w->sleeping, 0);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static void hvd_waiter_wake(struct hvd_waiter *w)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if(atomic_load_explicit(&w->sleeping, memory_order_relaxed))
+		hvd_waiter_wake_always(w);
+}
+
+static void hvd_waiter_wake_always(struct hvd_waiter *w)
+{
+	if(!w->initialized)
+		return;
+
+	pthread_mutex_lock(&w->mutex);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static int hvd_output_frame(struct hvd *h, struct hvd_frame_slot *slot, AVFrame *hw_frame)
+{
+	const int thread = h->async ? HVD_TRACE_DOWNLOADER : HVD_TRACE_USER;
+	int64_t start;
+	int ret;
+
+	hvd_trace(h, HVD_TRACE_TRANSFER_START, thread, &slot->packet);
+
+	start = av_gettime_relative();
+	ret = hvd_output_data(h, slot->frame, hw_frame);
+
+	hvd_histogram_add(&h->stats.transfer, av_gettime_relative() - start);
+
+	//data buffers may be allocated or replaced by output
+	hvd_memory_frame(h, slot);
+	hvd_memory_scratch(h);
+
+	hvd_trace(h, HVD_TRACE_TRANSFER_END, thread, &slot->packet);
+
+	//the user gets back pts of hvd_packet (e.g. published by hvd_shm_publish)
+	slot->frame->pts = slot->packet.pts;
+
+	return ret;
+}
+
+//the software decoder frames are already in system memory, for them:
+//- transfer is a copy (like download from hardware)
+//- hardware passthrough and mapping are references (no copy)
+static int hvd_output_data(struct hvd *h, AVFrame *frame, AVFrame *hw_frame)
+{
+	const int software = (hw_frame->hw_frames_ctx == NULL);
+	struct hvd_region region;
+	int ret;
+
+	if(h->output == HVD_OUTPUT_TRANSFER)
+	{
+		if(hvd_region_get(h, &region))
+			return software ? hvd_region_copy(h, frame, hw_frame, &region, &h->stats.transfer_bytes) :
+				hvd_transfer_region(h, frame, hw_frame, &region);
+
+		if(!software)
+			return hvd_transfer_data(h, frame, hw_frame);
+
+		if( (ret = hvd_copy_data(h, frame, hw_frame) ) == HVD_OK)
+			hvd_count(&h->stats.transfer_bytes, av_image_get_buffer_size(hw_frame->format, hw_frame->width, hw_frame->height, 1));
+
+		return ret;
+	}
+
+	if(h->output == HVD_OUTPUT_HARDWARE)
+	{
+		av_frame_move_ref(frame, hw_frame);
+		return HVD_OK;
+	}
+
+	if(software)
+	{
+		av_frame_move_ref(frame, hw_frame);
+		return hvd_region_get(h, &region) ? hvd_region_crop(h, frame, &region) : HVD_OK;
+	}
+
+	//HVD_OUTPUT_MAP, the mapping keeps reference to hardware surface until unmapped
+	frame->format = h->sw_pix_fmt;
+
+	if( (ret = av_hwframe_map(frame, hw_frame, AV_HWFRAME_MAP_READ) ) < 0)
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "unable to map frame to system memory - \"%s\"", av_err2str(ret));
+		hvd_dump_sw_pix_formats(h, hw_frame);
+		av_frame_unref(frame);
+		return HVD_ERROR;
+	}
+
+	return hvd_region_get(h, &region) ? hvd_region_crop(h, frame, &region) : HVD_OK;
+}
+
+//reuse data buffers from the last transfer if still matching and not referenced by the user
+static int hvd_frame_reusable(AVFrame *frame, int format, int width, int height)
+{
+	return frame->buf[0] != NULL && frame->format == format && frame->width == width &&
+		frame->height == height && av_frame_is_writable(frame);
+}
+
+//frame data in user memory, frame has format, width and height set
+static int hvd_frame_user_buffer(struct hvd *h, AVFrame *frame)
+{
+	const int ret = h->get_buffer(h->get_buffer_opaque, frame);
+
+	if(ret < 0 || frame->buf[0] == NULL || frame->data[0] == NULL)
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "get_buffer failed to provide %s %dx%d frame data",
+			av_get_pix_fmt_name(frame->format), frame->width, frame->height);
+		av_frame_unref(frame);
+		return HVD_ERROR;
+	}
+
+	return HVD_OK;
+}
+
+//frame data for the format and size, reused if possible, in user memory if allowed and configured
+static int hvd_frame_get_data(struct hvd *h, AVFrame *frame, enum AVPixelFormat format, int width, int height, int user)
+{
+	int ret;
+
+	if( !(user && h->get_buffer) && hvd_frame_reusable(frame, format, width, height) )
+		return HVD_OK;
+
+	av_frame_unref(frame);
+	frame->format = format;
+	frame->width = width;
+	frame->height = height;
+
+	if(user && h->get_buffer)
+		return hvd_frame_user_buffer(h, frame);
+
+	if( (ret = av_frame_get_buffer(frame, 32) ) < 0)
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "unable to allocate frame data - \"%s\"", av_err2str(ret));
+		return HVD_ERROR;
+	}
+
+	hvd_count(&h->pool_allocations, 1);
+
+	return HVD_OK;
+}
+
+static int hvd_region_valid(const struct hvd_region *region)
+{
+	return region->x >= 0 && region->y >= 0 && region->width >= 0 && region->height >= 0 &&
+		region->scale_width >= 0 && region->scale_height >= 0;
+}
+
+//copy of the region, changed concurrently by the user, non-zero if any of region fields is set
+static int hvd_region_get(struct hvd *h, struct hvd_region *region)
+{
+	pthread_mutex_lock(&h->region_mutex);
+	*region = h->region;
+	pthread_mutex_unlock(&h->region_mutex);
+
+	return region->x || region->y || region->width || region->height || region->scale_width || region->scale_height;
+}
+
+//planar or packed without chroma subsampling, byte aligned components
+static int hvd_region_supported(enum AVPixelFormat format)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+
+	if(desc == NULL || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)))
+		return 0;
+
+	return (desc->flags & (AV_PIX_FMT_FLAG_PLANAR | AV_PIX_FMT_FLAG_RGB)) || desc->log2_chroma_w == 0;
+}
+
+//region clamped to the frame and aligned to chroma subsampling, all fields set
+static void hvd_region_rect(const struct hvd_region *region, const AVFrame *frame, struct hvd_region *rect)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	const int rgb = (desc->flags & AV_PIX_FMT_FLAG_RGB) != 0;
+	const int align_w = rgb ? 1 : 1 << desc->log2_chroma_w;
+	const int align_h = rgb ? 1 : 1 << desc->log2_chroma_h;
+
+	rect->x = FFMIN(region->x, frame->width - 1) & ~(align_w - 1);
+	rect->y = FFMIN(region->y, frame->height - 1) & ~(align_h - 1);
+
+	//the region is extended to the aligned start, then rounded up to alignment within the frame
+	rect->width = region->width ? region->width + (region->x - rect->x) : frame->width;
+	rect->height = region->height ? region->height + (region->y - rect->y) : frame->height;
+	rect->width = FFMIN(FFALIGN(rect->width, align_w), frame->width - rect->x);
+	rect->height = FFMIN(FFALIGN(rect->height, align_h), frame->height - rect->y);
+
+	rect->scale_width = region->scale_width;
+	rect->scale_height = region->scale_height;
+
+	//keep the aspect ratio if only one of dimensions is set
+	if(!rect->scale_width && !rect->scale_height)
+	{
+		rect->scale_width = rect->width;
+		rect->scale_height = rect->height;
+	}
+	else if(!rect->scale_width)
+		rect->scale_width = (int)((int64_t)rect->width * rect->scale_height / rect->height);
+	else if(!rect->scale_height)
+		rect->scale_height = (int)((int64_t)rect->height * rect->scale_width / rect->width);
+
+	if(rect->scale_width != rect->width)
+		rect->scale_width = FFMAX(rect->scale_width & ~(align_w - 1), align_w);
+	if(rect->scale_height != rect->height)
+		rect->scale_height = FFMAX(rect->scale_height & ~(align_h - 1), align_h);
+}
+
+//region without copy, data pointers adjusted, output size ignored
+static int hvd_region_crop(struct hvd *h, AVFrame *frame, const struct hvd_region *region)
+{
+	struct hvd_region rect;
+	int ret;
+
+	if(!hvd_region_supported(frame->format))
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "region not supported for %s", av_get_pix_fmt_name(frame->format));
+		av_frame_unref(frame);
+		return HVD_ERROR;
+	}
+
+	hvd_region_rect(region, frame, &rect);
+
+	frame->crop_left = rect.x;
+	frame->crop_top = rect.y;
+	frame->crop_right = frame->width - rect.x - rect.width;
+	frame->crop_bottom = frame->height - rect.y - rect.height;
+
+	if( (ret = av_frame_apply_cropping(frame, AV_FRAME_CROP_UNALIGNED) ) < 0)
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "unable to crop frame - \"%s\"", av_err2str(ret));
+		av_frame_unref(frame);
+		return HVD_ERROR;
+	}
+
+	return HVD_OK;
+}
+
+//copy only region of src (system or mapped memory) to dst in output format, count bytes read from src
+static int hvd_region_copy(struct hvd *h, AVFrame *dst, const AVFrame *src, const struct hvd_region *region, hvd_counter *bytes)
+{
+	enum AVPixelFormat format = hvd_software_output_format(h, src->format);
+	AVFrame *target = (format == src->format) ? dst : h->region_frame;
+	struct hvd_region rect;
+	int64_t copied;
+
+	if(!hvd_region_supported(src->format) || (format != src->format && !hvd_convert_supported(src->format, format)))
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "region not supported for %s to %s",
+			av_get_pix_fmt_name(src->format), av_get_pix_fmt_name(format));
+		av_frame_unref(dst);
+		return HVD_ERROR;
+	}
+
+	hvd_region_rect(region, src, &rect);
+
+	if(hvd_frame_get_data(h, target, src->format, rect.scale_width, rect.scale_height, target == dst) != HVD_OK)
+		return HVD_ERROR;
+
+	copied = hvd_region_copy_planes(target, src, &rect);
+
+	if(bytes)
+		hvd_count(bytes, copied);
+
+	if(target == dst)
+		return HVD_OK;
+
+	//conversion to RGB depends on those, matrix follows the full frame size
+	target->colorspace = src->colorspace;
+	target->color_range = src->color_range;
+
+	if(src->colorspace == AVCOL_SPC_UNSPECIFIED)
+		target->colorspace = (src->height >= 720) ? AVCOL_SPC_BT709 : AVCOL_SPC_SMPTE170M;
+
+	if(hvd_frame_get_data(h, dst, format, rect.scale_width, rect.scale_height, 1) != HVD_OK)
+		return HVD_ERROR;
+
+	if(hvd_convert_data(dst, target) < 0)
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "unable to convert %s to %s",
+			av_get_pix_fmt_name(src->format), av_get_pix_fmt_name(format));
+		av_frame_unref(dst);
+		return HVD_ERROR;
+	}
+
+	return HVD_OK;
+}
+
+//nearest neighbour from pixel centers, returns bytes read from src
+static int64_t hvd_region_copy_planes(AVFrame *dst, const AVFrame *src, const struct hvd_region *rect)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(src->format);
+	const int planes = av_pix_fmt_count_planes(src->format);
+	int64_t bytes = 0;
+
+	for(int p = 0; p < planes; ++p)
+	{
+		int step = 0, subsampled = 0;
+
+		for(int c = 0; c < desc->nb_components; ++c)
+			if(desc->comp[c].plane == p)
+			{
+				step = FFMAX(step, desc->comp[c].step);
+				subsampled |= (c == 1 || c == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+			}
+
+		const int shift_w = subsampled ? desc->log2_chroma_w : 0;
+		const int shift_h = subsampled ? desc->log2_chroma_h : 0;
+		const int x = rect->x >> shift_w, y = rect->y >> shift_h;
+		const int width = AV_CEIL_RSHIFT(rect->width, shift_w);
+		const int height = AV_CEIL_RSHIFT(rect->height, shift_h);
+		const int dst_width = AV_CEIL_RSHIFT(rect->scale_width, shift_w);
+		const int dst_height = AV_CEIL_RSHIFT(rect->scale_height, shift_h);
+
+		for(int row = 0; row < dst_height; ++row)
+		{
+			const int src_row = y + (int)(((int64_t)row * 2 + 1) * height / (2 * dst_height));
+			const uint8_t *s = src->data[p] + (ptrdiff_t)src_row * src->linesize[p] + x * step;
+			uint8_t *d = dst->data[p] + (ptrdiff_t)row * dst->linesize[p];
+
+			if(dst_width == width)
+				memcpy(d, s, (size_t)width * step);
+			else
+				hvd_scale_row(d, s, dst_width, width, step);
+		}
+
+		bytes += (int64_t)dst_width * step * dst_height;
+	}
+
+	return bytes;
+}
+
+static void hvd_scale_row(uint8_t *dst, const uint8_t *src, int dst_width, int src_width, int step)
+{
+	//16.16 fixed point position of the source pixel center
+	const uint64_t delta = ((uint64_t)src_width << 16) / dst_width;
+	uint64_t pos = delta / 2;
+
+	switch(step)
+	{
+	case 1:
+		for(int i = 0; i < dst_width; ++i, pos += delta)
+			dst[i] = src[pos >> 16];
+		break;
+	case 2:
+		for(int i = 0; i < dst_width; ++i, pos += delta)
+			memcpy(dst + 2 * i, src + 2 * (pos >> 16), 2);
+		break;
+	case 4:
+		for(int i = 0; i < dst_width; ++i, pos += delta)
+			memcpy(dst + 4 * i, src + 4 * (pos >> 16), 4);
+		break;
+	default:
+		for(int i = 0; i < dst_width; ++i, pos += delta)
+			memcpy(dst + (size_t)step * i, src + (size_t)step * (pos >> 16), step);
+	}
+}
+
+//copy the region from mapped hardware frame, otherwise (e.g. cuda, vdpau) from full transfer
+static int hvd_transfer_region(struct hvd *h, AVFrame *sw_frame, const AVFrame *hw_frame, const struct hvd_region *region)
+{
+	const AVHWFramesContext *hw_frames = (const AVHWFramesContext*)hw_frame->hw_frames_ctx->data;
+	const enum AVPixelFormat format = hvd_software_output_format(h, hw_frames->sw_format);
+	//hardware conversions are available only in full transfer
+	const enum AVPixelFormat native = (format == hw_frames->sw_format || hvd_convert_supported(hw_frames->sw_format, format)) ?
+		hw_frames->sw_format : format;
+	AVFrame *full = h->transfer_frame;
+	int ret;
+
+	if(!h->region_map_unsupported && native == hw_frames->sw_format)
+	{
+		av_frame_unref(h->map_frame);
+		h->map_frame->format = native;
+
+		if( (ret = av_hwframe_map(h->map_frame, hw_frame, AV_HWFRAME_MAP_READ) ) >= 0)
+		{
+			h->map_frame->colorspace = hw_frame->colorspace;
+			h->map_frame->color_range = hw_frame->color_range;
+
+			ret = hvd_region_copy(h, sw_frame, h->map_frame, region, &h->stats.transfer_bytes);
+			av_frame_unref(h->map_frame);
+			return ret;
+		}
+
+		h->region_map_unsupported = 1;
+		hvd_log(h, HVD_LOG_INFO, HVD_LOG_OUTPUT, "unable to map frame for region - \"%s\", using full transfer", av_err2str(ret));
+	}
+
+	if( !hvd_frame_reusable(full, native, hw_frame->width, hw_frame->height) )
+	{
+		av_frame_unref(full);
+		full->format = native;
+		hvd_count(&h->pool_allocations, 1);
+	}
+
+	if( (ret = av_hwframe_transfer_data(full, hw_frame, 0) ) < 0)
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "unable to transfer data to system memory - \"%s\"", av_err2str(ret));
+		hvd_dump_sw_pix_formats(h, hw_frame);
+		av_frame_unref(full);
+		return HVD_ERROR;
+	}
+
+	hvd_count(&h->stats.transfer_bytes, av_image_get_buffer_size(full->format, full->width, full->height, 1));
+
+	full->colorspace = hw_frame->colorspace;
+	full->color_range = hw_frame->color_range;
+
+	return hvd_region_copy(h, sw_frame, full, region, NULL);
+}
+
+//hardware may not support requested format (some, like cuda, silently return native format instead)
+//then the native format is transferred and converted on CPU, checked once per hardware frames context
+static int hvd_transfer_mode(struct hvd *h, const AVFrame *hw_frame)
+{
+	const AVHWFramesContext *hw_frames = (const AVHWFramesContext*)hw_frame->hw_frames_ctx->data;
+	enum AVPixelFormat *formats, *iterator;
+	int supported = 0;
+
+	if(h->transfer_frames == hw_frames && h->transfer_sw_format == hw_frames->sw_format)
+		return h->transfer_mode;
+
+	h->transfer_frames = hw_frames;
+	h->transfer_sw_format = hw_frames->sw_format;
+	h->transfer_mode = HVD_TRANSFER_DIRECT;
+
+	if(h->sw_pix_fmt == AV_PIX_FMT_NONE || h->sw_pix_fmt == hw_frames->sw_format)
+		return h->transfer_mode;
+
+	//can't tell, let the transfer decide like before
+	if(av_hwframe_transfer_get_formats(hw_frame->hw_frames_ctx, AV_HWFRAME_TRANSFER_DIRECTION_FROM, &formats, 0) < 0)
+		return h->transfer_mode;
+
+	for(iterator = formats; *iterator != AV_PIX_FMT_NONE; ++iterator)
+		if(*iterator == h->sw_pix_fmt)
+			supported = 1;
+
+	av_free(formats);
+
+	if(!supported)
+	{
+		h->transfer_mode = hvd_convert_supported(hw_frames->sw_format, h->sw_pix_fmt) ? HVD_TRANSFER_CONVERT : HVD_TRANSFER_UNSUPPORTED;
+
+		if(h->transfer_mode == HVD_TRANSFER_CONVERT)
+			hvd_log(h, HVD_LOG_INFO, HVD_LOG_OUTPUT, "hardware doesn't support %s, converting from %s on CPU",
+				av_get_pix_fmt_name(h->sw_pix_fmt), av_get_pix_fmt_name(hw_frames->sw_format));
+	}
+
+	return h->transfer_mode;
+}
+
+//transfer in native format of hardware, then convert to requested format
+static int hvd_transfer_convert(struct hvd *h, AVFrame *sw_frame, const AVFrame *hw_frame)
+{
+	const AVHWFramesContext *hw_frames = (const AVHWFramesContext*)hw_frame->hw_frames_ctx->data;
+	AVFrame *native = h->transfer_frame;
+	int ret;
+
+	if( !hvd_frame_reusable(native, hw_frames->sw_format, hw_frame->width, hw_frame->height) )
+	{
+		av_frame_unref(native);
+		native->format = hw_frames->sw_format;
+		hvd_count(&h->pool_allocations, 1);
+	}
+
+	if( (ret = av_hwframe_transfer_data(native, hw_frame, 0) ) < 0)
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "unable to transfer data to system memory - \"%s\"", av_err2str(ret));
+		av_frame_unref(native);
+		return HVD_ERROR;
+	}
+
+	hvd_count(&h->stats.transfer_bytes, av_image_get_buffer_size(native->format, native->width, native->height, 1));
+
+	//conversion to RGB depends on those
+	native->colorspace = hw_frame->colorspace;
+	native->color_range = hw_frame->color_range;
+
+	return hvd_copy_data(h, sw_frame, native);
+}
+
+static int hvd_transfer_data(struct hvd *h, AVFrame *sw_frame, const AVFrame *hw_frame)
+{
+	const AVHWFramesContext *hw_frames = (const AVHWFramesContext*)hw_frame->hw_frames_ctx->data;
+	enum AVPixelFormat format = (h->sw_pix_fmt != AV_PIX_FMT_NONE) ? h->sw_pix_fmt : hw_frames->sw_format;
+	int ret;
+
+	switch(hvd_transfer_mode(h, hw_frame))
+	{
+	case HVD_TRANSFER_CONVERT:
+		return hvd_transfer_convert(h, sw_frame, hw_frame);
+	case HVD_TRANSFER_UNSUPPORTED:
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "unable to transfer %s to %s, unsupported by hardware and CPU conversion",
+			av_get_pix_fmt_name(hw_frames->sw_format), av_get_pix_fmt_name(format));
+		hvd_dump_sw_pix_formats(h, hw_frame);
+		return HVD_ERROR;
+	}
+
+	//user buffers are requested for every frame, av_hwframe_transfer_data writes to them
+	if(h->get_buffer)
+	{
+		av_frame_unref(sw_frame);
+		sw_frame->format = format;
+		sw_frame->width = hw_frame->width;
+		sw_frame->height = hw_frame->height;
+
+		if(hvd_frame_user_buffer(h, sw_frame) != HVD_OK)
+			return HVD_ERROR;
+	}
+	//otherwise av_hwframe_transfer_data allocates new buffers which we keep for later
+	else if( !hvd_frame_reusable(sw_frame, format, hw_frame->width, hw_frame->height) )
+	{
+		av_frame_unref(sw_frame);
+		sw_frame->format = h->sw_pix_fmt;
+		hvd_count(&h->pool_allocations, 1);
+	}
+
+	if ( (ret = av_hwframe_transfer_data(sw_frame, hw_frame, 0) ) < 0)
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "unable to transfer data to system memory - \"%s\"", av_err2str(ret));
+		hvd_dump_sw_pix_formats(h, hw_frame);
+		//the buffers may be in undefined state, start from scratch next time
+		av_frame_unref(sw_frame);
+		return HVD_ERROR;
+	}
+
+	hvd_count(&h->stats.transfer_bytes, av_image_get_buffer_size(sw_frame->format, sw_frame->width, sw_frame->height, 1));
+
+	return HVD_OK;
+}
+
+//software decoded frames keep the pixel format contract of the hardware path:
+//- pixel_format requested by the user
+//- or the format typically returned by hardware (nv12, p010) for 4:2:0 content
+static int hvd_copy_data(struct hvd *h, AVFrame *dst, const AVFrame *src)
+{
+	enum AVPixelFormat format = hvd_software_output_format(h, src->format);
+	int ret;
+
+	if(hvd_frame_get_data(h, dst, format, src->width, src->height, 1) != HVD_OK)
+		return HVD_ERROR;
+
+	ret = (format == src->format) ? av_frame_copy(dst, src) : hvd_convert_data(dst, src);
+
+	if(ret < 0)
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "unable to convert %s to %s, supported CPU conversions: "
+			"yuv420p to nv12/rgb0/bgr0/rgba/bgra, nv12 to yuv420p/rgb0/bgr0/rgba/bgra, "
+			"p010le to yuv420p10le/yuv420p/nv12/rgb0/bgr0/rgba/bgra, yuv420p10le to p010le",
+			av_get_pix_fmt_name(src->format), av_get_pix_fmt_name(format));
+		av_frame_unref(dst);
+		return HVD_ERROR;
+	}
+
+	return HVD_OK;
+}
+
+static enum AVPixelFormat hvd_software_output_format(struct hvd *h, enum AVPixelFormat decoded)
+{
+	if(h->sw_pix_fmt != AV_PIX_FMT_NONE)
+		return h->sw_pix_fmt;
+
+	switch(decoded)
+	{
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+		return AV_PIX_FMT_NV12;
+	case AV_PIX_FMT_YUV420P10LE:
+		return AV_PIX_FMT_P010LE;
+	default:
+		return decoded;
+	}
+}
+
+static int hvd_convert_supported(enum AVPixelFormat src, enum AVPixelFormat dst)
+{
+	const int rgb = (dst == AV_PIX_FMT_RGB0 || dst == AV_PIX_FMT_BGR0 || dst == AV_PIX_FMT_RGBA || dst == AV_PIX_FMT_BGRA);
+
+	switch(src)
+	{
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+		return dst == AV_PIX_FMT_NV12 || rgb;
+	case AV_PIX_FMT_YUV420P10LE:
+		return dst == AV_PIX_FMT_P010LE;
+	case AV_PIX_FMT_NV12:
+		return dst == AV_PIX_FMT_YUV420P || rgb;
+	case AV_PIX_FMT_P010LE:
+		return dst == AV_PIX_FMT_YUV420P10LE || dst == AV_PIX_FMT_YUV420P || dst == AV_PIX_FMT_NV12 || rgb;
+	default:
+		return 0;
+	}
+}
+
+//4:2:0 planar <-> semi-planar, 10 bit -> 8 bit and YUV -> RGB on CPU, <0 if unsupported
+static int hvd_convert_data(AVFrame *dst, const AVFrame *src)
+{
+	const struct hvd_convert_kernels *k = &hvd_kernels;
+	const int chroma_width = (src->width + 1) / 2;
+	const int chroma_height = (src->height + 1) / 2;
+	const enum AVPixelFormat format = (src->format == AV_PIX_FMT_YUVJ420P) ? AV_PIX_FMT_YUV420P : src->format;
+
+	if(!hvd_convert_supported(format, dst->format))
+		return AVERROR(ENOSYS);
+
+	if(dst->format == AV_PIX_FMT_RGB0 || dst->format == AV_PIX_FMT_BGR0 || dst->format == AV_PIX_FMT_RGBA || dst->format == AV_PIX_FMT_BGRA)
+	{
+		hvd_convert_rgb(dst, src);
+		return 0;
+	}
+
+	//planar to semi-planar (like hardware returns)
+	if(format == AV_PIX_FMT_YUV420P && dst->format == AV_PIX_FMT_NV12)
+	{
+		av_image_copy_plane(dst->data[0], dst->linesize[0], src->data[0], src->linesize[0], src->width, src->height);
+
+		for(int y=0;y<chroma_height;++y)
+			k->interleave_uv8(dst->data[1] + y * dst->linesize[1],
+				src->data[1] + y * src->linesize[1], src->data[2] + y * src->linesize[2], chroma_width);
+
+		return 0;
+	}
+
+	//10 bit samples in low bits to 10 bit samples in high bits
+	if(format == AV_PIX_FMT_YUV420P10LE && dst->format == AV_PIX_FMT_P010LE)
+	{
+		hvd_shift_plane16(dst->data[0], dst->linesize[0], src->data[0], src->linesize[0], src->width, src->height, 6);
+
+		for(int y=0;y<chroma_height;++y)
+			hvd_interleave_uv16((uint16_t*)(dst->data[1] + y * dst->linesize[1]),
+				(const uint16_t*)(src->data[1] + y * src->linesize[1]),
+				(const uint16_t*)(src->data[2] + y * src->linesize[2]), chroma_width, 6);
+
+		return 0;
+	}
+
+	//semi-planar (hardware) to planar
+	if(format == AV_PIX_FMT_NV12)
+	{
+		av_image_copy_plane(dst->data[0], dst->linesize[0], src->data[0], src->linesize[0], src->width, src->height);
+
+		for(int y=0;y<chroma_height;++y)
+			k->deinterleave_uv8(dst->data[1] + y * dst->linesize[1], dst->data[2] + y * dst->linesize[2],
+				src->data[1] + y * src->linesize[1], chroma_width);
+
+		return 0;
+	}
+
+	//10 bit samples in high bits to 10 bit samples in low bits
+	if(dst->format == AV_PIX_FMT_YUV420P10LE)
+	{
+		for(int y=0;y<src->height;++y)
+			k->shift_right16((uint16_t*)(dst->data[0] + y * dst->linesize[0]),
+				(const uint16_t*)(src->data[0] + y * src->linesize[0]), src->width);
+
+		for(int y=0;y<chroma_height;++y)
+			k->deinterleave_uv16((uint16_t*)(dst->data[1] + y * dst->linesize[1]), (uint16_t*)(dst->data[2] + y * dst->linesize[2]),
+				(const uint16_t*)(src->data[1] + y * src->linesize[1]), chroma_width);
+
+		return 0;
+	}
+
+	//10 bit to 8 bit, semi-planar or planar
+	for(int y=0;y<src->height;++y)
+		k->narrow16(dst->data[0] + y * dst->linesize[0], (const uint16_t*)(src->data[0] + y * src->linesize[0]), src->width);
+
+	for(int y=0;y<chroma_height;++y)
+	{
+		const uint16_t *uv = (const uint16_t*)(src->data[1] + y * src->linesize[1]);
+
+		if(dst->format == AV_PIX_FMT_NV12)
+		{
+			k->narrow16(dst->data[1] + y * dst->linesize[1], uv, 2 * chroma_width);
+			continue;
+		}
+
+		//in blocks through cache
+		for(int x=0;x<chroma_width;x+=HVD_CONVERT_BLOCK/2)
+		{
+			const int width = FFMIN(HVD_CONVERT_BLOCK/2, chroma_width - x);
+			uint8_t block[HVD_CONVERT_BLOCK];
+
+			k->narrow16(block, uv + 2*x, 2*width);
+			k->deinterleave_uv8(dst->data[1] + y * dst->linesize[1] + x, dst->data[2] + y * dst->linesize[2] + x, block, width);
+		}
+	}
+
+	return 0;
+}
+
+//nv12, p010le and yuv420p rows are brought to nv12 in blocks (through cache) and converted
+static void hvd_convert_rgb(AVFrame *dst, const AVFrame *src)
+{
+	const struct hvd_convert_kernels *k = &hvd_kernels;
+	uint8_t luma[HVD_CONVERT_BLOCK], chroma[HVD_CONVERT_BLOCK];
+	struct hvd_yuv_rgb c;
+
+	hvd_yuv_rgb_init(&c, src, dst->format);
+
+	for(int y=0;y<src->height;++y)
+	{
+		const uint8_t *l = src->data[0] + y * src->linesize[0];
+		const uint8_t *u = src->data[1] + y/2 * src->linesize[1];
+		const uint8_t *v = src->data[2] + y/2 * src->linesize[2]; //planar only
+		uint8_t *d = dst->data[0] + y * dst->linesize[0];
+
+		for(int x=0;x<src->width;x+=HVD_CONVERT_BLOCK)
+		{
+			const int width = FFMIN(HVD_CONVERT_BLOCK, src->width - x);
+			const uint8_t *block_luma = l + x, *block_chroma = u + x;
+
+			if(src->format == AV_PIX_FMT_P010LE)
+			{
+				k->narrow16(luma, (const uint16_t*)l + x, width);
+				k->narrow16(chroma, (const uint16_t*)u + x, (width + 1) & ~1);
+				block_luma = luma;
+				block_chroma = chroma;
+			}
+			else if(src->format != AV_PIX_FMT_NV12)
+			{
+				k->interleave_uv8(chroma, u + x/2, v + x/2, (width + 1) / 2);
+				block_chroma = chroma;
+			}
+
+			k->nv12_to_rgbx(d + 4*x, block_luma, block_chroma, width, &c);
+		}
+	}
+}
+
+//BT.601, BT.709 or BT.2020 matrix, limited or full range, unspecified matrix guessed from resolution like players do
+static void hvd_yuv_rgb_init(struct hvd_yuv_rgb *c, const AVFrame *src, enum AVPixelFormat dst)
+{
+	const int full_range = (src->color_range == AVCOL_RANGE_JPEG || src->format == AV_PIX_FMT_YUVJ420P);
+	const double luma_scale = full_range ? 1.0 : 255.0 / 219.0;
+	const double chroma_scale = full_range ? 1.0 : 255.0 / 224.0;
+	double kr = 0.299, kb = 0.114, kg;
+
+	if(src->colorspace == AVCOL_SPC_BT709 || (src->colorspace == AVCOL_SPC_UNSPECIFIED && src->height >= 720))
+	{
+		kr = 0.2126;
+		kb = 0.0722;
+	}
+	else if(src->colorspace == AVCOL_SPC_BT2020_NCL || src->colorspace == AVCOL_SPC_BT2020_CL)
+	{
+		kr = 0.2627;
+		kb = 0.0593;
+	}
+
+	kg = 1.0 - kr - kb;
+
+	//fixed point with 6 fractional bits, the results fit in 16 bits
+	c->y_offset = full_range ? 0 : 16;
+	c->y = (int16_t)(luma_scale * 64 + 0.5);
+	c->rv = (int16_t)(2 * (1 - kr) * chroma_scale * 64 + 0.5);
+	c->gu = (int16_t)(2 * (1 - kb) * kb / kg * chroma_scale * 64 + 0.5);
+	c->gv = (int16_t)(2 * (1 - kr) * kr / kg * chroma_scale * 64 + 0.5);
+	c->bu = (int16_t)(2 * (1 - kb) * chroma_scale * 64 + 0.5);
+	c->bgr = (dst == AV_PIX_FMT_BGR0 || dst == AV_PIX_FMT_BGRA);
+}
+
+//row kernels, scalar reference implementations
+
+static void hvd_interleave_uv8(uint8_t *dst, const uint8_t *u, const uint8_t *v, int width)
+{
+	for(int x=0;x<width;++x)
+	{
+		dst[2*x] = u[x];
+		dst[2*x+1] = v[x];
+	}
+}
+
+static void hvd_deinterleave_uv8(uint8_t *u, uint8_t *v, const uint8_t *src, int width)
+{
+	for(int x=0;x<width;++x)
+	{
+		u[x] = src[2*x];
+		v[x] = src[2*x+1];
+	}
+}
+
+//10 bit samples from high bits to low bits
+static void hvd_deinterleave_uv16(uint16_t *u, uint16_t *v, const uint16_t *src, int width)
+{
+	for(int x=0;x<width;++x)
+	{
+		u[x] = src[2*x] >> 6;
+		v[x] = src[2*x+1] >> 6;
+	}
+}
+
+static void hvd_shift_right16(uint16_t *dst, const uint16_t *src, int count)
+{
+	for(int i=0;i<count;++i)
+		dst[i] = src[i] >> 6;
+}
+
+//16 bit samples to 8 bit (most significant bits)
+static void hvd_narrow16(uint8_t *dst, const uint16_t *src, int count)
+{
+	for(int i=0;i<count;++i)
+		dst[i] = src[i] >> 8;
+}
+
+//SIMD versions compute in the same fixed point and give identical results
+static void hvd_nv12_to_rgbx(uint8_t *dst, const uint8_t *y, const uint8_t *uv, int width, const struct hvd_yuv_rgb *c)
+{
+	for(int x=0;x<width;++x)
+	{
+		const int l = (y[x] - c->y_offset) * c->y + 32;
+		const int u = uv[x & ~1] - 128;
+		const int v = uv[x | 1] - 128;
+		const uint8_t r = av_clip_uint8( (l + c->rv * v) >> 6 );
+		const uint8_t g = av_clip_uint8( (l - c->gu * u - c->gv * v) >> 6 );
+		const uint8_t b = av_clip_uint8( (l + c->bu * u) >> 6 );
+
+		dst[4*x] = c->bgr ? b : r;
+		dst[4*x+1] = g;
+		dst[4*x+2] = c->bgr ? r : b;
+		dst[4*x+3] = 255;
+	}
+}
+
+static void hvd_interleave_uv16(uint16_t *dst, const uint16_t *u, const uint16_t *v, int width, int shift)
+{
+	for(int x=0;x<width;++x)
+	{
+		dst[2*x] = u[x] << shift;
+		dst[2*x+1] = v[x] << shift;
+	}
+}
+
+static void hvd_shift_plane16(uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int width, int height, int shift)
+{
+	for(int y=0;y<height;++y)
+	{
+		const uint16_t *s = (const uint16_t*)(src + y * src_linesize);
+		uint16_t *d = (uint16_t*)(dst + y * dst_linesize);
+
+		for(int x=0;x<width;++x)
+			d[x] = s[x] << shift;
+	}
+}
+
+#ifdef HVD_SSE2
+
+static void hvd_interleave_uv8_sse2(uint8_t *dst, const uint8_t *u, const uint8_t *v, int width)
+{
+	int x = 0;
+
+	for(;x + 16 <= width;x+=16)
+	{
+		const __m128i u16 = _mm_loadu_si128((const __m128i*)(u + x));
+		const __m128i v16 = _mm_loadu_si128((const __m128i*)(v + x));
+
+		_mm_storeu_si128((__m128i*)(dst + 2*x), _mm_unpacklo_epi8(u16, v16));
+		_mm_storeu_si128((__m128i*)(dst + 2*x + 16), _mm_unpackhi_epi8(u16, v16));
+	}
+
+	hvd_interleave_uv8(dst + 2*x, u + x, v + x, width - x);
+}
+
+static void hvd_deinterleave_uv8_sse2(uint8_t *u, uint8_t *v, const uint8_t *src, int width)
+{
+	const __m128i low = _mm_set1_epi16(0x00FF);
+	int x = 0;
+
+	for(;x + 16 <= width;x+=16)
+	{
+		const __m128i a = _mm_loadu_si128((const __m128i*)(src + 2*x));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(src + 2*x + 16));
+
+		_mm_storeu_si128((__m128i*)(u + x), _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+		_mm_storeu_si128((__m128i*)(v + x), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+	}
+
+	hvd_deinterleave_uv8(u + x, v + x, src + 2*x, width - x);
+}
+
+static void hvd_deinterleave_uv16_sse2(uint16_t *u, uint16_t *v, const uint16_t *src, int width)
+{
+	int x = 0;
+
+	//10 bit results, signed saturation of pack never happens
+	for(;x + 8 <= width;x+=8)
+	{
+		const __m128i a = _mm_loadu_si128((const __m128i*)(src + 2*x));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(src + 2*x + 8));
+
+		_mm_storeu_si128((__m128i*)(u + x), _mm_packs_epi32(_mm_srli_epi32(_mm_slli_epi32(a, 16), 22), _mm_srli_epi32(_mm_slli_epi32(b, 16), 22)));
+		_mm_storeu_si128((__m128i*)(v + x), _mm_packs_epi32(_mm_srli_epi32(a, 22), _mm_srli_epi32(b, 22)));
+	}
+
+	hvd_deinterleave_uv16(u + x, v + x, src + 2*x, width - x);
+}
+
+static void hvd_shift_right16_sse2(uint16_t *dst, const uint16_t *src, int count)
+{
+	int i = 0;
+
+	for(;i + 8 <= count;i+=8)
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(src + i)), 6));
+
+	hvd_shift_right16(dst + i, src + i, count - i);
+}
+
+static void hvd_narrow16_sse2(uint8_t *dst, const uint16_t *src, int count)
+{
+	int i = 0;
+
+	for(;i + 16 <= count;i+=16)
+	{
+		const __m128i a = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(src + i)), 8);
+		const __m128i b = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(src + i + 8)), 8);
+
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+	}
+
+	hvd_narrow16(dst + i, src + i, count - i);
+}
+
+//8 pixels at once in 16 bit fixed point (saturation only where the result clips anyway)
+static void hvd_nv12_to_rgbx_sse2(uint8_t *dst, const uint8_t *y, const uint8_t *uv, int width, const struct hvd_yuv_rgb *c)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low = _mm_set1_epi32(0xFFFF);
+	const __m128i bias = _mm_set1_epi16(128);
+	const __m128i round = _mm_set1_epi16(32);
+	const __m128i alpha = _mm_set1_epi8(-1);
+	const __m128i y_offset = _mm_set1_epi16(c->y_offset), y_coef = _mm_set1_epi16(c->y);
+	const __m128i rv = _mm_set1_epi16(c->rv), gu = _mm_set1_epi16(c->gu);
+	const __m128i gv = _mm_set1_epi16(c->gv), bu = _mm_set1_epi16(c->bu);
+	int x = 0;
+
+	for(;x + 8 <= width;x+=8)
+	{
+		const __m128i l = _mm_adds_epi16(_mm_mullo_epi16(_mm_sub_epi16(
+			_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(y + x)), zero), y_offset), y_coef), round);
+		//u0 v0 u1 v1 ... -> u0 u0 u1 u1 ... and v0 v0 v1 v1 ...
+		const __m128i chroma = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(uv + x)), zero);
+		const __m128i u1 = _mm_and_si128(chroma, low), v1 = _mm_srli_epi32(chroma, 16);
+		const __m128i u = _mm_sub_epi16(_mm_or_si128(u1, _mm_slli_epi32(u1, 16)), bias);
+		const __m128i v = _mm_sub_epi16(_mm_or_si128(v1, _mm_slli_epi32(v1, 16)), bias);
+		const __m128i r16 = _mm_adds_epi16(l, _mm_mullo_epi16(v, rv));
+		const __m128i g16 = _mm_subs_epi16(_mm_subs_epi16(l, _mm_mullo_epi16(u, gu)), _mm_mullo_epi16(v, gv));
+		const __m128i b16 = _mm_adds_epi16(l, _mm_mullo_epi16(u, bu));
+		const __m128i r = _mm_packus_epi16(_mm_srai_epi16(c->bgr ? b16 : r16, 6), zero);
+		const __m128i g = _mm_packus_epi16(_mm_srai_epi16(g16, 6), zero);
+		const __m128i b = _mm_packus_epi16(_mm_srai_epi16(c->bgr ? r16 : b16, 6), zero);
+		const __m128i rg = _mm_unpacklo_epi8(r, g), ba = _mm_unpacklo_epi8(b, alpha);
+
+		_mm_storeu_si128((__m128i*)(dst + 4*x), _mm_unpacklo_epi16(rg, ba));
+		_mm_storeu_si128((__m128i*)(dst + 4*x + 16), _mm_unpackhi_epi16(rg, ba));
+	}
+
+	hvd_nv12_to_rgbx(dst + 4*x, y + x, uv + x, width - x, c);
+}
+
+#endif //HVD_SSE2
+
+#ifdef HVD_AVX2
+
+//AVX2 packs and unpacks work within 128 bit lanes, permutes restore the order
+
+HVD_TARGET_AVX2 static void hvd_interleave_uv8_avx2(uint8_t *dst, const uint8_t *u, const uint8_t *v, int width)
+{
+	int x = 0;
+
+	for(;x + 32 <= width;x+=32)
+	{
+		const __m256i u32 = _mm256_loadu_si256((const __m256i*)(u + x));
+		const __m256i v32 = _mm256_loadu_si256((const __m256i*)(v + x));
+		const __m256i lo = _mm256_unpacklo_epi8(u32, v32), hi = _mm256_unpackhi_epi8(u32, v32);
+
+		_mm256_storeu_si256((__m256i*)(dst + 2*x), _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i*)(dst + 2*x + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	hvd_interleave_uv8_sse2(dst + 2*x, u + x, v + x, width - x);
+}
+
+HVD_TARGET_AVX2 static void hvd_deinterleave_uv8_avx2(uint8_t *u, uint8_t *v, const uint8_t *src, int width)
+{
+	const __m256i low = _mm256_set1_epi16(0x00FF);
+	int x = 0;
+
+	for(;x + 32 <= width;x+=32)
+	{
+		const __m256i a = _mm256_loadu_si256((const __m256i*)(src + 2*x));
+		const __m256i b = _mm256_loadu_si256((const __m256i*)(src + 2*x + 32));
+		const __m256i u32 = _mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low));
+		const __m256i v32 = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+
+		_mm256_storeu_si256((__m256i*)(u + x), _mm256_permute4x64_epi64(u32, 0xD8));
+		_mm256_storeu_si256((__m256i*)(v + x), _mm256_permute4x64_epi64(v32, 0xD8));
+	}
+
+	hvd_deinterleave_uv8_sse2(u + x, v + x, src + 2*x, width - x);
+}
+
+HVD_TARGET_AVX2 static void hvd_deinterleave_uv16_avx2(uint16_t *u, uint16_t *v, const uint16_t *src, int width)
+{
+	int x = 0;
+
+	for(;x + 16 <= width;x+=16)
+	{
+		const __m256i a = _mm256_loadu_si256((const __m256i*)(src + 2*x));
+		const __m256i b = _mm256_loadu_si256((const __m256i*)(src + 2*x + 16));
+		const __m256i u16 = _mm256_packs_epi32(_mm256_srli_epi32(_mm256_slli_epi32(a, 16), 22), _mm256_srli_epi32(_mm256_slli_epi32(b, 16), 22));
+		const __m256i v16 = _mm256_packs_epi32(_mm256_srli_epi32(a, 22), _mm256_srli_epi32(b, 22));
+
+		_mm256_storeu_si256((__m256i*)(u + x), _mm256_permute4x64_epi64(u16, 0xD8));
+		_mm256_storeu_si256((__m256i*)(v + x), _mm256_permute4x64_epi64(v16, 0xD8));
+	}
+
+	hvd_deinterleave_uv16_sse2(u + x, v + x, src + 2*x, width - x);
+}
+
+HVD_TARGET_AVX2 static void hvd_shift_right16_avx2(uint16_t *dst, const uint16_t *src, int count)
+{
+	int i = 0;
+
+	for(;i + 16 <= count;i+=16)
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(src + i)), 6));
+
+	hvd_shift_right16_sse2(dst + i, src + i, count - i);
+}
+
+HVD_TARGET_AVX2 static void hvd_narrow16_avx2(uint8_t *dst, const uint16_t *src, int count)
+{
+	int i = 0;
+
+	for(;i + 32 <= count;i+=32)
+	{
+		const __m256i a = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(src + i)), 8);
+		const __m256i b = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(src + i + 16)), 8);
+
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+	}
+
+	hvd_narrow16_sse2(dst + i, src + i, count - i);
+}
+
+#endif //HVD_AVX2
+
+#ifdef HVD_NEON
+
+static void hvd_interleave_uv8_neon(uint8_t *dst, const uint8_t *u, const uint8_t *v, int width)
+{
+	int x = 0;
+
+	for(;x + 16 <= width;x+=16)
+	{
+		uint8x16x2_t uv;
+
+		uv.val[0] = vld1q_u8(u + x);
+		uv.val[1] = vld1q_u8(v + x);
+		vst2q_u8(dst + 2*x, uv);
+	}
+
+	hvd_interleave_uv8(dst + 2*x, u + x, v + x, width - x);
+}
+
+static void hvd_deinterleave_uv8_neon(uint8_t *u, uint8_t *v, const uint8_t *src, int width)
+{
+	int x = 0;
+
+	for(;x + 16 <= width;x+=16)
+	{
+		const uint8x16x2_t uv = vld2q_u8(src + 2*x);
+
+		vst1q_u8(u + x, uv.val[0]);
+		vst1q_u8(v + x, uv.val[1]);
+	}
+
+	hvd_deinterleave_uv8(u + x, v + x, src + 2*x, width - x);
+}
+
+static void hvd_deinterleave_uv16_neon(uint16_t *u, uint16_t *v, const uint16_t *src, int width)
+{
+	int x = 0;
+
+	for(;x + 8 <= width;x+=8)
+	{
+		const uint16x8x2_t uv = vld2q_u16(src + 2*x);
+
+		vst1q_u16(u + x, vshrq_n_u16(uv.val[0], 6));
+		vst1q_u16(v + x, vshrq_n_u16(uv.val[1], 6));
+	}
+
+	hvd_deinterleave_uv16(u + x, v + x, src + 2*x, width - x);
+}
+
+static void hvd_shift_right16_neon(uint16_t *dst, const uint16_t *src, int count)
+{
+	int i = 0;
+
+	for(;i + 8 <= count;i+=8)
+		vst1q_u16(dst + i, vshrq_n_u16(vld1q_u16(src + i), 6));
+
+	hvd_shift_right16(dst + i, src + i, count - i);
+}
+
+static void hvd_narrow16_neon(uint8_t *dst, const uint16_t *src, int count)
+{
+	int i = 0;
+
+	for(;i + 16 <= count;i+=16)
+		vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(vld1q_u16(src + i), 8), vshrn_n_u16(vld1q_u16(src + i + 8), 8)));
+
+	hvd_narrow16(dst + i, src + i, count - i);
+}
+
+//16 pixels at once, rounding narrowing shift saturates like the scalar clip
+static void hvd_nv12_to_rgbx_neon(uint8_t *dst, const uint8_t *y, const uint8_t *uv, int width, const struct hvd_yuv_rgb *c)
+{
+	const int16x8_t bias = vdupq_n_s16(128);
+	const int16x8_t y_offset = vdupq_n_s16(c->y_offset), y_coef = vdupq_n_s16(c->y);
+	const int16x8_t rv = vdupq_n_s16(c->rv), gu = vdupq_n_s16(c->gu);
+	const int16x8_t gv = vdupq_n_s16(c->gv), bu = vdupq_n_s16(c->bu);
+	int x = 0;
+
+	for(;x + 16 <= width;x+=16)
+	{
+		const uint8x16_t luma = vld1q_u8(y + x);
+		const uint8x8x2_t chroma = vld2_u8(uv + x);
+		const uint8x8x2_t u2 = vzip_u8(chroma.val[0], chroma.val[0]);
+		const uint8x8x2_t v2 = vzip_u8(chroma.val[1], chroma.val[1]);
+		uint8x8_t r[2], g[2], b[2];
+		uint8x16x4_t rgbx;
+
+		for(int half=0;half<2;++half)
+		{
+			const uint8x8_t l8 = half ? vget_high_u8(luma) : vget_low_u8(luma);
+			const int16x8_t l = vmulq_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(l8)), y_offset), y_coef);
+			const int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u2.val[half])), bias);
+			const int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v2.val[half])), bias);
+
+			r[half] = vqrshrun_n_s16(vqaddq_s16(l, vmulq_s16(v, rv)), 6);
+			g[half] = vqrshrun_n_s16(vqsubq_s16(vqsubq_s16(l, vmulq_s16(u, gu)), vmulq_s16(v, gv)), 6);
+			b[half] = vqrshrun_n_s16(vqaddq_s16(l, vmulq_s16(u, bu)), 6);
+		}
+
+		rgbx.val[0] = c->bgr ? vcombine_u8(b[0], b[1]) : vcombine_u8(r[0], r[1]);
+		rgbx.val[1] = vcombine_u8(g[0], g[1]);
+		rgbx.val[2] = c->bgr ? vcombine_u8(r[0], r[1]) : vcombine_u8(b[0], b[1]);
+		rgbx.val[3] = vdupq_n_u8(255);
+		vst4q_u8(dst + 4*x, rgbx);
+	}
+
+	hvd_nv12_to_rgbx(dst + 4*x, y + x, uv + x, width - x, c);
+}
+
+#endif //HVD_NEON
+
+//select kernels for CPU once per process, av_force_cpu_flags(0) before first hvd_init selects scalar reference
+static void hvd_convert_init(int cpu_flags)
+{
+	hvd_convert_select(&hvd_kernels, cpu_flags);
+}
+
+static void hvd_convert_select(struct hvd_convert_kernels *selected, int cpu_flags)
+{
+	struct hvd_convert_kernels k = {hvd_interleave_uv8, hvd_deinterleave_uv8, hvd_deinterleave_uv16,
+		hvd_shift_right16, hvd_narrow16, hvd_nv12_to_rgbx};
+
+#ifdef HVD_SSE2
+	if(cpu_flags & AV_CPU_FLAG_SSE2)
+	{
+		k.interleave_uv8 = hvd_interleave_uv8_sse2;
+		k.deinterleave_uv8 = hvd_deinterleave_uv8_sse2;
+		k.deinterleave_uv16 = hvd_deinterleave_uv16_sse2;
+		k.shift_right16 = hvd_shift_right16_sse2;
+		k.narrow16 = hvd_narrow16_sse2;
+		k.nv12_to_rgbx = hvd_nv12_to_rgbx_sse2;
+	}
+#endif
+
+#ifdef HVD_AVX2
+	if( (cpu_flags & AV_CPU_FLAG_SSE2) && (cpu_flags & AV_CPU_FLAG_AVX2) )
+	{
+		k.interleave_uv8 = hvd_interleave_uv8_avx2;
+		k.deinterleave_uv8 = hvd_deinterleave_uv8_avx2;
+		k.deinterleave_uv16 = hvd_deinterleave_uv16_avx2;
+		k.shift_right16 = hvd_shift_right16_avx2;
+		k.narrow16 = hvd_narrow16_avx2;
+	}
+#endif
+
+#ifdef HVD_NEON
+	if(cpu_flags & AV_CPU_FLAG_NEON)
+	{
+		k.interleave_uv8 = hvd_interleave_uv8_neon;
+		k.deinterleave_uv8 = hvd_deinterleave_uv8_neon;
+		k.deinterleave_uv16 = hvd_deinterleave_uv16_neon;
+		k.shift_right16 = hvd_shift_right16_neon;
+		k.narrow16 = hvd_narrow16_neon;
+		k.nv12_to_rgbx = hvd_nv12_to_rgbx_neon;
+	}
+#endif
+
+	*selected = k;
+}
+
+int hvd_check_kernels(void)
+{
+	const int cpu_flags = av_get_cpu_flags();
+	const int sets[] = {AV_CPU_FLAG_SSE2, AV_CPU_FLAG_SSE2 | AV_CPU_FLAG_AVX2, AV_CPU_FLAG_NEON};
+	const char *names[] = {"sse2", "avx2", "neon"};
+	struct hvd_convert_kernels reference, k;
+	int ret = HVD_OK;
+
+	hvd_convert_select(&reference, 0);
+
+	for(int i=0;i<3;++i)
+	{
+		if( (cpu_flags & sets[i]) != sets[i] )
+			continue;
+
+		hvd_convert_select(&k, sets[i]);
+
+		//instruction set not compiled in
+		if(memcmp(&k, &reference, sizeof(k)) == 0)
+			continue;
+
+		if(hvd_check_kernel_set(&reference, &k, names[i]) != HVD_OK)
+			ret = HVD_ERROR;
+	}
+
+	return ret;
+}
+
+//random rows of every width up to 4 blocks (odd, not multiple of vector width),
+//RGB for full and limited range BT.601/709/2020, outputs compared past the width
+static int hvd_check_kernel_set(const struct hvd_convert_kernels *reference, const struct hvd_convert_kernels *k, const char *name)
+{
+	enum {WIDTH = 4 * HVD_CONVERT_BLOCK, SIZE = 4 * WIDTH + 64, KERNELS = 6, MATRICES = 12};
+	const enum AVColorSpace spaces[] = {AVCOL_SPC_BT470BG, AVCOL_SPC_BT709, AVCOL_SPC_BT2020_NCL};
+	uint8_t *src[2] = {av_malloc(SIZE), av_malloc(SIZE)};
+	uint8_t *expected[2] = {av_malloc(SIZE), av_malloc(SIZE)};
+	uint8_t *out[2] = {av_malloc(SIZE), av_malloc(SIZE)};
+	AVFrame *frame = av_frame_alloc();
+	struct hvd_yuv_rgb c;
+	AVLFG lfg;
+	int ret = HVD_OK;
+
+	if(!src[0] || !src[1] || !expected[0] || !expected[1] || !out[0] || !out[1] || !frame)
+		ret = HVD_ERROR_MSG(NULL, "not enough memory to check kernels", name);
+
+	av_lfg_init(&lfg, 0x4856);
+
+	for(int width=1;width<=WIDTH && ret == HVD_OK;++width)
+	{
+		for(int i=0;i<SIZE;++i)
+		{
+			src[0][i] = av_lfg_get(&lfg);
+			src[1][i] = av_lfg_get(&lfg);
+		}
+
+		for(int kernel=0;kernel<KERNELS && ret == HVD_OK;++kernel)
+			for(int matrix=0;matrix<(kernel == KERNELS - 1 ? MATRICES : 1) && ret == HVD_OK;++matrix)
+			{
+				const char *kernel_name;
+
+				frame->format = AV_PIX_FMT_NV12;
+				frame->color_range = (matrix & 1) ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+				frame->colorspace = spaces[matrix / 2 % 3];
+				hvd_yuv_rgb_init(&c, frame, matrix < MATRICES / 2 ? AV_PIX_FMT_RGB0 : AV_PIX_FMT_BGR0);
+
+				for(int i=0;i<2;++i)
+				{
+					memset(expected[i], 0xAA, SIZE);
+					memset(out[i], 0xAA, SIZE);
+				}
+
+				hvd_check_kernel(reference, kernel, expected, src, width, &c);
+				kernel_name = hvd_check_kernel(k, kernel, out, src, width, &c);
+
+				if(!memcmp(expected[0], out[0], SIZE) && !memcmp(expected[1], out[1], SIZE))
+					continue;
+
+				if(kernel == KERNELS - 1)
+					hvd_log(NULL, HVD_LOG_ERROR, HVD_LOG_GENERAL, "%s %s differs from scalar reference at width %d (%s range %s %s)",
+						name, kernel_name, width, av_color_range_name(frame->color_range), av_color_space_name(frame->colorspace),
+						c.bgr ? "bgr0" : "rgb0");
+				else
+					hvd_log(NULL, HVD_LOG_ERROR, HVD_LOG_GENERAL, "%s %s differs from scalar reference at width %d",
+						name, kernel_name, width);
+
+				ret = HVD_ERROR;
+			}
+	}
+
+	if(ret == HVD_OK)
+		hvd_log(NULL, HVD_LOG_INFO, HVD_LOG_GENERAL, "%s kernels match scalar reference", name);
+
+	for(int i=0;i<2;++i)
+	{
+		av_free(src[i]);
+		av_free(expected[i]);
+		av_free(out[i]);
+	}
+
+	av_frame_free(&frame);
+
+	return ret;
+}
+
+//runs kernel of the set on source rows, returns its name
+static const char *hvd_check_kernel(const struct hvd_convert_kernels *k, int kernel, uint8_t *out[2], uint8_t *src[2], int width, const struct hvd_yuv_rgb *c)
+{
+	switch(kernel)
+	{
+	case 0:
+		k->interleave_uv8(out[0], src[0], src[1], width);
+		return "interleave_uv8";
+	case 1:
+		k->deinterleave_uv8(out[0], out[1], src[0], width);
+		return "deinterleave_uv8";
+	case 2:
+		k->deinterleave_uv16((uint16_t*)out[0], (uint16_t*)out[1], (const uint16_t*)src[0], width);
+		return "deinterleave_uv16";
+	case 3:
+		k->shift_right16((uint16_t*)out[0], (const uint16_t*)src[0], width);
+		return "shift_right16";
+	case 4:
+		k->narrow16(out[0], (const uint16_t*)src[0], width);
+		return "narrow16";
+	default:
+		//called with at most block of pixels
+		k->nv12_to_rgbx(out[0], src[0], src[1], FFMIN(width, HVD_CONVERT_BLOCK), c);
+		return "nv12_to_rgbx";
+	}
+}
+
+//scheduler
+
+struct hvd_scheduler *hvd_scheduler_init(const struct hvd_scheduler_config *config)
+{
+	struct hvd_scheduler *s, zero_scheduler = {0};
+	int device_count = 0;
+
+	if( (s = (struct hvd_scheduler*)malloc(sizeof(struct hvd_scheduler))) == NULL )
+		return hvd_scheduler_close_and_return_null(NULL, "not enough memory for scheduler", NULL);
+
+	*s = zero_scheduler;
+
+	hvd_global_init();
+
+	if(config->hardware == NULL)
+		return hvd_scheduler_close_and_return_null(s, "scheduler hardware not set", NULL);
+
+	if( (s->hardware = av_strdup(config->hardware)) == NULL )
+		return hvd_scheduler_close_and_return_null(s, "not enough memory for scheduler hardware", NULL);
+
+	while(config->devices && config->devices[device_count])
+		++device_count;
+
+	s->queue_depth = config->queue_depth ? config->queue_depth : HVD_SCHEDULER_QUEUE_DEPTH;
+	s->budget = config->budget ? config->budget : HVD_SCHEDULER_BUDGET;
+	s->worker_count = config->threads ? config->threads : av_cpu_count();
+
+	if(s->queue_depth <= 0 || s->budget <= 0 || s->worker_count <= 0)
+		return hvd_scheduler_close_and_return_null(s, "invalid scheduler queue depth, budget or threads", NULL);
+
+	//no devices means single default device
+	s->device_count = device_count ? device_count : 1;
+
+	if( (s->devices = (struct hvd_scheduler_device*)calloc(s->device_count, sizeof(struct hvd_scheduler_device))) == NULL )
+		return hvd_scheduler_close_and_return_null(s, "not enough memory for scheduler devices", NULL);
+
+	for(int i = 0; i < s->device_count; ++i)
+		if( (s->devices[i].device = hvd_device_init(s->hardware, device_count ? config->devices[i] : NULL)) == NULL )
+			return hvd_scheduler_close_and_return_null(s, "unable to initialize scheduler device", device_count ? config->devices[i] : NULL);
+
+	if(pthread_mutex_init(&s->mutex, NULL) != 0)
+		return hvd_scheduler_close_and_return_null(s, "unable to initialize scheduler mutex", NULL);
+
+	if(pthread_cond_init(&s->cond, NULL) != 0)
+	{
+		pthread_mutex_destroy(&s->mutex);
+		return hvd_scheduler_close_and_return_null(s, "unable to initialize scheduler condition", NULL);
+	}
+
+	if(pthread_cond_init(&s->idle, NULL) != 0)
+	{
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->mutex);
+		return hvd_scheduler_close_and_return_null(s, "unable to initialize scheduler condition", NULL);
+	}
+
+	s->sync_initialized = 1;
+
+	if( (s->workers = (struct hvd_scheduler_worker*)calloc(s->worker_count, sizeof(struct hvd_scheduler_worker))) == NULL )
+		return hvd_scheduler_close_and_return_null(s, "not enough memory for scheduler workers", NULL);
+
+	//workers steal from each other, all queues have to be ready before the first starts
+	for(int i = 0; i < s->worker_count; ++i)
+	{
+		struct hvd_scheduler_worker *w = &s->workers[i];
+
+		w->scheduler = s;
+		w->index = i;
+
+		if(pthread_mutex_init(&w->mutex, NULL) != 0)
+			return hvd_scheduler_close_and_return_null(s, "unable to initialize worker mutex", NULL);
+
+		w->mutex_initialized = 1;
+	}
+
+	for(int i = 0; i < s->worker_count; ++i)
+	{
+		if(pthread_create(&s->workers[i].thread, NULL, hvd_scheduler_worker_thread, &s->workers[i]) != 0)
+			return hvd_scheduler_close_and_return_null(s, "unable to create worker thread", NULL);
+
+		s->workers[i].running = 1;
+	}
+
+	return s;
+}
+
+void hvd_scheduler_close(struct hvd_scheduler *s)
+{
+	if(s == NULL)
+		return;
+
+	while(s->stream_count)
+		hvd_scheduler_remove_stream(s->streams[s->stream_count - 1]);
+
+	atomic_store(&s->stop, 1);
+
+	if(s->sync_initialized)
+	{
+		pthread_mutex_lock(&s->mutex);
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->mutex);
+	}
+
+	//running workers may still look into queues of others
+	for(int i = 0; s->workers && i < s->worker_count; ++i)
+		if(s->workers[i].running)
+			pthread_join(s->workers[i].thread, NULL);
+
+	for(int i = 0; s->workers && i < s->worker_count; ++i)
+		if(s->workers[i].mutex_initialized)
+			pthread_mutex_destroy(&s->workers[i].mutex);
+
+	for(int i = 0; s->devices && i < s->device_count; ++i)
+		hvd_device_close(s->devices[i].device);
+
+	if(s->sync_initialized)
+	{
+		pthread_cond_destroy(&s->idle);
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->mutex);
+	}
+
+	free(s->streams);
+	free(s->workers);
+	free(s->devices);
+	av_free(s->hardware);
+	free(s);
+}
+
+static struct hvd_scheduler *hvd_scheduler_close_and_return_null(struct hvd_scheduler *s, const char *msg, const char *msg_details)
+{
+	HVD_ERROR_MSG(NULL, msg, msg_details);
+	hvd_scheduler_close(s);
+
+	return NULL;
+}
+
+struct hvd_stream *hvd_scheduler_add_stream(struct hvd_scheduler *s, const struct hvd_config *config,
+	hvd_stream_callback callback, void *opaque)
+{
+	struct hvd_stream *stream, zero_stream = {0};
+	struct hvd_config stream_config = *config;
+
+	if(callback == NULL)
+		return hvd_stream_free_and_return_null(NULL, "stream callback not set");
+
+	if( (stream = (struct hvd_stream*)malloc(sizeof(struct hvd_stream))) == NULL )
+		return hvd_stream_free_and_return_null(NULL, "not enough memory for stream");
+
+	*stream = zero_stream;
+	stream->scheduler = s;
+	stream->callback = callback;
+	stream->opaque = opaque;
+	stream->device = -1;
+	stream->queue_depth = s->queue_depth;
+	stream->load = -1;
+
+	if( (stream->queue = (struct hvd_stream_entry*)calloc(stream->queue_depth, sizeof(struct hvd_stream_entry))) == NULL )
+		return hvd_stream_free_and_return_null(stream, "not enough memory for stream queue");
+
+	for(int i = 0; i < stream->queue_depth; ++i)
+		av_init_packet(&stream->queue[i].packet);
+
+	if(pthread_mutex_init(&stream->mutex, NULL) != 0)
+		return hvd_stream_free_and_return_null(stream, "unable to initialize stream mutex");
+
+	stream->mutex_initialized = 1;
+
+	//the device is reserved before decoder initialization so that concurrent registrations spread
+	pthread_mutex_lock(&s->mutex);
+	hvd_scheduler_update_load(s);
+	stream->device = hvd_scheduler_pick_device(s);
+	s->devices[stream->device].streams++;
+	stream->worker = s->next_worker++ % s->worker_count;
+	pthread_mutex_unlock(&s->mutex);
+
+	stream_config.hardware = s->hardware;
+	stream_config.device = NULL;
+	stream_config.shared_device = s->devices[stream->device].device;
+	stream_config.async = 0;
+
+	if(stream_config.thread_count == 0)
+		stream_config.thread_count = 1;
+
+	if( (stream->h = hvd_init(&stream_config)) == NULL )
+		return hvd_stream_free_and_return_null(stream, "unable to initialize stream decoder");
+
+	pthread_mutex_lock(&s->mutex);
+
+	if(s->stream_count == s->stream_capacity)
+	{
+		const int capacity = s->stream_capacity ? 2 * s->stream_capacity : 16;
+		struct hvd_stream **streams = (struct hvd_stream**)realloc(s->streams, capacity * sizeof(struct hvd_stream*));
+
+		if(streams == NULL)
+		{
+			pthread_mutex_unlock(&s->mutex);
+			return hvd_stream_free_and_return_null(stream, "not enough memory for stream");
+		}
+
+		s->streams = streams;
+		s->stream_capacity = capacity;
+	}
+
+	stream->sample_time = av_gettime_relative();
+	s->streams[s->stream_count++] = stream;
+
+	pthread_mutex_unlock(&s->mutex);
+
+	return stream;
+}
+
+void hvd_scheduler_remove_stream(struct hvd_stream *stream)
+{
+	struct hvd_scheduler *s;
+
+	if(stream == NULL)
+		return;
+
+	s = stream->scheduler;
+
+	pthread_mutex_lock(&stream->mutex);
+	stream->removing = 1;
+	pthread_mutex_unlock(&stream->mutex);
+
+	//the stream may be in worker queue or taking turn, the worker unschedules it
+	pthread_mutex_lock(&s->mutex);
+
+	while(1)
+	{
+		int scheduled;
+
+		pthread_mutex_lock(&stream->mutex);
+
+		if(stream->parked)
+		{
+			stream->parked = 0;
+			atomic_fetch_sub(&s->parked, 1);
+		}
+
+		scheduled = stream->scheduled;
+		pthread_mutex_unlock(&stream->mutex);
+
+		if(!scheduled)
+			break;
+
+		pthread_cond_wait(&s->idle, &s->mutex);
+	}
+
+	for(int i = 0; i < s->stream_count; ++i)
+		if(s->streams[i] == stream)
+		{
+			s->streams[i] = s->streams[--s->stream_count];
+			break;
+		}
+
+	pthread_mutex_unlock(&s->mutex);
+
+	hvd_stream_free(stream);
+}
+
+//unregistered stream or stream not registered yet
+static void hvd_stream_free(struct hvd_stream *stream)
+{
+	struct hvd_scheduler *s;
+
+	if(stream == NULL)
+		return;
+
+	s = stream->scheduler;
+
+	hvd_close(stream->h);
+
+	if(stream->device >= 0)
+	{
+		pthread_mutex_lock(&s->mutex);
+		s->devices[stream->device].streams--;
+		pthread_mutex_unlock(&s->mutex);
+	}
+
+	for(int i = 0; stream->queue && i < stream->queue_depth; ++i)
+		av_packet_unref(&stream->queue[i].packet);
+
+	if(stream->mutex_initialized)
+		pthread_mutex_destroy(&stream->mutex);
+
+	free(stream->queue);
+	free(stream);
+}
+
+static struct hvd_stream *hvd_stream_free_and_return_null(struct hvd_stream *stream, const char *msg)
+{
+	HVD_ERROR_MSG(NULL, msg, NULL);
+	hvd_stream_free(stream);
+
+	return NULL;
+}
+
+int hvd_scheduler_send(struct hvd_stream *stream, const struct hvd_packet *packet)
+{
+	struct hvd_stream_entry *entry;
+	int schedule;
+
+	pthread_mutex_lock(&stream->mutex);
+
+	if(stream->removing)
+	{
+		pthread_mutex_unlock(&stream->mutex);
+		return HVD_ERROR_MSG(stream->h, "stream is being removed", NULL);
+	}
+
+	//the user retrying is a good moment to retry parked stream (e.g. after releasing frames)
+	if(stream->queued == stream->queue_depth)
+	{
+		schedule = hvd_stream_unpark(stream);
+		pthread_mutex_unlock(&stream->mutex);
+
+		if(schedule)
+			hvd_scheduler_push(stream->scheduler, stream);
+
+		hvd_count(&stream->again, 1);
+		return HVD_AGAIN;
+	}
+
+	//over memory budget of the decoder the queue shrinks to one packet
+	if(stream->queued && packet && packet->data && hvd_memory_over(stream->h, packet->size))
+	{
+		schedule = hvd_stream_unpark(stream);
+		pthread_mutex_unlock(&stream->mutex);
+
+		if(schedule)
+			hvd_scheduler_push(stream->scheduler, stream);
+
+		hvd_count(&stream->again, 1);
+		hvd_count(&stream->h->memory.refused, 1);
+		return HVD_AGAIN;
+	}
+
+	//not visible to worker until queued, single sender
+	entry = &stream->queue[(stream->head + stream->queued) % stream->queue_depth];
+
+	pthread_mutex_unlock(&stream->mutex);
+
+	entry->flush = packet == NULL || packet->data == NULL;
+	entry->referenced = 0;
+	entry->pts = packet ? packet->pts : AV_NOPTS_VALUE;
+	entry->tag = packet ? packet->tag : 0;
+
+	if(!entry->flush && (packet->buf || packet->free))
+	{
+		av_packet_unref(&entry->packet);
+
+		if(hvd_packet_reference(stream->h, &entry->packet, packet) != HVD_OK)
+			return HVD_ERROR;
+
+		entry->packet.data = packet->data;
+		entry->packet.size = packet->size;
+		entry->referenced = 1;
+	}
+	else if(!entry->flush && hvd_packet_copy(stream->h, &entry->packet, packet->data, packet->size) != HVD_OK)
+		return HVD_ERROR;
+
+	if(!entry->flush)
+		hvd_memory_packet(stream->h, &entry->packet, !entry->referenced, &entry->bytes);
+
+	pthread_mutex_lock(&stream->mutex);
+	stream->queued++;
+	schedule = hvd_stream_unpark(stream) || !stream->scheduled;
+	stream->scheduled = 1;
+	pthread_mutex_unlock(&stream->mutex);
+
+	if(schedule)
+		hvd_scheduler_push(stream->scheduler, stream);
+
+	return HVD_OK;
+}
+
+static void *hvd_scheduler_worker_thread(void *arg)
+{
+	struct hvd_scheduler_worker *w = (struct hvd_scheduler_worker*)arg;
+	struct hvd_scheduler *s = w->scheduler;
+	struct hvd_stream *stream;
+
+	while(1)
+	{
+		if(atomic_load_explicit(&s->parked, memory_order_relaxed))
+			hvd_scheduler_unpark(s);
+
+		if( (stream = hvd_scheduler_take(w)) || (stream = hvd_scheduler_steal(w)) )
+		{
+			hvd_stream_turn(w, stream);
+			continue;
+		}
+
+		//pairs with hvd_scheduler_push, either we see queued stream or pusher sees us sleeping
+		pthread_mutex_lock(&s->mutex);
+		atomic_fetch_add(&s->sleeping, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+
+		while(!atomic_load(&s->stop) && atomic_load(&s->queued) == 0)
+		{
+			const int64_t remaining = s->unpark_time - av_gettime_relative();
+
+			if(!atomic_load(&s->parked))
+				pthread_cond_wait(&s->cond, &s->mutex);
+			else if(remaining > 0)
+			{	//condition waits for wall clock time
+				const int64_t until = av_gettime() + remaining;
+				struct timespec timeout = {until / 1000000, (until % 1000000) * 1000};
+
+				pthread_cond_timedwait(&s->cond, &s->mutex, &timeout);
+			}
+			else
+				break;
+		}
+
+		atomic_fetch_sub(&s->sleeping, 1);
+		pthread_mutex_unlock(&s->mutex);
+
+		if(atomic_load(&s->stop))
+			break;
+	}
+
+	return NULL;
+}
+
+//to the back of the queue of the worker that took the last turn
+static void hvd_scheduler_push(struct hvd_scheduler *s, struct hvd_stream *stream)
+{
+	struct hvd_scheduler_worker *w = &s->workers[stream->worker];
+
+	pthread_mutex_lock(&w->mutex);
+
+	stream->prev = w->tail;
+	stream->next = NULL;
+
+	if(w->tail)
+		w->tail->next = stream;
+	else
+		w->head = stream;
+
+	w->tail = stream;
+
+	pthread_mutex_unlock(&w->mutex);
+
+	atomic_fetch_add(&s->queued, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	//the owner may be busy, any sleeping worker takes or steals the stream
+	if(atomic_load_explicit(&s->sleeping, memory_order_relaxed))
+	{
+		pthread_mutex_lock(&s->mutex);
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->mutex);
+	}
+}
+
+//parked streams are retried after a while, the decoder may have room again
+static void hvd_scheduler_unpark(struct hvd_scheduler *s)
+{
+	struct hvd_stream *unparked = NULL, *next;
+
+	pthread_mutex_lock(&s->mutex);
+
+	if(av_gettime_relative() >= s->unpark_time)
+		for(int i = 0; i < s->stream_count; ++i)
+		{
+			struct hvd_stream *stream = s->streams[i];
+
+			pthread_mutex_lock(&stream->mutex);
+
+			//not in any worker queue, the link is free
+			if(hvd_stream_unpark(stream))
+			{
+				stream->next = unparked;
+				unparked = stream;
+			}
+
+			pthread_mutex_unlock(&stream->mutex);
+		}
+
+	pthread_mutex_unlock(&s->mutex);
+
+	for(; unparked; unparked = next)
+	{
+		next = unparked->next;
+		hvd_scheduler_push(s, unparked);
+	}
+}
+
+//called with stream mutex, parked stream is scheduled again and the caller pushes it
+static int hvd_stream_unpark(struct hvd_stream *stream)
+{
+	if(!stream->parked)
+		return 0;
+
+	stream->parked = 0;
+	stream->scheduled = 1;
+	atomic_fetch_sub(&stream->scheduler->parked, 1);
+
+	return 1;
+}
+
+//the oldest stream from own queue
+static struct hvd_stream *hvd_scheduler_take(struct hvd_scheduler_worker *w)
+{
+	struct hvd_stream *stream;
+
+	pthread_mutex_lock(&w->mutex);
+
+	if( (stream = w->head) != NULL )
+	{
+		w->head = stream->next;
+
+		if(w->head)
+			w->head->prev = NULL;
+		else
+			w->tail = NULL;
+	}
+
+	pthread_mutex_unlock(&w->mutex);
+
+	if(stream)
+		atomic_fetch_sub(&w->scheduler->queued, 1);
+
+	return stream;
+}
+
+//the newest stream from other worker queue, the oldest ones are likely taken by the owner soon
+static struct hvd_stream *hvd_scheduler_steal(struct hvd_scheduler_worker *w)
+{
+	struct hvd_scheduler *s = w->scheduler;
+	struct hvd_stream *stream = NULL;
+
+	for(int i = 1; i < s->worker_count && stream == NULL; ++i)
+	{
+		struct hvd_scheduler_worker *victim = &s->workers[(w->index + i) % s->worker_count];
+
+		pthread_mutex_lock(&victim->mutex);
+
+		if( (stream = victim->tail) != NULL )
+		{
+			victim->tail = stream->prev;
+
+			if(victim->tail)
+				victim->tail->next = NULL;
+			else
+				victim->head = NULL;
+		}
+
+		pthread_mutex_unlock(&victim->mutex);
+	}
+
+	if(stream)
+	{
+		atomic_fetch_sub(&s->queued, 1);
+		hvd_count(&s->steals, 1);
+	}
+
+	return stream;
+}
+
+//decodes at most budget packets, then the stream waits for its turn again
+static void hvd_stream_turn(struct hvd_scheduler_worker *w, struct hvd_stream *stream)
+{
+	struct hvd_scheduler *s = w->scheduler;
+	const int64_t start = av_gettime_relative();
+	int more, removing, parked, again = 0;
+
+	hvd_count(&s->turns, 1);
+
+	for(int i = 0; i < s->budget; ++i)
+	{
+		struct hvd_stream_entry *entry = NULL;
+
+		pthread_mutex_lock(&stream->mutex);
+
+		if(stream->queued && !stream->removing)
+			entry = &stream->queue[stream->head];
+
+		pthread_mutex_unlock(&stream->mutex);
+
+		if(entry == NULL)
+			break;
+
+		//the packet stays at the head for the next turn
+		if( (again = hvd_stream_decode(stream, entry) == HVD_AGAIN) )
+			break;
+
+		pthread_mutex_lock(&stream->mutex);
+		stream->head = (stream->head + 1) % stream->queue_depth;
+		stream->queued--;
+		pthread_mutex_unlock(&stream->mutex);
+	}
+
+	hvd_count(&stream->busy, av_gettime_relative() - start);
+	stream->worker = w->index;
+
+	//parking pairs with hvd_scheduler_unpark, retry time is guarded by scheduler mutex
+	if(again)
+		pthread_mutex_lock(&s->mutex);
+
+	pthread_mutex_lock(&stream->mutex);
+	more = stream->queued && !stream->removing;
+	removing = stream->removing;
+	parked = stream->parked = again && more;
+	stream->scheduled = more && !again;
+
+	//without room in decoder retrying immidiately would spin, frames are released by callbacks
+	if(parked && atomic_fetch_add(&s->parked, 1) == 0)
+		s->unpark_time = av_gettime_relative() + HVD_SCHEDULER_PARK_US;
+
+	pthread_mutex_unlock(&stream->mutex);
+
+	if(parked)
+	{	//sleeping workers wait for the retry
+		hvd_count(&s->parks, 1);
+		pthread_cond_signal(&s->cond);
+	}
+
+	if(again)
+		pthread_mutex_unlock(&s->mutex);
+
+	if(more && !again)
+		hvd_scheduler_push(s, stream);
+	else if(removing)
+	{
+		pthread_mutex_lock(&s->mutex);
+		pthread_cond_broadcast(&s->idle);
+		pthread_mutex_unlock(&s->mutex);
+	}
+}
+
+//HVD_AGAIN if decoder had no room for the packet, otherwise HVD_OK (errors go to callback)
+static int hvd_stream_decode(struct hvd_stream *stream, struct hvd_stream_entry *entry)
+{
+	struct hvd_packet packet = {0};
+	int ret, retried = 0;
+
+	packet.data = entry->packet.data;
+	packet.size = entry->packet.size;
+	packet.buf = entry->packet.buf;
+	packet.pts = entry->pts;
+	packet.tag = entry->tag;
+
+	//decoder is full, make room by receiving frames, once more without frames
+	//(frames drained from decoder may be dropped by drop policy)
+	while( (ret = hvd_send_packet(stream->h, entry->flush ? NULL : &packet)) == HVD_AGAIN )
+		if(hvd_stream_receive(stream))
+			retried = 0;
+		else if(retried++)
+			break;
+
+	//no frames out, e.g. held by callback, pool limited by memory budget or dropped
+	if(ret == HVD_AGAIN)
+		return HVD_AGAIN;
+
+	hvd_count(&stream->packets, 1);
+
+	if(ret != HVD_OK)
+	{
+		hvd_count(&stream->errors, 1);
+		stream->callback(stream->opaque, NULL, HVD_ERROR);
+	}
+
+	hvd_stream_receive(stream);
+
+	if(entry->flush)
+		stream->callback(stream->opaque, NULL, HVD_OK);
+
+	//user data is released as soon as possible, copy buffers are reused
+	if(entry->referenced)
+	{
+		av_packet_unref(&entry->packet);
+		hvd_memory_packet(stream->h, &entry->packet, 0, &entry->bytes);
+	}
+
+	return HVD_OK;
+}
+
+//returns number of frames passed to callback
+static int hvd_stream_receive(struct hvd_stream *stream)
+{
+	AVFrame *frame;
+	int error, frames = 0;
+
+	while( (frame = hvd_receive_frame(stream->h, &error)) != NULL )
+	{
+		stream->callback(stream->opaque, frame, HVD_OK);
+		++frames;
+	}
+
+	hvd_count(&stream->frames, frames);
+
+	//HVD_AGAIN is not an error, all the frames are held by callback
+	if(error == HVD_ERROR)
+	{
+		hvd_count(&stream->errors, 1);
+		stream->callback(stream->opaque, NULL, HVD_ERROR);
+	}
+
+	return frames;
+}
+
+//called with scheduler mutex, the load is busy time over at least sample period
+static void hvd_scheduler_update_load(struct hvd_scheduler *s)
+{
+	const int64_t now = av_gettime_relative();
+	double measured_load = 0, average_load;
+	int measured = 0;
+
+	for(int i = 0; i < s->stream_count; ++i)
+	{
+		struct hvd_stream *stream = s->streams[i];
+
+		if(now - stream->sample_time >= HVD_SCHEDULER_SAMPLE_US)
+		{
+			const uint64_t busy = atomic_load_explicit(&stream->busy, memory_order_relaxed);
+
+			stream->load = (double)(busy - stream->sample_busy) / (now - stream->sample_time);
+			stream->sample_busy = busy;
+			stream->sample_time = now;
+		}
+
+		if(stream->load >= 0)
+		{
+			measured_load += stream->load;
+			++measured;
+		}
+	}
+
+	//streams not measured yet count as average stream
+	average_load = measured ? measured_load / measured : 0;
+
+	for(int i = 0; i < s->device_count; ++i)
+		s->devices[i].load = 0;
+
+	for(int i = 0; i < s->stream_count; ++i)
+		s->devices[s->streams[i]->device].load += s->streams[i]->load >= 0 ? s->streams[i]->load : average_load;
+}
+
+//the least loaded device, with the same load the one with less streams
+static int hvd_scheduler_pick_device(const struct hvd_scheduler *s)
+{
+	int best = 0;
+
+	for(int i = 1; i < s->device_count; ++i)
+	{
+		const struct hvd_scheduler_device *d = &s->devices[i], *b = &s->devices[best];
+
+		if(d->load < b->load - 1e-6 || (d->load <= b->load + 1e-6 && d->streams < b->streams))
+			best = i;
+	}
+
+	return best;
+}
+
+struct hvd *hvd_stream_get_decoder(const struct hvd_stream *stream)
+{
+	return stream->h;
+}
+
+void hvd_stream_get_stats(struct hvd_stream *stream, struct hvd_stream_stats *stats)
+{
+	struct hvd_scheduler *s = stream->scheduler;
+
+	stats->device = stream->device;
+	stats->queue_depth = stream->queue_depth;
+	stats->packets = atomic_load_explicit(&stream->packets, memory_order_relaxed);
+	stats->frames = atomic_load_explicit(&stream->frames, memory_order_relaxed);
+	stats->again = atomic_load_explicit(&stream->again, memory_order_relaxed);
+	stats->errors = atomic_load_explicit(&stream->errors, memory_order_relaxed);
+
+	pthread_mutex_lock(&stream->mutex);
+	stats->queued = stream->queued;
+	pthread_mutex_unlock(&stream->mutex);
+
+	pthread_mutex_lock(&s->mutex);
+	hvd_scheduler_update_load(s);
+	stats->load = stream->load;
+	pthread_mutex_unlock(&s->mutex);
+}
+
+void hvd_scheduler_get_stats(struct hvd_scheduler *s, struct hvd_scheduler_stats *stats)
+{
+	pthread_mutex_lock(&s->mutex);
+	stats->streams = s->stream_count;
+	pthread_mutex_unlock(&s->mutex);
+
+	stats->workers = s->worker_count;
+	stats->turns = atomic_load_explicit(&s->turns, memory_order_relaxed);
+	stats->steals = atomic_load_explicit(&s->steals, memory_order_relaxed);
+	stats->parks = atomic_load_explicit(&s->parks, memory_order_relaxed);
+}
+
+int hvd_scheduler_get_device_load(struct hvd_scheduler *s, int device, int *streams, double *load)
+{
+	if(device < 0 || device >= s->device_count)
+		return HVD_ERROR_MSG(NULL, "invalid scheduler device", NULL);
+
+	pthread_mutex_lock(&s->mutex);
+	hvd_scheduler_update_load(s);
+	*streams = s->devices[device].streams;
+	*load = s->devices[device].load;
+	pthread_mutex_unlock(&s->mutex);
+
+	return HVD_OK;
+}
+
+//shared memory frame ring
+
+struct hvd_shm *hvd_shm_create(const struct hvd_shm_config *config)
+{
+	struct hvd_shm *ring, zero_ring = {0};
+	enum AVPixelFormat format;
+	int frame_size, slots;
+	size_t data_offset;
+
+	if( (ring = (struct hvd_shm*)malloc(sizeof(struct hvd_shm))) == NULL )
+		return hvd_shm_close_and_return_null(NULL, "not enough memory for ring", NULL);
+
+	*ring = zero_ring;
+	ring->fd = -1;
+	ring->publisher = 1;
+
+	if( config->pixel_format == NULL || (format = av_get_pix_fmt(config->pixel_format)) == AV_PIX_FMT_NONE )
+		return hvd_shm_close_and_return_null(ring, "invalid ring pixel format", config->pixel_format);
+
+	if( (frame_size = av_image_get_buffer_size(format, config->width, config->height, HVD_SHM_ALIGN)) <= 0 )
+		return hvd_shm_close_and_return_null(ring, "invalid ring frame size", NULL);
+
+	if( (slots = config->slots ? config->slots : HVD_SHM_DEFAULT_SLOTS) <= 0 )
+		return hvd_shm_close_and_return_null(ring, "invalid number of ring slots", NULL);
+
+	data_offset = FFALIGN(sizeof(struct hvd_shm_header) + slots * sizeof(struct hvd_shm_slot), HVD_SHM_PAGE);
+	ring->size = data_offset + (size_t)slots * FFALIGN(frame_size, HVD_SHM_PAGE);
+
+	if(config->name && ( (ring->name = av_strdup(config->name)) == NULL) )
+		return hvd_shm_close_and_return_null(ring, "not enough memory for ring name", NULL);
+
+	if(hvd_shm_map(ring, 1) != HVD_OK)
+		return hvd_shm_close_and_return_null(ring, NULL, NULL);
+
+	ring->header->version = HVD_SHM_VERSION;
+	ring->header->slots = slots;
+	ring->header->slot_size = FFALIGN(frame_size, HVD_SHM_PAGE);
+	ring->header->data_offset = data_offset;
+	ring->header->size = ring->size;
+	ring->slots = (struct hvd_shm_slot*)(ring->memory + sizeof(struct hvd_shm_header));
+	ring->data = ring->memory + data_offset;
+
+	//readers check magic, everything else has to be visible before
+	atomic_thread_fence(memory_order_release);
+	ring->header->magic = HVD_SHM_MAGIC;
+
+	return ring;
+}
+
+struct hvd_shm *hvd_shm_attach(const char *name, int fd)
+{
+	struct hvd_shm *ring, zero_ring = {0};
+	const struct hvd_shm_header *header;
+
+	if( (ring = (struct hvd_shm*)malloc(sizeof(struct hvd_shm))) == NULL )
+		return hvd_shm_close_and_return_null(NULL, "not enough memory for ring", NULL);
+
+	*ring = zero_ring;
+	ring->fd = name ? -1 : fd;
+
+	if(name && ( (ring->name = av_strdup(name)) == NULL) )
+		return hvd_shm_close_and_return_null(ring, "not enough memory for ring name", NULL);
+
+	if(hvd_shm_map(ring, 0) != HVD_OK)
+		return hvd_shm_close_and_return_null(ring, NULL, NULL);
+
+	header = ring->header;
+
+	if(header->magic != HVD_SHM_MAGIC || header->version != HVD_SHM_VERSION)
+		return hvd_shm_close_and_return_null(ring, "not a ring or incompatible version", name);
+
+	atomic_thread_fence(memory_order_acquire);
+
+	if(header->size > ring->size || header->slots == 0 || header->slot_size == 0 ||
+		header->data_offset + header->slots * header->slot_size > header->size)
+		return hvd_shm_close_and_return_null(ring, "corrupted ring header", name);
+
+	ring->slots = (struct hvd_shm_slot*)(ring->memory + sizeof(struct hvd_shm_header));
+	ring->data = ring->memory + header->data_offset;
+
+	return ring;
+}
+
+void hvd_shm_close(struct hvd_shm *ring)
+{
+	if(ring == NULL)
+		return;
+
+#ifdef HVD_SHM
+	if(ring->memory)
+		munmap(ring->memory, ring->size);
+
+	if(ring->fd_owned)
+		close(ring->fd);
+
+	if(ring->publisher && ring->name && ring->fd_owned)
+		shm_unlink(ring->name);
+#endif
+
+	av_free(ring->name);
+	free(ring);
+}
+
+static struct hvd_shm *hvd_shm_close_and_return_null(struct hvd_shm *ring, const char *msg, const char *msg_details)
+{
+	HVD_ERROR_MSG(NULL, msg, msg_details);
+	hvd_shm_close(ring);
+
+	return NULL;
+}
+
+//opens (publisher creates) and maps shared memory, sets fd, memory, size and header
+static int hvd_shm_map(struct hvd_shm *ring, int writable)
+{
+#ifdef HVD_SHM
+	struct stat info;
+
+	if(writable && ring->name)
+	{
+		//readers of the previous ring with the same name (e.g. crashed publisher) keep their memory
+		shm_unlink(ring->name);
+		ring->fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	}
+	else if(writable)
+	{
+#if defined(__linux__) && defined(SYS_memfd_create)
+		ring->fd = syscall(SYS_memfd_create, "hvd-ring", 1U); //MFD_CLOEXEC
+#else
+		return HVD_ERROR_MSG(NULL, "anonymous ring not supported on the platform, use name", NULL);
+#endif
+	}
+	else if(ring->name)
+		ring->fd = shm_open(ring->name, O_RDONLY, 0);
+
+	if(ring->fd == -1)
+		return HVD_ERROR_MSG(NULL, "unable to open shared memory", ring->name ? ring->name : strerror(errno));
+
+	ring->fd_owned = writable || ring->name;
+
+	if(writable && ftruncate(ring->fd, ring->size) == -1)
+		return HVD_ERROR_MSG(NULL, "unable to size shared memory", strerror(errno));
+
+	if(!writable)
+	{
+		if(fstat(ring->fd, &info) == -1 || (size_t)info.st_size < sizeof(struct hvd_shm_header))
+			return HVD_ERROR_MSG(NULL, "shared memory is not a ring", ring->name);
+
+		ring->size = info.st_size;
+	}
+
+	ring->memory = mmap(NULL, ring->size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, ring->fd, 0);
+
+	if(ring->memory == MAP_FAILED)
+	{
+		ring->memory = NULL;
+		return HVD_ERROR_MSG(NULL, "unable to map shared memory", strerror(errno));
+	}
+
+	ring->header = (struct hvd_shm_header*)ring->memory;
+
+	return HVD_OK;
+#else
+	(void)ring;
+	(void)writable;
+	return HVD_ERROR_MSG(NULL, "shared memory ring not supported on the platform", NULL);
+#endif
+}
+
+int hvd_shm_get_fd(const struct hvd_shm *ring)
+{
+	return ring->fd;
+}
+
+//next slot for writing, overwrites the oldest frame, readers of the slot detect overrun
+static uint64_t hvd_shm_claim(struct hvd_shm *ring, uint8_t **data)
+{
+	const uint64_t number = atomic_fetch_add_explicit(&ring->claimed, 1, memory_order_relaxed) + 1;
+	const uint64_t index = (number - 1) % ring->header->slots;
+
+	atomic_store_explicit(&ring->slots[index].sequence, 2 * number - 1, memory_order_relaxed);
+	//the odd sequence has to be visible before any data is written
+	atomic_thread_fence(memory_order_release);
+
+	*data = ring->data + index * ring->header->slot_size;
+
+	return number;
+}
+
+//slot memory belongs to the ring, opaque holds frame number
+static void hvd_shm_buffer_free(void *opaque, uint8_t *data)
+{
+	(void)opaque;
+	(void)data;
+}
+
+int hvd_shm_get_buffer(void *opaque, AVFrame *frame)
+{
+	struct hvd_shm *ring = (struct hvd_shm*)opaque;
+	const int size = av_image_get_buffer_size(frame->format, frame->width, frame->height, HVD_SHM_ALIGN);
+	uint64_t number;
+	uint8_t *data;
+
+	if(!ring->publisher || size <= 0 || (uint64_t)size > ring->header->slot_size)
+	{
+		hvd_log(NULL, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "%s %dx%d frame doesn't fit ring slot",
+			av_get_pix_fmt_name(frame->format), frame->width, frame->height);
+		return AVERROR(EINVAL);
+	}
+
+	number = hvd_shm_claim(ring, &data);
+
+	if( (frame->buf[0] = av_buffer_create(data, size, hvd_shm_buffer_free, (void*)(uintptr_t)number, 0)) == NULL )
+		return AVERROR(ENOMEM);
+
+	return av_image_fill_arrays(frame->data, frame->linesize, data, frame->format, frame->width, frame->height, HVD_SHM_ALIGN);
+}
+
+int hvd_shm_publish(struct hvd_shm *ring, const AVFrame *frame)
+{
+	const struct hvd_shm_header *header = ring->header;
+	const int size = av_image_get_buffer_size(frame->format, frame->width, frame->height, HVD_SHM_ALIGN);
+	const int in_ring = ring->publisher && frame->buf[0] &&
+		frame->data[0] >= ring->data && frame->data[0] < ring->data + header->slots * header->slot_size;
+	uint8_t *data, *planes[4] = {NULL};
+	int linesize[4] = {0};
+	struct hvd_shm_slot *slot;
+	uint64_t number;
+
+	if(!ring->publisher || frame->hw_frames_ctx || size <= 0 || (uint64_t)size > header->slot_size)
+	{
+		hvd_log(NULL, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "%s %dx%d frame can't be published (hardware frame or too large for ring)",
+			av_get_pix_fmt_name(frame->format), frame->width, frame->height);
+		return HVD_ERROR;
+	}
+
+	if(in_ring)
+	{	//decoded to the ring with hvd_shm_get_buffer, no copy
+		const uint64_t index = (frame->data[0] - ring->data) / header->slot_size;
+
+		number = (uintptr_t)av_buffer_get_opaque(frame->buf[0]);
+		slot = &ring->slots[index];
+		data = ring->data + index * header->slot_size;
+
+		if(atomic_load_explicit(&slot->sequence, memory_order_relaxed) != 2 * number - 1)
+		{
+			hvd_log(NULL, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "ring slot reused before publishing, use more ring slots");
+			return HVD_ERROR;
+		}
+
+		for(int i = 0; i < 4; ++i)
+		{
+			planes[i] = frame->data[i];
+			linesize[i] = frame->linesize[i];
+		}
+	}
+	else
+	{	//copy to the next slot
+		number = hvd_shm_claim(ring, &data);
+		slot = &ring->slots[(number - 1) % header->slots];
+
+		av_image_fill_arrays(planes, linesize, data, frame->format, frame->width, frame->height, HVD_SHM_ALIGN);
+		av_image_copy(planes, linesize, (const uint8_t **)frame->data, frame->linesize,
+			frame->format, frame->width, frame->height);
+	}
+
+	slot->format = frame->format;
+	slot->width = frame->width;
+	slot->height = frame->height;
+	slot->pts = frame->pts;
+
+	for(int i = 0; i < 4; ++i)
+	{
+		slot->linesize[i] = planes[i] ? linesize[i] : 0;
+		slot->offset[i] = planes[i] ? (uint32_t)(planes[i] - data) : 0;
+	}
+
+	atomic_store_explicit(&slot->sequence, 2 * number, memory_order_release);
+
+	//frames are published in order, only the publisher writes latest
+	if(number > atomic_load_explicit(&ring->header->latest, memory_order_relaxed))
+	{
+		atomic_store_explicit(&ring->header->latest, number, memory_order_release);
+		atomic_store_explicit(&ring->header->futex, (unsigned int)number, memory_order_release);
+#ifdef __linux__
+		syscall(SYS_futex, &ring->header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+	}
+
+	return HVD_OK;
+}
+
+uint64_t hvd_shm_latest(const struct hvd_shm *ring)
+{
+	return atomic_load_explicit(&ring->header->latest, memory_order_acquire);
+}
+
+int hvd_shm_wait(const struct hvd_shm *ring, uint64_t number, int timeout_ms)
+{
+	const int64_t deadline = av_gettime_relative() + (int64_t)timeout_ms * 1000;
+	int64_t remaining;
+
+	while(1)
+	{
+		//read before latest, publisher changes it after latest so the wake up is never missed
+		const unsigned int futex = atomic_load_explicit(&ring->header->futex, memory_order_acquire);
+
+		if(atomic_load_explicit(&ring->header->latest, memory_order_acquire) > number)
+			return HVD_OK;
+
+		if( (remaining = deadline - av_gettime_relative()) <= 0 )
+			return HVD_AGAIN;
+
+#ifdef __linux__
+		struct timespec timeout = {remaining / 1000000, (remaining % 1000000) * 1000};
+		syscall(SYS_futex, &ring->header->futex, FUTEX_WAIT, futex, &timeout, NULL, 0);
+#else
+		(void)futex;
+		av_usleep(FFMIN(remaining, 1000));
+#endif
+	}
+}
+
+int hvd_shm_read(const struct hvd_shm *ring, uint64_t number, struct hvd_shm_frame *frame)
+{
+	const struct hvd_shm_header *header = ring->header;
+	const struct hvd_shm_slot *slot;
+	const uint8_t *data;
+	uint64_t index;
+
+	if(number == 0 || number > atomic_load_explicit(&header->latest, memory_order_acquire))
+		return HVD_AGAIN;
+
+	index = (number - 1) % header->slots;
+	slot = &ring->slots[index];
+	data = ring->data + index * header->slot_size;
+
+	if(atomic_load_explicit(&slot->sequence, memory_order_acquire) != 2 * number)
+		return HVD_ERROR;
+
+	frame->number = number;
+	frame->format = slot->format;
+	frame->width = slot->width;
+	frame->height = slot->height;
+	frame->pts = slot->pts;
+
+	for(int i = 0; i < 4; ++i)
+	{
+		//publisher is trusted but the data pointers have to stay in the mapping
+		frame->data[i] = (slot->linesize[i] && slot->offset[i] < header->slot_size) ? data + slot->offset[i] : NULL;
+		frame->linesize[i] = frame->data[i] ? slot->linesize[i] : 0;
+	}
+
+	return hvd_shm_check(ring, frame);
+}
+
+int hvd_shm_check(const struct hvd_shm *ring, const struct hvd_shm_frame *frame)
+{
+	const struct hvd_shm_slot *slot = &ring->slots[(frame->number - 1) % ring->header->slots];
+
+	//the data reads have to complete before sequence is checked again
+	atomic_thread_fence(memory_order_acquire);
+
+	return atomic_load_explicit(&slot->sequence, memory_order_relaxed) == 2 * frame->number ? HVD_OK : HVD_ERROR;
+}
+
+//memory-mapped file source
+
+struct hvd_file *hvd_file_open(const struct hvd_file_config *config)
+{
+	struct hvd_file *f, zero_file = {0};
+	int ivf;
+
+	if( (f = (struct hvd_file*)malloc(sizeof(struct hvd_file))) == NULL )
+		return hvd_file_close_and_return_null(NULL, "not enough memory for file", NULL);
+
+	*f = zero_file;
+
+	if(config->path == NULL)
+		return hvd_file_close_and_return_null(f, "file path not set", NULL);
+
+	if(hvd_file_map(f, config->path) != HVD_OK)
+		return hvd_file_close_and_return_null(f, NULL, NULL);
+
+	ivf = f->size >= HVD_IVF_HEADER && memcmp(f->map->data, "DKIF", 4) == 0;
+
+	if( (f->codec = hvd_file_codec(f, config->codec)) == AV_CODEC_ID_NONE )
+		return hvd_file_close_and_return_null(f, "unknown codec of file (set codec for Annex B)", config->codec ? config->codec : config->path);
+
+	if(config->index_path && hvd_file_index_load(f, config->index_path) == HVD_OK)
+		f->index_loaded = 1;
+	else
+	{
+		if( (ivf ? hvd_file_index_ivf(f) : hvd_file_index_annexb(f)) != HVD_OK )
+			return hvd_file_close_and_return_null(f, "unable to index file", config->path);
+
+		//the index is only a cache, work without it
+		if(config->index_path && hvd_file_index_save(f, config->index_path) != HVD_OK)
+			hvd_log(NULL, HVD_LOG_WARNING, HVD_LOG_GENERAL, "unable to write index %s", config->index_path);
+	}
+
+	if(hvd_file_index_finish(f) != HVD_OK)
+		return hvd_file_close_and_return_null(f, NULL, NULL);
+
+	return f;
+}
+
+void hvd_file_close(struct hvd_file *f)
+{
+	if(f == NULL)
+		return;
+
+	//packets still in decoders keep the mapping
+	av_buffer_unref(&f->map);
+	av_buffer_unref(&f->tail);
+	free(f->entries);
+	free(f->keyframes);
+	free(f);
+}
+
+static struct hvd_file *hvd_file_close_and_return_null(struct hvd_file *f, const char *msg, const char *msg_details)
+{
+	HVD_ERROR_MSG(NULL, msg, msg_details);
+	hvd_file_close(f);
+
+	return NULL;
+}
+
+//maps the whole file read-only, sets map, size and mtime
+static int hvd_file_map(struct hvd_file *f, const char *path)
+{
+#ifdef HVD_MMAP
+	struct stat info;
+	void *data;
+	int fd;
+
+	if( (fd = open(path, O_RDONLY)) == -1 )
+		return HVD_ERROR_MSG(NULL, "unable to open file", path);
+
+	if(fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) || info.st_size <= 0 || (uint64_t)info.st_size > SIZE_MAX)
+	{
+		close(fd);
+		return HVD_ERROR_MSG(NULL, "not a regular non-empty file", path);
+	}
+
+	data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	//the mapping holds the file
+	close(fd);
+
+	if(data == MAP_FAILED)
+		return HVD_ERROR_MSG(NULL, "unable to map file", strerror(errno));
+
+	//decoding reads mostly forward, read ahead aggressively
+	posix_madvise(data, info.st_size, POSIX_MADV_SEQUENTIAL);
+
+	//buffer size is informative only (int), munmap gets the real size in opaque
+	f->map = av_buffer_create((uint8_t*)data, (int)FFMIN(info.st_size, INT_MAX), hvd_file_unmap,
+		(void*)(uintptr_t)info.st_size, AV_BUFFER_FLAG_READONLY);
+
+	if(f->map == NULL)
+	{
+		munmap(data, info.st_size);
+		return HVD_ERROR_MSG(NULL, "not enough memory for file mapping", NULL);
+	}
+
+	f->size = info.st_size;
+#ifdef __APPLE__
+	f->mtime = info.st_mtimespec.tv_sec * INT64_C(1000000000) + info.st_mtimespec.tv_nsec;
+#else
+	f->mtime = info.st_mtim.tv_sec * INT64_C(1000000000) + info.st_mtim.tv_nsec;
+#endif
+
+	return HVD_OK;
+#else
+	(void)f;
+	(void)path;
+	return HVD_ERROR_MSG(NULL, "memory-mapped file not supported on the platform", NULL);
+#endif
+}
+
+static void hvd_file_unmap(void *opaque, uint8_t *data)
+{
+#ifdef HVD_MMAP
+	munmap(data, (size_t)(uintptr_t)opaque);
+#else
+	(void)opaque;
+	(void)data;
+#endif
+}
+
+//codec set by user or from IVF header
+static enum AVCodecID hvd_file_codec(const struct hvd_file *f, const char *codec)
+{
+	const AVCodec *decoder;
+	const uint8_t *fourcc = f->map->data + 8;
+
+	if(codec)
+		return (decoder = avcodec_find_decoder_by_name(codec)) ? decoder->id : AV_CODEC_ID_NONE;
+
+	if(f->size < HVD_IVF_HEADER || memcmp(f->map->data, "DKIF", 4) != 0)
+		return AV_CODEC_ID_NONE;
+
+	if(memcmp(fourcc, "VP80", 4) == 0)
+		return AV_CODEC_ID_VP8;
+	if(memcmp(fourcc, "VP90", 4) == 0)
+		return AV_CODEC_ID_VP9;
+#ifdef HVD_AV1
+	if(memcmp(fourcc, "AV01", 4) == 0)
+		return AV_CODEC_ID_AV1;
+#endif
+
+	return AV_CODEC_ID_NONE;
+}
+
+//IVF frames are packets, truncated last frame (e.g. interrupted recording) ends the index
+static int hvd_file_index_ivf(struct hvd_file *f)
+{
+	const uint8_t *data = f->map->data;
+	int64_t offset = data[6] | (data[7] << 8);
+
+	while(offset + HVD_IVF_FRAME_HEADER <= f->size)
+	{
+		const uint8_t *header = data + offset;
+		const uint32_t size = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+
+		offset += HVD_IVF_FRAME_HEADER;
+
+		if(size == 0 || size > INT_MAX || offset + size > f->size)
+		{
+			hvd_log(NULL, HVD_LOG_WARNING, HVD_LOG_GENERAL, "truncated IVF frame at %lld, ignoring the rest", (long long)offset);
+			break;
+		}
+
+		if(hvd_file_index_add(f, offset, (int)size) != HVD_OK)
+			return HVD_ERROR;
+
+		offset += size;
+	}
+
+	return HVD_OK;
+}
+
+//access units found by libavcodec parser
+static int hvd_file_index_annexb(struct hvd_file *f)
+{
+	uint8_t tail[2 * AV_INPUT_BUFFER_PADDING_SIZE] = {0};
+	const int tail_size = (int)FFMIN(f->size, AV_INPUT_BUFFER_PADDING_SIZE);
+	const int64_t main_size = f->size - tail_size;
+	AVCodecParserContext *parser;
+	AVCodecContext *parser_ctx;
+	int64_t position, offset = 0;
+	int ret = HVD_OK;
+
+	if( (parser = av_parser_init(f->codec)) == NULL )
+		return HVD_ERROR_MSG(NULL, "no parser for codec", avcodec_get_name(f->codec));
+
+	if( (parser_ctx = avcodec_alloc_context3(NULL)) == NULL )
+	{
+		av_parser_close(parser);
+		return HVD_ERROR_MSG(NULL, "failed to alloc parser context, no memory?", NULL);
+	}
+
+	parser_ctx->codec_id = f->codec;
+
+	//parser may read padding after data, in the mapping that is the following data,
+	//the last bytes are parsed from zero padded copy, the mapping may end at file end
+	for(position = 0; position < main_size && ret == HVD_OK; position += INT_MAX / 2)
+		ret = hvd_file_index_parse(f, parser, parser_ctx, f->map->data + position,
+			(int)FFMIN(main_size - position, INT_MAX / 2), position, &offset);
+
+	memcpy(tail, f->map->data + main_size, tail_size);
+
+	if(ret == HVD_OK)
+		ret = hvd_file_index_parse(f, parser, parser_ctx, tail, tail_size, main_size, &offset);
+	//flush parser, the last packet
+	if(ret == HVD_OK)
+		ret = hvd_file_index_parse(f, parser, parser_ctx, NULL, 0, f->size, &offset);
+
+	av_parser_close(parser);
+	avcodec_free_context(&parser_ctx);
+
+	return ret;
+}
+
+//parse data of the file at data_offset (NULL to flush), offset is where the next packet starts
+static int hvd_file_index_parse(struct hvd_file *f, AVCodecParserContext *parser, AVCodecContext *parser_ctx,
+	const uint8_t *data, int size, int64_t data_offset, int64_t *offset)
+{
+	const uint8_t *start = data;
+	uint8_t *packet;
+	int used, packet_size;
+
+	do
+	{
+		used = av_parser_parse2(parser, parser_ctx, &packet, &packet_size, data, size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+
+		if(used < 0)
+			return HVD_ERROR_MSG(NULL, "error while parsing file", NULL);
+
+		data += used;
+		size -= used;
+
+		if(packet_size == 0)
+			continue;
+
+		//packet inside data tells its offset, packet spanning chunks is in parser buffer
+		if(start && packet >= start && packet + packet_size <= data)
+			*offset = data_offset + (packet - start);
+		else if(*offset + packet_size > f->size || memcmp(f->map->data + *offset, packet, packet_size) != 0)
+			return HVD_ERROR_MSG(NULL, "unable to locate parsed packet in file", NULL);
+
+		if(hvd_file_index_add(f, *offset, packet_size) != HVD_OK)
+			return HVD_ERROR;
+
+		*offset += packet_size;
+	}
+	while(size > 0);
+
+	return HVD_OK;
+}
+
+static int hvd_file_index_add(struct hvd_file *f, int64_t offset, int size)
+{
+	struct hvd_file_entry *entry;
+
+	if(f->count == f->capacity)
+	{
+		const int64_t capacity = f->capacity ? 2 * f->capacity : 1024;
+
+		if( (entry = (struct hvd_file_entry*)realloc(f->entries, capacity * sizeof(struct hvd_file_entry))) == NULL )
+			return HVD_ERROR_MSG(NULL, "not enough memory for file index", NULL);
+
+		f->entries = entry;
+		f->capacity = capacity;
+	}
+
+	entry = &f->entries[f->count++];
+	entry->offset = offset;
+	entry->size = size;
+	entry->key = hvd_keyframe(f->codec, f->map->data + offset, size);
+
+	return HVD_OK;
+}
+
+//keyframe list and zero padded tail from entries
+static int hvd_file_index_finish(struct hvd_file *f)
+{
+	int64_t i, start;
+
+	if(f->count == 0)
+		return HVD_ERROR_MSG(NULL, "no frames in file", NULL);
+
+	if( (f->keyframes = (int64_t*)malloc(f->count * sizeof(int64_t))) == NULL )
+		return HVD_ERROR_MSG(NULL, "not enough memory for keyframe index", NULL);
+
+	//decoding starts with packets before keyframe that have no picture (e.g. parameter sets)
+	for(i = 0; i < f->count; ++i)
+		if(f->entries[i].key == 1)
+		{
+			for(start = i; start > 0 && f->entries[start - 1].key < 0; --start)
+				;
+
+			if(f->keyframe_count == 0 || f->keyframes[f->keyframe_count - 1] < start)
+				f->keyframes[f->keyframe_count++] = start;
+		}
+
+	//packets without padding in file are served from copy
+	for(i = f->count; i > 0 && f->entries[i - 1].offset + f->entries[i - 1].size + AV_INPUT_BUFFER_PADDING_SIZE > f->size; --i)
+		;
+
+	if(i == f->count)
+		return HVD_OK;
+
+	f->tail_offset = f->entries[i].offset;
+
+	if( (f->tail = av_buffer_allocz((int)(f->size - f->tail_offset + AV_INPUT_BUFFER_PADDING_SIZE))) == NULL )
+		return HVD_ERROR_MSG(NULL, "not enough memory for file tail", NULL);
+
+	memcpy(f->tail->data, f->map->data + f->tail_offset, f->size - f->tail_offset);
+
+	return HVD_OK;
+}
+
+//HVD_OK if sidecar index exists and matches the file, sets entries and count
+static int hvd_file_index_load(struct hvd_file *f, const char *path)
+{
+	struct hvd_file_index_header header;
+	FILE *file = fopen(path, "rb");
+	int64_t i, end = 0;
+
+	if(file == NULL)
+		return HVD_ERROR;
+
+	if(fread(&header, sizeof(header), 1, file) != 1 || header.magic != HVD_FILE_MAGIC || header.version != HVD_FILE_VERSION ||
+		header.file_size != f->size || header.file_mtime != f->mtime || header.codec != (int32_t)f->codec ||
+		header.entry_size != (int32_t)sizeof(struct hvd_file_entry) || header.count <= 0 || header.count > f->size)
+	{
+		fclose(file);
+		return HVD_ERROR;
+	}
+
+	if( (f->entries = (struct hvd_file_entry*)malloc(header.count * sizeof(struct hvd_file_entry))) == NULL ||
+		fread(f->entries, sizeof(struct hvd_file_entry), header.count, file) != (size_t)header.count )
+	{
+		fclose(file);
+		free(f->entries);
+		f->entries = NULL;
+		return HVD_ERROR;
+	}
+
+	fclose(file);
+
+	//ascending, non-overlapping and inside the file
+	for(i = 0; i < header.count; ++i)
+	{
+		const struct hvd_file_entry *entry = &f->entries[i];
+
+		if(entry->offset < end || entry->size <= 0 || entry->offset + entry->size > f->size || entry->key < -1 || entry->key > 1)
+		{
+			free(f->entries);
+			f->entries = NULL;
+			return HVD_ERROR_MSG(NULL, "corrupted index, rebuilding", path);
+		}
+
+		end = entry->offset + entry->size;
+	}
+
+	f->count = f->capacity = header.count;
+
+	return HVD_OK;
+}
+
+static int hvd_file_index_save(const struct hvd_file *f, const char *path)
+{
+	struct hvd_file_index_header header = {0};
+
+	header.magic = HVD_FILE_MAGIC;
+	header.version = HVD_FILE_VERSION;
+	header.file_size = f->size;
+	header.file_mtime = f->mtime;
+	header.codec = f->codec;
+	header.entry_size = sizeof(struct hvd_file_entry);
+	header.count = f->count;
+
+	return hvd_cache_save(path, &header, sizeof(header), f->entries, sizeof(struct hvd_file_entry), f->count);
+}
+
+//header and entries written to temporary file and renamed, readers never see partial file
+static int hvd_cache_save(const char *path, const void *header, size_t header_size, const void *entries, size_t entry_size, int64_t count)
+{
+	//unique for processes starting together, exclusive in case it is not
+	char *temporary = av_asprintf("%s.%lld.tmp", path, (long long)av_gettime());
+	FILE *file;
+	int ret = HVD_ERROR;
+
+	if(temporary == NULL)
+		return HVD_ERROR;
+
+	if( (file = fopen(temporary, "wbx")) != NULL )
+	{
+		if(fwrite(header, header_size, 1, file) == 1 &&
+			(count == 0 || fwrite(entries, entry_size, count, file) == (size_t)count))
+			ret = HVD_OK;
+
+		if(fclose(file) != 0)
+			ret = HVD_ERROR;
+
+		if(ret == HVD_OK && rename(temporary, path) != 0)
+			ret = HVD_ERROR;
+
+		if(ret != HVD_OK)
+			remove(temporary);
+	}
+
+	av_free(temporary);
+
+	return ret;
+}
+
+int hvd_file_read(struct hvd_file *f, struct hvd_packet *packet)
+{
+	struct hvd_packet zero_packet = {0};
+
+	if(f->next >= f->count)
+	{	//end of file, flush
+		*packet = zero_packet;
+		return HVD_OK;
+	}
+
+	return hvd_file_packet(f, f->next++, packet);
+}
+
+int hvd_file_packet(const struct hvd_file *f, int64_t frame, struct hvd_packet *packet)
+{
+	struct hvd_packet zero_packet = {0};
+	const struct hvd_file_entry *entry;
+
+	*packet = zero_packet;
+
+	if(frame < 0 || frame >= f->count)
+		return HVD_ERROR_MSG(NULL, "no such frame in file", NULL);
+
+	entry = &f->entries[frame];
+
+	if(f->tail && entry->offset >= f->tail_offset)
+	{
+		packet->buf = f->tail;
+		packet->data = f->tail->data + (entry->offset - f->tail_offset);
+	}
+	else
+	{
+		packet->buf = f->map;
+		packet->data = f->map->data + entry->offset;
+	}
+
+	packet->size = entry->size;
+	packet->pts = frame;
+
+	return HVD_OK;
+}
+
+int64_t hvd_file_seek(struct hvd_file *f, int64_t frame)
+{
+	int64_t low = 0, high = f->keyframe_count;
+
+	if(frame < 0 || frame >= f->count)
+		return HVD_ERROR_MSG(NULL, "no such frame in file", NULL);
+
+	//the last keyframe at or before frame (binary search finds the first one after it)
+	while(low < high)
+	{
+		const int64_t middle = low + (high - low) / 2;
+
+		if(f->keyframes[middle] <= frame)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if(low == 0)
+		return HVD_ERROR_MSG(NULL, "no keyframe before frame", NULL);
+
+	return f->next = f->keyframes[low - 1];
+}
+
+void hvd_file_get_info(const struct hvd_file *f, struct hvd_file_info *info)
+{
+	info->size = f->size;
+	info->frames = f->count;
+	info->keyframes = f->keyframe_count;
+	info->index_loaded = f->index_loaded;
+}
+
+//capability probe
+
+int hvd_probe(const struct hvd_probe_config *config, struct hvd_probe *probe)
+{
+	const int64_t start = av_gettime_relative();
+	struct hvd_probe zero_probe = {0};
+
+	*probe = zero_probe;
+
+	if(config->hardware == NULL)
+		return HVD_ERROR_MSG(NULL, "probe hardware not set", NULL);
+
+	hvd_global_init();
+
+	av_strlcpy(probe->hardware, config->hardware, sizeof(probe->hardware));
+	av_strlcpy(probe->device, config->device ? config->device : "", sizeof(probe->device));
+	hvd_probe_key(probe, config);
+
+	if(config->cache_path && hvd_probe_cache_load(config->cache_path, probe) == HVD_OK)
+	{
+		probe->cached = 1;
+		probe->probe_time = av_gettime_relative() - start;
+		return HVD_OK;
+	}
+
+	//software stand-in (e.g. testing without GPU)
+	if(strcmp(config->hardware, "software") == 0)
+		hvd_probe_software(probe);
+	else if(hvd_probe_hardware(probe, config->hardware, config->device) != HVD_OK)
+		return HVD_ERROR;
+
+	probe->probe_time = av_gettime_relative() - start;
+
+	//the cache only saves time, work without it
+	if(config->cache_path && hvd_probe_cache_save(config->cache_path, probe) != HVD_OK)
+		hvd_log(NULL, HVD_LOG_WARNING, HVD_LOG_GENERAL, "unable to write probe cache %s", config->cache_path);
+
+	return HVD_OK;
+}
+
+int hvd_probe_check(const struct hvd_probe *probe, const struct hvd_config *config)
+{
+	const AVCodec *decoder;
+	enum AVPixelFormat pixel_format;
+	int codec = 0;
+
+	if(config->shared_device == NULL && (config->hardware == NULL || strcmp(config->hardware, probe->hardware) != 0))
+		return HVD_ERROR;
+
+	if(config->codec == NULL || (decoder = avcodec_find_decoder_by_name(config->codec)) == NULL)
+		return HVD_ERROR;
+
+	for(int i = 0; i < probe->codec_count && !codec; ++i)
+		codec = ((enum AVCodecID)probe->codecs[i].codec_id == decoder->id);
+
+	if(!codec)
+		return HVD_ERROR;
+
+	if(config->width && (config->width < probe->min_width || (probe->max_width && config->width > probe->max_width)))
+		return HVD_ERROR;
+
+	if(config->height && (config->height < probe->min_height || (probe->max_height && config->height > probe->max_height)))
+		return HVD_ERROR;
+
+	//pixel format matters only when data is downloaded
+	if(config->output != HVD_OUTPUT_TRANSFER || config->pixel_format == NULL || config->pixel_format[0] == '\0')
+		return HVD_OK;
+
+	if( (pixel_format = av_get_pix_fmt(config->pixel_format)) == AV_PIX_FMT_NONE )
+		return HVD_ERROR;
+
+	//downloaded directly or converted on CPU after download
+	for(int i = 0; i < probe->format_count; ++i)
+	{
+		const struct hvd_probe_format *format = &probe->formats[i];
+
+		if(format->sw_format == pixel_format || hvd_convert_supported(format->sw_format, pixel_format))
+			return HVD_OK;
+
+		for(int j = 0; j < format->transfer_count; ++j)
+			if(format->transfer_formats[j] == pixel_format || hvd_convert_supported(format->transfer_formats[j], pixel_format))
+				return HVD_OK;
+	}
+
+	return HVD_ERROR;
+}
+
+//errors logged
+static int hvd_probe_hardware(struct hvd_probe *probe, const char *hardware, const char *device)
+{
+	//if device doesn't report surface formats, the ones surfaces are prepared in (hvd_hw_frames_sw_format)
+	const enum AVPixelFormat default_formats[] = {AV_PIX_FMT_NV12, AV_PIX_FMT_P010LE, AV_PIX_FMT_NONE};
+	const enum AVPixelFormat *sw_formats = default_formats;
+	AVHWFramesConstraints *constraints;
+	AVBufferRef *hw_device_ctx = NULL;
+	enum AVPixelFormat hw_pix_fmt;
+
+	if(hvd_hw_device_open(NULL, &hw_device_ctx, &hw_pix_fmt, hardware, device) != HVD_OK)
+		return HVD_ERROR;
+
+	probe->hw_pix_fmt = hw_pix_fmt;
+
+	hvd_probe_codecs(probe, av_hwdevice_find_type_by_name(hardware), hw_pix_fmt);
+
+	if( (constraints = av_hwdevice_get_hwframe_constraints(hw_device_ctx, NULL)) != NULL )
+	{
+		probe->min_width = constraints->min_width;
+		probe->min_height = constraints->min_height;
+		probe->max_width = constraints->max_width;
+		probe->max_height = constraints->max_height;
+
+		if(constraints->valid_sw_formats)
+			sw_formats = constraints->valid_sw_formats;
+	}
+
+	for(int i = 0; sw_formats[i] != AV_PIX_FMT_NONE && probe->format_count < HVD_PROBE_FORMATS; ++i)
+		hvd_probe_format(probe, hw_device_ctx, hw_pix_fmt, sw_formats[i]);
+
+	av_hwframe_constraints_free(&constraints);
+	av_buffer_unref(&hw_device_ctx);
+
+	return HVD_OK;
+}
+
+//software decoders output planar 4:2:0, copied or converted like surfaces
+static void hvd_probe_software(struct hvd_probe *probe)
+{
+	const enum AVPixelFormat sw_formats[] = {AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV420P10LE};
+
+	probe->hw_pix_fmt = AV_PIX_FMT_NONE;
+
+	hvd_probe_codecs(probe, AV_HWDEVICE_TYPE_NONE, AV_PIX_FMT_NONE);
+
+	for(int i = 0; i < (int)(sizeof(sw_formats) / sizeof(sw_formats[0])); ++i)
+	{
+		struct hvd_probe_format *format = &probe->formats[probe->format_count++];
+
+		format->sw_format = sw_formats[i];
+		format->transfer_formats[0] = sw_formats[i];
+		format->transfer_count = 1;
+	}
+}
+
+//decoders by name as in hvd_config.codec, with hardware support if type is set
+static void hvd_probe_codecs(struct hvd_probe *probe, enum AVHWDeviceType type, enum AVPixelFormat hw_pix_fmt)
+{
+	const char *names[] = {"h264", "hevc", "vp8", "vp9", "av1", "mpeg2video", "vc1", "mjpeg"};
+
+	for(int i = 0; i < (int)(sizeof(names) / sizeof(names[0])) && probe->codec_count < HVD_PROBE_CODECS; ++i)
+	{
+		const AVCodec *decoder = avcodec_find_decoder_by_name(names[i]);
+		struct hvd_probe_codec *codec = &probe->codecs[probe->codec_count];
+
+		if(decoder == NULL || (type != AV_HWDEVICE_TYPE_NONE && !hvd_probe_codec_hardware(decoder, type, hw_pix_fmt)))
+			continue;
+
+		av_strlcpy(codec->name, decoder->name, sizeof(codec->name));
+		codec->codec_id = decoder->id;
+
+		for(const AVProfile *profile = decoder->profiles; profile && profile->profile != FF_PROFILE_UNKNOWN &&
+			codec->profile_count < HVD_PROBE_PROFILES; ++profile)
+			codec->profiles[codec->profile_count++] = profile->profile;
+
+		++probe->codec_count;
+	}
+}
+
+//non-zero if libavcodec decodes the codec on the hardware (not whether the driver does)
+static int hvd_probe_codec_hardware(const AVCodec *decoder, enum AVHWDeviceType type, enum AVPixelFormat hw_pix_fmt)
+{
+#ifdef HVD_HW_CONFIG
+	const AVCodecHWConfig *config;
+
+	(void)hw_pix_fmt;
+
+	for(int i = 0; (config = avcodec_get_hw_config(decoder, i)) != NULL; ++i)
+		if(config->device_type == type && (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX))
+			return 1;
+#else
+	//FFmpeg 3.4, hardware accelerations registered for codec and hardware pixel format
+	AVHWAccel *hwaccel = NULL;
+
+	(void)type;
+
+	while( (hwaccel = av_hwaccel_next(hwaccel)) != NULL )
+		if(hwaccel->id == decoder->id && hwaccel->pix_fmt == hw_pix_fmt)
+			return 1;
+#endif
+	return 0;
+}
+
+//surface format is usable if surfaces can be created, lists formats they can be downloaded as
+static void hvd_probe_format(struct hvd_probe *probe, AVBufferRef *hw_device_ctx, enum AVPixelFormat hw_pix_fmt, enum AVPixelFormat sw_format)
+{
+	struct hvd_probe_format *format = &probe->formats[probe->format_count];
+	enum AVPixelFormat *transfer_formats;
+	AVBufferRef *hw_frames_ctx;
+	AVHWFramesContext *frames;
+
+	if( (hw_frames_ctx = av_hwframe_ctx_alloc(hw_device_ctx)) == NULL )
+		return;
+
+	frames = (AVHWFramesContext*)hw_frames_ctx->data;
+	frames->format = hw_pix_fmt;
+	frames->sw_format = sw_format;
+	frames->width = FFMAX(probe->min_width, HVD_PROBE_SURFACE);
+	frames->height = FFMAX(probe->min_height, HVD_PROBE_SURFACE);
+	frames->initial_pool_size = 1;
+
+	if(av_hwframe_ctx_init(hw_frames_ctx) == 0 &&
+		av_hwframe_transfer_get_formats(hw_frames_ctx, AV_HWFRAME_TRANSFER_DIRECTION_FROM, &transfer_formats, 0) == 0)
+	{
+		format->sw_format = sw_format;
+
+		for(int i = 0; transfer_formats[i] != AV_PIX_FMT_NONE && format->transfer_count < HVD_PROBE_FORMATS; ++i)
+			format->transfer_formats[format->transfer_count++] = transfer_formats[i];
+
+		av_freep(&transfer_formats);
+		++probe->format_count;
+	}
+
+	av_buffer_unref(&hw_frames_ctx);
+}
+
+//hardware, device, FFmpeg, driver and user key, the probe is valid while they don't change
+static void hvd_probe_key(struct hvd_probe *probe, const struct hvd_probe_config *config)
+{
+	char driver[HVD_PROBE_KEY / 2] = "";
+
+	hvd_probe_driver(probe->device, driver, sizeof(driver));
+
+	//truncated key could match stale cache
+	if(snprintf(probe->key, sizeof(probe->key), "hardware=%s;device=%s;ffmpeg=%s;lavc=%u;lavu=%u;driver=%s;user=%s",
+		probe->hardware, probe->device, av_version_info(), avcodec_version(), avutil_version(), driver,
+		config->cache_key ? config->cache_key : "") >= (int)sizeof(probe->key))
+		hvd_log(NULL, HVD_LOG_WARNING, HVD_LOG_GENERAL, "probe cache key truncated, use shorter cache_key");
+}
+
+//what identifies the driver without vendor libraries
+static void hvd_probe_driver(const char *device, char *driver, int size)
+{
+#ifdef __linux__
+	struct utsname system;
+	char path[HVD_PROBE_NAME + 64], line[HVD_PROBE_NAME] = "", link[HVD_PROBE_NAME];
+	const char *env = getenv("LIBVA_DRIVER_NAME");
+	int length = 0;
+	ssize_t link_length;
+
+	//in-kernel drivers (e.g. i915, amdgpu) change with kernel
+	if(uname(&system) == 0)
+		length += snprintf(driver + length, size - length, "kernel %s", system.release);
+
+	//render node, e.g. /dev/dri/renderD128, DRM driver and PCI id
+	if(length < size && strncmp(device, "/dev/dri/", 9) == 0)
+	{
+		snprintf(path, sizeof(path), "/sys/class/drm/%s/device/driver", device + 9);
+
+		if( (link_length = readlink(path, link, sizeof(link) - 1)) > 0 )
+		{
+			link[link_length] = '\0';
+			length += snprintf(driver + length, size - length, " drm %s", strrchr(link, '/') ? strrchr(link, '/') + 1 : link);
+		}
+
+		snprintf(path, sizeof(path), "/sys/class/drm/%s/device/device", device + 9);
+
+		if(length < size && hvd_probe_read_line(path, line, sizeof(line)) == HVD_OK)
+			length += snprintf(driver + length, size - length, " pci %s", line);
+	}
+
+	if(length < size && hvd_probe_read_line("/proc/driver/nvidia/version", line, sizeof(line)) == HVD_OK)
+		length += snprintf(driver + length, size - length, " %s", line);
+
+	if(length < size && env)
+		snprintf(driver + length, size - length, " libva %s", env);
+#else
+	(void)device;
+	(void)driver;
+	(void)size;
+#endif
+}
+
+//first line without new line character
+static int hvd_probe_read_line(const char *path, char *line, int size)
+{
+	FILE *file = fopen(path, "r");
+	int ret = HVD_ERROR;
+
+	if(file == NULL)
+		return HVD_ERROR;
+
+	if(fgets(line, size, file))
+	{
+		line[strcspn(line, "\n")] = '\0';
+		ret = HVD_OK;
+	}
+
+	fclose(file);
+
+	return ret;
+}
+
+//HVD_OK if cache has probe with the same key, probe is then overwritten
+static int hvd_probe_cache_load(const char *path, struct hvd_probe *probe)
+{
+	struct hvd_probe *records;
+	int count, ret = HVD_ERROR;
+
+	records = hvd_probe_cache_read(path, &count);
+
+	for(int i = 0; i < count && ret != HVD_OK; ++i)
+	{
+		const struct hvd_probe *record = &records[i];
+
+		if(strcmp(record->key, probe->key) != 0)
+			continue;
+
+		*probe = *record;
+		ret = HVD_OK;
+	}
+
+	free(records);
+
+	return ret;
+}
+
+//records of the other devices are kept, the record of this device (e.g. stale after driver update) is replaced
+static int hvd_probe_cache_save(const char *path, const struct hvd_probe *probe)
+{
+	struct hvd_probe_cache_header header = {0};
+	struct hvd_probe *records, *grown;
+	int count, kept = 0, ret;
+
+	records = hvd_probe_cache_read(path, &count);
+
+	for(int i = 0; i < count; ++i)
+		if(strcmp(records[i].hardware, probe->hardware) != 0 || strcmp(records[i].device, probe->device) != 0)
+			records[kept++] = records[i];
+
+	//the oldest record goes when full
+	if(kept == HVD_PROBE_CACHE_RECORDS)
+		memmove(records, records + 1, --kept * sizeof(struct hvd_probe));
+
+	//the record of this device goes last
+	if( (grown = (struct hvd_probe*)realloc(records, (kept + 1) * sizeof(struct hvd_probe))) == NULL )
+	{
+		free(records);
+		return HVD_ERROR;
+	}
+
+	records = grown;
+	records[kept] = *probe;
+
+	header.magic = HVD_PROBE_MAGIC;
+	header.version = HVD_PROBE_VERSION;
+	header.record_size = sizeof(struct hvd_probe);
+	header.count = kept + 1;
+
+	ret = hvd_cache_save(path, &header, sizeof(header), records, sizeof(struct hvd_probe), kept + 1);
+
+	free(records);
+
+	return ret;
+}
+
+//NULL and 0 count if cache is missing or unusable (e.g. other library version)
+static struct hvd_probe *hvd_probe_cache_read(const char *path, int *count)
+{
+	struct hvd_probe_cache_header header;
+	struct hvd_probe *records = NULL;
+	FILE *file = fopen(path, "rb");
+
+	*count = 0;
+
+	if(file == NULL)
+		return NULL;
+
+	if(fread(&header, sizeof(header), 1, file) == 1 && header.magic == HVD_PROBE_MAGIC && header.version == HVD_PROBE_VERSION &&
+		header.record_size == sizeof(struct hvd_probe) && header.count > 0 && header.count <= HVD_PROBE_CACHE_RECORDS &&
+		(records = (struct hvd_probe*)malloc(header.count * sizeof(struct hvd_probe))) != NULL)
+	{
+		int valid = fread(records, sizeof(struct hvd_probe), header.count, file) == header.count;
+
+		for(int i = 0; valid && i < (int)header.count; ++i)
+			valid = hvd_probe_record_valid(&records[i]);
+
+		if(valid)
+			*count = header.count;
+		else
+		{
+			free(records);
+			records = NULL;
+			HVD_ERROR_MSG(NULL, "corrupted probe cache, probing again", path);
+		}
+	}
+
+	fclose(file);
+
+	return records;
+}
+
+//counts are in range and strings terminated, cache may be corrupted or foreign
+static int hvd_probe_record_valid(struct hvd_probe *record)
+{
+	record->hardware[HVD_PROBE_NAME - 1] = record->device[HVD_PROBE_NAME - 1] = '\0';
+	record->key[HVD_PROBE_KEY - 1] = '\0';
+
+	if(record->codec_count < 0 || record->codec_count > HVD_PROBE_CODECS ||
+		record->format_count < 0 || record->format_count > HVD_PROBE_FORMATS)
+		return 0;
+
+	for(int i = 0; i < record->codec_count; ++i)
+	{
+		record->codecs[i].name[HVD_PROBE_NAME - 1] = '\0';
+
+		if(record->codecs[i].profile_count < 0 || record->codecs[i].profile_count > HVD_PROBE_PROFILES)
+			return 0;
+	}
+
+	for(int i = 0; i < record->format_count; ++i)
+		if(record->formats[i].transfer_count < 0 || record->formats[i].transfer_count > HVD_PROBE_FORMATS)
+			return 0;
+
+	return 1;
+}
+
+static void hvd_count(hvd_counter *counter, uint64_t value)
+{
+	atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+//time of the first call, later calls are ignored
+static void hvd_mark_first(hvd_counter *time)
+{
+	uint64_t unset = 0;
+
+	if(atomic_load_explicit(time, memory_order_relaxed) == 0)
+		atomic_compare_exchange_strong_explicit(time, &unset, av_gettime_relative(), memory_order_relaxed, memory_order_relaxed);
+}
+
+static void hvd_histogram_add(struct hvd_histogram *histogram, int64_t duration)
+{
+	int_fast64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+	int index = 0;
+
+	//bucket i holds durations < 2^i
+	for(int64_t d = duration; d > 0 && index < HVD_HISTOGRAM_BUCKETS - 1; d >>= 1)
+		++index;
+
+	hvd_count(&histogram->bucket[index], 1);
+
+	while(duration > max &&
+		!atomic_compare_exchange_weak_explicit(&histogram->max, &max, duration, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+//the counters may change while reading, the result is approximate
+static void hvd_histogram_read(const struct hvd_histogram *histogram, struct hvd_timing *timing)
+{
+	uint64_t bucket[HVD_HISTOGRAM_BUCKETS];
+
+	timing->count = 0;
+
+	for(int i=0;i<HVD_HISTOGRAM_BUCKETS;++i)
+		timing->count += bucket[i] = atomic_load_explicit(&histogram->bucket[i], memory_order_relaxed);
+
+	timing->max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+	timing->p50 = hvd_histogram_percentile(bucket, timing->count, 50, timing->max);
+	timing->p99 = hvd_histogram_percentile(bucket, timing->count, 99, timing->max);
+}
+
+//upper bound of the bucket holding percentile, never above max
+static int64_t hvd_histogram_percentile(const uint64_t *bucket, uint64_t count, int percent, int64_t max)
+{
+	const uint64_t rank = (count * percent + 99) / 100;
+	uint64_t sum = 0;
+	int64_t bound;
+	int i;
+
+	if(count == 0)
+		return 0;
+
+	for(i=0;i<HVD_HISTOGRAM_BUCKETS - 1;++i)
+		if( (sum += bucket[i]) >= rank)
+			break;
+
+	bound = (i == 0) ? 0 : ((int64_t)1 << i) - 1;
+
+	return bound < max ? bound : max;
+}
+
+static int HVD_ERROR_MSG(const struct hvd *h, const char *msg, const char *msg_details)
+{
+	if(msg)
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_GENERAL, "%s %s", msg, msg_details ? msg_details : "");
+
+	return HVD_ERROR;
+}
+
+static void hvd_dump_sw_pix_formats(struct hvd *h, const AVFrame *hw_frame)
+{
+	enum AVPixelFormat *formats, *iterator;
+	char list[HVD_LOG_MESSAGE / 2] = "";
+	int length = 0;
+
+	if(av_hwframe_transfer_get_formats(hw_frame->hw_frames_ctx, AV_HWFRAME_TRANSFER_DIRECTION_FROM, &formats, 0) < 0)
+	{
+		hvd_log(h, HVD_LOG_ERROR, HVD_LOG_OUTPUT, "failed to get transfer formats");
+		return;
+	}
+
+	for(iterator = formats; *iterator != AV_PIX_FMT_NONE && length < (int)sizeof(list); ++iterator)
+		length += snprintf(list + length, sizeof(list) - length, " %s", av_get_pix_fmt_name(*iterator));
+
+	hvd_log(h, HVD_LOG_INFO, HVD_LOG_OUTPUT, "make sure you are using supported software pixel format:%s", list);
+
+	av_free(formats);
+}
+
+//NULL decoder logs to stderr (e.g. before decoder exists, shared device)
+static void hvd_log(const struct hvd *h, int level, int message_class, const char *format, ...)
+{
+	static struct hvd_log default_log = {.level = HVD_LOG_INFO, .rate = HVD_DEFAULT_LOG_RATE};
+	//the log of decoder is modified only by rate limiting (atomics)
+	struct hvd_log *log = h ? (struct hvd_log*)&h->log : &default_log;
+	char message[HVD_LOG_MESSAGE];
+	uint64_t suppressed;
+	va_list args;
+	int length;
+
+	//filter early, bad input shouldn't cost more than this
+	if(level > log->level || !hvd_log_allow(log, &log->limit[message_class], &suppressed))
+		return;
+
+	va_start(args, format);
+	length = vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	if(suppressed && length >= 0 && length < (int)sizeof(message))
+		snprintf(message + length, sizeof(message) - length, " (%llu similar messages suppressed)", (unsigned long long)suppressed);
+
+	if(log->callback)
+		log->callback(log->opaque, level, message);
+	else
+		fprintf(stderr, "hvd: %s\n", message);
+}
+
+//at most rate messages of the class per second, returns non-zero if message may be logged
+//and number of messages suppressed before it in suppressed
+static int hvd_log_allow(struct hvd_log *log, struct hvd_log_limit *limit, uint64_t *suppressed)
+{
+	const int64_t now = av_gettime_relative();
+	int_fast64_t window = atomic_load_explicit(&limit->window, memory_order_relaxed);
+
+	*suppressed = 0;
+
+	if(log->rate < 0)
+		return 1;
+
+	//new window, only one of concurrent threads starts it
+	if(now - window >= 1000000 &&
+		atomic_compare_exchange_strong_explicit(&limit->window, &window, now, memory_order_relaxed, memory_order_relaxed))
+		atomic_store_explicit(&limit->count, 0, memory_order_relaxed);
+
+	if(atomic_fetch_add_explicit(&limit->count, 1, memory_order_relaxed) >= log->rate)
+	{
+		hvd_count(&limit->suppressed, 1);
+		hvd_count(&log->suppressed, 1);
+		return 0;
+	}
+
+	*suppressed = atomic_exchange_explicit(&limit->suppressed, 0, memory_order_relaxed);
+	return 1;
 }
@@ -42,6 +42,141 @@ extern "C" {
  */
 struct hvd;
 
+/**
+ * @struct hvd_device
+ * @brief Hardware device shared by multiple decoders.
+ * @see hvd_device_init, hvd_device_close, hvd_config
+ */
+struct hvd_device;
+
+/**
+ * @struct hvd_shm
+ * @brief Shared memory ring of frames, publisher or reader side.
+ * @see hvd_shm_create, hvd_shm_attach, hvd_shm_close
+ */
+struct hvd_shm;
+
+/**
+ * @struct hvd_scheduler
+ * @brief Decoding of many streams on a set of devices and worker threads.
+ * @see hvd_scheduler_init, hvd_scheduler_close
+ */
+struct hvd_scheduler;
+
+/**
+ * @struct hvd_stream
+ * @brief Stream registered with the scheduler.
+ * @see hvd_scheduler_add_stream, hvd_scheduler_remove_stream
+ */
+struct hvd_stream;
+
+/**
+ * @struct hvd_file
+ * @brief Memory-mapped encoded file with frame index.
+ * @see hvd_file_open, hvd_file_close
+ */
+struct hvd_file;
+
+/**
+  * @brief Output modes of decoded frames
+  * @see hvd_config
+  */
+enum hvd_output_mode
+{
+	HVD_OUTPUT_TRANSFER=0, //!< copy (download) frame data to system memory
+	HVD_OUTPUT_HARDWARE=1, //!< return hardware frame (surface passthrough)
+	HVD_OUTPUT_MAP=2, //!< map hardware frame to system memory for reading
+};
+
+/**
+  * @brief Frame dropping policies (load shedding), combine with bitwise or
+  * @see hvd_config, hvd_set_drop_policy
+  */
+enum hvd_drop_policy
+{
+	HVD_DROP_NONE=0, //!< decode and return every frame
+	HVD_DROP_NONREF=1, //!< don't decode non-reference frames (libavcodec skip_frame)
+	HVD_DROP_UNREAD=2, //!< decode, but don't download frame if newer one is already decoded
+	HVD_DROP_LATEST=4, //!< return only the newest frame, discard stale frames not read yet
+	HVD_DROP_AUTO=8, //!< enable policies above by queue depth (hvd_config.drop_depth)
+};
+
+/**
+  * @brief Log levels of library messages
+  * @see hvd_config
+  */
+enum hvd_log_level
+{
+	HVD_LOG_QUIET=-1, //!< no messages
+	HVD_LOG_ERROR=1, //!< errors
+	HVD_LOG_WARNING=2, //!< recoverable problems (e.g. invalid data ignored, fallback)
+	HVD_LOG_INFO=3, //!< additional information (e.g. supported pixel formats)
+	HVD_LOG_DEBUG=4, //!< frequent events (e.g. decoder full)
+};
+
+/**
+  * @brief Pipeline events recorded with tracing
+  * @see hvd_config, hvd_trace_event
+  */
+enum hvd_trace_type
+{
+	HVD_TRACE_SUBMIT=0, //!< packet submitted with hvd_send_packet (or parsed by hvd_send_stream)
+	HVD_TRACE_ACCEPT=1, //!< packet accepted by decoder
+	HVD_TRACE_AGAIN=2, //!< packet not accepted, decoder or async queue full (HVD_AGAIN)
+	HVD_TRACE_DECODED=3, //!< frame out of decoder
+	HVD_TRACE_TRANSFER_START=4, //!< frame output started (transfer, map or passthrough)
+	HVD_TRACE_TRANSFER_END=5, //!< frame output finished
+	HVD_TRACE_OUTPUT=6, //!< frame handed to the user
+};
+
+/**
+  * @brief Threads recording trace events
+  * @see hvd_trace_event
+  */
+enum hvd_trace_thread
+{
+	HVD_TRACE_USER=0, //!< thread calling the library
+	HVD_TRACE_DECODER=1, //!< async decoding thread
+	HVD_TRACE_DOWNLOADER=2, //!< async download thread
+};
+
+/**
+  * @brief Sizes of capability probe results
+  * @see hvd_probe
+  */
+enum hvd_probe_limits
+{
+	HVD_PROBE_NAME=128, //!< maximum length of names (hardware, device, codec) with terminating zero
+	HVD_PROBE_KEY=512, //!< maximum length of cache key with terminating zero
+	HVD_PROBE_CODECS=16, //!< maximum number of codecs
+	HVD_PROBE_PROFILES=16, //!< maximum number of profiles per codec
+	HVD_PROBE_FORMATS=16, //!< maximum number of surface formats and of transfer formats per surface format
+};
+
+/**
+ * @struct hvd_region
+ * @brief Region of interest and output size.
+ *
+ * Leave all members as 0 for full frame without scaling.
+ *
+ * The region is clamped to the frame and aligned to chroma subsampling
+ * (e.g. even coordinates and size for nv12, yuv420p).
+ *
+ * Set only one of scale_width, scale_height to keep the aspect ratio.
+ * Scaling is nearest neighbour (fast, e.g. for thumbnails or analysis).
+ *
+ * @see hvd_config, hvd_set_region
+ */
+struct hvd_region
+{
+	int x; //!< left edge of region in decoded frame
+	int y; //!< top edge of region in decoded frame
+	int width; //!< 0 for the rest of frame width or region width
+	int height; //!< 0 for the rest of frame height or region height
+	int scale_width; //!< 0 for region width or output width
+	int scale_height; //!< 0 for region height or output height
+};
+
 /**
  * @struct hvd_config
  * @brief Decoder configuration.
@@ -53,11 +188,16 @@ struct hvd;
  * - d3d11va
  * - videotoolbox
  * - cuda (for Nvidia NVDEC/CUVID)
+ * - software (libavcodec software decoder standing in for hardware, e.g. for testing)
  *
  * The device can be:
  * - NULL (select automatically)
  * - point to valid device e.g. "/dev/dri/renderD128" for vaapi
  *
+ * If you open many decoders on the same device set shared_device
+ * to device from hvd_device_init. The hardware and device are then ignored.
+ * This way the device is opened and the driver initialized only once.
+ *
  * The codec (should be supported by your hardware):
  * - h264
  * - hevc
@@ -75,15 +215,22 @@ struct hvd;
  * NVDEC path is recommended for low latency.
  *
  * The pixel_format is format you want to receive data in.
- * Only hardware conversions are supported. If you select
- * something unsupported by hardware, the library will dump for you
- * list of supported pixel formats to standard error. From my experience
- * even those reported are not supported in all scenarios.
+ * Hardware conversions are used when hardware reports the format as supported.
+ * Otherwise the library transfers data in hardware native format and converts on CPU
+ * (SIMD - SSE2, AVX2, NEON where available):
+ * - nv12 to yuv420p, rgb0, bgr0, rgba, bgra
+ * - p010le to yuv420p10le, yuv420p, nv12 (8 bit), rgb0, bgr0, rgba, bgra
+ *
+ * If neither can produce the format, decoding frames fails and the library
+ * logs the list of supported pixel formats. From my experience even
+ * those reported by hardware are not supported in all scenarios.
  *
- * Nvidia (hardware == "cuda") has a quirk.
- * If you select pixel format unsupported by hardware it will silently
- * return data in nv12 (or p010le, p016le, ... depending on bit depth)
- * The frame format may still be incorrectly set to what you requested!
+ * Nvidia (hardware == "cuda") used to have a quirk, silently returning nv12
+ * (or p010le) for unsupported formats. Now those are converted on CPU.
+ * The frame format always tells the format of the data you get.
+ *
+ * RGB conversion uses BT.601, BT.709 or BT.2020 matrix (from stream,
+ * BT.709 for HD if not specified) and limited or full range.
  *
  * Typical examples:
  * - nv12
@@ -114,7 +261,148 @@ struct hvd;
  * - FF_PROFILE_HEVC_MAIN_10 (10 bit channel precision)
  * - ...
  *
- * @see hvd_init
+ * The output mode decides what you get from hvd_receive_frame:
+ * - HVD_OUTPUT_TRANSFER (default) - frame copied to system memory in pixel_format
+ * - HVD_OUTPUT_HARDWARE - hardware frame (surface), no copy, e.g. for further GPU processing
+ * - HVD_OUTPUT_MAP - hardware frame mapped to system memory for reading, no copy
+ *
+ * With HVD_OUTPUT_HARDWARE and HVD_OUTPUT_MAP the frame holds hardware surface.
+ * The surface returns to decoder with the next hvd_receive_frame or hvd_release_frame.
+ * Decoder has limited number of surfaces, don't hold many such frames at once.
+ * Mapping may be slow or unsupported for some hardware/pixel_format combinations.
+ *
+ * With software_fallback set, the library switches to software decoding when hardware:
+ * - can't be initialized (e.g. no device, unsupported codec)
+ * - doesn't support the stream (e.g. unsupported profile)
+ * - fails during decoding (e.g. surfaces exhausted), data pending in decoder is lost
+ *   and packets are dropped until the next keyframe (counted in hvd_stats resync fields)
+ *
+ * Software decoding keeps the pixel format contract of hardware decoding.
+ * With HVD_OUTPUT_TRANSFER you get data in requested pixel_format.
+ * If pixel_format is not set you get nv12 (8 bit) or p010le (10 bit) for 4:2:0
+ * content, like from typical hardware. Other content is returned as decoded.
+ * Software decoding supports the same CPU conversions as hardware decoding
+ * plus yuv420p to nv12, rgb0, bgr0, rgba, bgra and yuv420p10le to p010le.
+ *
+ * The thread_count and thread_type are used only for software decoding:
+ * - thread_count 0 for automatic (number of cores) or number of threads
+ * - thread_type 0 for default or FF_THREAD_FRAME, FF_THREAD_SLICE or both (bitwise or)
+ *
+ * Frame threading gives best throughput but adds frame of latency per thread.
+ * Slice threading doesn't add latency but depends on number of slices in the stream.
+ *
+ * With async set, decoding and download (transfer) run on internal threads:
+ * - hvd_send_packet copies the data, queues it and returns immidiately
+ * - hvd_receive_frame/hvd_acquire_frame never block
+ * - NULL frame with HVD_AGAIN error means that no frame is ready yet
+ * - NULL frame with HVD_OK error means that decoder was flushed completely
+ * - hvd_get_event_fd returns descriptor to wait on for frames (e.g. poll, epoll)
+ *
+ * The async_depth is the number of packets queued for decoding (0 for default 16).
+ * When the queue is full hvd_send_packet returns HVD_AGAIN.
+ * Decoded frames are queued up to frames_in_flight.
+ *
+ * With low_latency set the library minimizes buffering:
+ * - decoder outputs frames without waiting for reordering (where stream allows it, e.g. no B-frames)
+ * - software decoding uses slice threading (unless you set thread_type)
+ * - in async mode at most one decoded surface waits for download
+ *
+ * Use hvd_get_frame_info to check the latency you actually get.
+ * Low latency stream (e.g. no B-frames) results in one-frame-in/one-frame-out pipeline.
+ *
+ * The library messages go to standard error or log_callback if set.
+ * The callback may be called from internal threads in async mode.
+ * The log_level limits messages (0 for default HVD_LOG_INFO, HVD_LOG_QUIET for none).
+ * The log_rate limits each kind of messages per second (0 for default 10, -1 for unlimited).
+ * Rate limited messages are counted in hvd_stats.log_suppressed
+ * and reported with next message of the same kind.
+ * This way bad input (e.g. lossy link) doesn't slow down decoding.
+ *
+ * The library doesn't change FFmpeg log level (av_log_set_level), it is your choice.
+ *
+ * With software hardware frames are already in system memory and:
+ * - HVD_OUTPUT_TRANSFER copies the data (like download from hardware)
+ * - HVD_OUTPUT_HARDWARE and HVD_OUTPUT_MAP reference decoded frame (no copy)
+ *
+ * The frames_in_flight is the maximum number of frames you may hold at once
+ * with hvd_acquire_frame (frame pool size). Leave as 0 for default (4).
+ * Frames and their data buffers are allocated once and reused.
+ *
+ * With get_buffer set (HVD_OUTPUT_TRANSFER) frame data is written directly to your memory
+ * (e.g. pinned, aligned or shared buffers) instead of library buffers, saving you a copy:
+ * - the callback is called for each frame with format, width and height set
+ * - fill frame buf (reference counted, e.g. av_buffer_create), data and linesize, return 0
+ * - return negative value (AVERROR) on failure, the frame fails with HVD_ERROR
+ * - the buffer is unreferenced when frame is released (next hvd_receive_frame, hvd_release_frame)
+ * - keep your own reference (e.g. av_frame_ref) to use data after release
+ * - the callback is called from download thread in async mode
+ *
+ * The planes have to be large enough for the format, width and height (e.g. av_image_fill_arrays).
+ * The linesize doesn't have to match library alignment, some hardware may require 32 or 64 bytes alignment.
+ *
+ * With region set you get only region of interest, optionally scaled (e.g. crop or thumbnail):
+ * - HVD_OUTPUT_TRANSFER - only the region is copied from mapped hardware frame
+ * - HVD_OUTPUT_MAP - frame data pointers are adjusted to the region (no copy, no scaling)
+ * - HVD_OUTPUT_HARDWARE - region is ignored
+ *
+ * The data moved out of decoder memory shrinks in proportion to the region (see hvd_stats.transfer_bytes).
+ * Hardware that can't map frames (e.g. cuda, vdpau) transfers full frames and copies the region.
+ * Software decoding copies only the region (e.g. testing without GPU).
+ * You may change the region between frames with hvd_set_region.
+ *
+ * With width and height set, hvd_init prepares hardware surfaces up front
+ * (FFmpeg 4.0+), otherwise the decoder allocates them on the first frame.
+ * The decoder uses the prepared surfaces only if they fit the stream
+ * (e.g. width, height and bit depth from profile match), see hvd_stats.prebuilt_surfaces.
+ * The surfaces is the number of extra surfaces on top of what codec needs,
+ * e.g. for further GPU processing. Surfaces held by the library (frames_in_flight
+ * with HVD_OUTPUT_HARDWARE or HVD_OUTPUT_MAP, async queue) are added in both cases.
+ *
+ * With warmup set hvd_init also does what the first frame would otherwise pay for:
+ * - touches all the surfaces (drivers with lazy allocation)
+ * - checks hardware transfer formats
+ * - allocates output buffers of the frame pool (HVD_OUTPUT_TRANSFER without region and get_buffer)
+ *
+ * This makes startup latency (e.g. fast channel switching) predictable,
+ * measure it with hvd_stats.first_frame_time and first_frame_latency.
+ *
+ * The drop_policy sheds load when you can't keep up (e.g. overloaded node):
+ * - HVD_DROP_NONREF - non-reference frames are not decoded at all (e.g. B-frames)
+ * - HVD_DROP_UNREAD - decoded frames superseded before download are not downloaded
+ * - HVD_DROP_LATEST - you always get the newest frame, older ones are discarded
+ *
+ * In synchronous mode HVD_DROP_UNREAD and HVD_DROP_LATEST are the same, hvd_receive_frame
+ * pulls all the frames decoder has ready and downloads only the newest.
+ *
+ * With HVD_DROP_AUTO the queue depth (hvd_stats.queue_depth) decides.
+ * From drop_depth HVD_DROP_UNREAD and HVD_DROP_LATEST are enabled,
+ * from twice the drop_depth also HVD_DROP_NONREF. If your own queues
+ * decide, switch with hvd_set_drop_policy instead.
+ *
+ * With resync after packet loss (e.g. unreliable network) decoder errors
+ * and frames flagged corrupt start waiting for the next keyframe
+ * (H.264 IDR or recovery point, HEVC IDR/CRA/BLA, VP8/VP9/AV1 key frame).
+ * Until then packets are dropped by their headers, without decoding,
+ * and corrupt frames are not downloaded. Streams that have no keyframes
+ * in-band (e.g. H.264 in avcC format) are decoded as without resync.
+ *
+ * With trace set the pipeline records per-frame events (hvd_trace_type)
+ * in a lock-free ring keeping the latest trace events (rounded up to power of 2).
+ * Recording an event is a few atomic stores, without tracing only a pointer check.
+ * Read the events with hvd_trace_read or export them with hvd_trace_export.
+ *
+ * With memory_budget set host memory of the decoder stays within the budget
+ * (e.g. many streams per host without OOM):
+ * - frame pool grows only while the next frame fits (frames_in_flight is the upper limit)
+ * - packets queued for decoding (async, scheduler) are refused with HVD_AGAIN
+ * - hvd_init warm-up allocates only the frames that fit
+ *
+ * One frame and one queued packet are always allowed, so decoding continues
+ * under too small budget, slower. Hardware surfaces are estimated, not limited,
+ * leave room for them on integrated GPUs sharing host memory (e.g. vaapi).
+ * Query the usage with hvd_get_memory.
+ *
+ * @see hvd_init, hvd_acquire_frame
  */
 struct hvd_config
 {
@@ -125,6 +413,29 @@ struct hvd_config
 	int width; //!< 0 to not specify, needed by some codecs
 	int height; //!< 0 to not specify, needed by some codecs
 	int profile; //!< 0 to leave as FF_PROFILE_UNKNOWN or profile e.g. FF_PROFILE_HEVC_MAIN, ...
+	int frames_in_flight; //!< 0 for default or maximum number of frames acquired at once
+	int output; //!< HVD_OUTPUT_TRANSFER (default), HVD_OUTPUT_HARDWARE, HVD_OUTPUT_MAP
+	int software_fallback; //!< 0 to treat software decoding as error, non zero to fall back to software decoding
+	int thread_count; //!< 0 for automatic or number of threads for software decoding
+	int thread_type; //!< 0 for default or FF_THREAD_FRAME, FF_THREAD_SLICE for software decoding
+	struct hvd_device *shared_device; //!< NULL or device from hvd_device_init shared between decoders
+	int async; //!< 0 for synchronous, non-zero to decode and download on internal threads
+	int async_depth; //!< 0 for default or number of packets queued for decoding in async mode
+	int low_latency; //!< 0 for default, non-zero to minimize decoder buffering
+	void (*log_callback)(void *opaque, int level, const char *message); //!< NULL for standard error or function receiving messages
+	void *log_opaque; //!< user data passed to log_callback
+	int log_level; //!< 0 for default (HVD_LOG_INFO) or hvd_log_level
+	int log_rate; //!< 0 for default (10), -1 for unlimited or maximum number of messages of the same kind per second
+	int (*get_buffer)(void *opaque, AVFrame *frame); //!< NULL for library buffers or function providing frame data buffers
+	void *get_buffer_opaque; //!< user data passed to get_buffer
+	struct hvd_region region; //!< all 0 for full frame or region of interest and output size
+	int surfaces; //!< 0 for default or number of extra hardware surfaces (like extra_hw_frames)
+	int warmup; //!< 0 for default or non-zero to prepare surfaces and output buffers in hvd_init
+	int drop_policy; //!< 0 (HVD_DROP_NONE) or hvd_drop_policy flags, e.g. HVD_DROP_NONREF | HVD_DROP_LATEST
+	int drop_depth; //!< 0 for default (4) or queue depth starting HVD_DROP_AUTO policies
+	int resync; //!< 0 to decode everything or non-zero to drop packets after errors until the next keyframe
+	int trace; //!< 0 to disable tracing or number of the latest trace events kept
+	int64_t memory_budget; //!< 0 for unlimited or host bytes of frames and packets held by decoder
 };
 
 /**
@@ -140,136 +451,1496 @@ struct hvd_config
  *
  * Pass hvd_packet with your data to hvd_send_packet.
  *
+ * Without buf and free the decoder copies the data internally.
+ * To avoid the copy (e.g. high bitrate intra streams) pass the data with ownership:
+ * - buf - reference to FFmpeg buffer holding data, the library takes its own reference
+ * - free - function called with opaque and data when decoder no longer needs the data
+ *
+ * With free the library takes ownership of the data, also on HVD_ERROR.
+ * With HVD_AGAIN the data stays with you, send it again as usual.
+ * The free function may be called from decoder threads, any time until hvd_close.
+ *
+ * The pts and tag are yours, they come back with the frame decoded
+ * from the packet (hvd_frame_info) and in trace events. Use the tag
+ * to follow frame through your own pipeline (e.g. capture id).
+ *
  * @see hvd_send_packet
+ *
+ * Example:
+ * @code
+ * //e.g. receive buffer from your pool, returned there by free_callback
+ * struct hvd_packet packet = {0};
+ *
+ * packet.data = buffer->data;
+ * packet.size = received_bytes;
+ * packet.free = free_callback;
+ * packet.opaque = buffer;
+ *
+ * hvd_send_packet(h, &packet);
+ * @endcode
  */
 struct hvd_packet
 {
 	uint8_t *data; //!< pointer to encoded data
 	int size; //!< size of encoded data
+	AVBufferRef *buf; //!< NULL or reference to buffer holding data (data must point inside)
+	void (*free)(void *opaque, uint8_t *data); //!< NULL or function called when data is no longer needed
+	void *opaque; //!< user data passed to free
+	int64_t pts; //!< your timestamp, returned with the frame
+	uint64_t tag; //!< your identifier, returned with the frame
 };
 
 /**
-  * @brief Constants returned by most of library functions
-  */
-enum hvd_retval_enum
+ * @struct hvd_frame_info
+ * @brief Information about returned frame.
+ *
+ * The latency is time from hvd_send_packet with frame data
+ * to hvd_receive_frame/hvd_acquire_frame returning the frame.
+ *
+ * The delay is number of packets sent after frame data until the frame was returned.
+ * For one-frame-in/one-frame-out pipeline (e.g. low_latency) it is 0.
+ *
+ * Both are -1 if unknown (e.g. decoder doesn't pass timestamps).
+ *
+ * The pts and tag are from hvd_packet with frame data.
+ *
+ * @see hvd_get_frame_info
+ */
+struct hvd_frame_info
 {
-	HVD_AGAIN=AVERROR(EAGAIN), //!< hvd_send_packet was not accepted (e.g. buffers full), use hvd_receive_frame before next call
-	HVD_ERROR=-1, //!< error occured
-	HVD_OK=0, //!< succesfull execution
+	int64_t latency; //!< microseconds from hvd_send_packet to returning the frame, -1 if unknown
+	int delay; //!< packets sent after frame data until the frame was returned, -1 if unknown
+	int64_t pts; //!< hvd_packet pts, AV_NOPTS_VALUE if unknown
+	uint64_t tag; //!< hvd_packet tag, 0 if unknown
 };
 
 /**
- * @brief Initialize internal library data.
- * @param config decoder configuration
- * @return
- * - pointer to internal library data
- * - NULL on error, errors printed to stderr
+ * @struct hvd_memory
+ * @brief Memory held by decoder.
  *
- * @see hvd_config, hvd_close
+ * Frames are library data buffers of the frame pool and CPU conversion,
+ * not your buffers (get_buffer) or frames in hardware (surfaces, mappings).
+ * Packets are queued for decoding (async, scheduler, hvd_send_stream) and held
+ * by decoder until frames come out. Library copies count with buffers kept for reuse,
+ * referenced data (e.g. hvd_file packets in file mapping) counts only packet size.
+ *
+ * Surfaces are estimated from hardware frames context of the decoder,
+ * 0 with software decoding or pools growing on demand.
+ *
+ * @see hvd_get_memory, hvd_config
  */
-struct hvd *hvd_init(const struct hvd_config *config);
+struct hvd_memory
+{
+	int64_t budget; //!< hvd_config.memory_budget, 0 for unlimited
+	int64_t used; //!< host bytes of frames and packets
+	int64_t frames; //!< host bytes of frame data buffers
+	int64_t packets; //!< host bytes of packet data
+	int frames_allocated; //!< frames of the pool with data buffers, limited by budget
+	int surfaces; //!< estimated number of hardware surfaces
+	int64_t surface_bytes; //!< estimated size of hardware surfaces
+	uint64_t refused; //!< packets refused with HVD_AGAIN to stay within budget
+};
 
 /**
- * @brief Free library resources
+ * @struct hvd_trace_event
+ * @brief Event recorded with tracing.
  *
- * Cleans and frees library memory.
+ * The seq is number of packet counted from hvd_init, it follows
+ * the packet through decoder to the frame (with pts and tag).
  *
- * @param h pointer to internal library data
- * @see hvd_init
+ * @see hvd_trace_read, hvd_trace_type
+ */
+struct hvd_trace_event
+{
+	int64_t time; //!< microseconds, monotonic clock (av_gettime_relative)
+	int64_t seq; //!< packet sequence number, -1 if unknown
+	int64_t pts; //!< hvd_packet pts, AV_NOPTS_VALUE if unknown
+	uint64_t tag; //!< hvd_packet tag, 0 if unknown
+	int type; //!< hvd_trace_type
+	int thread; //!< hvd_trace_thread
+};
+
+/**
+ * @struct hvd_pool_stats
+ * @brief Frame pool statistics
+ *
+ * The allocations counter includes AVFrame allocations and
+ * allocations of data buffers for frames. After warm-up (first frames)
+ * it stays constant unless frame size or format changes,
+ * or you keep additional references to the frames (e.g. av_frame_ref).
  *
+ * @see hvd_get_pool_stats
  */
-void hvd_close(struct hvd *h);
+struct hvd_pool_stats
+{
+	int size; //!< number of frames in the pool
+	int in_use; //!< number of frames currently held by the user
+	uint64_t frames; //!< number of frames returned so far
+	uint64_t allocations; //!< number of allocations made so far by the pool
+};
 
 /**
- * @brief Send packet to hardware for decoding.
+ * @struct hvd_timing
+ * @brief Timing histogram summary of decoding stage.
  *
- * Pass data in hvd_packet for decoding.
- * Follow with hvd_receive_frame to get decoded data from hardware.
+ * The percentiles have power of two resolution (upper bound of histogram bucket).
  *
- * If you have simple loop like:
- * - send encoded data with hve_send_packet
- * - receive decoded data with hve_receive_frame
+ * @see hvd_stats
+ */
+struct hvd_timing
+{
+	uint64_t count; //!< number of measurements
+	int64_t p50; //!< median in microseconds
+	int64_t p99; //!< 99th percentile in microseconds
+	int64_t max; //!< maximum in microseconds
+};
+
+/**
+ * @struct hvd_stats
+ * @brief Decoder statistics.
  *
- * HVD_AGAIN return value will never happen.
- * If you are sending lots of data and not reading you may get HVD_AGAIN when buffers are full.
+ * The counters are cumulative since hvd_init.
+ * Counting is cheap (no locks), the statistics are always on.
  *
- * When you are done with decoding call with:
- * - NULL packet argument
- * - or packet with NULL data and 0 size
- * to flush the decoder and follow with hvd_receive_frame as usual to get last frames from decoder.
+ * The decoder rejects invalid data (e.g. non-existing PPS referenced)
+ * with AVERROR_INVALIDDATA or AVERROR(EIO). Such packets are
+ * ignored by hvd_send_packet (returns HVD_OK) and counted here.
+ * With hvd_config.resync they start waiting for keyframe, resync_packets
+ * and resync_bytes tell how much decoding and transfer was saved.
  *
- * After flushing and reading last frames you can follow with decoding new stream.
+ * Timings are measured for:
+ * - send - avcodec_send_packet accepting the data
+ * - receive - avcodec_receive_frame returning frame
+ * - transfer - av_hwframe_transfer_data, copy or mapping, depending on output mode
  *
- * Perfomance hints:
- *  - don't copy data from your source, pass the pointer in packet->data
+ * The transfer_bytes counts frame data copied out of decoder memory by the library
+ * (transfer, region copy, software decoder frame copy). Mapping without copy is not counted.
  *
- * @param h pointer to internal library data
- * @param packet data to decode
- * @return
- * - HVD_OK on success
- * - HVD_ERROR on error
- * - HVD_AGAIN input was rejected, read data with hvd_receive_packet before next try
+ * The startup cost is split into init_time (hvd_init) and first_frame_latency
+ * (first packet to first frame), the first_frame_time covers both and the time in between.
+ * After hvd_reconfigure the first frame times are measured from the switch,
+ * compare reconfigure with init_time for the cost of switch.
  *
- * @see hvd_packet, hvd_receive_frame
+ * @see hvd_get_stats
+ */
+struct hvd_stats
+{
+	uint64_t packets; //!< number of packets accepted by decoder
+	uint64_t bytes; //!< number of bytes accepted by decoder
+	uint64_t frames; //!< number of frames returned
+	uint64_t invalid_data; //!< number of packets ignored with AVERROR_INVALIDDATA
+	uint64_t io_errors; //!< number of packets ignored with AVERROR(EIO)
+	uint64_t again; //!< number of times decoder (or async queue) was full (HVD_AGAIN)
+	uint64_t flushes; //!< number of flushes
+	struct hvd_timing send; //!< avcodec_send_packet timing
+	struct hvd_timing receive; //!< avcodec_receive_frame timing
+	struct hvd_timing transfer; //!< transfer/copy/map timing
+	uint64_t log_suppressed; //!< number of messages suppressed by log rate limiting
+	uint64_t transfer_bytes; //!< number of frame data bytes copied out of decoder memory
+	int64_t init_time; //!< microseconds spent in hvd_init (including surfaces and warm-up)
+	int64_t first_frame_time; //!< microseconds from the start of hvd_init to the first frame, 0 until then
+	int64_t first_frame_latency; //!< microseconds from the first packet to the first frame, 0 until then
+	int prebuilt_surfaces; //!< number of surfaces prepared in hvd_init used by decoder, 0 if allocated on first frame
+	struct hvd_timing reconfigure; //!< hvd_reconfigure timing (switch time)
+	uint64_t reopens; //!< number of hvd_reconfigure calls that reopened decoder
+	uint64_t dropped_nonref; //!< number of packets not decoded by HVD_DROP_NONREF (approximate until flush)
+	uint64_t dropped_unread; //!< number of frames decoded but not downloaded by HVD_DROP_UNREAD/HVD_DROP_LATEST
+	uint64_t dropped_stale; //!< number of downloaded frames discarded by HVD_DROP_LATEST (async)
+	int queue_depth; //!< packets and frames queued in the library (async queues, hvd_send_stream)
+	int drop_policy; //!< hvd_drop_policy flags in effect (decided by queue depth with HVD_DROP_AUTO)
+	uint64_t resyncs; //!< number of times decoding waited for keyframe (hvd_config.resync)
+	uint64_t resync_packets; //!< number of packets dropped waiting for keyframe
+	uint64_t resync_bytes; //!< number of bytes dropped waiting for keyframe
+	uint64_t corrupt_frames; //!< number of frames flagged corrupt and not returned (hvd_config.resync)
+};
+
+/**
+ * @struct hvd_scheduler_config
+ * @brief Scheduler configuration.
  *
- * Example flushing:
- * @code
- *  //flush
- *  hvd_send_packet(hardware_decoder, NULL);
+ * The scheduler opens each device once (hvd_device_init) and decodes
+ * registered streams on worker threads. New streams go to the device
+ * with the lowest measured load (decoding time of its streams).
  *
- *  //retrieve last frames from decoder as usual
- *	while( (frame=hvd_receive_frame(hardware_decoder, &failed)) )
- *	{
- *		//do something with frame->data, frame->linesize
- *	}
+ * Each worker has its own queue of streams with pending packets.
+ * Idle workers steal streams from busy ones. A stream decodes at most
+ * budget packets per turn and goes to the back of the queue,
+ * so busy streams don't starve others.
  *
- *	//NULL frame and non-zero failed indicates failure during decoding
- *	if(failed)
- *		//your logic on failure
+ * When decoder has no room for packet and gives no frames (e.g. callback
+ * holds frames with av_frame_ref, memory budget) the stream is parked.
+ * It is retried on next hvd_scheduler_send for the stream or after a millisecond.
  *
- *  //terminate or continue decoding new stream
- * @endcode
+ * With "software" hardware devices are simulated (any names),
+ * e.g. for testing the scheduling without GPU.
  *
+ * @see hvd_scheduler_init
  */
-int hvd_send_packet(struct hvd *h, struct hvd_packet *packet);
+struct hvd_scheduler_config
+{
+	const char *hardware; //!< hardware type for all devices, e.g. "vaapi", "software"
+	const char **devices; //!< NULL terminated list of devices (e.g. "/dev/dri/renderD128") or NULL for single default device
+	int threads; //!< number of worker threads, 0 for number of CPUs
+	int queue_depth; //!< 0 for default (16) or number of packets queued per stream before HVD_AGAIN
+	int budget; //!< 0 for default (4) or number of packets decoded per stream turn
+};
 
+/**
+ * @brief Callback with decoded frames of the stream.
+ *
+ * Called on worker thread, never concurrently for the same stream.
+ * The frame is valid only during the call (copy or av_frame_ref it if needed).
+ *
+ * - frame with HVD_OK - decoded frame
+ * - NULL with HVD_OK - stream was flushed completely (hvd_scheduler_send with NULL packet)
+ * - NULL with HVD_ERROR - decoding failed, the stream continues with next packets
+ *
+ * @see hvd_scheduler_add_stream
+ */
+typedef void (*hvd_stream_callback)(void *opaque, AVFrame *frame, int error);
 
 /**
- * @brief Retrieve decoded frame data from hardware.
+ * @struct hvd_stream_stats
+ * @brief Stream statistics in scheduler.
  *
- * Keep calling this functions after hvd_send_packet until NULL is returned.
- * The ownership of returned FFmpeg AVFrame remains with the library:
- * - consume it immidiately
- * - or copy the data
+ * The queued and queue_depth show back-pressure, full queue rejects packets with HVD_AGAIN.
+ * The load is fraction of single thread time spent decoding the stream
+ * (e.g. 0.25 is 25% of one core or device submission thread), measured over at least one second.
  *
- * @param h pointer to internal library data
- * @param error pointer to error code
- * @return
- * - AVFrame* pointer to FFMpeg AVFrame, you are mainly interested in data and linesize arrays
- * - NULL when no more data is pending, query error argument to check result (HVD_OK on success)
+ * @see hvd_stream_get_stats
+ */
+struct hvd_stream_stats
+{
+	int device; //!< index of the device in hvd_scheduler_config.devices
+	int queued; //!< packets waiting for decoding
+	int queue_depth; //!< maximum packets waiting for decoding
+	uint64_t packets; //!< packets decoded
+	uint64_t frames; //!< frames passed to callback
+	uint64_t again; //!< packets rejected with HVD_AGAIN (queue full)
+	uint64_t errors; //!< decoding errors
+	double load; //!< measured load, -1 if not measured yet
+};
+
+/**
+ * @struct hvd_scheduler_stats
+ * @brief Scheduler statistics.
  *
- * @see hvd_send_packet
+ * @see hvd_scheduler_get_stats
+ */
+struct hvd_scheduler_stats
+{
+	int streams; //!< number of registered streams
+	int workers; //!< number of worker threads
+	uint64_t turns; //!< stream turns on workers
+	uint64_t steals; //!< turns with stream stolen from other worker
+	uint64_t parks; //!< turns ended without room in decoder and without frames (stream retried later)
+};
+
+/**
+ * @struct hvd_shm_config
+ * @brief Shared memory frame ring configuration.
  *
- * Example (in decoding loop):
- * @code
- * //send data for hardware decoding
- * if(hvd_send_packet(h, packet) != HVD_OK)
- *   break; //break on error
+ * The ring is sized for frames up to width x height in pixel_format.
+ * Smaller frames (e.g. region) and other formats that fit are also accepted.
  *
- * //get the decoded data
- * while( (frame = hvd_receive_frame(av, &error) ) )
- * {
- *   //do something with frame->data, frame->linesize
- * }
+ * The name is POSIX shared memory name (e.g. "/hvd-camera"), readers attach by name.
+ * With NULL name the ring is anonymous (memfd, Linux), pass its descriptor
+ * to readers (e.g. fork, unix socket SCM_RIGHTS) and attach by descriptor.
  *
- * //NULL frame and non-zero failed indicates failure during decoding
- * if(failed)
- *   break; //break on error
+ * @see hvd_shm_create
+ */
+struct hvd_shm_config
+{
+	const char *name; //!< shared memory name starting with slash or NULL for anonymous ring
+	int slots; //!< number of frames in the ring, 0 for default (8), more than frames held by you
+	int width; //!< maximum frame width
+	int height; //!< maximum frame height
+	const char *pixel_format; //!< pixel format of frames, e.g. "nv12", "rgb0"
+};
+
+/**
+ * @struct hvd_shm_frame
+ * @brief Frame read from shared memory ring.
  *
- * @endcode
+ * The data points directly to shared memory (read-only), there is no copy.
+ * Publisher may overwrite the slot at any time, check with hvd_shm_check
+ * after you are done with the data (or copied what you need).
  *
+ * @see hvd_shm_read, hvd_shm_check
  */
-AVFrame *hvd_receive_frame(struct hvd *h, int *error);
+struct hvd_shm_frame
+{
+	uint64_t number; //!< frame number in the ring, starting from 1
+	int format; //!< AVPixelFormat of the frame
+	int width; //!< frame width
+	int height; //!< frame height
+	const uint8_t *data[4]; //!< frame planes in shared memory
+	int linesize[4]; //!< frame plane line sizes
+	int64_t pts; //!< presentation timestamp of the frame (hvd_packet pts for library frames)
+};
+
+/**
+ * @struct hvd_file_config
+ * @brief Memory-mapped file source configuration.
+ *
+ * The file is raw Annex B (H.264, HEVC) or IVF (VP8, VP9, AV1), recognized by IVF signature.
+ * Annex B is split into frames with libavcodec parser of the codec.
+ *
+ * Building the index reads the whole file once. With index_path the index
+ * is loaded from sidecar file if it matches the file (size, modification time, codec)
+ * and written there otherwise, so that the next open doesn't read the file.
+ *
+ * @see hvd_file_open
+ */
+struct hvd_file_config
+{
+	const char *path; //!< encoded file
+	const char *codec; //!< codec name, e.g. "h264", needed for Annex B, NULL for IVF (from header)
+	const char *index_path; //!< NULL or sidecar index file, e.g. "sample.h264.hvdi"
+};
+
+/**
+ * @struct hvd_file_info
+ * @brief Memory-mapped file source summary.
+ *
+ * @see hvd_file_get_info
+ */
+struct hvd_file_info
+{
+	int64_t size; //!< file size in bytes
+	int64_t frames; //!< number of frames (packets) in the file
+	int64_t keyframes; //!< number of keyframes
+	int index_loaded; //!< non-zero if index was loaded from sidecar file
+};
+
+/**
+ * @struct hvd_probe_config
+ * @brief Capability probe configuration.
+ *
+ * With cache_path the result is stored in cache file and loaded from there
+ * if the cache key matches (hardware, device, FFmpeg version, driver, cache_key).
+ * The driver is identified by what is visible without vendor libraries
+ * (kernel release, DRM driver and PCI id of render node, NVIDIA driver version),
+ * pass user-space driver version (e.g. of VAAPI driver package) in cache_key.
+ *
+ * One cache file holds results of many devices.
+ *
+ * @see hvd_probe
+ */
+struct hvd_probe_config
+{
+	const char *hardware; //!< hardware type as in hvd_config, e.g. "vaapi", "cuda", "software"
+	const char *device; //!< NULL / empty string for default or device, e.g. "/dev/dri/renderD128"
+	const char *cache_path; //!< NULL or cache file, e.g. "/var/cache/myservice/hvd.probe"
+	const char *cache_key; //!< NULL or extra key invalidating cache, e.g. driver package version
+};
+
+/**
+ * @struct hvd_probe_codec
+ * @brief Codec decoded by probed hardware.
+ *
+ * The profiles are the ones libavcodec knows for the codec.
+ * Which of them hardware decodes is not known without decoding.
+ *
+ * @see hvd_probe
+ */
+struct hvd_probe_codec
+{
+	char name[HVD_PROBE_NAME]; //!< decoder name for hvd_config.codec, e.g. "h264"
+	int codec_id; //!< AVCodecID
+	int profiles[HVD_PROBE_PROFILES]; //!< profiles (e.g. FF_PROFILE_H264_HIGH), names from avcodec_profile_name
+	int profile_count; //!< number of profiles
+};
+
+/**
+ * @struct hvd_probe_format
+ * @brief Surface format of probed hardware.
+ *
+ * @see hvd_probe
+ */
+struct hvd_probe_format
+{
+	int sw_format; //!< AVPixelFormat of surface data, e.g. nv12, p010le
+	int transfer_formats[HVD_PROBE_FORMATS]; //!< AVPixelFormat surfaces can be downloaded as (av_hwframe_transfer_get_formats)
+	int transfer_count; //!< number of transfer formats
+};
+
+/**
+ * @struct hvd_probe
+ * @brief Capabilities of hardware device.
+ *
+ * Surface size limits are 0 if not reported by the device.
+ *
+ * The "software" hardware stands in for hardware (e.g. testing without GPU).
+ * It reports codecs with software decoders, 8 and 10 bit 4:2:0 surfaces
+ * (yuv420p, yuv420p10le) and no size limits.
+ *
+ * @see hvd_probe, hvd_probe_check
+ */
+struct hvd_probe
+{
+	char hardware[HVD_PROBE_NAME]; //!< probed hardware
+	char device[HVD_PROBE_NAME]; //!< probed device, empty for default
+	char key[HVD_PROBE_KEY]; //!< cache key
+	int hw_pix_fmt; //!< AVPixelFormat of hardware frames, AV_PIX_FMT_NONE for software
+	int min_width; //!< minimum surface width
+	int min_height; //!< minimum surface height
+	int max_width; //!< maximum surface width
+	int max_height; //!< maximum surface height
+	struct hvd_probe_codec codecs[HVD_PROBE_CODECS]; //!< decoded codecs
+	int codec_count; //!< number of codecs
+	struct hvd_probe_format formats[HVD_PROBE_FORMATS]; //!< surface formats
+	int format_count; //!< number of surface formats
+	int cached; //!< non-zero if loaded from cache file
+	int64_t probe_time; //!< microseconds spent on probing or loading from cache
+};
+
+/**
+  * @brief Constants returned by most of library functions
+  */
+enum hvd_retval_enum
+{
+	HVD_AGAIN=AVERROR(EAGAIN), //!< hvd_send_packet was not accepted (e.g. buffers full), use hvd_receive_frame before next call
+	HVD_ERROR=-1, //!< error occured
+	HVD_OK=0, //!< succesfull execution
+};
+
+/**
+ * @brief Initialize internal library data.
+ *
+ * It is safe to call hvd_init concurrently from different threads.
+ * Single decoder (struct hvd) should be used by one thread at a time.
+ *
+ * @param config decoder configuration
+ * @return
+ * - pointer to internal library data
+ * - NULL on error, errors logged (standard error or log_callback)
+ *
+ * @see hvd_config, hvd_close
+ */
+struct hvd *hvd_init(const struct hvd_config *config);
+
+/**
+ * @brief Open hardware device for sharing between decoders.
+ *
+ * Pass the device in hvd_config.shared_device to hvd_init.
+ *
+ * The hardware and device have the same meaning as in hvd_config.
+ * With "software" hardware no device is opened and decoders
+ * using it decode in software (e.g. testing without GPU).
+ *
+ * @param hardware hardware type for decoding, e.g. "vaapi"
+ * @param device NULL / "" or device, e.g. "/dev/dri/renderD128"
+ * @return
+ * - pointer to device
+ * - NULL on error, errors printed to standard error
+ *
+ * @see hvd_device_close, hvd_config
+ *
+ * Example:
+ * @code
+ * struct hvd_device *device = hvd_device_init("vaapi", "/dev/dri/renderD128");
+ * struct hvd_config config = {0};
+ *
+ * config.codec = "h264";
+ * config.shared_device = device;
+ *
+ * for(int i=0;i<32;++i)
+ *   decoders[i] = hvd_init(&config);
+ *
+ * //decoders hold their own references, device may be closed now
+ * hvd_device_close(device);
+ * @endcode
+ */
+struct hvd_device *hvd_device_init(const char *hardware, const char *device);
+
+/**
+ * @brief Release device.
+ *
+ * Decoders keep their own references to the device.
+ * It is safe to close the device before decoders using it.
+ *
+ * @param d pointer to device
+ * @see hvd_device_init
+ */
+void hvd_device_close(struct hvd_device *d);
+
+/**
+ * @brief Free library resources
+ *
+ * Cleans and frees library memory.
+ *
+ * @param h pointer to internal library data
+ * @see hvd_init
+ *
+ */
+void hvd_close(struct hvd *h);
+
+/**
+ * @brief Switch decoder to new stream parameters in place.
+ *
+ * Faster alternative to hvd_close and hvd_init when source changes
+ * codec, profile, resolution or output settings (e.g. channel switching).
+ *
+ * What is kept:
+ * - hardware device (no new av_hwdevice_ctx_create)
+ * - frame pool with data buffers, frames you hold stay valid until released
+ * - prepared surfaces if they still fit the new stream
+ * - decoder if codec, profile, low_latency and threading didn't change (only flushed)
+ *
+ * Data in flight (queued packets, parsed stream, decoded frames not returned yet) is discarded.
+ * To get the last frames of the old stream flush and receive them before the call.
+ * In async mode the internal threads are stopped and restarted, event_fd stays the same.
+ *
+ * The hardware, device, shared_device, frames_in_flight, async, async_depth and log
+ * settings in config are ignored (kept from hvd_init). Everything else is applied
+ * as in hvd_init. After software fallback the decoder stays in software.
+ *
+ * Don't call with the decoder added to scheduler.
+ * On HVD_ERROR the decoder is unusable, call hvd_close.
+ *
+ * Switch time is measured in hvd_stats.reconfigure, reopens counts decoder reopenings.
+ * The first_frame_time and first_frame_latency are measured again from the switch.
+ *
+ * @param h pointer to internal library data
+ * @param config new decoder configuration
+ * @return
+ * - HVD_OK on success
+ * - HVD_ERROR on error (invalid config is rejected before any change)
+ *
+ * @see hvd_init, hvd_stats
+ *
+ * Example:
+ * @code
+ * config.codec = "hevc";
+ * config.width = 3840;
+ * config.height = 2160;
+ *
+ * if(hvd_reconfigure(h, &config) != HVD_OK)
+ *   //your logic on failure, e.g. hvd_close
+ *
+ * //continue with hvd_send_packet of the new stream
+ * @endcode
+ */
+int hvd_reconfigure(struct hvd *h, const struct hvd_config *config);
+
+/**
+ * @brief Send packet to hardware for decoding.
+ *
+ * Pass data in hvd_packet for decoding.
+ * Follow with hvd_receive_frame to get decoded data from hardware.
+ *
+ * If you have simple loop like:
+ * - send encoded data with hve_send_packet
+ * - receive decoded data with hve_receive_frame
+ *
+ * HVD_AGAIN return value will never happen.
+ * If you are sending lots of data and not reading you may get HVD_AGAIN when buffers are full.
+ *
+ * When you are done with decoding call with:
+ * - NULL packet argument
+ * - or packet with NULL data and 0 size
+ * to flush the decoder and follow with hvd_receive_frame as usual to get last frames from decoder.
+ *
+ * After flushing and reading last frames you can follow with decoding new stream.
+ *
+ * Perfomance hints:
+ *  - don't copy data from your source, pass the pointer in packet->data
+ *  - pass the data with ownership (packet->buf or packet->free) so that decoder doesn't copy it
+ *
+ * @param h pointer to internal library data
+ * @param packet data to decode
+ * @return
+ * - HVD_OK on success
+ * - HVD_ERROR on error
+ * - HVD_AGAIN input was rejected, read data with hvd_receive_packet before next try
+ *
+ * In async mode the data is copied and queued, HVD_AGAIN means that the queue is full.
+ * Errors are reported later as NULL frame with error from hvd_receive_frame.
+ * Decoding continues after receive errors. After failing to send packet
+ * to decoder hvd_send_packet returns HVD_ERROR until hvd_reconfigure.
+ *
+ * @see hvd_packet, hvd_receive_frame
+ *
+ * Example flushing:
+ * @code
+ *  //flush
+ *  hvd_send_packet(hardware_decoder, NULL);
+ *
+ *  //retrieve last frames from decoder as usual
+ *	while( (frame=hvd_receive_frame(hardware_decoder, &failed)) )
+ *	{
+ *		//do something with frame->data, frame->linesize
+ *	}
+ *
+ *	//NULL frame and non-zero failed indicates failure during decoding
+ *	if(failed)
+ *		//your logic on failure
+ *
+ *  //terminate or continue decoding new stream
+ * @endcode
+ *
+ */
+int hvd_send_packet(struct hvd *h, struct hvd_packet *packet);
+
+/**
+ * @brief Send raw byte stream for decoding.
+ *
+ * Alternative to hvd_send_packet when your data is not split into packets
+ * (e.g. H.264/HEVC Annex B from network in arbitrary chunks).
+ * The stream is split into packets with libavcodec parser.
+ * Don't mix with hvd_send_packet in the same stream.
+ *
+ * The data doesn't need padding and is copied once, you may reuse the buffer after the call.
+ * Packets entirely inside the chunk are passed to decoder without further copies.
+ *
+ * The parser recognizes end of packet with the beginning of the next one.
+ * The last packet is decoded when more data arrives or on flush.
+ * For lowest latency send whole packets with hvd_send_packet.
+ *
+ * Follow with hvd_receive_frame as usual.
+ *
+ * When you are done call with NULL data and 0 size
+ * to flush the parser and the decoder.
+ *
+ * @param h pointer to internal library data
+ * @param data encoded data
+ * @param size size of encoded data
+ * @return
+ * - HVD_OK on success, data was accepted
+ * - HVD_ERROR on error
+ * - HVD_AGAIN data was not accepted, read frames with hvd_receive_frame and send the same data again
+ *
+ * When decoder is full parsed packets wait in the library and are sent to decoder
+ * when there is space (in hvd_receive_frame or next hvd_send_stream).
+ * Waiting packets are bounded (async_depth, 16 in sync mode, memory_budget),
+ * then new data is refused with HVD_AGAIN, like with hvd_send_packet.
+ *
+ * @see hvd_send_packet, hvd_receive_frame
+ *
+ * Example:
+ * @code
+ * while( (size = recv(socket, buffer, sizeof(buffer), 0)) > 0 )
+ * {
+ *   do
+ *   {
+ *     if( (ret = hvd_send_stream(h, buffer, size)) == HVD_ERROR )
+ *       return 1;
+ *
+ *     while( (frame = hvd_receive_frame(h, &error) ) )
+ *     {
+ *       //do something with frame->data, frame->linesize
+ *     }
+ *   } while(ret == HVD_AGAIN); //with async wait for frames (event_fd) before trying again
+ * }
+ * @endcode
+ */
+int hvd_send_stream(struct hvd *h, const uint8_t *data, int size);
+
+/**
+ * @brief Retrieve decoded frame data from hardware.
+ *
+ * Keep calling this functions after hvd_send_packet until NULL is returned.
+ * The ownership of returned FFmpeg AVFrame remains with the library:
+ * - consume it immidiately
+ * - or copy the data
+ *
+ * The frame is valid until the next call to hvd_receive_frame or hvd_close.
+ * The frame pts is hvd_packet pts of the frame (AV_NOPTS_VALUE if unknown).
+ * The frame and its data buffers are reused, there are no allocations
+ * per frame after warm-up. If you need more frames at once use hvd_acquire_frame.
+ *
+ * @param h pointer to internal library data
+ * @param error pointer to error code
+ * @return
+ * - AVFrame* pointer to FFMpeg AVFrame, you are mainly interested in data and linesize arrays
+ * - NULL when no more data is pending, query error argument to check result (HVD_OK on success)
+ *
+ * In async mode the call doesn't block, NULL with HVD_AGAIN error means no frame is ready yet.
+ *
+ * @see hvd_send_packet
+ *
+ * Example (in decoding loop):
+ * @code
+ * //send data for hardware decoding
+ * if(hvd_send_packet(h, packet) != HVD_OK)
+ *   break; //break on error
+ *
+ * //get the decoded data
+ * while( (frame = hvd_receive_frame(av, &error) ) )
+ * {
+ *   //do something with frame->data, frame->linesize
+ * }
+ *
+ * //NULL frame and non-zero failed indicates failure during decoding
+ * if(failed)
+ *   break; //break on error
+ *
+ * @endcode
+ *
+ */
+AVFrame *hvd_receive_frame(struct hvd *h, int *error);
+
+/**
+ * @brief Retrieve decoded frame data from hardware and keep it.
+ *
+ * Works like hvd_receive_frame but returned frame stays valid until
+ * you call hvd_release_frame. This way you may hold up to
+ * hvd_config.frames_in_flight frames at once.
+ *
+ * If all the frames are held by you NULL is returned and
+ * error is set to HVD_AGAIN. Release some frames and try again.
+ * The data pending in decoder is not lost.
+ *
+ * Don't mix frames from hvd_receive_frame with hvd_release_frame.
+ *
+ * @param h pointer to internal library data
+ * @param error pointer to error code
+ * @return
+ * - AVFrame* pointer to FFMpeg AVFrame, you are mainly interested in data and linesize arrays
+ * - NULL when no more data is pending, query error argument to check result (HVD_OK on success, HVD_AGAIN if all frames are held)
+ *
+ * @see hvd_release_frame, hvd_receive_frame, hvd_config
+ *
+ * Example:
+ * @code
+ * AVFrame *frames[2];
+ *
+ * frames[0] = hvd_acquire_frame(h, &error);
+ * frames[1] = hvd_acquire_frame(h, &error);
+ *
+ * //do something with both frames (e.g. compare, pass to other thread)
+ *
+ * hvd_release_frame(h, frames[0]);
+ * hvd_release_frame(h, frames[1]);
+ * @endcode
+ */
+AVFrame *hvd_acquire_frame(struct hvd *h, int *error);
+
+/**
+ * @brief Return frame to the library.
+ *
+ * The frame and its data buffers are reused by the library.
+ * Don't use the frame after this call.
+ *
+ * @param h pointer to internal library data
+ * @param frame frame returned by hvd_acquire_frame (NULL is ignored)
+ *
+ * @see hvd_acquire_frame
+ */
+void hvd_release_frame(struct hvd *h, AVFrame *frame);
+
+/**
+ * @brief Get descriptor signaled when frames are ready (async mode).
+ *
+ * The descriptor becomes readable when there are frames (or flush/error markers)
+ * ready for hvd_receive_frame/hvd_acquire_frame.
+ * Wait for it with poll, select, epoll and then receive frames until HVD_AGAIN.
+ * The library clears the descriptor, don't read it yourself.
+ *
+ * Available on Linux (eventfd).
+ *
+ * @param h pointer to internal library data
+ * @return
+ * - file descriptor
+ * - -1 if not in async mode or not supported on the platform
+ *
+ * Example:
+ * @code
+ * struct pollfd pfd = {hvd_get_event_fd(h), POLLIN, 0};
+ *
+ * while(keep_decoding)
+ * {
+ *   //send data with hvd_send_packet (doesn't block)
+ *
+ *   poll(&pfd, 1, timeout_ms); //or your epoll based event loop
+ *
+ *   while( (frame = hvd_receive_frame(h, &error)) )
+ *   {
+ *     //do something with frame->data, frame->linesize
+ *   }
+ *
+ *   if(error == HVD_ERROR)
+ *     break;
+ *
+ *   //error == HVD_AGAIN - no more frames for now
+ * }
+ * @endcode
+ */
+int hvd_get_event_fd(const struct hvd *h);
+
+/**
+ * @brief Get information about returned frame.
+ *
+ * @param h pointer to internal library data
+ * @param frame frame returned by hvd_receive_frame or hvd_acquire_frame
+ * @param info pointer to information to fill
+ * @return
+ * - HVD_OK on success
+ * - HVD_ERROR if frame doesn't belong to the decoder
+ *
+ * @see hvd_frame_info
+ *
+ * Example:
+ * @code
+ * struct hvd_frame_info info;
+ *
+ * while( (frame = hvd_receive_frame(h, &error) ) )
+ * {
+ *   hvd_get_frame_info(h, frame, &info);
+ *   //info.latency - microseconds since hvd_send_packet with frame data
+ * }
+ * @endcode
+ */
+int hvd_get_frame_info(const struct hvd *h, const AVFrame *frame, struct hvd_frame_info *info);
+
+/**
+ * @brief Change region of interest and output size.
+ *
+ * Applies to frames output after the call:
+ * - in synchronous mode starting with the next hvd_receive_frame
+ * - in asynchronous mode frames already downloaded keep the previous region
+ *
+ * Safe to call at any time, also from other thread than decoding.
+ *
+ * @param h pointer to internal library data
+ * @param region region of interest and output size, NULL for full frame
+ * @return
+ * - HVD_OK on success
+ * - HVD_ERROR on invalid region (negative values)
+ *
+ * @see hvd_region, hvd_config
+ *
+ * Example:
+ * @code
+ * struct hvd_region plate = {640, 480, 320, 120}; //x, y, width, height
+ * struct hvd_region thumbnail = {0, 0, 0, 0, 160}; //full frame scaled to 160 width
+ *
+ * hvd_set_region(h, &plate);
+ * frame = hvd_receive_frame(h, &error); //320x120 crop
+ * hvd_set_region(h, &thumbnail);
+ * frame = hvd_receive_frame(h, &error); //160 wide with aspect ratio kept
+ * hvd_set_region(h, NULL); //back to full frames
+ * @endcode
+ */
+int hvd_set_region(struct hvd *h, const struct hvd_region *region);
+
+/**
+ * @brief Change frame dropping policy at runtime.
+ *
+ * Takes effect with the next packet (HVD_DROP_NONREF) or frame.
+ * Safe to call in async mode, the decoding threads pick it up.
+ *
+ * @param h pointer to internal library data
+ * @param policy HVD_DROP_NONE or hvd_drop_policy flags
+ * @return
+ * - HVD_OK on success
+ * - HVD_ERROR on invalid policy
+ *
+ * @see hvd_drop_policy, hvd_config, hvd_stats
+ *
+ * Example:
+ * @code
+ * //your queue of work grows, shed load
+ * if(backlog > 8)
+ *   hvd_set_drop_policy(h, HVD_DROP_NONREF | HVD_DROP_LATEST);
+ * else if(backlog == 0)
+ *   hvd_set_drop_policy(h, HVD_DROP_NONE);
+ * @endcode
+ */
+int hvd_set_drop_policy(struct hvd *h, int policy);
+
+/**
+ * @brief Get decoder statistics.
+ *
+ * Safe to call at any time, also from other thread than decoding.
+ *
+ * @param h pointer to internal library data
+ * @param stats pointer to statistics to fill
+ *
+ * @see hvd_stats
+ *
+ * Example:
+ * @code
+ * struct hvd_stats stats;
+ *
+ * hvd_get_stats(h, &stats);
+ * printf("invalid data %llu, receive p99 %lld us\n",
+ *   (unsigned long long)stats.invalid_data, (long long)stats.receive.p99);
+ * @endcode
+ */
+void hvd_get_stats(const struct hvd *h, struct hvd_stats *stats);
+
+/**
+ * @brief Get frame pool statistics.
+ *
+ * You may use it to confirm that there are no allocations
+ * in steady state (allocations counter doesn't grow).
+ *
+ * @param h pointer to internal library data
+ * @param stats pointer to statistics to fill
+ *
+ * @see hvd_pool_stats
+ */
+void hvd_get_pool_stats(const struct hvd *h, struct hvd_pool_stats *stats);
+
+/**
+ * @brief Get memory held by decoder and its budget.
+ *
+ * Safe to call at any time, also from other thread than decoding.
+ *
+ * @param h pointer to internal library data
+ * @param memory pointer to memory usage to fill
+ *
+ * @see hvd_memory, hvd_config
+ *
+ * Example:
+ * @code
+ * struct hvd_memory memory;
+ *
+ * hvd_get_memory(h, &memory);
+ * printf("%lld of %lld bytes, %d surfaces\n",
+ *   (long long)memory.used, (long long)memory.budget, memory.surfaces);
+ * @endcode
+ */
+void hvd_get_memory(const struct hvd *h, struct hvd_memory *memory);
+
+/**
+ * @brief Read the latest trace events.
+ *
+ * Safe to call at any time, also while decoding on other threads.
+ * Events being recorded at the moment are skipped.
+ *
+ * @param h pointer to internal library data
+ * @param events array to fill, oldest events first
+ * @param count size of events array
+ * @return number of events read, 0 without tracing (hvd_config.trace)
+ *
+ * @see hvd_trace_event, hvd_trace_export
+ */
+int hvd_trace_read(const struct hvd *h, struct hvd_trace_event *events, int count);
+
+/**
+ * @brief Export the latest trace events in Chrome trace format (JSON).
+ *
+ * Open the file in chrome://tracing or https://ui.perfetto.dev
+ * - threads show packets submitted, accepted, frames decoded, output and handed to you
+ * - frame spans show each frame from packet accepted to frame handed to you
+ * - events carry packet seq, pts and tag
+ *
+ * Safe to call at any time, like hvd_trace_read.
+ *
+ * @param h pointer to internal library data
+ * @param path file to write
+ * @return
+ * - HVD_OK on success
+ * - HVD_ERROR without tracing or if the file can't be written
+ *
+ * @see hvd_trace_read
+ *
+ * Example:
+ * @code
+ * struct hvd_config config = {0};
+ * //...
+ * config.trace = 4096;
+ *
+ * //decode, then at any time
+ * hvd_trace_export(h, "hvd.json");
+ * @endcode
+ */
+int hvd_trace_export(const struct hvd *h, const char *path);
+
+/**
+ * @brief Start scheduler with devices and worker threads.
+ *
+ * @param config scheduler configuration
+ * @return
+ * - pointer to scheduler
+ * - NULL on error (e.g. device can't be opened), errors logged
+ *
+ * @see hvd_scheduler_config, hvd_scheduler_add_stream, hvd_scheduler_close
+ *
+ * Example:
+ * @code
+ * const char *devices[] = {"/dev/dri/renderD128", "/dev/dri/renderD129", NULL};
+ * struct hvd_scheduler_config scheduler_config = {"vaapi", devices};
+ * struct hvd_scheduler *scheduler = hvd_scheduler_init(&scheduler_config);
+ *
+ * struct hvd_config stream_config = {0};
+ * stream_config.codec = "h264";
+ * stream_config.pixel_format = "nv12";
+ *
+ * for(int i=0;i<cameras;++i)
+ *   streams[i] = hvd_scheduler_add_stream(scheduler, &stream_config, on_frame, &cameras[i]);
+ *
+ * //on network data for camera i
+ * if(hvd_scheduler_send(streams[i], &packet) == HVD_AGAIN)
+ *   ; //stream is behind, drop the data or slow down the source
+ *
+ * hvd_scheduler_close(scheduler);
+ * @endcode
+ */
+struct hvd_scheduler *hvd_scheduler_init(const struct hvd_scheduler_config *config);
+
+/**
+ * @brief Stop scheduler.
+ *
+ * Removes remaining streams (pending packets are dropped),
+ * stops worker threads and closes devices.
+ *
+ * @param scheduler pointer to scheduler (NULL is ignored)
+ */
+void hvd_scheduler_close(struct hvd_scheduler *scheduler);
+
+/**
+ * @brief Register stream for decoding.
+ *
+ * The hardware, device, shared_device and async of config are set by the scheduler.
+ * With 0 thread_count software decoders use single thread (scheduler provides parallelism).
+ *
+ * Safe to call from any thread.
+ *
+ * @param scheduler pointer to scheduler
+ * @param config decoder configuration (e.g. codec, pixel_format, output)
+ * @param callback function receiving decoded frames
+ * @param opaque user data passed to callback
+ * @return
+ * - pointer to stream
+ * - NULL on error, errors logged
+ *
+ * @see hvd_stream_callback, hvd_scheduler_send, hvd_scheduler_remove_stream
+ */
+struct hvd_stream *hvd_scheduler_add_stream(struct hvd_scheduler *scheduler, const struct hvd_config *config,
+	hvd_stream_callback callback, void *opaque);
+
+/**
+ * @brief Unregister stream.
+ *
+ * Pending packets are dropped. Waits until the stream turn on worker finishes,
+ * the callback is not called after return. Don't call from the callback.
+ *
+ * @param stream pointer to stream (NULL is ignored)
+ */
+void hvd_scheduler_remove_stream(struct hvd_stream *stream);
+
+/**
+ * @brief Queue packet for decoding.
+ *
+ * Doesn't block. The data is referenced (packet.buf), taken over (packet.free)
+ * or copied like in hvd_send_packet.
+ * Send NULL packet to flush the stream (callback gets NULL frame with HVD_OK when done).
+ *
+ * Safe to call from any thread, one thread at a time for the stream.
+ *
+ * @param stream pointer to stream
+ * @param packet encoded data or NULL to flush
+ * @return
+ * - HVD_OK on success
+ * - HVD_AGAIN queue of the stream is full (back-pressure), the data stays with you
+ * - HVD_ERROR on error
+ *
+ * @see hvd_stream_get_stats
+ */
+int hvd_scheduler_send(struct hvd_stream *stream, const struct hvd_packet *packet);
+
+/**
+ * @brief Get decoder of the stream.
+ *
+ * Use only from the stream callback (e.g. hvd_get_frame_info, hvd_get_stats).
+ *
+ * @param stream pointer to stream
+ * @return decoder of the stream
+ */
+struct hvd *hvd_stream_get_decoder(const struct hvd_stream *stream);
+
+/**
+ * @brief Get stream statistics.
+ *
+ * Safe to call at any time from any thread.
+ *
+ * @param stream pointer to stream
+ * @param stats pointer to statistics to fill
+ *
+ * @see hvd_stream_stats
+ */
+void hvd_stream_get_stats(struct hvd_stream *stream, struct hvd_stream_stats *stats);
+
+/**
+ * @brief Get scheduler statistics.
+ *
+ * @param scheduler pointer to scheduler
+ * @param stats pointer to statistics to fill
+ *
+ * @see hvd_scheduler_stats
+ */
+void hvd_scheduler_get_stats(struct hvd_scheduler *scheduler, struct hvd_scheduler_stats *stats);
+
+/**
+ * @brief Get device load and number of streams.
+ *
+ * The load is sum of measured loads of device streams
+ * (streams not measured yet count as average stream).
+ *
+ * @param scheduler pointer to scheduler
+ * @param device index of the device in hvd_scheduler_config.devices
+ * @param streams pointer to number of streams on the device
+ * @param load pointer to load of the device
+ * @return
+ * - HVD_OK on success
+ * - HVD_ERROR on invalid device index
+ */
+int hvd_scheduler_get_device_load(struct hvd_scheduler *scheduler, int device, int *streams, double *load);
+
+/**
+ * @brief Create shared memory frame ring for publishing frames.
+ *
+ * One decoder feeds any number of reader processes.
+ * Each frame is written to shared memory once, readers access it without copies.
+ *
+ * Each ring slot has sequence number (seqlock), odd while written, even when published.
+ * Readers never block the publisher and the publisher never waits for readers.
+ * Slow readers detect that frames were overwritten (overrun).
+ *
+ * Decode directly to ring by setting hvd_config.get_buffer to hvd_shm_get_buffer
+ * and hvd_config.get_buffer_opaque to the ring. Then hvd_shm_publish doesn't copy.
+ * Otherwise hvd_shm_publish copies the frame to the ring.
+ *
+ * Available on POSIX systems (anonymous ring on Linux).
+ *
+ * @param config ring configuration
+ * @return
+ * - pointer to ring
+ * - NULL on error, errors logged
+ *
+ * @see hvd_shm_config, hvd_shm_publish, hvd_shm_attach, hvd_shm_close
+ *
+ * Example:
+ * @code
+ * struct hvd_shm_config ring_config = {"/hvd-camera", 8, 1920, 1080, "nv12"};
+ * struct hvd_shm *ring = hvd_shm_create(&ring_config);
+ *
+ * hardware_config.get_buffer = hvd_shm_get_buffer; //optional, decode to shared memory
+ * hardware_config.get_buffer_opaque = ring;
+ * h = hvd_init(&hardware_config);
+ *
+ * //decoding loop
+ * while( (frame = hvd_receive_frame(h, &error) ) )
+ *   hvd_shm_publish(ring, frame);
+ *
+ * hvd_close(h);
+ * hvd_shm_close(ring);
+ * @endcode
+ */
+struct hvd_shm *hvd_shm_create(const struct hvd_shm_config *config);
+
+/**
+ * @brief Attach to frame ring for reading.
+ *
+ * Shared memory is mapped read-only, readers can't disturb publisher or each other.
+ *
+ * @param name shared memory name from hvd_shm_config or NULL if using descriptor
+ * @param fd ring descriptor (see hvd_shm_get_fd) if name is NULL, the descriptor is not closed
+ * @return
+ * - pointer to ring
+ * - NULL on error (e.g. no such ring), errors logged
+ *
+ * @see hvd_shm_read, hvd_shm_wait, hvd_shm_close
+ *
+ * Example:
+ * @code
+ * struct hvd_shm *ring = hvd_shm_attach("/hvd-camera", -1);
+ * struct hvd_shm_frame frame;
+ * uint64_t number = 0;
+ *
+ * while(keep_reading)
+ * {
+ *   if(hvd_shm_wait(ring, number, 1000) != HVD_OK)
+ *     continue; //timeout
+ *
+ *   number = hvd_shm_latest(ring); //or number + 1 to process every frame
+ *
+ *   if(hvd_shm_read(ring, number, &frame) != HVD_OK)
+ *     continue; //overwritten already
+ *
+ *   //do something with frame.data, frame.linesize
+ *
+ *   if(hvd_shm_check(ring, &frame) != HVD_OK)
+ *     ; //overwritten while you were using it, discard results
+ * }
+ *
+ * hvd_shm_close(ring);
+ * @endcode
+ */
+struct hvd_shm *hvd_shm_attach(const char *name, int fd);
+
+/**
+ * @brief Close frame ring.
+ *
+ * Publisher removes the shared memory name, attached readers keep working
+ * until they close. Close publisher after frames from hvd_shm_get_buffer
+ * are released (e.g. after hvd_close).
+ *
+ * @param ring pointer to ring (NULL is ignored)
+ */
+void hvd_shm_close(struct hvd_shm *ring);
+
+/**
+ * @brief Get ring shared memory descriptor.
+ *
+ * @param ring pointer to ring
+ * @return file descriptor, valid until hvd_shm_close
+ */
+int hvd_shm_get_fd(const struct hvd_shm *ring);
+
+/**
+ * @brief Provide frame data in ring slot.
+ *
+ * Function for hvd_config.get_buffer with the ring as hvd_config.get_buffer_opaque.
+ *
+ * @param ring pointer to ring (publisher)
+ * @param frame frame with format, width and height set
+ * @return 0 on success, negative AVERROR if frame doesn't fit the ring
+ *
+ * @see hvd_config, hvd_shm_publish
+ */
+int hvd_shm_get_buffer(void *ring, AVFrame *frame);
+
+/**
+ * @brief Publish frame to readers.
+ *
+ * Frames from hvd_shm_get_buffer are published without copy.
+ * Other frames (in system memory) are copied to the next ring slot.
+ *
+ * @param ring pointer to ring (publisher)
+ * @param frame decoded frame
+ * @return
+ * - HVD_OK on success
+ * - HVD_ERROR on error (e.g. frame doesn't fit, slot reused before publishing with too few slots)
+ */
+int hvd_shm_publish(struct hvd_shm *ring, const AVFrame *frame);
+
+/**
+ * @brief Get number of the latest published frame.
+ *
+ * Lock-free, cheap enough for polling.
+ *
+ * @param ring pointer to ring
+ * @return frame number, 0 if nothing was published yet
+ */
+uint64_t hvd_shm_latest(const struct hvd_shm *ring);
+
+/**
+ * @brief Wait for frame newer than number.
+ *
+ * Sleeps on futex in shared memory (Linux), otherwise polls.
+ *
+ * @param ring pointer to ring
+ * @param number the last frame number you have seen (0 initially)
+ * @param timeout_ms maximum time to wait in milliseconds
+ * @return
+ * - HVD_OK newer frame is available
+ * - HVD_AGAIN on timeout
+ */
+int hvd_shm_wait(const struct hvd_shm *ring, uint64_t number, int timeout_ms);
+
+/**
+ * @brief Read frame from the ring without copy.
+ *
+ * @param ring pointer to ring (reader or publisher)
+ * @param number frame number (e.g. hvd_shm_latest)
+ * @param frame pointer to frame to fill
+ * @return
+ * - HVD_OK on success, use hvd_shm_check when done with data
+ * - HVD_AGAIN frame is not published yet
+ * - HVD_ERROR frame was overwritten (overrun) or skipped by publisher
+ *
+ * @see hvd_shm_check, hvd_shm_frame
+ */
+int hvd_shm_read(const struct hvd_shm *ring, uint64_t number, struct hvd_shm_frame *frame);
+
+/**
+ * @brief Check if frame data is still intact.
+ *
+ * @param ring pointer to ring
+ * @param frame frame from hvd_shm_read
+ * @return
+ * - HVD_OK data you have read is consistent
+ * - HVD_ERROR publisher started overwriting the slot (overrun)
+ */
+int hvd_shm_check(const struct hvd_shm *ring, const struct hvd_shm_frame *frame);
+
+/**
+ * @brief Open memory-mapped file source.
+ *
+ * Packets point straight into the mapping (no reads, no copies).
+ * They carry reference to the mapping (hvd_packet.buf) so decoder
+ * references the data instead of copying it. The padding after packet
+ * data (see hvd_packet) is the following data in the file.
+ * The last packets, too close to the end of file, are served from zero padded copy.
+ *
+ * Available on POSIX systems.
+ *
+ * @param config file configuration
+ * @return
+ * - pointer to file
+ * - NULL on error (e.g. no such file, not indexable), errors logged
+ *
+ * @see hvd_file_config, hvd_file_read, hvd_file_seek, hvd_file_close
+ *
+ * Example:
+ * @code
+ * struct hvd_file_config file_config = {"camera.h264", "h264", "camera.h264.hvdi"};
+ * struct hvd_file *file = hvd_file_open(&file_config);
+ * struct hvd_packet packet;
+ *
+ * hvd_file_seek(file, 1000); //start at keyframe before frame 1000
+ *
+ * //the last (empty) packet flushes decoder
+ * do
+ * {
+ *   if(hvd_file_read(file, &packet) != HVD_OK || hvd_send_packet(h, &packet) == HVD_ERROR)
+ *     break;
+ *
+ *   while( (frame = hvd_receive_frame(h, &error) ) )
+ *   {
+ *     //do something with frame->data, frame->linesize
+ *   }
+ * }
+ * while(packet.data);
+ *
+ * hvd_file_close(file);
+ * @endcode
+ */
+struct hvd_file *hvd_file_open(const struct hvd_file_config *config);
+
+/**
+ * @brief Close file source.
+ *
+ * The mapping stays until decoders release packets referencing it.
+ *
+ * @param f pointer to file
+ */
+void hvd_file_close(struct hvd_file *f);
+
+/**
+ * @brief Get the next packet of the file.
+ *
+ * Don't change the packet data, send it as is with hvd_send_packet.
+ * The packet pts is the frame number in the file, you may set the tag.
+ * At the end of file the packet has NULL data and 0 size (sending it flushes decoder).
+ * With HVD_AGAIN from hvd_send_packet send the same packet again.
+ *
+ * @param f pointer to file
+ * @param packet filled with frame data
+ * @return
+ * - HVD_OK on success (also at the end of file)
+ * - HVD_ERROR on error
+ *
+ * @see hvd_file_packet, hvd_file_seek
+ */
+int hvd_file_read(struct hvd_file *f, struct hvd_packet *packet);
+
+/**
+ * @brief Get packet of any frame (random access).
+ *
+ * Decoding has to start from keyframe, see hvd_file_seek.
+ * Doesn't change the position of hvd_file_read.
+ *
+ * @param f pointer to file
+ * @param frame frame number, from 0
+ * @param packet filled with frame data
+ * @return
+ * - HVD_OK on success
+ * - HVD_ERROR if there is no such frame
+ */
+int hvd_file_packet(const struct hvd_file *f, int64_t frame, struct hvd_packet *packet);
+
+/**
+ * @brief Seek to the nearest keyframe at or before frame.
+ *
+ * Binary search in keyframe index. The next hvd_file_read returns the keyframe.
+ * When seeking in the middle of decoding flush the decoder first
+ * (or use hvd_reconfigure), the references of previous frames don't apply.
+ *
+ * @param f pointer to file
+ * @param frame frame number, from 0
+ * @return
+ * - number of keyframe where reading continues
+ * - HVD_ERROR if there is no such frame or no keyframe before it
+ */
+int64_t hvd_file_seek(struct hvd_file *f, int64_t frame);
+
+/**
+ * @brief Get file source summary.
+ *
+ * @param f pointer to file
+ * @param info filled with summary
+ */
+void hvd_file_get_info(const struct hvd_file *f, struct hvd_file_info *info);
+
+/**
+ * @brief Probe capabilities of hardware device.
+ *
+ * Opens the device, lists codecs with hardware decoding, surface size limits,
+ * surface formats and formats they can be transferred as. Nothing is decoded.
+ *
+ * Probing takes from milliseconds to hundreds of milliseconds (device and driver
+ * initialization), loading from cache file (hvd_probe_config.cache_path) takes microseconds.
+ * Unusable cache is ignored and rewritten. Failed probe is not cached (device may show up later).
+ *
+ * @param config probe configuration
+ * @param probe filled with capabilities
+ * @return
+ * - HVD_OK on success
+ * - HVD_ERROR on error (e.g. no such hardware or device), errors logged
+ *
+ * @see hvd_probe_check
+ *
+ * Example:
+ * @code
+ * struct hvd_probe_config probe_config = {"vaapi", "/dev/dri/renderD128", "hvd.probe", NULL};
+ * struct hvd_probe probe;
+ *
+ * if(hvd_probe(&probe_config, &probe) == HVD_OK && hvd_probe_check(&probe, &config) == HVD_OK)
+ *   h = hvd_init(&config);
+ * else
+ *   //your logic, e.g. different hardware or pixel format
+ * @endcode
+ */
+int hvd_probe(const struct hvd_probe_config *config, struct hvd_probe *probe);
+
+/**
+ * @brief Check decoder configuration against probed capabilities.
+ *
+ * Checks hardware, codec, width and height (if set) and pixel format (if set)
+ * which has to be transfer format of some surface format or converted
+ * by the library from one (see hvd_config.pixel_format).
+ * Profile is not checked, stream with profile unsupported by hardware
+ * still fails on decoding (see hvd_config.software_fallback).
+ *
+ * @param probe capabilities from hvd_probe
+ * @param config decoder configuration
+ * @return
+ * - HVD_OK if configuration fits capabilities
+ * - HVD_ERROR otherwise
+ */
+int hvd_probe_check(const struct hvd_probe *probe, const struct hvd_config *config);
+
+/**
+ * @brief Check SIMD conversion kernels against scalar reference.
+ *
+ * Runs CPU conversion kernels of every instruction set of this CPU
+ * (SSE2, AVX2, NEON) on random rows of all widths up to 1024
+ * and for full and limited range BT.601, BT.709 and BT.2020 RGB.
+ * The results have to be identical to the scalar reference.
+ *
+ * Takes a fraction of second, e.g. for installation checks (hvd-bench --check-kernels).
+ *
+ * @return
+ * - HVD_OK if all kernels give identical results (or there are no SIMD kernels)
+ * - HVD_ERROR otherwise, mismatches logged
+ */
+int hvd_check_kernels(void);
 
 /** @}*/
 
@@ -0,0 +1,309 @@
+/*
+ * HVD Hardware Video Decoder C++ header
+ *
+ * Copyright 2019-2023 (C) Bartosz Meglicki <meglickib@gmail.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+/**
+ ******************************************************************************
+ *
+ *  \file       hvd.hpp
+ *  \brief      Header-only C++17 wrapper of the C interface
+ *
+ * The wrapper owns decoder and frames, nothing more:
+ * - hvd_cpp::decoder - move-only owner of struct hvd (hvd_init/hvd_close)
+ * - hvd_cpp::frame - move-only frame from hvd_acquire_frame, released on destruction
+ * - hvd_cpp::decoder::frames - range of ready frames, for sync and async mode
+ *
+ * There are no allocations, exceptions or copies over the C interface.
+ * Handles are one or two pointers, frames come from the library pool.
+ *
+ ******************************************************************************
+ */
+
+#ifndef HVD_HPP
+#define HVD_HPP
+
+#include "hvd.h"
+
+#include <cstddef> //std::size_t
+#include <cstdint> //uint8_t
+#include <utility> //std::exchange
+
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+namespace hvd_cpp
+{
+
+#if defined(__cpp_lib_span)
+/**
+ * @brief Encoded data, AV_INPUT_BUFFER_PADDING_SIZE larger than size (see hvd_packet).
+ */
+using bytes = std::span<uint8_t>;
+#else
+/**
+ * @brief Encoded data, AV_INPUT_BUFFER_PADDING_SIZE larger than size (see hvd_packet).
+ *
+ * Subset of std::span<uint8_t> for C++17.
+ */
+class bytes
+{
+public:
+	constexpr bytes() noexcept = default;
+	constexpr bytes(uint8_t *data, std::size_t size) noexcept : m_data(data), m_size(size) {}
+
+	constexpr uint8_t *data() const noexcept { return m_data; }
+	constexpr std::size_t size() const noexcept { return m_size; }
+	constexpr bool empty() const noexcept { return m_size == 0; }
+private:
+	uint8_t *m_data = nullptr;
+	std::size_t m_size = 0;
+};
+#endif
+
+/**
+ * @brief Frame held by the user, returned to decoder pool on destruction.
+ *
+ * Move-only, the frame must not outlive its decoder.
+ * Empty (false) if no frame was ready.
+ *
+ * @see hvd_acquire_frame, hvd_release_frame
+ */
+class frame
+{
+public:
+	frame() noexcept = default;
+	frame(struct hvd *h, AVFrame *f) noexcept : m_hvd(h), m_frame(f) {}
+	~frame() { reset(); }
+
+	frame(const frame &) = delete;
+	frame &operator=(const frame &) = delete;
+
+	frame(frame &&other) noexcept : m_hvd(other.m_hvd), m_frame(std::exchange(other.m_frame, nullptr)) {}
+
+	frame &operator=(frame &&other) noexcept
+	{
+		if(this != &other)
+		{
+			reset();
+			m_hvd = other.m_hvd;
+			m_frame = std::exchange(other.m_frame, nullptr);
+		}
+		return *this;
+	}
+
+	//! return the frame to the pool now
+	void reset() noexcept
+	{
+		if(m_frame)
+			hvd_release_frame(m_hvd, std::exchange(m_frame, nullptr));
+	}
+
+	explicit operator bool() const noexcept { return m_frame != nullptr; }
+
+	AVFrame *get() const noexcept { return m_frame; }
+	AVFrame *operator->() const noexcept { return m_frame; }
+	AVFrame &operator*() const noexcept { return *m_frame; }
+
+	//! hvd_get_frame_info, HVD_OK or HVD_ERROR if unknown
+	int info(struct hvd_frame_info *info) const noexcept { return hvd_get_frame_info(m_hvd, m_frame, info); }
+private:
+	struct hvd *m_hvd = nullptr;
+	AVFrame *m_frame = nullptr;
+};
+
+/**
+ * @brief Range of frames ready now, ends when decoder has no more.
+ *
+ * Each frame is released when iteration advances unless you move it out.
+ * After the loop error() tells why it ended:
+ * - HVD_OK - more data is needed (sync) or decoder was flushed completely
+ * - HVD_AGAIN - no frame ready yet (async) or all frames are held
+ * - HVD_ERROR - decoding failed
+ *
+ * Example:
+ * @code
+ * auto frames = decoder.frames();
+ *
+ * for(hvd_cpp::frame &frame : frames)
+ *   consume(frame->data, frame->linesize); //or keep with std::move(frame)
+ *
+ * if(frames.error() == HVD_ERROR)
+ *   //your logic on failure
+ * @endcode
+ */
+class frame_range
+{
+public:
+	struct sentinel {};
+
+	class iterator
+	{
+	public:
+		using value_type = hvd_cpp::frame;
+		using reference = hvd_cpp::frame &;
+		using difference_type = std::ptrdiff_t;
+
+		reference operator*() const noexcept { return m_range->m_frame; }
+		hvd_cpp::frame *operator->() const noexcept { return &m_range->m_frame; }
+		iterator &operator++() noexcept { m_range->next(); return *this; }
+		void operator++(int) noexcept { m_range->next(); }
+
+		friend bool operator==(const iterator &it, sentinel) noexcept { return it.done(); }
+		friend bool operator!=(const iterator &it, sentinel) noexcept { return !it.done(); }
+		friend bool operator==(sentinel, const iterator &it) noexcept { return it.done(); }
+		friend bool operator!=(sentinel, const iterator &it) noexcept { return !it.done(); }
+	private:
+		friend class frame_range;
+		explicit iterator(frame_range *range) noexcept : m_range(range) {}
+		bool done() const noexcept { return !m_range->m_frame; }
+		frame_range *m_range;
+	};
+
+	explicit frame_range(struct hvd *h) noexcept : m_hvd(h) {}
+
+	frame_range(const frame_range &) = delete;
+	frame_range &operator=(const frame_range &) = delete;
+
+	iterator begin() noexcept { next(); return iterator(this); }
+	sentinel end() const noexcept { return {}; }
+
+	int error() const noexcept { return m_error; }
+private:
+	void next() noexcept
+	{
+		//before acquire, otherwise the pool would hold one more frame
+		m_frame.reset();
+
+		AVFrame *f = hvd_acquire_frame(m_hvd, &m_error);
+		m_frame = f ? hvd_cpp::frame(m_hvd, f) : hvd_cpp::frame();
+	}
+
+	struct hvd *m_hvd;
+	hvd_cpp::frame m_frame;
+	int m_error = HVD_OK;
+};
+
+/**
+ * @brief Decoder owning struct hvd, closed on destruction.
+ *
+ * Move-only. Check with operator bool, like NULL from hvd_init,
+ * errors are logged (standard error or hvd_config.log_callback).
+ *
+ * Frames come from hvd_acquire_frame, hold up to hvd_config.frames_in_flight at once.
+ * For raw pointer use get(), all the C functions work with it.
+ *
+ * Example:
+ * @code
+ * struct hvd_config config = {0};
+ * config.hardware = "vaapi";
+ * config.codec = "h264";
+ *
+ * hvd_cpp::decoder decoder(config);
+ *
+ * if(!decoder)
+ *   return 1;
+ *
+ * while(keep_decoding)
+ * {
+ *   if(decoder.send(hvd_cpp::bytes(buffer, size)) == HVD_ERROR)
+ *     break;
+ *
+ *   for(hvd_cpp::frame &frame : decoder.frames())
+ *     consume(frame->data, frame->linesize);
+ * }
+ * @endcode
+ */
+class decoder
+{
+public:
+	decoder() noexcept = default;
+	explicit decoder(const struct hvd_config &config) noexcept : m_hvd(hvd_init(&config)) {}
+	~decoder() { hvd_close(m_hvd); }
+
+	decoder(const decoder &) = delete;
+	decoder &operator=(const decoder &) = delete;
+
+	decoder(decoder &&other) noexcept : m_hvd(std::exchange(other.m_hvd, nullptr)) {}
+
+	decoder &operator=(decoder &&other) noexcept
+	{
+		if(this != &other)
+		{
+			hvd_close(m_hvd);
+			m_hvd = std::exchange(other.m_hvd, nullptr);
+		}
+		return *this;
+	}
+
+	explicit operator bool() const noexcept { return m_hvd != nullptr; }
+
+	struct hvd *get() const noexcept { return m_hvd; }
+
+	//! hvd_send_packet without ownership of data (copied by decoder)
+	int send(bytes data) noexcept
+	{
+		struct hvd_packet packet = {};
+
+		packet.data = data.data();
+		packet.size = (int)data.size();
+
+		return hvd_send_packet(m_hvd, &packet);
+	}
+
+	//! hvd_send_packet, e.g. with buf or free passing data ownership
+	int send(struct hvd_packet &packet) noexcept { return hvd_send_packet(m_hvd, &packet); }
+
+	//! hvd_send_stream, raw byte stream in arbitrary chunks
+	int send_stream(bytes data) noexcept { return hvd_send_stream(m_hvd, data.data(), (int)data.size()); }
+
+	//! flush decoder, follow with frames() to get the last frames
+	int flush() noexcept { return hvd_send_packet(m_hvd, nullptr); }
+
+	//! single frame, empty with error HVD_OK, HVD_AGAIN or HVD_ERROR (see hvd_acquire_frame)
+	hvd_cpp::frame acquire(int *error) noexcept
+	{
+		AVFrame *f = hvd_acquire_frame(m_hvd, error);
+		return f ? hvd_cpp::frame(m_hvd, f) : hvd_cpp::frame();
+	}
+
+	//! frames ready now, see frame_range
+	frame_range frames() noexcept { return frame_range(m_hvd); }
+
+	int reconfigure(const struct hvd_config &config) noexcept { return hvd_reconfigure(m_hvd, &config); }
+	int event_fd() const noexcept { return hvd_get_event_fd(m_hvd); }
+
+	struct hvd_stats stats() const noexcept
+	{
+		struct hvd_stats stats;
+		hvd_get_stats(m_hvd, &stats);
+		return stats;
+	}
+
+	struct hvd_pool_stats pool_stats() const noexcept
+	{
+		struct hvd_pool_stats stats;
+		hvd_get_pool_stats(m_hvd, &stats);
+		return stats;
+	}
+
+	struct hvd_memory memory() const noexcept
+	{
+		struct hvd_memory memory;
+		hvd_get_memory(m_hvd, &memory);
+		return memory;
+	}
+private:
+	struct hvd *m_hvd = nullptr;
+};
+
+} //namespace hvd_cpp
+
+#endif